@@ -136,6 +136,33 @@ void __attribute__((noreturn)) main() {
 	//phy_dump();
 	//debug(0x59, 0);
 
+#ifdef USING_BENCHMARK
+	// compare the optimized code paths with the ones they replaced (built with "make BENCHMARK=1")
+	heap_benchmark(1000000); // the slabs and the heap for small blocks
+	realloc_benchmark(16UL << 20); // growing a buffer by copying it and with realloc, like stream_expand
+	phy_benchmark(4096); // the buddy allocator and the old free list, and check for overlapping allocations
+	mmu_benchmark(64UL << 20); // accessing and freeing memory mapped with 4kB and with large pages
+	tlb_batch_test(); // check that page_free commits a full TLB batch without losing pages
+	sync_benchmark(8, 100000); // spin locks and mutexes under contention
+	thread_sleep_benchmark(10000); // the sorted sleep list and the sleep heap
+	ntfs_lookup_benchmark(10000); // parsing the runlist and the extent map for finding the cluster of a file offset
+	memcpy_benchmark(16UL << 20); // the byte loops and the accelerated memory functions
+#ifdef USING_TIME
+	timer_stress_test(10000); // check that the timing wheel fires every timer on time
+#endif
+#ifdef USING_DEFLATE
+	// (the comparisons with zlib run on the host, see platform/windows/zlibbench.c)
+	huffman_benchmark(1000000); // decoding huffman codes bit by bit and with the lookup tables
+	bitstream_benchmark(16UL << 20); // reading bits byte by byte and with 8 byte loads
+	inflate_benchmark(16UL << 20); // decompressing into a single buffer and with the streaming inflater
+	inflate_copy_benchmark(4UL << 20); // copying back-references byte by byte and in chunks
+	deflate_benchmark(16UL << 20); // the speed and the compression ratio of the deflate levels
+#endif
+#ifdef USING_GRAPHICS
+	bitmap_benchmark(10); // the double precision filter and the fixed point scaler
+#endif
+#endif
+
 
 
 	//teletype_print_string(asciiart, sizeof(asciiart), 0x07);
@@ -156,6 +183,10 @@ void __attribute__((noreturn)) main() {
 	if (load_bootimg(1, &rootDir, &bmp1))
 		for (;;);
 
+	uint64_t cacheHits, cacheMisses;
+	if (!ntfs_get_cache_statistics(rootDir.filesystem, &cacheHits, &cacheMisses))
+		LOGI("MFT record cache: %d hits, %d misses", (int)cacheHits, (int)cacheMisses);
+
 	LOGI("switching graphics...");
 
 	bitmap_t *screen = graphics_init();
@@ -34,4 +34,14 @@
 #endif
 
 
+/*
+* without an architecture layer that selects them by the features of the CPU (see CPUACCELFUNC in arch/x86/io.h),
+* accelerated functions are compiled once at level 0
+*/
+#ifndef CPUACCELFUNC
+#	define CPUACCELDECL(returnType, funcName, funcParams)			static returnType funcName funcParams
+#	define CPUACCELFUNC(returnType, funcName, funcParams, ...)	static returnType funcName funcParams { enum { CPUACCELLEVEL = 0 }; __VA_ARGS__ }
+#endif
+
+
 #endif // __GLOBAL_IO_H__
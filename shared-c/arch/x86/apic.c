@@ -1,5 +1,8 @@
 
 
+// the timer and IPI handlers must not use vector registers (see interrupts.c)
+#pragma GCC target("general-regs-only")
+
 #include <system.h>
 #include "apic.h"
 
@@ -11,6 +14,8 @@
 
 #define CPUID_BIT_MCE				7	// machine check exception (CPUID:01h.EDX)
 #define CPUID_BIT_MCA				14	// machine check architecture (CPUID:01h.EDX)
+#define CPUID_BIT_TSC_DEADLINE		24	// TSC-deadline mode of the local APIC timer (CPUID:01h.ECX)
+#define CPUID_BIT_INVARIANT_TSC		8	// the TSC runs at a constant rate in all power states (CPUID:80000007h.EDX)
 
 #define IA32_MCG_CAP				0x179
 #define IA32_MCG_CAP_COUNT			0xFFUL	// number of machine check banks
@@ -27,12 +32,17 @@
 #define IA32_MCi_ADDR				0x402		// implementation specific
 #define IA32_MCi_MISC				0x403
 
+#define IA32_TSC_DEADLINE			0x6E0		// the local APIC timer fires when the TSC reaches this value (0 disarms the timer)
+
 
 
+#define APIC_REG_ID			0x20
 #define APIC_REG_VERSION	0x30
 #define APIC_REG_EOI		0xB0
 #define APIC_REG_SPURIOUS	0xF0
 #define APIC_REG_ERR_STATUS	0x280
+#define APIC_REG_ICR_LOW	0x300
+#define APIC_REG_ICR_HIGH	0x310
 #define APIC_REG_T_INTERVAL	0x380
 #define APIC_REG_T_COUNT	0x390
 #define APIC_REG_T_DIVIDE	0x3E0
@@ -50,6 +60,12 @@
 #define APIC_TIMER_PERIODIC	0x00020000
 #define APIC_TIMER_DEADLINE	0x00040000 // timer fires after a specified deadline timestamp
 
+#define APIC_ICR_FIXED		0x00000000
+#define APIC_ICR_INIT		0x00000500
+#define APIC_ICR_STARTUP	0x00000600
+#define APIC_ICR_PENDING	0x00001000 // delivery status: the previous IPI was not yet accepted
+#define APIC_ICR_ASSERT		0x00004000
+
 #define APIC_REGFILE_LENGTH			(0x1000)
 
 enum {
@@ -61,6 +77,8 @@ enum {
 	APIC_INT_PERFORMANCE	= 0xF3, // Performance Counter
 	APIC_INT_LINT0			= 0xF4, // External Int 0
 	APIC_INT_LINT1			= 0xF5, // External Int 1
+	APIC_INT_RESCHEDULE		= 0xF6, // Sent by another processor to invoke the timer callback early
+	APIC_INT_TLB_SHOOTDOWN	= 0xF7, // Sent by another processor that unmapped pages
 
 	APIC_INT_ERROR			= 0xFE, // The local APIC encountered an error
 	APIC_INT_SPURIOUS		= 0xFF // Spurious interrupt (returns immediately in asm code). Don't change this value (to keep compatibility with older processors)
@@ -74,6 +92,15 @@ timer_callback_t timerCallback = NULL;
 
 volatile system_ticks_t systemTicks = 0;
 
+// If the TSC is invariant, the system ticks are derived from it, so that they remain correct while the timer is not
+// firing periodically. These values are measured by the first call to apic_timer_start.
+// Otherwise the TSC may stop or change its rate in sleep states, so the ticks are counted by the timer interrupt.
+uint64_t tscPerTick = 0;	// number of TSC increments per system tick (0 while not calibrated)
+uint64_t tscBase;			// the TSC value at system tick 0
+uint32_t timerInterval;		// the timer interval (in timer counts) that corresponds to one system tick
+int tscDeadlineSupport = 0;	// set if the local APIC timer supports TSC-deadline mode and the TSC is invariant
+int tscInvariant = 0;		// set if the TSC can be used to keep time while the timer is stopped
+
 
 // Checks for the presence of the local APIC
 int apic_available(void) {
@@ -120,6 +147,12 @@ int apic_read_lvt_num(void) {
 }
 
 
+// Returns the ID of the local APIC
+uint32_t apic_read_id(void) {
+	return apic_reg_read(APIC_REG_ID) >> 24;
+}
+
+
 // Returns the last error code of the APIC
 int apic_read_error_status(void) {
 	apic_reg_write(APIC_REG_ERR_STATUS, 0); // we should write to this register first
@@ -127,6 +160,15 @@ int apic_read_error_status(void) {
 }
 
 
+// Returns a non-zero value if the timer of the local processor may be stopped or run in one-shot mode.
+// With an invariant TSC, this applies to every processor, as the system ticks are derived from the TSC while the timer
+// is not periodic. Otherwise the periodic timer interrupt of the bootstrap processor counts the system ticks, so only
+// the timers of the other processors can be stopped (they use the plain one-shot mode of the local APIC timer).
+int apic_timer_tickless_available(void) {
+	return tscInvariant || cpu_current()->index;
+}
+
+
 // Sets the callback for the APIC timer
 //	callback: a routine that will be called whenever the timer fires.
 //	This routine must comply with the constraints of an interrupt handler.
@@ -136,21 +178,86 @@ void apic_timer_config(timer_callback_t callback) {
 }
 
 
-// Starts the local APIC timer. This must not be called before apic_init.
+// Measures the number of TSC increments that correspond to one timer interval.
+// The timer must be masked and the divide register must already be set.
+static void apic_timer_measure(uint32_t interval) {
+	apic_reg_write(APIC_REG_T_INTERVAL, 0xFFFFFFFF);
+	uint32_t start = apic_reg_read(APIC_REG_T_COUNT);
+	uint64_t tscStart = read_tsc();
+	uint32_t elapsed;
+	while ((elapsed = start - apic_reg_read(APIC_REG_T_COUNT)) < interval);
+	uint64_t tscEnd = read_tsc();
+	apic_reg_write(APIC_REG_T_INTERVAL, 0);
+
+	tscPerTick = (tscEnd - tscStart) * interval / elapsed;
+	if (!tscPerTick)
+		tscPerTick = 1;
+	tscBase = tscEnd - systemTicks * tscPerTick;
+}
+
+
+// Brings the system ticks up to date and returns the current value.
+// Before the timer was calibrated (or if the TSC is not invariant), system ticks are only counted by the timer interrupt
+// of the bootstrap processor.
+uintptr_t apic_update_ticks(void) {
+	if (!tscPerTick)
+		return systemTicks;
+
+	system_ticks_t ticks = (read_tsc() - tscBase) / tscPerTick;
+	system_ticks_t old;
+	while ((old = systemTicks) < ticks)
+		if (__sync_bool_compare_and_swap(&systemTicks, old, ticks))
+			return ticks;
+	return old;
+}
+
+
+// Sets the prescaler of the local APIC timer without starting it. This must not be called before apic_init.
+// One interval corresponds to one system tick. If the TSC is invariant, the first call also measures the interval
+// in TSC increments.
 //	prescaler: 111: 1, 000: 2, 001: 4, 010: 8, 011: 16, 100: 32, 101: 64, 110: 128
-void apic_timer_start(int interval, int prescaler) {
+void apic_timer_calibrate(int interval, int prescaler) {
 	apic_reg_write(APIC_REG_T_DIVIDE, ((prescaler & 0x04) << 1) | (prescaler & 0x03));
+	timerInterval = interval;
+	if (!tscPerTick && tscInvariant)
+		apic_timer_measure(interval);
+}
+
+
+// Starts the local APIC timer in periodic mode (calibrating it first, see apic_timer_calibrate).
+void apic_timer_start(int interval, int prescaler) {
+	apic_timer_calibrate(interval, prescaler);
+	apic_reg_write(APIC_REG_LVT_TIMER, APIC_INT_TIMER | APIC_TIMER_PERIODIC); // the mode must be set before the interval
 	apic_reg_write(APIC_REG_T_INTERVAL, interval);
-	apic_reg_write(APIC_REG_LVT_TIMER, apic_reg_read(APIC_REG_LVT_TIMER) & ~APIC_INT_MASKED); // unmask timer interrupt
-	//apic_reg_write(APIC_REG_T_COUNT, interval);
 }
 
 
-// Stops the local APIC timer.
-// The system ticks counter is tied to the APIC and is not incremented when the timer is stopped.
+// Programs the local APIC timer to fire once at the specified system tick instead of periodically.
+// If the deadline has already passed, the timer fires immediately.
+// This requires apic_timer_tickless_available. apic_timer_start must have been called before on any processor, so that
+// the timer is calibrated. Without an invariant TSC, the system ticks are those counted by the bootstrap processor,
+// so the timer may fire up to one tick late.
+void apic_timer_oneshot(uintptr_t deadline) {
+	if (tscDeadlineSupport) {
+		apic_reg_write(APIC_REG_LVT_TIMER, APIC_INT_TIMER | APIC_TIMER_DEADLINE);
+		__sync_synchronize(); // the mode switch must be complete before the deadline is written
+		write_msr(IA32_TSC_DEADLINE, tscBase + deadline * tscPerTick);
+	} else {
+		system_ticks_t now = apic_update_ticks();
+		uint64_t count = (deadline > now ? (deadline - now) * timerInterval : 1);
+		apic_reg_write(APIC_REG_LVT_TIMER, APIC_INT_TIMER | APIC_TIMER_ONE_SHOT);
+		apic_reg_write(APIC_REG_T_INTERVAL, count > 0xFFFFFFFF ? 0xFFFFFFFF : count); // if the timer fires too early, the caller will program it again
+	}
+}
+
+
+// Stops the local APIC timer. This requires apic_timer_tickless_available.
+// The system ticks remain up to date as long as apic_update_ticks is called.
 void apic_timer_stop(void) {
 	apic_reg_write(APIC_REG_LVT_TIMER, apic_reg_read(APIC_REG_LVT_TIMER) | APIC_INT_MASKED); // mask timer interrupt
-	apic_reg_write(APIC_REG_T_COUNT, 0);
+	if (tscDeadlineSupport)
+		write_msr(IA32_TSC_DEADLINE, 0);
+	apic_reg_write(APIC_REG_T_INTERVAL, 0);
 }
 
 
@@ -160,6 +267,41 @@ void apic_timer_trigger(void) {
 }
 
 
+// Sends an inter-processor interrupt to the processor with the specified local APIC ID.
+//	command: the lower half of the interrupt command register (vector and delivery mode)
+static void apic_send_ipi(uint32_t apicId, uint32_t command) {
+	while (apic_reg_read(APIC_REG_ICR_LOW) & APIC_ICR_PENDING);
+	apic_reg_write(APIC_REG_ICR_HIGH, apicId << 24);
+	apic_reg_write(APIC_REG_ICR_LOW, command); // writing the lower half sends the IPI
+}
+
+
+// Invokes the timer callback on the processor with the specified local APIC ID without counting a system tick.
+// This is used to wake up an idle processor.
+void apic_timer_trigger_remote(uint32_t apicId) {
+	apic_send_ipi(apicId, APIC_ICR_FIXED | APIC_ICR_ASSERT | APIC_INT_RESCHEDULE);
+}
+
+
+// Makes the processor with the specified local APIC ID invalidate the TLB entries that are listed in the current TLB batch.
+void apic_send_tlb_shootdown(uint32_t apicId) {
+	apic_send_ipi(apicId, APIC_ICR_FIXED | APIC_ICR_ASSERT | APIC_INT_TLB_SHOOTDOWN);
+}
+
+
+// Sends an INIT IPI to the specified processor, which resets it into the wait-for-SIPI state.
+void apic_send_init(uint32_t apicId) {
+	apic_send_ipi(apicId, APIC_ICR_INIT | APIC_ICR_ASSERT);
+}
+
+
+// Sends a startup IPI to the specified processor.
+// The processor starts executing in real mode at the beginning of the specified physical page (must be below 1MB).
+void apic_send_startup(uint32_t apicId, uint8_t page) {
+	apic_send_ipi(apicId, APIC_ICR_STARTUP | APIC_ICR_ASSERT | page);
+}
+
+
 // Sets an I/O APIC register
 void io_apic_write(void *ioapicaddr, uint32_t reg, uint32_t value) {
 	uint32_t volatile *ioapic = (uint32_t volatile *)ioapicaddr;
@@ -183,9 +325,16 @@ char apicMsg3[] = "\nexecution halted\n";
 char picMsg[] = "\npic: 0x";
 
 void apic_interrupt_handler(uint64_t intNumber, uint64_t errCode, execution_context_t *context) {
-	if (intNumber == APIC_INT_TIMER && timerCallback) {
-		systemTicks++;
+	if ((intNumber == APIC_INT_TIMER || intNumber == APIC_INT_RESCHEDULE) && timerCallback) {
+		if (intNumber == APIC_INT_TIMER) {
+			if (tscPerTick)
+				apic_update_ticks();
+			else if (!cpu_current()->index) // before calibration, system ticks are counted by the bootstrap processor
+				systemTicks++;
+		}
 		timerCallback(context);
+	} else if (intNumber == APIC_INT_TLB_SHOOTDOWN) {
+		tlb_shootdown_poll();
 	} else {
 		errCode = apic_read_error_status();
 		teletype_print_string(apicMsg1, sizeof(apicMsg1), 0x07);
@@ -279,19 +428,9 @@ void apic_disable(void) {
 
 
 
-// initializes the APIC
-//	timerCallback: an interrupt handler that is executed whenever the timer fires
-void apic_init() {
-	// Disable legacy PIC
-	picMaskMaster = in(0x21);
-	picMaskSlave = in(0xA1);
-	pic_disable();
-
-	// Check for APIC availability and map it to virtual address space
-	assert(apic_available());
-	uintptr_t base = apic_base_read();
-	apicBase = page_map((void *)base, APIC_REGFILE_LENGTH, 0, 1, 0);
-
+// Configures the local APIC of the calling processor.
+// The local APIC registers of each processor are mapped to the same physical address, so apicBase is valid on all processors.
+static void apic_init_local(void) {
 	// todo: move to separate file
 	int claimedBanks = 0;
 	if (cpuid_test(1, 0, 0, 0, (1 << CPUID_BIT_MCE) | (1 << CPUID_BIT_MCA))) { // check if MCE and MCA are available
@@ -324,34 +463,62 @@ void apic_init() {
 	}
 
 
+	// configure all local APIC built in interrupts (start off with all interrupts masked)
+	if (claimedBanks)
+		apic_reg_write(APIC_REG_LVT_CMCI, APIC_INT_CMCI | APIC_INT_MASKED);
+	apic_reg_write(APIC_REG_LVT_TIMER, APIC_INT_TIMER | APIC_TIMER_PERIODIC | APIC_INT_MASKED);
+	apic_reg_write(APIC_REG_LVT_THERMAL, APIC_INT_THERMAL | APIC_INT_MASKED);
+	apic_reg_write(APIC_REG_LVT_PERFORMANCE, APIC_INT_PERFORMANCE | APIC_INT_MASKED);
+	apic_reg_write(APIC_REG_LVT_LINT0, APIC_INT_LINT0 | APIC_INT_MASKED); // edge triggered, active high (might need to be adjusted) (see MPS table / ACPI)
+	//apic_reg_write(APIC_REG_LVT_LINT0, APIC_INT_LINT0); // edge triggered, active high (might need to be adjusted) (see MPS table / ACPI)
+	apic_reg_write(APIC_REG_LVT_LINT1, APIC_INT_LINT1 | APIC_INT_MASKED);
+	apic_reg_write(APIC_REG_LVT_ERROR, APIC_INT_ERROR | APIC_INT_MASKED);
+
+
+
+	apic_enable();
+}
+
+
+
+// initializes the APIC
+//	timerCallback: an interrupt handler that is executed whenever the timer fires
+void apic_init() {
+	// Disable legacy PIC
+	picMaskMaster = in(0x21);
+	picMaskSlave = in(0xA1);
+	pic_disable();
+
+	// Check for APIC availability and map it to virtual address space
+	assert(apic_available());
+	uintptr_t base = apic_base_read();
+	apicBase = page_map((void *)base, APIC_REGFILE_LENGTH, 0, 1, 0);
+
 	// install dummy handlers for legacy PIC
 	for (int i = 0; i < 16; i++)
 		interrupt_register(PIC_INT + i, pic_interrupt_handler);
 
-	// setup handlers for all local APIC built in interrupts
-	if (claimedBanks)
-		interrupt_register(APIC_INT_CMCI, apic_interrupt_handler);
+	// setup handlers for all local APIC built in interrupts (the IDT is shared by all processors)
+	interrupt_register(APIC_INT_CMCI, apic_interrupt_handler);
 	interrupt_register(APIC_INT_TIMER, apic_interrupt_handler);
 	interrupt_register(APIC_INT_THERMAL, apic_interrupt_handler); // todo: should be implementation specific
 	interrupt_register(APIC_INT_PERFORMANCE, apic_interrupt_handler); // todo: should be implementation specific
 	interrupt_register(APIC_INT_LINT0, apic_interrupt_handler);
 	interrupt_register(APIC_INT_LINT1, apic_interrupt_handler);
+	interrupt_register(APIC_INT_RESCHEDULE, apic_interrupt_handler);
+	interrupt_register(APIC_INT_TLB_SHOOTDOWN, apic_interrupt_handler);
 	interrupt_register(APIC_INT_SPURIOUS, apic_interrupt_handler);
 	interrupt_register(APIC_INT_ERROR, apic_interrupt_handler);
 
+	// without an invariant TSC, there is no TSC value that corresponds to a system tick (e.g. QEMU without "-cpu ...,+invtsc")
+	tscInvariant = cpuid_test(0x80000007, 0, 0, 0, 1 << CPUID_BIT_INVARIANT_TSC);
+	tscDeadlineSupport = tscInvariant && cpuid_test(1, 0, 0, 1 << CPUID_BIT_TSC_DEADLINE, 0);
 
-	// configure all local APIC built in interrupts (start off with all interrupts masked)
-	if (claimedBanks)
-		apic_reg_write(APIC_REG_LVT_CMCI, APIC_INT_CMCI | APIC_INT_MASKED);
-	apic_reg_write(APIC_REG_LVT_TIMER, APIC_INT_TIMER | APIC_TIMER_PERIODIC | APIC_INT_MASKED);
-	apic_reg_write(APIC_REG_LVT_THERMAL, APIC_INT_THERMAL | APIC_INT_MASKED);
-	apic_reg_write(APIC_REG_LVT_PERFORMANCE, APIC_INT_PERFORMANCE | APIC_INT_MASKED);
-	apic_reg_write(APIC_REG_LVT_LINT0, APIC_INT_LINT0 | APIC_INT_MASKED); // edge triggered, active high (might need to be adjusted) (see MPS table / ACPI)
-	//apic_reg_write(APIC_REG_LVT_LINT0, APIC_INT_LINT0); // edge triggered, active high (might need to be adjusted) (see MPS table / ACPI)
-	apic_reg_write(APIC_REG_LVT_LINT1, APIC_INT_LINT1 | APIC_INT_MASKED);
-	apic_reg_write(APIC_REG_LVT_ERROR, APIC_INT_ERROR | APIC_INT_MASKED);
+	apic_init_local();
+}
 
 
-	
-	apic_enable();
+// Initializes the local APIC of an application processor. apic_init must have been called on the bootstrap processor.
+void apic_init_ap(void) {
+	apic_init_local();
 }
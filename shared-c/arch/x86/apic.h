@@ -5,13 +5,23 @@
 
 typedef void(*timer_callback_t)(execution_context_t *context);
 
+int apic_timer_tickless_available(void);
 void apic_timer_config(timer_callback_t);
+void apic_timer_calibrate(int interval, int prescaler);
 void apic_timer_start(int interval, int prescaler);
+void apic_timer_oneshot(uintptr_t deadline);
 void apic_timer_stop(void);
+uintptr_t apic_update_ticks(void);
 void apic_timer_trigger(void);
+void apic_timer_trigger_remote(uint32_t apicId);
+void apic_send_tlb_shootdown(uint32_t apicId);
+uint32_t apic_read_id(void);
+void apic_send_init(uint32_t apicId);
+void apic_send_startup(uint32_t apicId, uint8_t page);
 void apic_enable(void);
 void apic_disable(void);
 void apic_init(void);
+void apic_init_ap(void);
 void pic_enable(void);
 void pic_disable(void);
 
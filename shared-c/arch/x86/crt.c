@@ -135,6 +135,33 @@ extern void(*__init4[])(void);
 extern void(*__init5[])(void);
 
 int cpuFeatureLevel = 0;
+int fpuSaveMode = FPU_SAVE_FXSAVE;
+size_t fpuStateSize = 512;
+
+
+// Enables SSE (and AVX if available) and initializes the FPU of the calling processor.
+// Application processors call this when they start up.
+void cpu_init_fpu(void) {
+	// enable SSE
+	write_cr0((read_cr0() & ~(1 << 2)) | (1 << 1));
+	write_cr4(read_cr4() | (1 << 9) | (1 << 10));
+
+	// enable AVX state through XSAVE (required by level 2 accelerated functions)
+	if (cpuid_test(1, 0, 0, (1 << 26) | (1 << 28), 0)) {
+		write_cr4(read_cr4() | (1 << 18));
+		write_xcr0(read_xcr0() | 0x7); // x87, SSE and AVX state
+
+		// the size of the XSAVE area depends on the components that are enabled in XCR0
+		uint32_t eax, ebx, ecx, edx;
+		cpuid_ex(0xD, 0, &eax, &ebx, &ecx, &edx);
+		fpuStateSize = ebx;
+		cpuid_ex(0xD, 1, &eax, &ebx, &ecx, &edx);
+		fpuSaveMode = (eax & (1 << 0)) ? FPU_SAVE_XSAVEOPT : FPU_SAVE_XSAVE;
+	}
+
+	// init x87 floating-point unit
+	__asm volatile("finit" : : : "memory");
+}
 
 
 void __start(uintptr_t bootloaderBase) {
@@ -146,12 +173,7 @@ void __start(uintptr_t bootloaderBase) {
 	for (int i = 0; __bootref_list[i]; i++)
 		__bootref_list[i] += bootloaderBase;
 
-	// enable SSE
-	write_cr0((read_cr0() & ~(1 << 2)) | (1 << 1));
-	write_cr4(read_cr4() | (1 << 9) | (1 << 10));
-
-	// init x87 floating-point unit
-	__asm volatile("finit" : : : "memory");
+	cpu_init_fpu();
 
 	// determine level of CPU features (required by accelerated functions)
 	if (cpuid_test(1, 0, 0, CPULEVEL1_MASK_ECX, CPULEVEL1_MASK_EDX)) {
@@ -1,4 +1,10 @@
 
+// The ISR stubs only save the general purpose registers, while the vector registers may still hold the state of
+// a thread other than the interrupted one (they are switched lazily, see thread_fpu_handler). Interrupt handlers
+// and everything they call are therefore compiled without SSE. The target must be set before any header is included,
+// otherwise the inline functions of the headers could not be inlined into these handlers.
+#pragma GCC target("general-regs-only")
+
 #include <system.h>
 #include "interrupts.h"
 
@@ -28,14 +34,8 @@ typedef struct __attribute__((packed)) {
 } tss_descriptor_t;
 
 
-struct __attribute__((packed)) __attribute__((aligned(4))) {
-	uint32_t reserved1;
-	uint64_t rsp[3]; // stack pointer for ring 0 - 2
-	uint64_t ist[8]; // several stack pointers to be used for interrupts (entry 0 is reserved)
-	uint64_t reserved2;
-	uint16_t reserved3;
-	uint16_t ioBitmapOffset; // offset of the IO permission bitmap relative to the TSS address (not used)
-} tss;
+// the TSS of the bootstrap processor (application processors bring their own)
+tss_t tss;
 
 
 
@@ -166,8 +166,38 @@ void interrupt_register(int number, interrupt_handler_t handler) {
 }
 
 
-static inline void setup_stack(int number, void *start, size_t size) {
-	tss.ist[number] = (uintptr_t)start + size;
+static inline void setup_stack(tss_t *tss, int number, void *start, size_t size) {
+	tss->ist[number] = (uintptr_t)start + size;
+}
+
+
+// Sets up the stacks in the specified TSS, points the TSS descriptor to it and loads it on the local processor.
+static void tss_load(tss_t *tss, void *tssDescriptor, char *kernelStack, char *interruptStack, char *fallbackStack) {
+	// set up some stacks in TSS
+	setup_stack(tss, STACK_NUM_KERNEL, kernelStack, PAGE_SIZE);
+	setup_stack(tss, STACK_NUM_INT, interruptStack, PAGE_SIZE);
+	setup_stack(tss, STACK_NUM_FALLBACK, fallbackStack, PAGE_SIZE);
+
+	// set up TSS descriptor in GDT
+	// this descriptor is used to locate the TSS whenever an interrupt occurs
+	tss_descriptor_t *tssDscr = (tss_descriptor_t *)tssDescriptor;
+	tssDscr->base1 = ((uintptr_t)tss >> 0) & 0xFFFF;
+	tssDscr->base2 = ((uintptr_t)tss >> 16) & 0xFF;
+	tssDscr->base3 = ((uintptr_t)tss >> 24) & 0xFF;
+	tssDscr->base4 = ((uintptr_t)tss >> 32) & 0xFFFFFFFF;
+	tssDscr->limit = sizeof(tss_t) - 1;
+	tssDscr->attributes = 0x0089; // also clears the busy flag if the descriptor was copied from a loaded one
+	tssDscr->reserved = 0;
+	set_tr(TASK_SEGMENT_SELECTOR);
+}
+
+
+// Loads the interrupt descriptor table that is shared by all processors
+static inline void idt_load(void) {
+	set_idtr((idtr_t) {
+		.address = interrupt_descriptor_table,
+			.limit = sizeof(interrupt_descriptor_table) - 1
+	});
 }
 
 
@@ -196,28 +226,10 @@ void backup_handler(uint64_t intNumber, uint64_t errCode, execution_context_t *c
 // Loads the interrupt descriptor table
 void interrupt_init(void *tssDescriptor) {
 	
-	// set up some stacks in TSS
-	setup_stack(STACK_NUM_KERNEL, kernel_stack, PAGE_SIZE);
-	setup_stack(STACK_NUM_INT, interrupt_stack, PAGE_SIZE);
-	setup_stack(STACK_NUM_FALLBACK, fallback_stack, PAGE_SIZE);
-
-	// set up TSS descriptor in GDT
-	// this descriptor is used to locate the TSS whenever an interrupt occurs
-	tss_descriptor_t *tssDscr = (tss_descriptor_t *)tssDescriptor;
-	tssDscr->base1 = ((uintptr_t)&tss >> 0) & 0xFFFF;
-	tssDscr->base2 = ((uintptr_t)&tss >> 16) & 0xFF;
-	tssDscr->base3 = ((uintptr_t)&tss >> 24) & 0xFF;
-	tssDscr->base4 = ((uintptr_t)&tss >> 32) & 0xFFFFFFFF;
-	tssDscr->limit = sizeof(tss) - 1;
-	tssDscr->attributes = 0x0089;
-	tssDscr->reserved = 0;
-	set_tr(TASK_SEGMENT_SELECTOR);
+	tss_load(&tss, tssDescriptor, kernel_stack, interrupt_stack, fallback_stack);
 	
 	// set idtr before setting up the handlers, so there's a chance we can catch some memory allocation issues
-	set_idtr((idtr_t) {
-		.address = interrupt_descriptor_table,
-			.limit = sizeof(interrupt_descriptor_table) - 1
-	});
+	idt_load();
 
 	// install some essential handlers for non recoverable system states
 	interrupt_register_ex(INTERRUPT_NUMBER_DEBUG, 0, panic_handler, STACK_NUM_FALLBACK);
@@ -248,3 +260,16 @@ void interrupt_init(void *tssDescriptor) {
 	for (uint8_t i = 0x14; i; i++)
 		interrupt_register_ex(i, 0, backup_handler, STACK_NUM_FALLBACK);
 }
+
+
+// Sets up interrupt handling on an application processor.
+// The interrupt handlers registered by the bootstrap processor are shared by all processors,
+// but each processor needs its own TSS and its own interrupt stacks.
+//	tssDescriptor: the TSS descriptor in the GDT of the calling processor
+//	tss: a TSS that is used exclusively by the calling processor
+//	kernelStack, interruptStack, fallbackStack: stacks of PAGE_SIZE bytes each
+void interrupt_init_ap(void *tssDescriptor, tss_t *tss, char *kernelStack, char *interruptStack, char *fallbackStack) {
+	memset(tss, 0, sizeof(tss_t));
+	tss_load(tss, tssDescriptor, kernelStack, interruptStack, fallbackStack);
+	idt_load();
+}
@@ -77,7 +77,20 @@ static inline void atomic_exit(int intFlag) {
 typedef void(*interrupt_handler_t)(uint64_t intNumber, uint64_t errCode, execution_context_t *context);
 
 
+// task state segment (one per processor)
+typedef struct __attribute__((packed)) __attribute__((aligned(4))) {
+	uint32_t reserved1;
+	uint64_t rsp[3]; // stack pointer for ring 0 - 2
+	uint64_t ist[8]; // several stack pointers to be used for interrupts (entry 0 is reserved)
+	uint64_t reserved2;
+	uint16_t reserved3;
+	uint16_t ioBitmapOffset; // offset of the IO permission bitmap relative to the TSS address (not used)
+} tss_t;
+
+
 void interrupt_init(void *tssDescriptor);
+void interrupt_init_ap(void *tssDescriptor, tss_t *tss, char *kernelStack, char *interruptStack, char *fallbackStack);
+void interrupt_register_ex(int number, int hasErrorCode, interrupt_handler_t handler, int stackNumber);
 void interrupt_register(int number, interrupt_handler_t handler);
 
 
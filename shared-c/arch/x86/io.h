@@ -61,9 +61,13 @@ static inline void cpu_halt(void) {
 	__asm volatile("hlt" : : : "memory");
 }
 
-static inline void cpuid(int code, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
+static inline void cpuid_ex(int code, int subleaf, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
 	__asm volatile("cpuid"
-	: "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(code), "c"(0) : "memory");
+	: "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(code), "c"(subleaf) : "memory");
+}
+
+static inline void cpuid(int code, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
+	cpuid_ex(code, 0, a, b, c, d);
 }
 
 static inline int cpuid_test(int code, uint32_t maskA, uint32_t maskB, uint32_t maskC, uint32_t maskD) {
@@ -120,6 +124,21 @@ static inline void write_msr(uint32_t msrId, uint64_t msrValue) {
 		);
 }
 
+static inline void invlpg(void *address) {
+	__asm volatile ("invlpg [%0]" : : "r" (address) : "memory");
+}
+
+// Tells the processor that it is waiting in a spin loop
+static inline void cpu_relax(void) {
+	__builtin_ia32_pause();
+}
+
+static inline uint64_t read_tsc(void) {
+	uint32_t tscLo, tscHi;
+	__asm volatile ("rdtsc" : "=a" (tscLo), "=d" (tscHi));
+	return ((uint64_t)tscHi << 32) | (uint64_t)tscLo;
+}
+
 typedef volatile struct __attribute__((aligned(4))) __attribute__((packed)) {
 	uint16_t limit;
 	void *address;
@@ -138,6 +157,21 @@ static inline void set_idtr(idtr_t idtr) {
 }
 
 
+typedef idtr_t gdtr_t;
+
+static inline gdtr_t get_gdtr(void) {
+	gdtr_t gdtr;
+	__asm volatile ("sgdt [rax]"
+	: : "a" (&gdtr) : "memory");
+	return gdtr;
+}
+
+static inline void set_gdtr(gdtr_t gdtr) {
+	__asm volatile ("lgdt [rax]"
+	: : "a" (&gdtr) : "memory");
+}
+
+
 static inline void set_tr(short selector) {
 	__asm volatile ("ltr ax"
 	: : "a" (selector) : "memory");
@@ -185,6 +219,26 @@ static inline void write_cr4(unsigned long val) {
 	__asm volatile("mov cr4, %0\n\t" : : "r" (val));
 }
 
+static inline uint64_t read_xcr0(void) {
+	uint32_t low, high;
+	__asm volatile("xgetbv\n\t" : "=a" (low), "=d" (high) : "c" (0));
+	return ((uint64_t)high << 32) | low;
+}
+
+static inline void write_xcr0(uint64_t val) {
+	__asm volatile("xsetbv\n\t" : : "a" ((uint32_t)val), "d" ((uint32_t)(val >> 32)), "c" (0));
+}
+
+// Clears CR0.TS, so that floating-point and SIMD instructions no longer raise #NM
+static inline void clts(void) {
+	__asm volatile("clts" : : : "memory");
+}
+
+// Sets CR0.TS, so that the next floating-point or SIMD instruction raises #NM
+static inline void stts(void) {
+	write_cr0(read_cr0() | (1 << 3));
+}
+
 
 // Performs really hard reset of the local CPU
 static inline __attribute__((__noreturn__)) void __reset(int reason) {
@@ -208,6 +262,44 @@ typedef struct  __attribute__((packed)) {
 
 extern int cpuFeatureLevel;
 
+// Enables SSE (and AVX if available) and initializes the FPU of the calling processor (defined in crt.c)
+void cpu_init_fpu(void);
+
+
+#define FPU_SAVE_FXSAVE		(0)	// legacy x87 and SSE state only
+#define FPU_SAVE_XSAVE		(1)	// all state components that are enabled in XCR0
+#define FPU_SAVE_XSAVEOPT	(2)	// same as XSAVE, but skips components that were not modified since they were restored
+
+#define FPU_STATE_ALIGNMENT	(64)
+
+extern int fpuSaveMode;			// one of the FPU_SAVE_ constants (set up by cpu_init_fpu)
+extern size_t fpuStateSize;		// number of bytes required to hold the FPU, SSE and AVX state of a thread
+
+// Prepares a state area of fpuStateSize bytes, such that restoring it yields a freshly initialized FPU
+static inline void fpu_init_state(void *area) {
+	memset(area, 0, fpuStateSize);
+	*(uint16_t *)((char *)area + 0) = 0x037F;	// FCW: all x87 exceptions masked
+	*(uint32_t *)((char *)area + 24) = 0x1F80;	// MXCSR: all SSE exceptions masked
+}
+
+// Stores the FPU, SSE and AVX registers of the local processor in the specified state area
+static inline void fpu_save(void *area) {
+	if (fpuSaveMode == FPU_SAVE_XSAVEOPT)
+		__asm volatile("xsaveopt64 [%0]" : : "r" (area), "a" (-1), "d" (-1) : "memory");
+	else if (fpuSaveMode == FPU_SAVE_XSAVE)
+		__asm volatile("xsave64 [%0]" : : "r" (area), "a" (-1), "d" (-1) : "memory");
+	else
+		__asm volatile("fxsave64 [%0]" : : "r" (area) : "memory");
+}
+
+// Loads the FPU, SSE and AVX registers of the local processor from the specified state area
+static inline void fpu_restore(void *area) {
+	if (fpuSaveMode == FPU_SAVE_FXSAVE)
+		__asm volatile("fxrstor64 [%0]" : : "r" (area) : "memory");
+	else
+		__asm volatile("xrstor64 [%0]" : : "r" (area), "a" (-1), "d" (-1) : "memory");
+}
+
 
 #define CPUACCELDECL(returnType, funcName, funcParams)				\
 extern returnType(*funcName)funcParams
@@ -227,7 +319,7 @@ __attribute__((__target__("sse4.1")))								\
 __attribute__((__target__("sse4.2")))
 
 #define CPULEVEL2_MASK_EDX	(CPULEVEL1_MASK_EDX)
-#define CPULEVEL2_MASK_ECX	(CPULEVEL1_MASK_ECX | (1 << 29) | (1 << 28) | (1 << 23))
+#define CPULEVEL2_MASK_ECX	(CPULEVEL1_MASK_ECX | (1 << 29) | (1 << 28) | (1 << 27) | (1 << 23) | (1 << 1))	// includes OSXSAVE (set by __start if AVX is available)
 #define CPULEVEL2_MASK_EBX	((1 << 5) | (1 << 3) | (1 << 8))				// on CPUID page 7
 #define CPULEVEL2 CPULEVEL1											\
 __attribute__((__target__("f16c")))									\
@@ -235,24 +327,27 @@ __attribute__((__target__("avx")))									\
 __attribute__((__target__("avx2")))									\
 __attribute__((__target__("abm")))									\
 __attribute__((__target__("popcnt")))								\
+__attribute__((__target__("pclmul")))								\
 /*__attribute__((__target__("bmi1")))*/								\
 __attribute__((__target__("bmi2")))
 
 
-#define CPUACCELFUNC(returnType, funcName, funcParams, funcBody)	\
+// The body is compiled once for each level. CPUACCELLEVEL is the level of the variant that is being compiled, so that
+// the body can use instructions that only some levels provide.
+#define CPUACCELFUNC(returnType, funcName, funcParams, ...)		\
 returnType															\
 CPULEVEL0															\
 funcName ## _level0 funcParams										\
-funcBody															\
+{ enum { CPUACCELLEVEL = 0 }; __VA_ARGS__ }						\
 returnType															\
 CPULEVEL1															\
 funcName ## _level1 funcParams										\
-funcBody															\
+{ enum { CPUACCELLEVEL = 1 }; __VA_ARGS__ }						\
 returnType															\
 CPULEVEL2															\
 funcName ## _level2 funcParams										\
-funcBody															\
-returnType(*funcName)funcParams;									\
+{ enum { CPUACCELLEVEL = 2 }; __VA_ARGS__ }						\
+returnType(*funcName)funcParams = funcName ## _level0;				\
 void __attribute__((constructor)) funcName ## _init (void) {		\
 	funcName = ((cpuFeatureLevel > 0) ? ((cpuFeatureLevel > 1) ? funcName ## _level2 : funcName ## _level1) : funcName ## _level0); \
 }
@@ -267,6 +362,7 @@ void __attribute__((constructor)) funcName ## _init (void) {		\
 #include "mmu.h"
 #include "pit.h"
 #include "realmode.h"
+#include "smp.h"
 //#include "vmx.h"
 
 
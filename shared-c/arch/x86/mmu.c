@@ -3,6 +3,11 @@
 *
 * Manages virtual (linear) memory space and maps it to physical memory by using the MMU utilities provided by the hardware.
 * Physical pages that hold data or paging structures are allocated and freed dynamically.
+* Where the physical and virtual addresses allow it, large blocks are mapped using 2MB pages (PML2T entries) and
+* 1GB pages (PML3T entries, if supported by the CPU). Such pages are split up if only a part of them is freed.
+* Free virtual address space is kept track of in a range tree (see va_alloc), which is built from the paging
+* structures when an address space is first used.
+* Pages that are unmapped are invalidated in the TLBs of all processors in batches (see tlb_commit_batch).
 *
 * Memory organization:
 *	0000000000000000 - 0000007FFFFFFFFF (1st 512GB)
@@ -29,14 +34,17 @@
 *
 */
 
+// TLB shootdowns are handled in interrupt context (see interrupts.c)
+#pragma GCC target("general-regs-only")
+
 #include <system.h>
 #include "mmu.h"
 
 
 //#define DBG_MAP(...)	LOGI(__VA_ARGS__)
 #define DBG_MAP(...)
-//#define DBG_FIND(...)	LOGI(__VA_ARGS__)
-#define DBG_FIND(...)
+//#define DBG_VA(...)	LOGI(__VA_ARGS__)
+#define DBG_VA(...)
 
 
 
@@ -61,18 +69,6 @@ uint64_t *PML4T = (uint64_t *)0xFFFFFF8040200000UL; // 4kB,               512 el
 #define KERNELSPACE_START		(0xFFFFFFFF80000000UL)
 #define KERNELSPACE_END			(0xFFFFFFFFFFFFEFFFUL)
 
-#define MEMSPACE_START(userspace)	((userspace) ? USERSPACE_START : KERNELSPACE_START)
-#define MEMSPACE_END(userspace)		((userspace) ? USERSPACE_END : KERNELSPACE_END)
-#define PML4T_START(userspace)		((MEMSPACE_START(userspace) >> 39) & 0x1FF)
-#define PML4T_END(userspace)		(((MEMSPACE_END(userspace) >> 39) & 0x1FF) + 1)
-#define PML3T_START(userspace)		((MEMSPACE_START(userspace) >> 30) & 0x1FF)
-#define PML3T_END(userspace)		(((MEMSPACE_END(userspace) >> 30) & 0x1FF) + 1)
-#define PML2T_START(userspace)		((MEMSPACE_START(userspace) >> 21) & 0x1FF)
-#define PML2T_END(userspace)		(((MEMSPACE_END(userspace) >> 21) & 0x1FF) + 1)
-#define PML1T_START(userspace)		((MEMSPACE_START(userspace) >> 12) & 0x1FF)
-#define PML1T_END(userspace)		(((MEMSPACE_END(userspace) >> 12) & 0x1FF) + 1)
-
-
 // retrieves a page table entry based on a page numer in linear address space (0 referring to the page at 0x0000000000000000 - 0x0000000000001000)
 #define PML4T_VA_ENTRY(i)										(PML4T[((i) >> 27) & 0x00000000000001FFUL])
 #define PML3T_VA_ENTRY(i)										(PML3T[((i) >> 18) & 0x000000000003FFFFUL])
@@ -93,7 +89,7 @@ uint64_t *PML4T = (uint64_t *)0xFFFFFF8040200000UL; // 4kB,               512 el
 // 51:12	4kB aligned physical address of lower level paging structure
 // 11:9		unused
 // 8		"global" flag
-// 7		cache control
+// 7		cache control (PML1T), "page size" flag (PML2T, PML3T: the entry maps a 2MB or 1GB page instead of a paging structure)
 // 6		"dirty" flag (set by CPU, only in lowest level table)
 // 5		"acessed" flag (set by CPU)
 // 4:3		cache control
@@ -138,6 +134,15 @@ uint64_t *PML4T = (uint64_t *)0xFFFFFF8040200000UL; // 4kB,               512 el
 // marks the specified entry as having some free space
 #define pte_mark_not_full(entry)		((entry) &= ~(1UL << 52))
 
+// returns a non-zero value if the specified PML2T or PML3T entry maps a 2MB or 1GB page
+#define pte_is_huge(entry)				(!pte_is_completely_free(entry) && (((entry) >> 7) & 1))
+
+// the "page size" flag
+#define PTE_HUGE						(1UL << 7)
+
+// the number of 4kB pages that are controlled by an entry at the specified level (1: PML1T, ..., 4: PML4T)
+#define PAGE_LEVEL_PAGES(level)			(1UL << (9 * ((level) - 1)))
+
 // flushes the translation lookaside buffer
 #define flush_tlb()						write_cr3(read_cr3())
 
@@ -146,6 +151,8 @@ uint64_t *PML4T = (uint64_t *)0xFFFFFF8040200000UL; // 4kB,               512 el
 
 
 int nxSupport = 0; // todo: check CPUID for no-execute support
+int largePageSupport = 1; // 2MB pages are always available in long mode
+int hugePageSupport = 0; // 1GB pages
 
 
 uint64_t pml4tTemp;
@@ -154,6 +161,7 @@ uintptr_t realmodePML3TAddr;
 
 void mmu_init(void) {
 	realmodePML3TAddr = PML1T[((uintptr_t)TEMP_PAGE_VA & 0x0000FFFFFFFFFFFFUL) >> PAGE_ALIGN_BITS] & 0x000FFFFFFFFFF000;
+	hugePageSupport = cpuid_test(0x80000001, 0, 0, 0, 1 << 26);
 }
 
 REGISTER_INIT0(mmu_init);
@@ -165,15 +173,16 @@ REGISTER_INIT0(mmu_init);
 // Returns the virtual address that was used.
 static void *page_map_temp(void *physicalAddress) {
 	PML1T[((uintptr_t)TEMP_PAGE_VA & 0x0000FFFFFFFFFFFFUL) >> PAGE_ALIGN_BITS] = pte_create(physicalAddress, 0, 1, 0);
-	flush_tlb();
+	invlpg((void *)TEMP_PAGE_VA);
 	for (int i = 0; i < (PAGE_SIZE >> 3); i++)
 		((uint64_t *)TEMP_PAGE_VA)[i] = 0;
 	return (void *)TEMP_PAGE_VA;
 }
 
 // Restores a 1:1 mapping of the real mode memory to allow exiting paging
+// The PML3T for this mapping was set up by the bootloader and is never changed, so it's not
+// rewritten here (that would need the temporary page, which may be in use on another processor).
 void page_map_realmode(void) {
-	((uint64_t *)page_map_temp((void *)realmodePML3TAddr))[0] = PML3T[0x3FFFE];
 	pml4tTemp = PML4T[0];
 	PML4T[0] = pte_create(realmodePML3TAddr, 0, 1, 0);
 	flush_tlb();
@@ -189,9 +198,32 @@ void page_unmap_realmode(void) {
 
 
 
+// Returns the entry at the specified level (1: PML1T, ..., 4: PML4T) that controls the specified virtual page
+static inline uint64_t *pte_get(uintptr_t virtualPage, int level) {
+	virtualPage &= 0x0000000FFFFFFFFFUL;
+	switch (level) {
+		case 1: return &PML1T_VA_ENTRY(virtualPage);
+		case 2: return &PML2T_VA_ENTRY(virtualPage);
+		case 3: return &PML3T_VA_ENTRY(virtualPage);
+		default: return &PML4T_VA_ENTRY(virtualPage);
+	}
+}
+
+
+// Returns the largest level of page (1: 4kB, 2: 2MB, 3: 1GB) that can be used to map the specified physical page to the
+// specified virtual page, given that the specified number of pages is to be mapped.
+static int page_level(uintptr_t physicalPage, uintptr_t virtualPage, size_t count) {
+	int level = (hugePageSupport ? 3 : largePageSupport ? 2 : 1);
+	while (level > 1 && (((physicalPage | virtualPage) & (PAGE_LEVEL_PAGES(level) - 1)) || count < PAGE_LEVEL_PAGES(level)))
+		level--;
+	return level;
+}
+
+
 // Maps the specified page in physical address space to the specified page in virtual address space using the specified settings
+//	level: 1 to map a 4kB page, 2 to map a 2MB page, 3 to map a 1GB page (both addresses must be aligned accordingly)
 // Returns zero if the operation succeeded.
-int page_map_single(void *physicalAddress, uintptr_t virtualPage, int userspace, int writable, int executable) {
+static int page_map_entry(void *physicalAddress, uintptr_t virtualPage, int level, int userspace, int writable, int executable) {
 	struct
 	{
 		void *physicalAddress;
@@ -199,7 +231,8 @@ int page_map_single(void *physicalAddress, uintptr_t virtualPage, int userspace,
 	} newTables[3];
 	int newTablesCount = 0;
 
-	DBG_MAP("map physical address %xp to virtual address %xp", (uintptr_t)physicalAddress, virtualPage << 12);
+	DBG_MAP("map physical address %xp to virtual address %xp (level %d)", (uintptr_t)physicalAddress, virtualPage << 12, level);
+	assert(!(((uintptr_t)physicalAddress >> PAGE_ALIGN_BITS | virtualPage) & (PAGE_LEVEL_PAGES(level) - 1)));
 
 	// ensure that page is within limits of the specified usage
 	uintptr_t va = (uintptr_t)make_cannonical_va(virtualPage << 12);
@@ -240,7 +273,7 @@ int page_map_single(void *physicalAddress, uintptr_t virtualPage, int userspace,
 	}
 
 	// ensure that PML2T is available
-	if (pte_is_completely_free(currentPML3T[PML3TIndex])) {
+	if (level < 3 && pte_is_completely_free(currentPML3T[PML3TIndex])) {
 		//LOGI("PML2T missing\n");
 		if (!(newTables[newTablesCount].physicalAddress = phy_page_alloc(1))) return 1;
 		pte_alloc_child(currentPML4T[PML4TIndex]); // the PML3T has now one more entry
@@ -251,7 +284,7 @@ int page_map_single(void *physicalAddress, uintptr_t virtualPage, int userspace,
 	}
 
 	// ensure that PML1T is available
-	if (pte_is_completely_free(currentPML2T[PML2TIndex])) {
+	if (level < 2 && pte_is_completely_free(currentPML2T[PML2TIndex])) {
 		//LOGI("PML1T missing\n");
 		if (!(newTables[newTablesCount].physicalAddress = phy_page_alloc(1))) return 1;
 		pte_alloc_child(currentPML3T[PML3TIndex]);
@@ -263,18 +296,23 @@ int page_map_single(void *physicalAddress, uintptr_t virtualPage, int userspace,
 		newTablesCount++;
 	}
 
-	pte_alloc_child(currentPML2T[PML2TIndex]);
+	// 2MB and 1GB pages are referenced directly by the PML2T or PML3T entry
+	uint64_t *entry = (level == 3 ? &currentPML3T[PML3TIndex] : level == 2 ? &currentPML2T[PML2TIndex] : &currentPML1T[PML1TIndex]);
+	uint64_t *parentEntry = (level == 3 ? &currentPML4T[PML4TIndex] : level == 2 ? &currentPML3T[PML3TIndex] : &currentPML2T[PML2TIndex]);
+	assert(!pte_is_huge(*parentEntry));
+	pte_alloc_child(*parentEntry);
 
 	// ensure that the virtual page wasn't already allocated
-	assert(pte_is_completely_free(currentPML1T[PML1TIndex]));
+	assert(pte_is_completely_free(*entry));
 	
 	//LOGI("creating page frame\n");
 
-	currentPML1T[PML1TIndex] = pte_create(physicalAddress, userspace, writable, executable);
-	pte_alloc_child(currentPML1T[PML1TIndex]);
-	pte_mark_full(currentPML1T[PML1TIndex]);
+	*entry = pte_create(physicalAddress, userspace, writable, executable) | (level > 1 ? PTE_HUGE : 0);
+	pte_alloc_child(*entry);
+	pte_mark_full(*entry);
 
-	flush_tlb();
+	// there may still be paging-structure cache entries for tables that were freed
+	invlpg((void *)va);
 
 	// map all newly created tables
 	if (newTablesCount)
@@ -289,89 +327,314 @@ int page_map_single(void *physicalAddress, uintptr_t virtualPage, int userspace,
 }
 
 
+// Maps the specified page in physical address space to the specified page in virtual address space using the specified settings
+// Returns zero if the operation succeeded.
+int page_map_single(void *physicalAddress, uintptr_t virtualPage, int userspace, int writable, int executable) {
+	return page_map_entry(physicalAddress, virtualPage, 1, userspace, writable, executable);
+}
 
-// Finds the first contiguous memory block of the requested size in virtual address space
-//	count: the number of contiguous virtual pages to find
-// Returns the virtual page number of the block that was found or 0 if no large enough block was found.
-uintptr_t page_find(size_t count, int userspace) {
-	DBG_FIND("searching %d free pages for %s", count, (userspace ? "userspace" : "kernelspace"));
 
-	// We do a depth-search through the page table hierarchy for each entry, while
-	// skipping entries if we already know that they're fully allocated/free.
-	// The search is aborted once enough contiguous free space is found.
-	// Also, if we detect that an entry is completely allocated, we mark it as full to save time in the next search.
-	size_t freePages = 0;
-	size_t nonFreePages = MEMSPACE_START(userspace) >> PAGE_ALIGN_BITS;
-	int pml3t_full, pml2t_full, pml1t_full;
+// Replaces the 2MB or 1GB page that contains the specified virtual page by a new paging structure
+// that maps the same memory using 512 pages of the next smaller size.
+//	level: 2 to split a 2MB page, 3 to split a 1GB page
+// Returns zero if the operation succeeded.
+static int page_split(uintptr_t virtualPage, int level) {
+	uint64_t *entry = pte_get(virtualPage, level);
+	uint64_t hugeEntry = *entry;
+	assert(pte_is_huge(hugeEntry));
+
+	DBG_MAP("split %s page at virtual address %xp", (level == 3 ? "1GB" : "2MB"), virtualPage << 12);
+
+	void *table = phy_page_alloc(1);
+	if (!table) return 1;
+
+	// the new entries keep the access flags, bit 7 is the PAT flag in PML1T entries
+	uint64_t flags = (hugeEntry & 0x8000000000000FFFUL) & (level == 2 ? ~PTE_HUGE : ~0UL);
+	uint64_t *newEntries = (uint64_t *)page_map_temp(table);
+	for (size_t i = 0; i < PAGE_TABLE_SIZE; i++) {
+		newEntries[i] = ((uintptr_t)pte_get_phy_addr(hugeEntry) + (i * PAGE_LEVEL_PAGES(level - 1) << PAGE_ALIGN_BITS)) | flags;
+		pte_alloc_child(newEntries[i]);
+		pte_mark_full(newEntries[i]);
+	}
 
+	*entry = pte_create(table, 1, 1, 1) | ((uint64_t)PAGE_TABLE_SIZE << 53);
+	pte_mark_full(*entry);
+	invlpg(make_cannonical_va(virtualPage << PAGE_ALIGN_BITS));
 
-	size_t pml4t_start = PML4T_START(userspace), pml4t_end = PML4T_END(userspace);
-	size_t pml3t_start = PML3T_START(userspace), pml3t_end = PML3T_END(userspace);
-	size_t pml2t_start = PML2T_START(userspace), pml2t_end = PML2T_END(userspace);
-	size_t pml1t_start = PML1T_START(userspace), pml1t_end = PML1T_END(userspace);
+	// the new paging structure becomes visible at its place in the PML1T or PML2T area
+	uintptr_t firstPage = virtualPage & ~(PAGE_LEVEL_PAGES(level) - 1);
+	return page_map_single(table, ((uintptr_t)pte_get(firstPage, level - 1) & 0x0000FFFFFFFFFFFFUL) >> PAGE_ALIGN_BITS, 0, 1, 0);
+}
 
-	for (size_t i4 = pml4t_start; i4 < pml4t_end && freePages < count; i4++) {
-		DBG_FIND("  looking at PTE4T[%d]", i4);
-		if (pte_is_completely_free(PML4T_GET_ENTRY(i4)) || pte_is_fully_allocated(PML4T_GET_ENTRY(i4))) {
-			freePages += 512 * 512 * 512 - (pml3t_start << 18) - (pml2t_start << 9) - pml1t_start;
-			if (pte_is_fully_allocated(PML4T_GET_ENTRY(i4))) {
-				nonFreePages += freePages;
-				freePages = 0;
-			}
+
+
+// Free virtual address space is kept track of as a set of ranges of free pages. Each range is a node in two treaps,
+// one sorted by address (to find the neighbours of a range that is freed, so that they can be coalesced) and one sorted
+// by size and address (for best-fit allocation). The priority of a node is derived from its address in memory,
+// so the trees are balanced with high probability and all operations take O(log n) steps.
+// Page numbers have their upper 28 bits cleared (like the ones used to index the paging structures), this makes
+// userspace contiguous. Free ranges never cross the non-canonical hole though.
+
+typedef struct va_range_t
+{
+	uintptr_t startPage;				// first page of the range
+	size_t count;						// number of pages in the range
+	struct va_range_t *children[2][2];	// left and right child in the address tree and in the size tree
+	struct va_range_t *nextUnused;		// next structure in the list of unused range structures
+} va_range_t; // size: 56B
+
+#define VA_TREE_ADDRESS		(0)
+#define VA_TREE_SIZE		(1)
+
+typedef struct
+{
+	va_range_t *trees[2];				// roots of the address tree and the size tree
+	uintptr_t startPage;				// first page of this address space
+	uintptr_t endPage;					// first page after this address space
+	int initialized;					// set once the free ranges were collected from the paging structures
+} va_space_t;
+
+// the first page of the upper half of the address space (ranges must not extend across this page)
+#define VA_CANONICAL_HOLE_PAGE	(0x0000800000000000UL >> PAGE_ALIGN_BITS)
+
+// the kernelspace and the userspace (the first 512GB are never used, see above)
+va_space_t vaSpaces[2] = {
+	{ .startPage = (KERNELSPACE_START >> PAGE_ALIGN_BITS) & 0x0000000FFFFFFFFFUL, .endPage = ((KERNELSPACE_END >> PAGE_ALIGN_BITS) & 0x0000000FFFFFFFFFUL) + 1 },
+	{ .startPage = PAGE_LEVEL_PAGES(4), .endPage = ((USERSPACE_END >> PAGE_ALIGN_BITS) & 0x0000000FFFFFFFFFUL) + 1 }
+};
+
+// Range structures that are not in use. Before falling back to malloc, the structures are taken from a
+// static pool, so that collecting the initial free ranges doesn't need to allocate memory.
+va_range_t *vaUnusedRanges = NULL;
+va_range_t vaRangePool[32];
+size_t vaRangePoolUsed = 0;
+
+
+
+// Returns an unused range structure or NULL if none is available.
+//	allowAlloc: if set, a new structure is allocated if there is no unused one
+static va_range_t *va_range_get(int allowAlloc) {
+	va_range_t *range = vaUnusedRanges;
+	if (range)
+		vaUnusedRanges = range->nextUnused;
+	else if (vaRangePoolUsed < sizeof(vaRangePool) / sizeof(vaRangePool[0]))
+		range = &vaRangePool[vaRangePoolUsed++];
+	else if (allowAlloc)
+		range = malloc(sizeof(va_range_t));
+	return range;
+}
+
+// Adds a range structure to the list of unused structures.
+// The structures are never freed, as that might happen while the trees are inconsistent.
+static void va_range_put(va_range_t *range) {
+	range->nextUnused = vaUnusedRanges;
+	vaUnusedRanges = range;
+}
+
+
+// Returns a non-zero value if range a comes before range b in the specified tree
+static inline int va_less(va_range_t *a, va_range_t *b, int tree) {
+	if (tree == VA_TREE_SIZE && a->count != b->count)
+		return a->count < b->count;
+	return a->startPage < b->startPage;
+}
+
+// Returns the treap priority of a range
+static inline uint32_t va_priority(va_range_t *range) {
+	return (uint32_t)(((uintptr_t)range * 0x9E3779B97F4A7C15UL) >> 32);
+}
+
+// Rotates the child in the specified direction (0: left, 1: right) up to the place of the specified node
+static inline void va_rotate(va_range_t **node, int tree, int direction) {
+	va_range_t *child = (*node)->children[tree][direction];
+	(*node)->children[tree][direction] = child->children[tree][!direction];
+	child->children[tree][!direction] = *node;
+	*node = child;
+}
+
+// Inserts a range into the specified tree
+static void va_tree_insert(va_range_t **node, va_range_t *range, int tree) {
+	if (!*node) {
+		range->children[tree][0] = range->children[tree][1] = NULL;
+		*node = range;
+		return;
+	}
+
+	int direction = va_less(*node, range, tree);
+	va_tree_insert(&(*node)->children[tree][direction], range, tree);
+	if (va_priority((*node)->children[tree][direction]) > va_priority(*node))
+		va_rotate(node, tree, direction);
+}
+
+// Removes a range from the specified tree.
+// Must be called before the fields that the tree is sorted by are changed.
+static void va_tree_remove(va_range_t **node, va_range_t *range, int tree) {
+	while (*node != range)
+		node = &(*node)->children[tree][va_less(*node, range, tree)];
+
+	// rotate the range down until it has at most one child
+	while (range->children[tree][0] && range->children[tree][1]) {
+		int direction = va_priority(range->children[tree][1]) > va_priority(range->children[tree][0]);
+		va_rotate(node, tree, direction);
+		node = &(*node)->children[tree][!direction];
+	}
+
+	*node = (range->children[tree][0] ? range->children[tree][0] : range->children[tree][1]);
+}
+
+
+// Returns the address space that contains the specified page or NULL if it isn't in any address space
+static va_space_t *va_space_of(uintptr_t page) {
+	for (int i = 0; i < 2; i++)
+		if (page >= vaSpaces[i].startPage && page < vaSpaces[i].endPage)
+			return &vaSpaces[i];
+	return NULL;
+}
+
+
+// Adds a free range that was found while scanning the paging structures
+static void va_scan_add(va_space_t *space, uintptr_t startPage, uintptr_t endPage) {
+	if (endPage <= startPage)
+		return;
+
+	va_range_t *range = va_range_get(0);
+	if (!range) {
+		LOGW("virtual address space at %xp with %d pages is not used", make_cannonical_va(startPage << PAGE_ALIGN_BITS), (int)(endPage - startPage));
+		return;
+	}
+
+	DBG_VA("free virtual address space at %xp: %d pages", make_cannonical_va(startPage << PAGE_ALIGN_BITS), (int)(endPage - startPage));
+	range->startPage = startPage;
+	range->count = endPage - startPage;
+	va_tree_insert(&space->trees[VA_TREE_ADDRESS], range, VA_TREE_ADDRESS);
+	va_tree_insert(&space->trees[VA_TREE_SIZE], range, VA_TREE_SIZE);
+}
+
+
+// Collects the free ranges of an address space from the paging structures.
+// Entries that are completely free or that map a page are not descended into, so this is cheap for sparse address spaces.
+static void va_scan(va_space_t *space) {
+	space->initialized = 1;
+
+	uintptr_t freeStart = space->startPage;
+	for (uintptr_t page = space->startPage; page < space->endPage; ) {
+		// find the highest level entry that is either completely free or maps a page
+		int level = 4;
+		while (level > 1 && !pte_is_completely_free(*pte_get(page, level)) && !pte_is_huge(*pte_get(page, level)))
+			level--;
+
+		int mapped = !pte_is_completely_free(*pte_get(page, level));
+		uintptr_t nextPage = min((page | (PAGE_LEVEL_PAGES(level) - 1)) + 1, space->endPage);
+
+		if (mapped || page == VA_CANONICAL_HOLE_PAGE) {
+			va_scan_add(space, freeStart, page);
+			freeStart = (mapped ? nextPage : page);
+		}
+
+		page = nextPage;
+	}
+
+	va_scan_add(space, freeStart, space->endPage);
+}
+
+
+// Allocates a contiguous block of virtual pages, using the smallest free range that is large enough.
+//	count: the number of contiguous virtual pages to allocate
+// Returns the number of the first page or 0 if there was no large enough free range.
+static uintptr_t va_alloc(size_t count, int userspace) {
+	va_space_t *space = &vaSpaces[userspace ? 1 : 0];
+	if (!space->initialized)
+		va_scan(space);
+
+	// find the smallest range that is large enough (the one at the lowest address if there are several)
+	va_range_t *range = NULL;
+	for (va_range_t *node = space->trees[VA_TREE_SIZE]; node; ) {
+		if (node->count >= count) {
+			range = node;
+			node = node->children[VA_TREE_SIZE][0];
 		} else {
-			pml3t_full = 1;
-			for (size_t i3 = pml3t_start; i3 < (((i4 == pml4t_end - 1)) ? pml3t_end : PAGE_TABLE_SIZE) && freePages < count; i3++) {
-				DBG_FIND("    looking at PTE3T[%d]", i3);
-				if (pte_is_completely_free(PML3T_GET_ENTRY(i4, i3)) || pte_is_fully_allocated(PML3T_GET_ENTRY(i4, i3))) {
-					freePages += 512 * 512 - (pml2t_start << 9) - pml1t_start;
-					if (pte_is_fully_allocated(PML3T_GET_ENTRY(i4, i3))) {
-						nonFreePages += freePages;
-						freePages = 0;
-					} else {
-						pml3t_full = pml2t_full = 0;
-					}
-				} else {
-					pml2t_full = 1;
-					for (size_t i2 = pml2t_start; i2 < (((i4 == pml4t_end - 1) && (i3 == pml3t_end - 1)) ? pml2t_end : PAGE_TABLE_SIZE) && freePages < count; i2++) {
-						DBG_FIND("      looking at PTE2T[%d]", i2);
-						if (pte_is_completely_free(PML2T_GET_ENTRY(i4, i3, i2)) || pte_is_fully_allocated(PML2T_GET_ENTRY(i4, i3, i2))) {
-							//debug(0x35, PML2T_GET_ENTRY(i4, i3, i2));
-							freePages += 512 - pml1t_start;
-							if (pte_is_fully_allocated(PML2T_GET_ENTRY(i4, i3, i2))) {
-								nonFreePages += freePages;
-								freePages = 0;
-							} else {
-								pml3t_full = pml2t_full = 0;
-							}
-						} else {
-							pml1t_full = 1;
-							for (size_t i1 = pml1t_start; i1 < (((i4 == pml4t_end - 1) && (i3 == pml3t_end - 1) && (i2 == pml2t_end - 1)) ? pml1t_end : PAGE_TABLE_SIZE) && freePages < count; i1++) {
-								DBG_FIND("        looking at PTE1T[%d]", i1);
-								freePages++;
-								//debug(0x36, (uint64_t)&(PML1T_GET_ENTRY(i4, i3, i2, i1)));
-								if (pte_is_fully_allocated(PML1T_GET_ENTRY(i4, i3, i2, i1))) {
-									nonFreePages += freePages;
-									freePages = 0;
-								} else {
-									pml3t_full = pml2t_full = pml1t_full = 0;
-								}
-							}
-							if (pml1t_full) pte_mark_full(PML2T_GET_ENTRY(i4, i3, i2));
-						}
-						pml1t_start = 0;
-					}
-					if (pml2t_full) pte_mark_full(PML3T_GET_ENTRY(i4, i3));
-				}
-				pml2t_start = 0; pml1t_start = 0;
-			}
-			if (pml3t_full) pte_mark_full(PML4T_GET_ENTRY(i4));
+			node = node->children[VA_TREE_SIZE][1];
 		}
-		pml3t_start = 0; pml2t_start = 0; pml1t_start = 0;
 	}
 
-	DBG_FIND("found %d free pages at %xp", freePages, (void *)(nonFreePages << PAGE_ALIGN_BITS));
+	if (!range) {
+		DBG_VA("no %d free pages in %s", (int)count, (userspace ? "userspace" : "kernelspace"));
+		return 0;
+	}
 
-	return (freePages < count ? 0 : nonFreePages);
+	// take the pages from the beginning of the range, this doesn't change its position in the address tree
+	uintptr_t page = range->startPage;
+	va_tree_remove(&space->trees[VA_TREE_SIZE], range, VA_TREE_SIZE);
+	if (range->count == count) {
+		va_tree_remove(&space->trees[VA_TREE_ADDRESS], range, VA_TREE_ADDRESS);
+		va_range_put(range);
+	} else {
+		range->startPage += count;
+		range->count -= count;
+		va_tree_insert(&space->trees[VA_TREE_SIZE], range, VA_TREE_SIZE);
+	}
+
+	DBG_VA("allocated %d pages at %xp", (int)count, make_cannonical_va(page << PAGE_ALIGN_BITS));
+	return page;
+}
+
+
+// Returns a block of virtual pages to the free ranges of its address space and coalesces it with adjacent free ranges.
+// Pages that are not in the kernelspace or userspace (e.g. paging structures) are ignored.
+static void va_free(uintptr_t page, size_t count) {
+	page &= 0x0000000FFFFFFFFFUL;
+	va_space_t *space = va_space_of(page);
+	if (!space || !space->initialized || !count)
+		return;
+
+	// this may allocate memory, so it must be done before the trees are touched
+	va_range_t *range = va_range_get(1);
+
+	// find the free ranges right before and after the block
+	va_range_t *previous = NULL, *next = NULL;
+	for (va_range_t *node = space->trees[VA_TREE_ADDRESS]; node; ) {
+		if (node->startPage < page) {
+			previous = node;
+			node = node->children[VA_TREE_ADDRESS][1];
+		} else {
+			next = node;
+			node = node->children[VA_TREE_ADDRESS][0];
+		}
+	}
+	assert(!previous || previous->startPage + previous->count <= page); // double free
+	assert(!next || page + count <= next->startPage);
+
+	int mergePrevious = (previous && previous->startPage + previous->count == page && page != VA_CANONICAL_HOLE_PAGE);
+	int mergeNext = (next && page + count == next->startPage && next->startPage != VA_CANONICAL_HOLE_PAGE);
+
+	if (mergePrevious) {
+		va_tree_remove(&space->trees[VA_TREE_SIZE], previous, VA_TREE_SIZE);
+		previous->count += count;
+		if (mergeNext) {
+			va_tree_remove(&space->trees[VA_TREE_SIZE], next, VA_TREE_SIZE);
+			va_tree_remove(&space->trees[VA_TREE_ADDRESS], next, VA_TREE_ADDRESS);
+			previous->count += next->count;
+			va_range_put(next);
+		}
+		va_tree_insert(&space->trees[VA_TREE_SIZE], previous, VA_TREE_SIZE);
+	} else if (mergeNext) {
+		// extending the next range downwards doesn't change its position in the address tree
+		va_tree_remove(&space->trees[VA_TREE_SIZE], next, VA_TREE_SIZE);
+		next->startPage = page;
+		next->count += count;
+		va_tree_insert(&space->trees[VA_TREE_SIZE], next, VA_TREE_SIZE);
+	} else if (range) {
+		range->startPage = page;
+		range->count = count;
+		va_tree_insert(&space->trees[VA_TREE_ADDRESS], range, VA_TREE_ADDRESS);
+		va_tree_insert(&space->trees[VA_TREE_SIZE], range, VA_TREE_SIZE);
+		range = NULL;
+	} else {
+		LOGW("out of memory: lost %d pages of virtual address space", (int)count);
+	}
+
+	if (range)
+		va_range_put(range);
 }
 
 
@@ -383,12 +646,39 @@ uintptr_t page_find(size_t count, int userspace) {
 void *page_map(void *physicalAddress, size_t length, int userspace, int writable, int executable) {
 	assert(!((uintptr_t)physicalAddress & PAGE_SIZE_MASK));
 	assert(!(length & PAGE_SIZE_MASK));
-	uintptr_t page = page_find(length >>= PAGE_ALIGN_BITS, 0);
+
+	memmgr_enter_routine();
+
+	size_t count = length >> PAGE_ALIGN_BITS;
+	uintptr_t physicalPage = (uintptr_t)physicalAddress >> PAGE_ALIGN_BITS;
+
+	// 2MB and 1GB pages can only be used where the virtual address has the same offset into such a page as the physical
+	// address. If the block contains a whole 2MB (or 1GB) page, we look for some more free space and only map the part
+	// of it where the offsets match.
+	uintptr_t page = 0;
+	for (int level = page_level(0, 0, count); level >= 1 && !page; level--) {
+		size_t alignment = PAGE_LEVEL_PAGES(level);
+		if (round_up(physicalPage, 9 * (level - 1)) + alignment > physicalPage + count)
+			continue;
+		if ((page = va_alloc(count + alignment - 1, userspace))) {
+			// give back the parts before and after the block that is actually used
+			size_t offset = (physicalPage - page) & (alignment - 1);
+			va_free(page, offset);
+			va_free(page + offset + count, alignment - 1 - offset);
+			page += offset;
+		}
+	}
 	if (!page)
-		return NULL;
-	for (int i = 0; i < length; i++)
-		if (page_map_single((char *)physicalAddress + (i << PAGE_ALIGN_BITS), page + i, userspace, writable, executable))
-			return NULL;
+		return memmgr_exit_routine(), NULL;
+
+	for (size_t i = 0; i < count; ) {
+		int level = page_level(physicalPage + i, page + i, count - i);
+		if (page_map_entry((char *)physicalAddress + (i << PAGE_ALIGN_BITS), page + i, level, userspace, writable, executable))
+			return memmgr_exit_routine(), NULL;
+		i += PAGE_LEVEL_PAGES(level);
+	}
+
+	memmgr_exit_routine();
 	return make_cannonical_va(page << PAGE_ALIGN_BITS);
 }
 
@@ -409,18 +699,22 @@ void *page_alloc_ex(size_t length, int userspace, int writable, int executable)
 	if (phyAddr)
 		return page_map(phyAddr, length, userspace, writable, executable);
 
+	memmgr_enter_routine();
+
 	// if the chunk is too large, alloc and map pages one by one
-	uintptr_t page = page_find(length >>= PAGE_ALIGN_BITS, userspace);
+	uintptr_t page = va_alloc(length >>= PAGE_ALIGN_BITS, userspace);
 	if (!page)
-		return NULL;
+		return memmgr_exit_routine(), NULL;
 
 	for (int i = 0; i < length; i++) {
 		phyAddr = phy_page_alloc(1);
 		if (!phyAddr)
-			return NULL;
+			return memmgr_exit_routine(), NULL;
 		if (page_map_single(phyAddr, page + i, userspace, writable, executable))
-			return NULL;
+			return memmgr_exit_routine(), NULL;
 	}
+
+	memmgr_exit_routine();
 	return make_cannonical_va(page << PAGE_ALIGN_BITS);
 }
 
@@ -433,6 +727,121 @@ void *page_alloc(size_t length) {
 
 
 
+// Pages that were unmapped must be invalidated in the TLB of every processor before their physical memory or their
+// virtual address can be reused. To keep this cheap for large blocks, page_free collects the unmapped pages and their
+// physical memory (as contiguous runs) in a batch, which is committed when the outermost page_free call returns or
+// when the batch runs out of space. Committing the batch invalidates each page separately if there are only a few of
+// them and reloads CR3 otherwise. The other processors are asked to do the same and the physical memory is
+// freed once all of them are done.
+#define TLB_BATCH_PAGES		(32)	// maximum number of pages that are invalidated separately
+#define TLB_BATCH_RUNS		(16)	// maximum number of runs of physical pages in a batch
+
+// a run of physical pages that is freed once the batch is invalidated
+typedef struct
+{
+	void *address;
+	size_t count;
+} tlb_batch_run_t;
+
+uintptr_t tlbBatchPages[TLB_BATCH_PAGES];	// the first pages in the batch
+size_t tlbBatchPageCount = 0;				// may exceed TLB_BATCH_PAGES, in which case the entire TLB is flushed
+tlb_batch_run_t tlbBatchRuns[TLB_BATCH_RUNS];
+int tlbBatchRunCount = 0;
+int tlbBatchNestedLevel = 0;
+
+// bit n is set while processor n still has to process the current batch
+volatile uint32_t tlbShootdownTargets = 0;
+
+
+// Invalidates the pages of the current batch in the TLB of this processor
+static void tlb_invalidate_batch(void) {
+	if (tlbBatchPageCount > TLB_BATCH_PAGES) {
+		flush_tlb();
+		return;
+	}
+	for (size_t i = 0; i < tlbBatchPageCount; i++)
+		invlpg(make_cannonical_va(tlbBatchPages[i] << PAGE_ALIGN_BITS));
+}
+
+
+// Processes the current batch if another processor requested it.
+// This is invoked by the shootdown IPI and must also be polled by code that waits for the memory
+// manager with interrupts disabled, as the processor that owns it may be waiting for us.
+void tlb_shootdown_poll(void) {
+	uint32_t self = 1U << cpu_current()->index;
+	if (!(tlbShootdownTargets & self))
+		return;
+	tlb_invalidate_batch();
+	__sync_fetch_and_and(&tlbShootdownTargets, ~self);
+}
+
+
+// Invalidates the pages of the current batch on all processors and frees the physical memory.
+static void tlb_commit_batch(void) {
+	if (!tlbBatchPageCount)
+		return;
+
+	tlb_invalidate_batch();
+
+	// ask all other processors to do the same and wait until they are done
+	int self = cpu_current()->index;
+	uint32_t targets = 0;
+	for (int i = 0; i < cpuCount; i++)
+		if (i != self && cpus[i].online)
+			targets |= 1U << i;
+	if (targets) {
+		__sync_synchronize();
+		tlbShootdownTargets = targets;
+		for (int i = 0; i < cpuCount; i++)
+			if (targets & (1U << i))
+				apic_send_tlb_shootdown(cpus[i].apicId);
+		while (tlbShootdownTargets)
+			__builtin_ia32_pause();
+	}
+
+	// freeing physical memory may cause nested page_free calls, which start a new batch
+	tlb_batch_run_t runs[TLB_BATCH_RUNS];
+	int runCount = tlbBatchRunCount;
+	memcpy(runs, tlbBatchRuns, runCount * sizeof(runs[0]));
+	tlbBatchRunCount = 0;
+	tlbBatchPageCount = 0;
+
+	for (int i = 0; i < runCount; i++)
+		phy_page_free(runs[i].address, runs[i].count);
+}
+
+
+// Adds a page that was unmapped (and the physical memory that it was mapped to) to the current batch.
+// The page table entry must already be cleared, as the batch may be committed first.
+static void tlb_batch_add(uintptr_t page, void *physicalAddress, size_t count) {
+	// a full batch is committed before anything is added, so that the page and its run end up in the new batch
+	if (tlbBatchRunCount == TLB_BATCH_RUNS)
+		tlb_commit_batch();
+
+	if (tlbBatchPageCount < TLB_BATCH_PAGES)
+		tlbBatchPages[tlbBatchPageCount] = page;
+	tlbBatchPageCount++;
+
+	// extend a run if possible
+	for (int i = 0; i < tlbBatchRunCount; i++) {
+		if ((char *)tlbBatchRuns[i].address + (tlbBatchRuns[i].count << PAGE_ALIGN_BITS) == (char *)physicalAddress) {
+			tlbBatchRuns[i].count += count;
+			return;
+		}
+		if ((char *)physicalAddress + (count << PAGE_ALIGN_BITS) == (char *)tlbBatchRuns[i].address) {
+			tlbBatchRuns[i].address = physicalAddress;
+			tlbBatchRuns[i].count += count;
+			return;
+		}
+	}
+
+	tlbBatchRuns[tlbBatchRunCount].address = physicalAddress;
+	tlbBatchRuns[tlbBatchRunCount].count = count;
+	tlbBatchRunCount++;
+}
+
+
+
 // Frees a virtual page and it's underlying physical page in linear address space.
 // The address and size parameters should be page aligned.
 void page_free(void *address, size_t size) {
@@ -440,9 +849,12 @@ void page_free(void *address, size_t size) {
 	assert(!(size & PAGE_SIZE_MASK));
 
 	memmgr_enter_routine();
+	tlbBatchNestedLevel++;
 
 	uintptr_t page = ((uintptr_t)address >> PAGE_ALIGN_BITS) & 0x0000000FFFFFFFFFUL;
 	size >>= PAGE_ALIGN_BITS;
+	uintptr_t firstPage = page;
+	size_t count = size;
 
 	void *freeTables[4];
 	int freeTableCount = 0;
@@ -450,45 +862,53 @@ void page_free(void *address, size_t size) {
 	// Free every page separately.
 	// If freeing a page makes the table that controls it free, it is also freed.
 	// This chain of freeing is propagated up to the topmost page table
-	while (size--) {
-		//debug(0x11, page);
-		//debug(0x11, size);
-
-		//debug(0x11, ((page) >> 0) & 0x0000000FFFFFFFFFUL);
+	while (size) {
 		freeTableCount = 0;
 
-		void *phyPageAddr = pte_get_phy_addr(PML1T_VA_ENTRY(page));
-		pte_mark_not_full(PML1T_VA_ENTRY(page));
-		pte_free_child(PML1T_VA_ENTRY(page));
-
-		pte_mark_not_full(PML2T_VA_ENTRY(page));
-		pte_free_child(PML2T_VA_ENTRY(page));
+		// 2MB and 1GB pages are freed as a whole if possible, otherwise they are split up first
+		int level = 1;
+		for (int hugeLevel = 3; hugeLevel >= 2 && level == 1; hugeLevel--) {
+			if (!pte_is_huge(*pte_get(page, hugeLevel)))
+				continue;
+			if (!(page & (PAGE_LEVEL_PAGES(hugeLevel) - 1)) && size >= PAGE_LEVEL_PAGES(hugeLevel))
+				level = hugeLevel;
+			else if (page_split(page, hugeLevel))
+				bug_check(STATUS_OUT_OF_MEMORY, 0);
+		}
 
-		if (pte_is_completely_free(PML2T_VA_ENTRY(page))) {
-			freeTables[freeTableCount++] = &PML1T[(page >> 0) & ~(0x1FFUL)];
-			pte_mark_not_full(PML3T_VA_ENTRY(page));
-			pte_free_child(PML3T_VA_ENTRY(page));
+		uint64_t *entry = pte_get(page, level);
+		void *physicalAddress = pte_get_phy_addr(*entry);
+		*entry = 0;
+		tlb_batch_add(page, physicalAddress, PAGE_LEVEL_PAGES(level));
 
-			if (pte_is_completely_free(PML3T_VA_ENTRY(page))) {
-				freeTables[freeTableCount++] = &PML2T[(page >> 9) & ~(0x1FFUL)];
-				pte_mark_not_full(PML4T_VA_ENTRY(page));
-				pte_free_child(PML4T_VA_ENTRY(page));
+		for (int parentLevel = level + 1; parentLevel <= 4; parentLevel++) {
+			uint64_t *parentEntry = pte_get(page, parentLevel);
+			pte_mark_not_full(*parentEntry);
+			pte_free_child(*parentEntry);
+			if (!pte_is_completely_free(*parentEntry))
+				break;
 
-				if (pte_is_completely_free(PML4T_VA_ENTRY(page))) {
-					freeTables[freeTableCount++] = &PML3T[(page >> 18) & ~(0x1FFUL)];
-				}
-			}
+			// the table that holds the entries of the level below is now empty
+			freeTables[freeTableCount++] = pte_get(page & ~(PAGE_LEVEL_PAGES(parentLevel) - 1), parentLevel - 1);
+			*parentEntry = 0;
 		}
 
-		phy_page_free(phyPageAddr, 1);
+		// the tables are added to the same batch
 		for (int i = 0; i < freeTableCount; i++)
 			page_free(freeTables[i], PAGE_SIZE);
 
-		page++;
+		page += PAGE_LEVEL_PAGES(level);
+		size -= PAGE_LEVEL_PAGES(level);
 	}
 
-	// the page tables are now in a consistent state, so this call is safe
+	// Paging structures that were freed by nested calls can wait for the outermost call. Anything else
+	// is committed now, as the virtual address space is released right away.
+	if (!--tlbBatchNestedLevel || va_space_of(firstPage))
+		tlb_commit_batch();
+
+	// the page tables are now in a consistent state, so these calls are safe
 	phy_cleanup();
+	va_free(firstPage, count);
 
 	memmgr_exit_routine();
 }
@@ -515,8 +935,8 @@ void mmu_dump(int level) {
 				break;
 			}
 			if (pte_is_completely_free(*pte3)) continue;
-			LOGI("  PML3T[%x16], ref count: %d%s", (int)i3, (int)(*pte3 >> 53) & 0x3FF, ((*pte3 >> 52) & 1) ? " (full)" : "");
-			if (level <= 2) continue;
+			LOGI("  PML3T[%x16], ref count: %d%s", (int)i3, (int)(*pte3 >> 53) & 0x3FF, pte_is_huge(*pte3) ? " (1GB page)" : ((*pte3 >> 52) & 1) ? " (full)" : "");
+			if (level <= 2 || pte_is_huge(*pte3)) continue;
 			for (uint64_t i2 = 0; i2 < PAGE_TABLE_SIZE; i2++) {
 				uint64_t *pte2 = &PML2T[(i4 << 18) + (i3 << 9) + i2];
 				if (!is_va_mapped(pte2)) {
@@ -524,8 +944,8 @@ void mmu_dump(int level) {
 					break;
 				}
 				if (pte_is_completely_free(*pte2)) continue;
-				LOGI("    PML2T[%x16], ref count: %d%s", (int)i2, (int)(*pte2 >> 53) & 0x3FF, ((*pte2 >> 52) & 1) ? " (full)" : "");
-				if (level <= 3) continue;
+				LOGI("    PML2T[%x16], ref count: %d%s", (int)i2, (int)(*pte2 >> 53) & 0x3FF, pte_is_huge(*pte2) ? " (2MB page)" : ((*pte2 >> 52) & 1) ? " (full)" : "");
+				if (level <= 3 || pte_is_huge(*pte2)) continue;
 				LOGI__("           PML1T: ");
 				for (uint64_t i1 = 0; i1 < PAGE_TABLE_SIZE; i1++) {
 					//LOGI__("start at %x64 ", (uint64_t)PML1T);
@@ -541,4 +961,101 @@ void mmu_dump(int level) {
 			}
 		}
 	}
-}
\ No newline at end of file
+}
+
+
+
+#ifdef USING_BENCHMARK
+
+// Measures the cost of accessing a large block of memory, once mapped using 4kB pages only and once
+// using 2MB (and 1GB) pages where possible. The results are written to the log.
+// The large block is freed in two parts, so that splitting a 2MB page is exercised as well.
+// The time needed to free the block (including TLB invalidation) is measured too.
+//	length: the size of the block in bytes (should be a multiple of several MB, the block must fit into physical memory)
+void mmu_benchmark(size_t length) {
+	const int rounds = 16;
+	benchmark_t bench;
+	benchmark_init(&bench, "mmu");
+	LOGI("mmu benchmark: %d kB", (int)(length >> 10));
+
+	for (int pass = 0; pass < 2; pass++) {
+		int largePages = largePageSupport, hugePages = hugePageSupport;
+		if (!pass)
+			largePageSupport = hugePageSupport = 0;
+		char *block = page_alloc(length);
+		largePageSupport = largePages;
+		hugePageSupport = hugePages;
+		if (!block) {
+			LOGE("mmu benchmark: could not allocate %d kB", (int)(length >> 10));
+			return;
+		}
+
+		// touch every page once so that the first round isn't different from the others
+		for (size_t offset = 0; offset < length; offset += PAGE_SIZE)
+			((volatile char *)block)[offset] = 0;
+
+		// access one cache line per page, so that nearly every access needs a new translation when using 4kB pages
+		benchmark_start(&bench);
+		for (int round = 0; round < rounds; round++)
+			for (size_t offset = (round * 64) & PAGE_SIZE_MASK; offset < length; offset += PAGE_SIZE)
+				((volatile char *)block)[offset]++;
+		benchmark_stop(&bench, (pass ? "large pages, access" : "4kB pages, access"), rounds * (length >> PAGE_ALIGN_BITS), "access");
+
+		benchmark_start(&bench);
+		if (pass)
+			page_free(block + PAGE_SIZE, length - PAGE_SIZE);
+		page_free(block, pass ? PAGE_SIZE : length);
+		benchmark_stop(&bench, (pass ? "large pages, free" : "4kB pages, free"), length >> PAGE_ALIGN_BITS, "4kB");
+	}
+}
+
+
+// Frees a block whose pages lie in more runs of physical memory than a TLB batch can hold, so that page_free has to
+// commit the batch in the middle of the block. Afterwards, the batch must be empty (every run was freed) and the
+// physical pages must be available again.
+void tlb_batch_test(void) {
+	const size_t count = 2 * TLB_BATCH_RUNS + 1;
+
+	// Each page is mapped to the first half of a pair of physical pages and the second half is given back,
+	// so that no two pages of the block are adjacent in physical memory.
+	memmgr_enter_routine();
+	uintptr_t page = va_alloc(count, 0);
+	size_t mapped = 0;
+	while (page && mapped < count) {
+		void *physicalAddress = phy_page_alloc(2);
+		if (!physicalAddress)
+			break;
+		if (page_map_single(physicalAddress, page + mapped, 0, 1, 0)) {
+			phy_page_free(physicalAddress, 2);
+			break;
+		}
+		phy_page_free((char *)physicalAddress + PAGE_SIZE, 1);
+		mapped++;
+	}
+	if (page && mapped < count)
+		va_free(page + mapped, count - mapped);
+	memmgr_exit_routine();
+
+	char *block = make_cannonical_va(page << PAGE_ALIGN_BITS);
+	if (mapped < count) {
+		LOGE("tlb batch test: could not map %d pages", (int)count);
+		if (mapped)
+			page_free(block, mapped << PAGE_ALIGN_BITS);
+		return;
+	}
+
+	for (size_t i = 0; i < count; i++)
+		((volatile char *)block)[i << PAGE_ALIGN_BITS] = (char)i;
+
+	// (page_free may release page tables as well, but it never allocates physical memory)
+	size_t freePages = phy_get_free_page_count();
+	page_free(block, count << PAGE_ALIGN_BITS);
+	size_t freed = phy_get_free_page_count() - freePages;
+
+	if (tlbBatchRunCount || tlbBatchPageCount || freed < count)
+		LOGE("tlb batch test: %d of %d pages were freed, %d runs were left in the batch", (int)freed, (int)count, tlbBatchRunCount);
+	else
+		LOGI("tlb batch test: %d pages in separate runs were freed", (int)count);
+}
+
+#endif // USING_BENCHMARK
@@ -9,13 +9,17 @@
 
 void page_map_realmode(void);
 void page_unmap_realmode(void);
-uintptr_t page_find(size_t count, int userspace);
 int page_map_single(void *physicalAddress, uintptr_t virtualPage, int userspace, int writable, int executable);
 void *page_map(void *physicalAddress, size_t length, int userspace, int writable, int executable);
 void *page_alloc_ex(size_t length, int userspace, int writable, int executable);
 void *page_alloc(size_t length);
 void page_free(void *address, size_t size);
+void tlb_shootdown_poll(void);
 void mmu_dump(int level);
+#ifdef USING_BENCHMARK
+void mmu_benchmark(size_t length);
+void tlb_batch_test(void);
+#endif
 
 
 #endif // __MMU_H__
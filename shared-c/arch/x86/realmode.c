@@ -56,16 +56,21 @@ IMPORT_BOOTLOADER_SYMBOL(uint32_t *volumeStart, uint32_t *, volume_offset, KERNE
 //	16. switch to kernel stack
 //	17. pop real mode context
 //	18. return to kernel mode code
+//	19. restore the GS base that was cleared by reloading the segment registers
+// Only the bootstrap processor is allowed to do this, as the legacy PIC and the BIOS only talk to that one.
 uint32_t realmode_execute(uint64_t code, realmode_context_t *context) {
 	uint32_t flags;
 	//debug(0x63, 0);
 	atomic() {
+		assert(!cpu_current()->index);
+		uint64_t gsBase = read_msr(IA32_GS_BASE_MSR);
 		apic_disable();		// the BIOS can't handle APIC interrupts
 		page_map_realmode();
 		pic_enable();		// ... instead it expects legacy PIC interrupts
 		idtr_t idtr = get_idtr(); // idtr is clobbered by BIOS code
 		flags = realmodeEntry(code, context);
 		set_idtr(idtr);
+		write_msr(IA32_GS_BASE_MSR, gsBase);
 		pic_disable();
 		page_unmap_realmode();
 		apic_enable();
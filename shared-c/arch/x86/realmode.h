@@ -19,6 +19,7 @@ uint32_t realmode_execute(uint64_t code, realmode_context_t *context);
 
 // buffer to transfer data to and from real mode
 extern char *realmodeBuffer; // length: ~500kB
+#define REALMODE_BUFFER_END		(0x80000) // physical address where the real mode buffer ends (the EBDA may follow)
 extern char *realmodeBuffer2; // length: 16 bytes
 
 
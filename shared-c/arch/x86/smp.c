@@ -0,0 +1,419 @@
+/*
+*
+* Brings up the application processors (APs) and provides per-processor data.
+*
+* The processors are enumerated using the ACPI MADT. Each AP is started separately by sending
+* INIT-SIPI-SIPI to it. It starts executing a small trampoline that is copied to a page below 1MB.
+* The trampoline switches to long mode, using a temporary 1:1 mapping of the lower memory, and jumps
+* to smp_ap_entry. There, the AP loads its own GDT (to have its own TSS), enables the FPU, sets up
+* interrupt handling and its local APIC and finally invokes the entry function passed to smp_init.
+*
+* The GS segment base of each processor points to its cpu_t structure, so cpu_current is cheap.
+*
+* created: 16.10.26
+*
+*/
+
+// smp_reschedule is called by the scheduler in interrupt context (see interrupts.c)
+#pragma GCC target("general-regs-only")
+
+#include <system.h>
+#include "smp.h"
+
+
+//#define DBG_SMP(...)	LOGI(__VA_ARGS__)
+#define DBG_SMP(...)
+
+
+cpu_t cpus[CPU_MAX];
+volatile int cpuCount = 1;
+
+// the function that each application processor runs after initialization
+void(*smpApEntry)(void);
+
+
+
+// The trampoline where the APs start. It is copied to a page below 1MB before starting an AP and
+// the fields at the end are filled in by the bootstrap processor.
+// In real mode, cs points to the trampoline page. This is used to find the trampoline in protected mode.
+extern char smp_trampoline;
+extern char smp_trampoline_end;
+extern char smp_trampoline_jump32;
+extern char smp_trampoline_jump64;
+extern char smp_trampoline_32;
+extern char smp_trampoline_64;
+extern char smp_trampoline_gdt;
+extern char smp_trampoline_gdtr;
+extern char smp_trampoline_cr3;
+extern char smp_trampoline_stack;
+extern char smp_trampoline_cpu;
+extern char smp_trampoline_entry;
+
+__asm (
+".global smp_trampoline						\n"
+".global smp_trampoline_end					\n"
+".global smp_trampoline_jump32				\n"
+".global smp_trampoline_jump64				\n"
+".global smp_trampoline_32					\n"
+".global smp_trampoline_64					\n"
+".global smp_trampoline_gdt					\n"
+".global smp_trampoline_gdtr				\n"
+".global smp_trampoline_cr3					\n"
+".global smp_trampoline_stack				\n"
+".global smp_trampoline_cpu					\n"
+".global smp_trampoline_entry				\n"
+
+".code16									\n"
+"smp_trampoline:							\n"
+"cli										\n"
+"cld										\n"
+"mov	ax, cs								\n"
+"mov	ds, ax								\n"
+"xor	ebx, ebx							\n"
+"mov	bx, ax								\n"
+"shl	ebx, 4								\n" // ebx: physical address of the trampoline
+"lgdt	[smp_trampoline_gdtr - smp_trampoline]	\n"
+
+// enter 32-bit protected mode
+"mov	eax, cr0							\n"
+"or	eax, 0x1								\n"
+"mov	cr0, eax							\n"
+".byte	0x66, 0xEA							\n" // far jump with 32-bit offset
+"smp_trampoline_jump32:						\n"
+".long	0									\n" // physical address of smp_trampoline_32
+".word	0x08								\n"
+
+".code32									\n"
+"smp_trampoline_32:							\n"
+"mov	ax, 0x10							\n"
+"mov	ds, ax								\n"
+"mov	es, ax								\n"
+"mov	ss, ax								\n"
+
+// enable physical address extension and load the paging structures of the bootstrap processor
+"mov	eax, cr4							\n"
+"or	eax, 0x20								\n"
+"mov	cr4, eax							\n"
+"mov	eax, [ebx + smp_trampoline_cr3 - smp_trampoline]	\n"
+"mov	cr3, eax							\n"
+
+// enable long mode and no-execute (same as the bootloader)
+"mov	ecx, 0xC0000080						\n"
+"rdmsr										\n"
+"or	eax, 0x901								\n"
+"wrmsr										\n"
+
+// enable paging and enter long mode
+"mov	eax, cr0							\n"
+"or	eax, 0x80010000							\n"
+"mov	cr0, eax							\n"
+".byte	0xEA								\n"
+"smp_trampoline_jump64:						\n"
+".long	0									\n" // physical address of smp_trampoline_64
+".word	0x28								\n" // CODE_SEGMENT_SELECTOR
+
+".code64									\n"
+"smp_trampoline_64:							\n"
+"mov	ebx, ebx							\n" // clear upper half
+"mov	ax, 0x30							\n" // DATA_SEGMENT_SELECTOR
+"mov	ds, ax								\n"
+"mov	es, ax								\n"
+"mov	ss, ax								\n"
+"mov	rsp, [rbx + smp_trampoline_stack - smp_trampoline]	\n"
+"mov	rdi, [rbx + smp_trampoline_cpu - smp_trampoline]	\n"
+"mov	rax, [rbx + smp_trampoline_entry - smp_trampoline]	\n"
+"call	rax									\n" // jump to smp_ap_entry in kernel space (never returns)
+
+// temporary GDT (the selectors for long mode match the ones of the bootloader)
+".align 16									\n"
+"smp_trampoline_gdt:						\n"
+".quad	0x0000000000000000					\n" // null entry
+".quad	0x00CF9A000000FFFF					\n" // 0x08: 32-bit code segment
+".quad	0x00CF92000000FFFF					\n" // 0x10: data segment
+".quad	0x0000000000000000					\n"
+".quad	0x0000000000000000					\n"
+".quad	0x00209A0000000000					\n" // 0x28: 64-bit code segment
+".quad	0x00CF92000000FFFF					\n" // 0x30: data segment
+"smp_trampoline_gdtr:						\n"
+".word	smp_trampoline_gdtr - smp_trampoline_gdt - 1	\n"
+".long	0									\n" // physical address of smp_trampoline_gdt
+
+".align 8									\n"
+"smp_trampoline_cr3:						\n"
+".quad	0									\n"
+"smp_trampoline_stack:						\n"
+".quad	0									\n"
+"smp_trampoline_cpu:						\n"
+".quad	0									\n"
+"smp_trampoline_entry:						\n"
+".quad	0									\n"
+"smp_trampoline_end:						\n"
+);
+
+
+// Returns a pointer to a field of the trampoline copy
+#define TRAMPOLINE_FIELD(trampoline, field)	((trampoline) + ((uintptr_t)&(field) - (uintptr_t)&smp_trampoline))
+
+
+
+
+typedef struct __attribute__((packed)) {
+	char signature[8];				// "RSD PTR "
+	uint8_t checksum;				// covers the fields up to rsdtAddress (the ACPI 1.0 structure)
+	char oemId[6];
+	uint8_t revision;				// 0 for ACPI 1.0, 2 for ACPI 2.0 and later
+	uint32_t rsdtAddress;			// physical address of the RSDT
+	// the following fields are only present in revision 2 and later
+	uint32_t length;				// length of the entire structure
+	uint64_t xsdtAddress;			// physical address of the XSDT
+	uint8_t extendedChecksum;		// covers the entire structure
+	uint8_t reserved[3];
+} acpi_rsdp_t;
+
+typedef struct __attribute__((packed)) {
+	char signature[4];
+	uint32_t length;				// length of the table, including the header
+	uint8_t revision;
+	uint8_t checksum;
+	char oemId[6];
+	char oemTableId[8];
+	uint32_t oemRevision;
+	uint32_t creatorId;
+	uint32_t creatorRevision;
+} acpi_header_t;
+
+typedef struct __attribute__((packed)) {
+	acpi_header_t header;			// signature "APIC"
+	uint32_t localApicAddress;
+	uint32_t flags;
+	uint8_t entries[];				// variable length entries, each starting with a type and a length byte
+} acpi_madt_t;
+
+#define MADT_TYPE_LOCAL_APIC		(0)
+#define MADT_LOCAL_APIC_ENABLED		(1)
+
+
+
+// Returns zero if the bytes in the specified range sum up to zero
+static uint8_t acpi_checksum(void *ptr, size_t length) {
+	uint8_t sum = 0;
+	for (size_t i = 0; i < length; i++)
+		sum += ((uint8_t *)ptr)[i];
+	return sum;
+}
+
+
+// Searches the RSDP in the specified physical range, which must be below 1MB.
+static acpi_rsdp_t *acpi_search_rsdp(uintptr_t start, size_t length) {
+	for (uintptr_t address = start; address < start + length; address += 16) {
+		acpi_rsdp_t *rsdp = (acpi_rsdp_t *)(KERNEL_OFFSET + address);
+		if (!memcmp(rsdp->signature, "RSD PTR ", 8) && !acpi_checksum(rsdp, offsetof(acpi_rsdp_t, length)))
+			return rsdp;
+	}
+	return NULL;
+}
+
+
+// Maps an ACPI table to kernel space.
+// The mapping is never released, this is fine as long as only a few tables are looked at while booting.
+static acpi_header_t *acpi_map_table(uintptr_t address) {
+	uintptr_t offset = address & PAGE_SIZE_MASK;
+	char *page = page_map((void *)(address - offset), 2 * PAGE_SIZE, 0, 0, 0);
+	if (!page)
+		return NULL;
+
+	acpi_header_t *header = (acpi_header_t *)(page + offset);
+	if (header->length < sizeof(acpi_header_t) || header->length > 0x100000)
+		return NULL;
+	if (offset + header->length > 2 * PAGE_SIZE)
+		if (!(page = page_map((void *)(address - offset), round_up(offset + header->length, PAGE_ALIGN_BITS), 0, 0, 0)))
+			return NULL;
+
+	header = (acpi_header_t *)(page + offset);
+	return (acpi_checksum(header, header->length) ? NULL : header);
+}
+
+
+// Locates the MADT (multiple APIC description table), which lists all processors.
+// Returns NULL if there is no valid MADT.
+static acpi_madt_t *acpi_find_madt(void) {
+	// the RSDP is either in the first kB of the extended BIOS data area or in the BIOS ROM
+	acpi_rsdp_t *rsdp = NULL;
+	uintptr_t ebda = (uintptr_t)*(uint16_t *)(KERNEL_OFFSET + 0x40E) << 4;
+	if (ebda)
+		rsdp = acpi_search_rsdp(ebda, 0x400);
+	if (!rsdp)
+		rsdp = acpi_search_rsdp(0xE0000, 0x20000);
+	if (!rsdp)
+		return NULL;
+
+	// ACPI 2.0 and later list the tables in the XSDT (with 64-bit addresses), the RSDT is only kept for older
+	// operating systems and may be missing
+	int extended = (rsdp->revision >= 2 && rsdp->length >= sizeof(acpi_rsdp_t) && rsdp->xsdtAddress && !acpi_checksum(rsdp, rsdp->length));
+	acpi_header_t *sdt = (extended ? acpi_map_table(rsdp->xsdtAddress) : NULL);
+	if (!sdt) {
+		extended = 0;
+		if (!rsdp->rsdtAddress || !(sdt = acpi_map_table(rsdp->rsdtAddress)))
+			return NULL;
+	}
+	DBG_SMP("ACPI: using the %s", extended ? "XSDT" : "RSDT");
+
+	// the entries of both tables are 4 byte aligned
+	uint32_t *entries = (uint32_t *)(sdt + 1);
+	size_t entryCount = (sdt->length - sizeof(acpi_header_t)) / (extended ? sizeof(uint64_t) : sizeof(uint32_t));
+	for (size_t i = 0; i < entryCount; i++) {
+		uint64_t address = (extended ? entries[2 * i] | (uint64_t)entries[2 * i + 1] << 32 : entries[i]);
+		acpi_header_t *table = acpi_map_table(address);
+		if (table && !memcmp(table->signature, "APIC", 4))
+			return (acpi_madt_t *)table;
+	}
+
+	return NULL;
+}
+
+
+
+
+// Waits for roughly the specified number of microseconds (one I/O port access takes about 1us)
+static void smp_delay(int microseconds) {
+	while (microseconds--)
+		io_wait();
+}
+
+
+// Executed by each application processor after the trampoline switched to long mode.
+static void __attribute__((__noreturn__)) smp_ap_entry(cpu_t *cpu) {
+	// switch to the GDT of this processor (the code segment selector remains valid)
+	set_gdtr((gdtr_t) { .address = cpu->gdt, .limit = cpu->gdtLimit });
+	__asm volatile (
+		"mov	ds, ax	\n"
+		"mov	es, ax	\n"
+		"mov	ss, ax	\n"
+		"mov	fs, ax	\n"
+		"mov	gs, ax	\n"
+		: : "a" (DATA_SEGMENT_SELECTOR) : "memory");
+	write_msr(IA32_GS_BASE_MSR, (uintptr_t)cpu);
+
+	cpu_init_fpu();
+	interrupt_init_ap((char *)cpu->gdt + TASK_SEGMENT_SELECTOR, &cpu->tss, cpu->stacks, cpu->stacks + PAGE_SIZE, cpu->stacks + 2 * PAGE_SIZE);
+	apic_init_ap();
+
+	DBG_SMP("processor %d online (APIC ID %d)", cpu->index, cpu->apicId);
+	__sync_synchronize();
+	cpu->online = 1;
+
+	smpApEntry();
+
+	for (;;)
+		cpu_halt();
+}
+
+
+// Starts the specified application processor using the INIT-SIPI-SIPI sequence.
+// Returns a non-zero value if the processor came up.
+static int smp_start_ap(cpu_t *cpu, uintptr_t trampoline) {
+	apic_send_init(cpu->apicId);
+	smp_delay(10000);
+
+	for (int attempt = 0; attempt < 2 && !cpu->online; attempt++) {
+		apic_send_startup(cpu->apicId, trampoline >> PAGE_ALIGN_BITS);
+		for (int i = 0; i < (attempt ? 100000 : 200) && !cpu->online; i++)
+			smp_delay(1);
+	}
+
+	return cpu->online;
+}
+
+
+// Starts all application processors that are listed in the MADT (up to CPU_MAX processors in total).
+// Each processor sets up its own GDT, TSS, interrupt stacks and local APIC and then calls apEntry,
+// which must not return. Must be called on the bootstrap processor after apic_init and with interrupts disabled.
+void smp_init(void(*apEntry)(void)) {
+	cpus[0].apicId = apic_read_id();
+	cpus[0].online = 1;
+
+	acpi_madt_t *madt = acpi_find_madt();
+	if (!madt) {
+		LOGI("no MADT found, using the bootstrap processor only");
+		return;
+	}
+
+	// copy the trampoline to a page in the real mode buffer (the start of the buffer isn't page aligned)
+	uintptr_t trampoline = round_up((uintptr_t)realmodeBuffer - KERNEL_OFFSET, PAGE_ALIGN_BITS);
+	char *trampolineVA = (char *)(KERNEL_OFFSET + trampoline);
+	size_t trampolineLength = (uintptr_t)&smp_trampoline_end - (uintptr_t)&smp_trampoline;
+	if (trampoline + trampolineLength > REALMODE_BUFFER_END) {
+		LOGE("the trampoline doesn't fit into the real mode buffer, using the bootstrap processor only");
+		return;
+	}
+	assert(read_cr3() < 0x100000000UL); // the trampoline loads cr3 in 32-bit mode
+	memcpy(trampolineVA, &smp_trampoline, trampolineLength);
+
+	*(uint32_t *)TRAMPOLINE_FIELD(trampolineVA, smp_trampoline_jump32) = trampoline + (uintptr_t)&smp_trampoline_32 - (uintptr_t)&smp_trampoline;
+	*(uint32_t *)TRAMPOLINE_FIELD(trampolineVA, smp_trampoline_jump64) = trampoline + (uintptr_t)&smp_trampoline_64 - (uintptr_t)&smp_trampoline;
+	*(uint32_t *)(TRAMPOLINE_FIELD(trampolineVA, smp_trampoline_gdtr) + 2) = trampoline + (uintptr_t)&smp_trampoline_gdt - (uintptr_t)&smp_trampoline;
+	*(uint64_t *)TRAMPOLINE_FIELD(trampolineVA, smp_trampoline_cr3) = read_cr3();
+	*(uint64_t *)TRAMPOLINE_FIELD(trampolineVA, smp_trampoline_entry) = (uintptr_t)smp_ap_entry;
+	smpApEntry = apEntry;
+
+	// each AP starts off with a copy of our GDT
+	gdtr_t gdtr = get_gdtr();
+	assert(gdtr.limit < sizeof(cpus[0].gdt));
+
+	// the trampoline enables paging while running from the lower memory
+	page_map_realmode();
+
+	for (uint8_t *entry = madt->entries; entry < (uint8_t *)madt + madt->header.length; entry += entry[1]) {
+		if (!entry[1])
+			break;
+		if (entry[0] != MADT_TYPE_LOCAL_APIC || !(*(uint32_t *)(entry + 4) & MADT_LOCAL_APIC_ENABLED) || entry[3] == cpus[0].apicId)
+			continue;
+		if (cpuCount >= CPU_MAX) {
+			LOGW("only %d processors are used", CPU_MAX);
+			break;
+		}
+
+		cpu_t *cpu = &cpus[cpuCount];
+		cpu->self = cpu;
+		cpu->index = cpuCount;
+		cpu->apicId = entry[3];
+		cpu->online = 0;
+		memcpy(cpu->gdt, (void *)gdtr.address, gdtr.limit + 1);
+		cpu->gdtLimit = gdtr.limit;
+		if (!(cpu->stacks = malloc(3 * PAGE_SIZE))) {
+			LOGE("out of memory while starting processors");
+			break;
+		}
+
+		*(uint64_t *)TRAMPOLINE_FIELD(trampolineVA, smp_trampoline_stack) = (uintptr_t)cpu->stacks + PAGE_SIZE;
+		*(uint64_t *)TRAMPOLINE_FIELD(trampolineVA, smp_trampoline_cpu) = (uintptr_t)cpu;
+		__sync_synchronize();
+
+		if (smp_start_ap(cpu, trampoline)) {
+			cpuCount++;
+		} else {
+			LOGE("processor with APIC ID %d did not respond", cpu->apicId);
+			free(cpu->stacks);
+		}
+	}
+
+	page_unmap_realmode();
+
+	LOGI("%d processors online", cpuCount);
+}
+
+
+// Makes the specified processor invoke the scheduler as soon as possible (e.g. to end idling).
+void smp_reschedule(int cpuIndex) {
+	apic_timer_trigger_remote(cpus[cpuIndex].apicId);
+}
+
+
+// Points the GS segment base of the bootstrap processor to its cpu_t structure
+void smp_init_bsp(void) {
+	cpus[0].self = &cpus[0];
+	cpus[0].index = 0;
+	write_msr(IA32_GS_BASE_MSR, (uintptr_t)&cpus[0]);
+}
+
+REGISTER_INIT0(smp_init_bsp);
@@ -0,0 +1,40 @@
+#ifndef __SMP_H__
+#define __SMP_H__
+
+
+#define CPU_MAX				(16)	// maximum number of processors that are used
+
+#define IA32_GS_BASE_MSR	0xC0000101UL
+
+
+// Describes a logical processor. The GS segment base of each processor points to its own structure.
+typedef struct cpu_t {
+	struct cpu_t *self;				// points to this structure (must be the first field, see cpu_current)
+	int index;						// index into the cpus array (0 for the bootstrap processor)
+	uint32_t apicId;				// ID of the local APIC of this processor
+	volatile int online;			// set by the processor as soon as it is initialized
+	uint64_t gdt[16];				// the GDT of this processor (each processor needs its own TSS descriptor)
+	uint16_t gdtLimit;
+	tss_t tss;						// the TSS of this processor (application processors only)
+	char *stacks;					// kernel, interrupt and fallback stack of PAGE_SIZE each (application processors only)
+} cpu_t;
+
+
+extern cpu_t cpus[CPU_MAX];
+extern volatile int cpuCount;
+
+
+// Returns the structure that describes the processor that executes this function.
+// Unless interrupts are disabled, the calling thread may be moved to another processor at any time.
+static inline cpu_t *cpu_current(void) {
+	cpu_t *cpu;
+	__asm volatile ("mov %0, gs:[0]" : "=r" (cpu));
+	return cpu;
+}
+
+
+void smp_init(void(*apEntry)(void));
+void smp_reschedule(int cpuIndex);
+
+
+#endif // __SMP_H__
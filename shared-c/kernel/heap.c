@@ -5,6 +5,11 @@
 * The heap is splitted into several smaller heaps, each of which is stored in one or more virtual memory pages.
 * The single parts of the heap are allocated and freed dynamically by calling page_alloc() and page_free().
 *
+* Small blocks (up to SLAB_MAX_SIZE bytes) are not taken from the heaps but from slabs. A slab is a run of
+* pages that is split into objects of one size class, so allocating and freeing them takes constant time.
+* Every block, whether it lives in a heap or a slab, is preceded by a size field with the "allocated" flag
+* (bit 0). For slab objects, this field holds the address of the slab and has the "slab" flag (bit 1) set.
+*
 *
 * created: 27.12.14
 *
@@ -46,6 +51,36 @@ heap_t *heap = NULL;
 heap_t *lastHeap = NULL;
 
 
+#define SLAB_FLAG				(2UL)	// set in the size field of blocks that reside in a slab
+#define SLAB_CLASS_COUNT		(8)		// number of size classes (16B, 32B, ..., 2kB)
+#define SLAB_MIN_SIZE_BITS		(4)		// the smallest size class holds 16 bytes
+#define SLAB_MAX_SIZE			(1UL << (SLAB_MIN_SIZE_BITS + SLAB_CLASS_COUNT - 1))
+#define SLAB_EMPTY_MAX			(1)		// number of completely free slabs that are kept per size class
+
+typedef struct slab_t
+{
+	struct slab_t *nextSlab;		// next slab of the same size class that has free objects
+	struct slab_t *previousSlab;	// previous slab of the same size class that has free objects
+	void *freeObjects;				// singly linked list of objects that were freed
+	char *unusedSpace;				// objects at or after this address were never handed out
+	size_t usedObjects;				// number of objects that are currently allocated
+	size_t sizeClass;				// index into slabClasses
+} slab_t; // size: 48B on 64-bit system
+
+typedef struct
+{
+	size_t objectSize;				// size of one object (excluding its size field)
+	size_t slabSize;				// size of a slab in bytes (multiple of PAGE_SIZE)
+	size_t emptySlabs;				// number of slabs in the list without any allocated objects
+	slab_t *partialSlabs;			// list of slabs that have at least one free object
+} slab_class_t;
+
+slab_class_t slabClasses[SLAB_CLASS_COUNT];
+
+// Slabs are carved from pages, so they can't be used until the physical memory manager is up.
+int slabsAvailable = 0;
+
+
 // Initializes an empty heap structure
 void heap_init(heap_t *newHeap, size_t size) {
 	assert(!((uintptr_t)newHeap & PAGE_SIZE_MASK));
@@ -87,23 +122,147 @@ void malloc_init(void) {
 #ifdef USING_VIRTUAL_MEMORY
 	phy_page_init();
 #endif
+
+	// larger objects use larger slabs, so that each slab holds at least ~30 objects
+	for (size_t i = 0; i < SLAB_CLASS_COUNT; i++) {
+		slabClasses[i].objectSize = 1UL << (SLAB_MIN_SIZE_BITS + i);
+		slabClasses[i].slabSize = max(PAGE_SIZE, slabClasses[i].objectSize << 5);
+		slabClasses[i].emptySlabs = 0;
+		slabClasses[i].partialSlabs = NULL;
+	}
+	slabsAvailable = 1;
 }
 
 REGISTER_INIT4(malloc_init);
 
 
 
-// Allocates a block of memory in the current processes linear address space.
-// Returns NULL if not enough physical or virtual memory could be allocated or if the size argument is 0.
-// The pointer is guaranteed to be 16-byte aligned for 8-byte address sizes. <= NO, NOT YET
-void *malloc(size_t size) {
-	//debug(1, size);
-	if (!size)
-		return NULL;
+// Returns a non-zero value if the slab has no more free objects.
+static inline int slab_is_full(slab_t *slab) {
+	slab_class_t *class = &slabClasses[slab->sizeClass];
+	return !slab->freeObjects && (slab->unusedSpace + sizeof(size_t) + class->objectSize > (char *)slab + class->slabSize);
+}
+
+
+// Allocates an object from the smallest size class that fits the requested size.
+// Returns NULL if no new slab could be allocated.
+static void *slab_alloc(size_t size) {
+	size_t sizeClass = (size <= (1UL << SLAB_MIN_SIZE_BITS)) ? 0 : (64 - __builtin_clzl(size - 1) - SLAB_MIN_SIZE_BITS);
+	slab_class_t *class = &slabClasses[sizeClass];
+	slab_t *slab = class->partialSlabs;
+
+	if (!slab) {
+		// this call may allocate other slabs, but the size class is in a consistent state
+		if (!(slab = page_alloc(class->slabSize)))
+			return NULL;
+		DBG_ALLOC("allocating slab of %d pages for %d byte objects", (int)(class->slabSize >> PAGE_ALIGN_BITS), (int)class->objectSize);
+
+		slab->freeObjects = NULL;
+		slab->unusedSpace = (char *)slab + sizeof(slab_t);
+		slab->usedObjects = 0;
+		slab->sizeClass = sizeClass;
+		slab->previousSlab = NULL;
+		if ((slab->nextSlab = class->partialSlabs))
+			slab->nextSlab->previousSlab = slab;
+		class->partialSlabs = slab;
+		class->emptySlabs++;
+	}
+
+	// take a previously freed object or carve a new one from the unused space
+	size_t *object;
+	if (slab->freeObjects) {
+		object = (size_t *)slab->freeObjects - 1;
+		slab->freeObjects = *(void **)slab->freeObjects;
+	} else {
+		object = (size_t *)slab->unusedSpace;
+		slab->unusedSpace += sizeof(size_t) + class->objectSize;
+	}
+
+	if (!slab->usedObjects++)
+		class->emptySlabs--;
+
+	// remove full slabs from the list
+	if (slab_is_full(slab)) {
+		if ((class->partialSlabs = slab->nextSlab))
+			class->partialSlabs->previousSlab = NULL;
+	}
+
+	*object = (size_t)slab | SLAB_FLAG | 1;
+	return object + 1;
+}
+
+
+// Returns an object to its slab.
+// The slab is released if it becomes empty, unless it is one of the few empty slabs kept for reuse.
+static void slab_free(void *block) {
+	size_t *object = (size_t *)block - 1;
+	assert(*object & 1); // cannot free a block that wasn't allocated
+	slab_t *slab = (slab_t *)(*object & ~(SLAB_FLAG | 1));
+	slab_class_t *class = &slabClasses[slab->sizeClass];
+	*object &= ~(size_t)1;
+
+	// full slabs are not in the list, so add it now that it will have a free object
+	if (slab_is_full(slab)) {
+		slab->previousSlab = NULL;
+		if ((slab->nextSlab = class->partialSlabs))
+			slab->nextSlab->previousSlab = slab;
+		class->partialSlabs = slab;
+	}
+
+	*(void **)block = slab->freeObjects;
+	slab->freeObjects = block;
+
+	if (--slab->usedObjects)
+		return;
+
+	if (class->emptySlabs < SLAB_EMPTY_MAX) {
+		class->emptySlabs++;
+		return;
+	}
+
+	// remove this slab from the list and free the associated pages
+	if (slab->previousSlab)
+		slab->previousSlab->nextSlab = slab->nextSlab;
+	else
+		class->partialSlabs = slab->nextSlab;
+	if (slab->nextSlab)
+		slab->nextSlab->previousSlab = slab->previousSlab;
+
+	// the size class is now in a consistent state, so this call is safe
+	page_free(slab, class->slabSize);
+}
+
+
+// Returns the number of bytes that can be used in the specified block (which must be allocated).
+static inline size_t block_size(void *block) {
+	size_t sizeField = *((size_t *)block - 1);
+	if (sizeField & SLAB_FLAG)
+		return slabClasses[((slab_t *)(sizeField & ~(SLAB_FLAG | 1)))->sizeClass].objectSize;
+	return sizeField & ~(size_t)1;
+}
+
+
+
+// Returns the offset from the start of a free block to the first block at the specified alignment that can be carved from it.
+// The offset is either zero or large enough to leave a free block in front of the aligned block.
+static inline size_t heap_alignment_gap(free_block_t *block, size_t alignment) {
+	if (alignment <= sizeof(size_t))
+		return 0;
+	size_t gap = -((uintptr_t)block + sizeof(size_t)) & (alignment - 1);
+	while (gap && gap < sizeof(free_block_t))
+		gap += alignment;
+	return gap;
+}
+
+
+// Allocates a block from the first heap that has a large enough free block.
+// If there is no such heap, a new heap is allocated. The new heap is made larger by the specified
+// number of bytes (if possible), so that the block can later grow in place.
+// The alignment must be a power of two. Slack in front of an aligned block is kept as a free block.
+static void *heap_alloc(size_t size, size_t reserve, size_t alignment) {
 	if (size < 2 * sizeof(void *))
 		size = 2 * sizeof(void *); // size must be at least that of a free block
-	if (size & 1)
-		size++;
+	size = round_up(size, 3); // keep blocks aligned to the size fields (bit 1 of the size is used by slab objects)
 
 	memmgr_enter_routine();
 
@@ -118,7 +277,8 @@ void *malloc(size_t size) {
 				size_t largestFreeBlock = 0;
 
 				while (currentBlock) {
-					if (currentBlock->size >= size) {
+					size_t gap = heap_alignment_gap(currentBlock, alignment);
+					if (currentBlock->size >= size + gap) {
 						// we found a suitable block
 
 						// track memory usage
@@ -126,6 +286,23 @@ void *malloc(size_t size) {
 						if (currentBlock->size >= currentHeap->largestFreeBlock)
 							currentHeap->largestFreeBlock = SIZE_MAX; // invalidate largestFreeBlock field
 
+						if (gap) {
+							// split off the unaligned front part, which remains in the linked list,
+							// and continue with the aligned rest as if it was the free block that we found
+							free_block_t *alignedBlock = (free_block_t *)((char *)currentBlock + gap);
+							alignedBlock->size = currentBlock->size - gap;
+							alignedBlock->previousFreeBlock = currentBlock;
+							alignedBlock->nextFreeBlock = currentBlock->nextFreeBlock;
+							if (currentBlock->nextFreeBlock)
+								currentBlock->nextFreeBlock->previousFreeBlock = alignedBlock;
+							currentBlock->nextFreeBlock = alignedBlock;
+
+							currentBlock->size = gap - 2 * sizeof(size_t);
+							*(size_t *)((char *)currentBlock + sizeof(size_t) + currentBlock->size) = currentBlock->size;
+							currentHeap->freeSpace += currentBlock->size;
+							currentBlock = alignedBlock;
+						}
+
 						if (currentBlock->size >= size + 2 * sizeof(size_t) + 2 * sizeof(void *)) { // can this block be splitted?
 							free_block_t *newFreeBlock = (free_block_t *)((char *)currentBlock + 2 * sizeof(size_t) + size);
 
@@ -178,14 +355,25 @@ void *malloc(size_t size) {
 		assert(lastHeap);
 
 		// allocate enough pages for the requested memory block plus the heap header structure
+		// (and the largest gap that may be needed to align the block)
 		size_t heapSize = sizeof(heap_t) + 2 * sizeof(size_t) + size;
+		if (alignment > sizeof(size_t))
+			heapSize += alignment + sizeof(free_block_t);
 		if (heapSize & PAGE_SIZE_MASK)
 			heapSize += PAGE_SIZE;
 		heapSize &= ~PAGE_SIZE_MASK;
 
-		DBG_ALLOC("allocating heap of %d pages", (int)(heapSize >> PAGE_ALIGN_BITS));
+		heap_t *newHeap = NULL;
+		if (reserve && heapSize + reserve > heapSize) {
+			DBG_ALLOC("allocating heap of %d pages", (int)(round_up(heapSize + reserve, PAGE_ALIGN_BITS) >> PAGE_ALIGN_BITS));
+			if ((newHeap = page_alloc(round_up(heapSize + reserve, PAGE_ALIGN_BITS))))
+				heapSize = round_up(heapSize + reserve, PAGE_ALIGN_BITS);
+		}
 
-		heap_t *newHeap = page_alloc(heapSize);
+		if (!newHeap) {
+			DBG_ALLOC("allocating heap of %d pages", (int)(heapSize >> PAGE_ALIGN_BITS));
+			newHeap = page_alloc(heapSize);
+		}
 		if (!newHeap) return memmgr_exit_routine(), NULL; // page allocation failed
 
 		// init the heap structure
@@ -204,49 +392,166 @@ void *malloc(size_t size) {
 }
 
 
+// Allocates a block of memory in the current processes linear address space.
+// Returns NULL if not enough physical or virtual memory could be allocated or if the size argument is 0.
+// The pointer is guaranteed to be 8-byte aligned.
+void *malloc(size_t size) {
+	//debug(1, size);
+	if (!size)
+		return NULL;
+
+	memmgr_enter_routine();
+
+	void *block = NULL;
+	if (slabsAvailable && size <= SLAB_MAX_SIZE)
+		block = slab_alloc(size);
+	if (!block)
+		block = heap_alloc(size, 0, 0);
+
+	return memmgr_exit_routine(), block;
+}
+
 
-// to do
-void *realloc(void *block, size_t size) {
-	if (!block) return NULL;
 
+// Allocates a block of memory whose address is a multiple of the specified alignment.
+// The alignment must be a power of two no larger than PAGE_SIZE. The block is freed using free().
+// Returns NULL if the arguments are invalid or not enough memory could be allocated.
+void *aligned_alloc(size_t alignment, size_t size) {
+	if (!size || !alignment || (alignment & (alignment - 1)) || alignment > PAGE_SIZE)
+		return NULL;
+
+	// every block is aligned to its size field
+	if (alignment <= sizeof(size_t))
+		return malloc(size);
+
+	// slab objects are packed with their size fields, so aligned blocks always come from a heap
 	memmgr_enter_routine();
-	
+	void *block = heap_alloc(size, 0, alignment);
+	return memmgr_exit_routine(), block;
+}
+
+
+// Resizes a heap block without moving it.
+// The block grows by absorbing the free block that directly follows it (if any) and shrinks by splitting off its tail.
+// Returns zero if the block can't hold the requested size at its current address.
+static int heap_resize(void *block, size_t size) {
+	if (size < 2 * sizeof(void *))
+		size = 2 * sizeof(void *);
+	size = round_up(size, 3);
+
+	// the size fields are shared with the neighbouring blocks, so they are only read while holding the memory manager
+	memmgr_enter_routine();
+
 	size_t *blockSize1 = (size_t *)block - 1;
-	size_t *blockSize2 = (size_t *)((char *)block + *blockSize1);
+	size_t *blockSize2 = (size_t *)((char *)block + (*blockSize1 & ~(size_t)1));
+	assert((*blockSize1) & 1);
+	assert(*blockSize1 == *blockSize2);
+
+	// a block that shrinks by less than the size of a free block stays as it is
+	size_t available = *blockSize1 & ~(size_t)1;
+	if (size <= available && available < size + 2 * sizeof(size_t) + 2 * sizeof(void *))
+		return memmgr_exit_routine(), 1;
 
 	// find last free block before this one
-	free_block_t *nextFreeBlock = (free_block_t *)blockSize1;
+	free_block_t *precedingFreeBlock = (free_block_t *)blockSize1;
 	do {
-		nextFreeBlock = (free_block_t *)((char *)nextFreeBlock - (*((size_t *)nextFreeBlock - 1) & ~(1UL)) - 2 * sizeof(size_t)); // find first size field of preceding block
-	} while (nextFreeBlock->size & 1);
-	nextFreeBlock = nextFreeBlock->nextFreeBlock;
+		precedingFreeBlock = (free_block_t *)((char *)precedingFreeBlock - (*((size_t *)precedingFreeBlock - 1) & ~(1UL)) - 2 * sizeof(size_t)); // find first size field of preceding block
+	} while (precedingFreeBlock->size & 1);
 
-	int retainAddress = 0;
+	// the free blocks are sorted by address, so the next free block is our successor if it starts right after our second size field
+	free_block_t *nextFreeBlock = precedingFreeBlock->nextFreeBlock;
+	if (nextFreeBlock != (free_block_t *)(blockSize2 + 1))
+		nextFreeBlock = NULL;
+	else
+		available += nextFreeBlock->size + 2 * sizeof(size_t);
 
-	if (nextFreeBlock)
-		if (&(nextFreeBlock->size) == (blockSize2 + 1))
-			if (*blockSize1 + nextFreeBlock->size + 2 * sizeof(size_t) >= size)
-				retainAddress = 1;
-	
-	if (retainAddress) {
-		// todo
-	} else {
-		void *newBlock = malloc(size);
-		if (!newBlock) return NULL;
-		memcpy(newBlock, block, *blockSize1);
-		free(block);
-		block = newBlock;
+	if (available < size)
+		return memmgr_exit_routine(), 0;
+
+	// find the heap we're in
+	free_block_t *head = precedingFreeBlock;
+	while (head->previousFreeBlock)
+		head = head->previousFreeBlock;
+	heap_t *currentHeap = (heap_t *)((char *)head - offsetof(heap_t, head[0]));
+	assert(!((uintptr_t)currentHeap & PAGE_SIZE_MASK));
+
+	// absorb the succeeding free block
+	// (largestFreeBlock remains an upper bound, so there is no need to update it)
+	if (nextFreeBlock) {
+		precedingFreeBlock->nextFreeBlock = nextFreeBlock->nextFreeBlock;
+		if (nextFreeBlock->nextFreeBlock)
+			nextFreeBlock->nextFreeBlock->previousFreeBlock = precedingFreeBlock;
+		currentHeap->freeSpace -= nextFreeBlock->size;
+	}
+
+	if (available >= size + 2 * sizeof(size_t) + 2 * sizeof(void *)) { // can the tail be splitted off?
+		free_block_t *newFreeBlock = (free_block_t *)((char *)block + size + sizeof(size_t));
+
+		// the block after the tail is allocated (or the end of the heap), so there is nothing to coalesce
+		newFreeBlock->previousFreeBlock = precedingFreeBlock;
+		newFreeBlock->nextFreeBlock = precedingFreeBlock->nextFreeBlock;
+		if (precedingFreeBlock->nextFreeBlock)
+			precedingFreeBlock->nextFreeBlock->previousFreeBlock = newFreeBlock;
+		precedingFreeBlock->nextFreeBlock = newFreeBlock;
+
+		newFreeBlock->size = available - size - 2 * sizeof(size_t);
+		*(size_t *)((char *)newFreeBlock + sizeof(size_t) + newFreeBlock->size) = newFreeBlock->size;
+
+		currentHeap->freeSpace += newFreeBlock->size;
+		if (currentHeap->largestFreeBlock < newFreeBlock->size)
+			currentHeap->largestFreeBlock = newFreeBlock->size;
+		available = size;
 	}
 
-	return block;
+	// set "allocated" flag in both size fields
+	*blockSize1 = *(size_t *)((char *)block + available) = available | 1;
+
+	return memmgr_exit_routine(), 1;
 }
 
 
+// Changes the size of a memory block that was obtained through a malloc() call.
+// Heap blocks are resized in place where possible, otherwise the contents are moved to a new block.
+// A size of 0 frees the block and returns NULL.
+// Returns NULL (and leaves the original block untouched) if not enough memory could be allocated.
+void *realloc(void *block, size_t size) {
+	if (!block) return NULL;
+	if (!size) {
+		free(block);
+		return NULL;
+	}
+
+	// the size field is only read while holding the memory manager (see heap_resize)
+	memmgr_enter_routine();
+	size_t blockSize = block_size(block);
+	void *newBlock;
+
+	if (*((size_t *)block - 1) & SLAB_FLAG) {
+		// slab objects can't be resized, but they don't need to move as long as the new size fits
+		if (size <= blockSize)
+			return memmgr_exit_routine(), block;
+		newBlock = malloc(size);
+	} else {
+		if (heap_resize(block, size))
+			return memmgr_exit_routine(), block;
+
+		// The block has to move. If it ends up in a new heap, leave room behind it for growing by twice
+		// as much again, so that a buffer which keeps doubling its size only moves every other time.
+		newBlock = heap_alloc(size, 2 * (size - blockSize), 0);
+	}
+	memmgr_exit_routine();
+
+	if (!newBlock) return NULL;
+	memcpy(newBlock, block, min(size, blockSize));
+	free(block);
+	return newBlock;
+}
+
 
-// Frees the memory block that is associated with a pointer that was obtained through a malloc() call.
-void free(void *block) {
-	if (!block) return;
 
+// Returns a block to the heap that it was allocated from and coalesces it with adjacent free blocks.
+// If the heap becomes completely free, its pages are released.
+static void heap_free(void *block) {
 	memmgr_enter_routine();
 
 	size_t *blockSize1 = (size_t *)block - 1;
@@ -344,15 +649,153 @@ void free(void *block) {
 }
 
 
+// Frees the memory block that is associated with a pointer that was obtained through a malloc() call.
+void free(void *block) {
+	if (!block) return;
 
+	memmgr_enter_routine();
 
+	if (*((size_t *)block - 1) & SLAB_FLAG)
+		slab_free(block);
+	else
+		heap_free(block);
 
+	memmgr_exit_routine();
+}
 
 
 
+#ifdef USING_BENCHMARK
 
+#define HEAP_BENCHMARK_SLOTS	(1024)	// the number of blocks that are allocated at any time
 
-void *memcpy(void *restrict __dest, const void *restrict __src, size_t __n) {
+// Compares the heap with the slabs by replacing pseudo-random blocks of 16 to 200 bytes the specified number of times.
+// The same sequence is run once on the heap alone (as before the slabs existed) and once through malloc and free.
+void heap_benchmark(int count) {
+	benchmark_t bench;
+	benchmark_init(&bench, "heap");
+	void **blocks = malloc(HEAP_BENCHMARK_SLOTS * sizeof(void *));
+	if (!blocks) {
+		LOGE("heap benchmark: out of memory");
+		return;
+	}
+
+	for (int pass = 0; pass < 2; pass++) {
+		memset(blocks, 0, HEAP_BENCHMARK_SLOTS * sizeof(void *));
+		benchmark_reseed(&bench);
+		int i;
+
+		benchmark_start(&bench);
+		for (i = 0; i < count; i++) {
+			uint32_t random = benchmark_random(&bench);
+			size_t slot = (random >> 8) % HEAP_BENCHMARK_SLOTS;
+			size_t size = 16 + (random >> 20) % 185;
+
+			if (blocks[slot]) {
+				if (pass)
+					free(blocks[slot]);
+				else
+					heap_free(blocks[slot]);
+			}
+			if (!(blocks[slot] = (pass ? malloc(size) : heap_alloc(size, 0, 0))))
+				break;
+			*(char *)blocks[slot] = i; // touch the block, like a caller would
+		}
+		benchmark_stop(&bench, (pass ? "slabs" : "heap only"), i, "allocation and free");
+
+		for (size_t slot = 0; slot < HEAP_BENCHMARK_SLOTS; slot++) {
+			if (!blocks[slot])
+				continue;
+			if (pass)
+				free(blocks[slot]);
+			else
+				heap_free(blocks[slot]);
+		}
+
+		if (i < count)
+			LOGE("heap benchmark: allocation failed after %d allocations", i);
+	}
+
+	free(blocks);
+}
+
+
+// Compares growing a buffer by allocating a new block and copying it (as realloc did before it resized blocks in place)
+// with realloc, the way stream_expand grows a stream: the buffer starts at 64 bytes and doubles until it holds
+// the specified number of bytes. The buffer is grown to 64 kB, to 1 MB and to the specified length.
+void realloc_benchmark(size_t length) {
+	benchmark_t bench;
+	benchmark_init(&bench, "realloc");
+
+	size_t sizes[] = { 64UL << 10, 1UL << 20, length };
+	for (int i = 0; i < 3; i++) {
+		size_t size = min(sizes[i], length);
+		size_t repeats = max(1, (64UL << 20) / size);
+		LOGI("realloc benchmark: growing %d times to %d kB", (int)repeats, (int)(size >> 10));
+
+		for (int pass = 0; pass < 2; pass++) {
+			size_t moves = 0, r;
+
+			benchmark_start(&bench);
+			for (r = 0; r < repeats; r++) {
+				size_t capacity = 64;
+				char *data = malloc(capacity);
+				while (data && capacity < size) {
+					char *newData;
+					if (pass) {
+						newData = realloc(data, capacity << 1);
+						moves += (newData && newData != data);
+					} else if ((newData = malloc(capacity << 1))) {
+						memcpy(newData, data, capacity);
+						free(data);
+						moves++;
+					}
+					if (!newData)
+						break;
+					data = newData;
+					capacity <<= 1;
+					data[capacity - 1] = (char)r; // touch the new end of the buffer, like a writer would
+				}
+				free(data);
+				if (capacity < size)
+					break;
+			}
+			benchmark_stop(&bench, (pass ? "realloc" : "malloc and copy"), r * (size >> 10), "kB");
+
+			if (r < repeats)
+				LOGE("realloc benchmark: could not grow a buffer to %d kB", (int)(size >> 10));
+			else
+				LOGI("realloc benchmark: %s: %d moves per buffer", (pass ? "realloc" : "malloc and copy"), (int)(moves / repeats));
+		}
+	}
+}
+
+#endif // USING_BENCHMARK
+
+
+
+
+
+
+
+
+
+
+// The memory functions below copy, fill and compare in chunks of 32 bytes where possible.
+// On x86, each function is compiled for every CPU feature level (SSE2, SSE4.2, AVX2) and the
+// best variant is chosen at runtime. Copies and fills that are larger than MEM_NONTEMPORAL_THRESHOLD
+// use non-temporal stores, so that they don't evict the whole cache.
+
+#define MEM_NONTEMPORAL_THRESHOLD	(1UL << 20)
+
+// Prevent the compiler from turning the loops below into calls to the very functions they implement.
+#pragma GCC push_options
+#pragma GCC optimize ("no-tree-loop-distribute-patterns")
+
+#if !defined(CPUACCELFUNC) || defined(USING_BENCHMARK)
+
+// The byte loops are used where there are no accelerated variants (and as a baseline by memcpy_benchmark).
+static void *memcpy_bytewise(void *restrict __dest, const void *restrict __src, size_t __n) {
 	char *dest = __dest;
 	const char *src = __src;
 	while (__n--) *dest++ = *src++;
@@ -360,8 +803,8 @@ void *memcpy(void *restrict __dest, const void *restrict __src, size_t __n) {
 }
 
 
-int memcmp(const void *ptr1, const void *ptr2, size_t num) {
-	const char *__ptr1 = ptr1, *__ptr2 = ptr2;
+static int memcmp_bytewise(const void *ptr1, const void *ptr2, size_t num) {
+	const unsigned char *__ptr1 = ptr1, *__ptr2 = ptr2;
 	while (num--) {
 		if (*__ptr1 > *__ptr2) return 1;
 		if (*(__ptr1++) < *(__ptr2++)) return -1;
@@ -370,13 +813,256 @@ int memcmp(const void *ptr1, const void *ptr2, size_t num) {
 }
 
 
-void *memset(void *ptr, int value, size_t num) {
+static void *memset_bytewise(void *ptr, int value, size_t num) {
 	char *__ptr = ptr;
 	while (num--)
 		*(__ptr++) = (unsigned char)value;
 	return ptr;
 }
 
+#endif
+
+
+#ifdef CPUACCELFUNC
+
+// Unaligned scalar and vector types (the compiler maps the vector type to whatever registers the feature level provides)
+typedef uint16_t mem_u16_t __attribute__((__aligned__(1), __may_alias__));
+typedef uint32_t mem_u32_t __attribute__((__aligned__(1), __may_alias__));
+typedef uint64_t mem_u64_t __attribute__((__aligned__(1), __may_alias__));
+typedef uint64_t mem_v32_t __attribute__((__vector_size__(32), __aligned__(1), __may_alias__));
+typedef uint64_t mem_v32a_t __attribute__((__vector_size__(32), __may_alias__));
+typedef long long mem_v16a_t __attribute__((__vector_size__(16), __may_alias__));
+
+CPUACCELDECL(void *, memcpy_accel, (void *restrict __dest, const void *restrict __src, size_t __n));
+CPUACCELFUNC(void *, memcpy_accel, (void *restrict __dest, const void *restrict __src, size_t __n), {
+	char *dest = __dest;
+	const char *src = __src;
+
+	// small copies: two possibly overlapping moves
+	if (__n < 32) {
+		if (__n >= 16) {
+			mem_u64_t a = *(mem_u64_t *)src, b = *((mem_u64_t *)src + 1), c = *(mem_u64_t *)(src + __n - 16), d = *(mem_u64_t *)(src + __n - 8);
+			*(mem_u64_t *)dest = a; *((mem_u64_t *)dest + 1) = b; *(mem_u64_t *)(dest + __n - 16) = c; *(mem_u64_t *)(dest + __n - 8) = d;
+		} else if (__n >= 8) {
+			mem_u64_t a = *(mem_u64_t *)src, b = *(mem_u64_t *)(src + __n - 8);
+			*(mem_u64_t *)dest = a; *(mem_u64_t *)(dest + __n - 8) = b;
+		} else if (__n >= 4) {
+			mem_u32_t a = *(mem_u32_t *)src, b = *(mem_u32_t *)(src + __n - 4);
+			*(mem_u32_t *)dest = a; *(mem_u32_t *)(dest + __n - 4) = b;
+		} else if (__n >= 2) {
+			mem_u16_t a = *(mem_u16_t *)src, b = *(mem_u16_t *)(src + __n - 2);
+			*(mem_u16_t *)dest = a; *(mem_u16_t *)(dest + __n - 2) = b;
+		} else if (__n) {
+			*dest = *src;
+		}
+		return __dest;
+	}
+
+	// copy the last chunk up front, then align the destination
+	mem_v32_t last = *(mem_v32_t *)(src + __n - 32);
+	char *lastDest = dest + __n - 32;
+	*(mem_v32_t *)dest = *(mem_v32_t *)src;
+	size_t delta = 32 - ((uintptr_t)dest & 31);
+	dest += delta; src += delta; __n -= delta;
+
+	if (__n > MEM_NONTEMPORAL_THRESHOLD) {
+		for (; __n > 32; __n -= 32, dest += 32, src += 32) {
+			mem_v32_t chunk = *(mem_v32_t *)src;
+			__builtin_ia32_movntdq((mem_v16a_t *)dest, ((mem_v16a_t *)&chunk)[0]);
+			__builtin_ia32_movntdq((mem_v16a_t *)dest + 1, ((mem_v16a_t *)&chunk)[1]);
+		}
+		__builtin_ia32_sfence();
+	} else {
+		for (; __n > 64; __n -= 64, dest += 64, src += 64) {
+			mem_v32_t a = *(mem_v32_t *)src, b = *((mem_v32_t *)src + 1);
+			*(mem_v32a_t *)dest = a;
+			*((mem_v32a_t *)dest + 1) = b;
+		}
+		if (__n > 32)
+			*(mem_v32a_t *)dest = *(mem_v32_t *)src;
+	}
+
+	*(mem_v32_t *)lastDest = last;
+	return __dest;
+})
+
+
+CPUACCELDECL(void *, memset_accel, (void *ptr, int value, size_t num));
+CPUACCELFUNC(void *, memset_accel, (void *ptr, int value, size_t num), {
+	char *__ptr = ptr;
+	uint64_t pattern = (uint64_t)(unsigned char)value * 0x0101010101010101UL;
+
+	// small fills: two possibly overlapping stores
+	if (num < 32) {
+		if (num >= 16) {
+			*(mem_u64_t *)__ptr = pattern; *((mem_u64_t *)__ptr + 1) = pattern;
+			*(mem_u64_t *)(__ptr + num - 16) = pattern; *(mem_u64_t *)(__ptr + num - 8) = pattern;
+		} else if (num >= 8) {
+			*(mem_u64_t *)__ptr = pattern; *(mem_u64_t *)(__ptr + num - 8) = pattern;
+		} else if (num >= 4) {
+			*(mem_u32_t *)__ptr = pattern; *(mem_u32_t *)(__ptr + num - 4) = pattern;
+		} else if (num >= 2) {
+			*(mem_u16_t *)__ptr = pattern; *(mem_u16_t *)(__ptr + num - 2) = pattern;
+		} else if (num) {
+			*__ptr = pattern;
+		}
+		return ptr;
+	}
+
+	mem_v32a_t chunk = { pattern, pattern, pattern, pattern };
+	*(mem_v32_t *)(__ptr + num - 32) = chunk;
+	*(mem_v32_t *)__ptr = chunk;
+	size_t delta = 32 - ((uintptr_t)__ptr & 31);
+	__ptr += delta; num -= delta;
+
+	if (num > MEM_NONTEMPORAL_THRESHOLD) {
+		for (; num > 32; num -= 32, __ptr += 32) {
+			__builtin_ia32_movntdq((mem_v16a_t *)__ptr, ((mem_v16a_t *)&chunk)[0]);
+			__builtin_ia32_movntdq((mem_v16a_t *)__ptr + 1, ((mem_v16a_t *)&chunk)[1]);
+		}
+		__builtin_ia32_sfence();
+	} else {
+		for (; num > 64; num -= 64, __ptr += 64) {
+			*(mem_v32a_t *)__ptr = chunk;
+			*((mem_v32a_t *)__ptr + 1) = chunk;
+		}
+		if (num > 32)
+			*(mem_v32a_t *)__ptr = chunk;
+	}
+
+	return ptr;
+})
+
+
+CPUACCELDECL(int, memcmp_accel, (const void *ptr1, const void *ptr2, size_t num));
+CPUACCELFUNC(int, memcmp_accel, (const void *ptr1, const void *ptr2, size_t num), {
+	const unsigned char *__ptr1 = ptr1, *__ptr2 = ptr2;
+
+	// skip equal chunks of 32 bytes
+	for (; num >= 32; num -= 32, __ptr1 += 32, __ptr2 += 32) {
+		mem_v32_t diff = *(mem_v32_t *)__ptr1 ^ *(mem_v32_t *)__ptr2;
+		if (diff[0] | diff[1] | diff[2] | diff[3])
+			break;
+	}
+
+	// skip equal words (the first differing byte is the lowest one that differs)
+	for (; num >= 8; num -= 8, __ptr1 += 8, __ptr2 += 8) {
+		uint64_t diff = *(mem_u64_t *)__ptr1 ^ *(mem_u64_t *)__ptr2;
+		if (diff) {
+			int index = __builtin_ctzl(diff) >> 3;
+			return (__ptr1[index] > __ptr2[index] ? 1 : -1);
+		}
+	}
+
+	for (; num; num--, __ptr1++, __ptr2++)
+		if (*__ptr1 != *__ptr2)
+			return (*__ptr1 > *__ptr2 ? 1 : -1);
+	return 0;
+})
+
+
+void *memcpy(void *restrict __dest, const void *restrict __src, size_t __n) {
+	return memcpy_accel(__dest, __src, __n);
+}
+
+
+int memcmp(const void *ptr1, const void *ptr2, size_t num) {
+	return memcmp_accel(ptr1, ptr2, num);
+}
+
+
+void *memset(void *ptr, int value, size_t num) {
+	return memset_accel(ptr, value, num);
+}
+
+#else
+
+void *memcpy(void *restrict __dest, const void *restrict __src, size_t __n) {
+	return memcpy_bytewise(__dest, __src, __n);
+}
+
+
+int memcmp(const void *ptr1, const void *ptr2, size_t num) {
+	return memcmp_bytewise(ptr1, ptr2, num);
+}
+
+
+void *memset(void *ptr, int value, size_t num) {
+	return memset_bytewise(ptr, value, num);
+}
+
+#endif
+
+
+// memcpy doesn't allow the blocks to overlap, so memmove copies in whichever direction is safe
+void *memmove(void *__dest, const void *__src, size_t __n) {
+	char *dest = __dest;
+	const char *src = __src;
+	if (dest + __n <= src || dest >= src + __n)
+		return memcpy(__dest, __src, __n);
+	if (dest < src)
+		while (__n--) *dest++ = *src++;
+	else
+		while (__n--) dest[__n] = src[__n];
+	return __dest;
+}
+
+#pragma GCC pop_options
+
+
+#ifdef USING_BENCHMARK
+
+// Compares the byte loops with the accelerated memory functions on blocks of 64 bytes, 4kB and the specified length.
+// Each block size is repeated until four times the specified length was processed. The results are written to the log.
+void memcpy_benchmark(size_t length) {
+	benchmark_t bench;
+	benchmark_init(&bench, "memcpy");
+	char *src = malloc(length), *dest = malloc(length);
+	if (!src || !dest) {
+		LOGE("memcpy benchmark: could not allocate %d kB", (int)(length >> 10));
+		free(src);
+		free(dest);
+		return;
+	}
+
+	for (size_t i = 0; i < length; i++)
+		src[i] = benchmark_random(&bench) >> 24;
+
+	size_t sizes[] = { 64, 4096, length };
+	for (int i = 0; i < 3; i++) {
+		size_t size = min(sizes[i], length);
+		size_t repeats = max(1, 4 * length / size);
+		uint64_t kilobytes = max(1, repeats * size >> 10);
+		int differences = 0;
+		LOGI("memcpy benchmark: blocks of %d bytes", (int)size);
+
+		for (int pass = 0; pass < 2; pass++) {
+			benchmark_start(&bench);
+			for (size_t j = 0; j < repeats; j++)
+				pass ? memcpy(dest, src, size) : memcpy_bytewise(dest, src, size);
+			benchmark_stop(&bench, (pass ? "accelerated copy" : "byte loop copy"), kilobytes, "kB");
+
+			benchmark_start(&bench);
+			for (size_t j = 0; j < repeats; j++)
+				differences += (pass ? memcmp(dest, src, size) : memcmp_bytewise(dest, src, size)) != 0;
+			benchmark_stop(&bench, (pass ? "accelerated compare" : "byte loop compare"), kilobytes, "kB");
+
+			benchmark_start(&bench);
+			for (size_t j = 0; j < repeats; j++)
+				pass ? memset(dest, j, size) : memset_bytewise(dest, j, size);
+			benchmark_stop(&bench, (pass ? "accelerated fill" : "byte loop fill"), kilobytes, "kB");
+		}
+
+		if (differences)
+			LOGE("memcpy benchmark: the copy differs from the source");
+	}
+
+	free(src);
+	free(dest);
+}
+
+#endif // USING_BENCHMARK
+
 
 
 
@@ -398,9 +1084,23 @@ memmgr_lazy_call_t memmgrStagedCalls[20];
 int memmgrStagedCallCount = 0;
 int memmgrNestedLevel = 0;
 
+// The memory manager is used by one processor at a time, with interrupts disabled.
+// The lock holds the index of the owning processor plus one, so that it can be entered recursively.
+volatile int memmgrOwner = 0;
+int memmgrIntFlag;
+
 
 // marks the beginning of a memory management related routine
 void memmgr_enter_routine(void) {
+	int intFlag = atomic_enter();
+	int owner = cpu_current()->index + 1;
+	if (memmgrOwner != owner) {
+		while (!__sync_bool_compare_and_swap(&memmgrOwner, 0, owner)) {
+			tlb_shootdown_poll(); // the owner may be waiting for us to invalidate pages that it unmapped
+			__builtin_ia32_pause();
+		}
+		memmgrIntFlag = intFlag;
+	}
 	memmgrNestedLevel++;
 }
 
@@ -438,6 +1138,10 @@ void memmgr_exit_routine(void) {
 	}
 
 	memmgrNestedLevel--;
+
+	int intFlag = memmgrIntFlag;
+	__sync_lock_release(&memmgrOwner);
+	atomic_exit(intFlag);
 }
 
 
@@ -6,6 +6,12 @@
 
 // malloc, realloc and free are declared in stdlib.h
 
+#ifdef USING_BENCHMARK
+void heap_benchmark(int count);
+void realloc_benchmark(size_t length);
+void memcpy_benchmark(size_t length);
+#endif
+
 // all of these functions were commeted out for some reason -> find out why
 // these functions are related to lazy free calls to prevent recursiveness of memory manager functions
 #ifdef USING_VIRTUAL_MEMORY
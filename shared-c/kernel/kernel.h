@@ -20,6 +20,7 @@ extern volatile int shuttingDown;
 #include "memory.h"
 #include "ntfs.h"
 #include "threading.h"
+#include "sync.h"
 
 
 #endif // __KERNEL_H__
@@ -2,7 +2,19 @@
 /*
 *
 * Manages physical memory by keeping track of which memory areas are in use and which ones are free.
-* The physical memory management is  fully thread and multiprocessing safe and lock-free.
+* Free memory is managed by a binary buddy allocator: every free region is split into blocks of
+* 2^order pages that are aligned to their own size. There is one free list per order and a hash
+* table that maps the first page of every free block to its descriptor, so the buddy of a block
+* can be found in constant time. Allocations and frees therefore take O(log n) steps.
+* The hash table is sized from the amount of physical memory once it is known (see phy_resize_table).
+*
+* As free pages are not mapped into the virtual address space, the block descriptors can't be stored
+* in the free pages themselves and are allocated on the heap instead. A small reserve of descriptors
+* is kept in the list of unused blocks so that the allocator never needs to call malloc while it
+* holds the lock (malloc may itself end up calling phy_page_alloc).
+*
+* The physical memory management is thread and multiprocessing safe. All free lists are protected by
+* a single spinlock that is only held for a bounded number of steps with interrupts disabled.
 *
 * created: 27.12.14
 *
@@ -22,29 +34,66 @@
 
 
 
+// The largest block that is managed as a whole spans 2^BUDDY_MAX_ORDER pages (1GB).
+// Larger free regions are simply represented by multiple blocks of the maximum order.
+#define BUDDY_MAX_ORDER		(18)
+#define BUDDY_ORDER_COUNT	(BUDDY_MAX_ORDER + 1)
+
+// The free block lookup table starts out with 2^FREE_BLOCK_TABLE_MIN_BITS buckets and is enlarged
+// to about one bucket per FREE_BLOCK_TABLE_PAGES pages when all free memory was handed over.
+#define FREE_BLOCK_TABLE_MIN_BITS	(10)
+#define FREE_BLOCK_TABLE_PAGES		(8)
+
+
 typedef struct memory_block_t
 {
-	uintptr_t startPage;					// number of the page where the block starts (derived from the physical start address)
-	size_t pageCount;						// number of pages in this block
-	struct memory_block_t * volatile next;
-	volatile int flags;						// bit 0: allocated, bit 1: currently being modified
-} memory_block_t; // size: ~36B
-
-
-// Linked list of memory blocks, each of which is either marked "allocated" or "free"
-// The list is sorted by address and spans the entire physical address space without
-// overlaps or gaps.
-// Blocks that are marked in use must not be accessed or edited, except for referencing
-// the next element.
-// The first block must always be allocated.
-memory_block_t * volatile firstMemoryBlock = NULL;
-
-// Linked list of memory block structures that are currently not in the memory list
-// and can be recycled.
+	uintptr_t startPage;					// number of the first page in this block (a multiple of 2^order)
+	size_t order;							// the block spans 2^order pages
+	struct memory_block_t * volatile next;	// next free block of the same order (also used in the list of unused blocks)
+	struct memory_block_t *previous;		// previous free block of the same order
+	struct memory_block_t *nextInBucket;	// next free block in the same bucket of the lookup table
+} memory_block_t; // size: 40B
+
+
+// Only used during initialization to collect the free and reserved regions of the BIOS memory map
+typedef struct memory_region_t
+{
+	uintptr_t startPage;					// number of the page where the region starts (derived from the physical start address)
+	size_t pageCount;						// number of pages in this region
+	struct memory_region_t *next;
+} memory_region_t; // size: 24B
+
+
+// One list of free blocks for each order.
+// The lists are not sorted.
+memory_block_t *freeLists[BUDDY_ORDER_COUNT] = { NULL };
+
+// Bit n is set if the free list of order n is not empty.
+size_t freeOrders = 0;
+
+// Maps the start page of each free block to the block. Used to find the buddy of a block.
+memory_block_t *initialFreeBlockTable[1 << FREE_BLOCK_TABLE_MIN_BITS] = { NULL };
+memory_block_t **freeBlockTable = initialFreeBlockTable;
+size_t freeBlockTableBits = FREE_BLOCK_TABLE_MIN_BITS;
+
+// Total number of free pages
+size_t freePageCount = 0;
+
+// Protects the free lists, the lookup table and the counters above.
+volatile int phyLock = 0;
+
+// Linked list of memory block structures that are currently not in use and can be recycled.
 memory_block_t * volatile unusedBlocks = NULL;
+volatile int unusedBlockCount = 0;
+volatile int reservingBlocks = 0;
+
+// The minimum number of unused blocks that should be available before an allocation.
+// One allocation consumes at most BUDDY_MAX_ORDER blocks, some headroom is left for
+// allocations that happen while the reserve is refilled.
+#define UNUSED_BLOCKS_MIN	(2 * BUDDY_ORDER_COUNT)
 
 // The maximum number of unused blocks that are kept when the list is cleaned up.
-#define UNUSED_BLOCKS_MAX	(16)
+#define UNUSED_BLOCKS_MAX	(4 * BUDDY_ORDER_COUNT)
 
 
 typedef struct __attribute__((__packed__)) {
@@ -57,17 +106,33 @@ typedef struct __attribute__((__packed__)) {
 
 
 
-// Prints the specified list
-void phy_dump_ex(memory_block_t *block) {
-	int flags;
-	for (; block; block = block->next)
-		LOGI("  page %d: %d pages %s", block->startPage, block->pageCount, (flags = block->flags, (flags & 2 ? "in use" : (flags & 1 ? "allocated" : "free"))));
+// Acquires the lock that protects the free lists.
+// Returns the interrupt flag that must be passed to phy_unlock.
+static inline int phy_lock(void) {
+	int intFlag = atomic_enter();
+	while (!__sync_bool_compare_and_swap(&phyLock, 0, 1));
+	return intFlag;
 }
 
-// Prints the current state of the allocated and free memory blocks.
+// Releases the lock that protects the free lists.
+static inline void phy_unlock(int intFlag) {
+	__sync_lock_release(&phyLock);
+	atomic_exit(intFlag);
+}
+
+
+
+// Prints the current state of the free memory blocks.
 void phy_dump(void) {
-	LOGI("physical memory dump:");
-	phy_dump_ex(firstMemoryBlock);
+	int intFlag = phy_lock();
+	LOGI("physical memory dump: %d free pages", freePageCount);
+	for (size_t order = 0; order < BUDDY_ORDER_COUNT; order++) {
+		if (!freeLists[order]) continue;
+		LOGI(" order %d:", order);
+		for (memory_block_t *block = freeLists[order]; block; block = block->next)
+			LOGI("  page %d: %d pages free", block->startPage, 1UL << order);
+	}
+	phy_unlock(intFlag);
 }
 
 
@@ -119,23 +184,418 @@ void phy_test(void) {
 
 
 
+// Adds a block to the list of unused blocks.
+//	thread-safe: yes
+void mem_enqueue_unused_block(memory_block_t *block) {
+	assert(block);
+	memory_block_t *unusedBlocksFetch;
+	do {
+		unusedBlocksFetch = unusedBlocks;
+		block->next = unusedBlocksFetch;
+	} while (!(__sync_bool_compare_and_swap(&unusedBlocks, unusedBlocksFetch, block)));
+	__sync_fetch_and_add(&unusedBlockCount, 1);
+}
+
+// Removes and returns a block from the list of unused blocks.
+// Returns NULL if the list was empty and no new block could be allocated.
+//	allowAlloc: if set, if the list is empty, a new block is allocated.
+//	thread-safe: yes
+memory_block_t *mem_dequeue_unused_block(int allowAlloc) {
+	memory_block_t *unusedBlocksFetch;
+	do {
+		unusedBlocksFetch = unusedBlocks;
+		if (!unusedBlocksFetch)
+			return (allowAlloc ? (memory_block_t *)malloc(sizeof(memory_block_t)) : NULL);
+	} while (!(__sync_bool_compare_and_swap(&unusedBlocks, unusedBlocksFetch, unusedBlocksFetch->next)));
+	__sync_fetch_and_sub(&unusedBlockCount, 1);
+	return unusedBlocksFetch;
+}
+
+
+// Refills the list of unused blocks up to UNUSED_BLOCKS_MIN.
+// Nested calls (caused by malloc calling phy_page_alloc) return immediately
+// and rely on the blocks that are already available.
+void mem_reserve_unused_blocks(void) {
+	if (unusedBlockCount >= UNUSED_BLOCKS_MIN)
+		return;
+	if (!__sync_bool_compare_and_swap(&reservingBlocks, 0, 1))
+		return;
+
+	while (unusedBlockCount < UNUSED_BLOCKS_MIN) {
+		memory_block_t *block = (memory_block_t *)malloc(sizeof(memory_block_t));
+		if (!block) break;
+		mem_enqueue_unused_block(block);
+	}
+
+	__sync_lock_release(&reservingBlocks);
+}
+
+
+
+// Returns the bucket of the free block lookup table that contains the block starting at the specified page.
+static inline memory_block_t **phy_table_bucket(uintptr_t page) {
+	return &freeBlockTable[(uint64_t)(page * 0x9E3779B97F4A7C15UL) >> (64 - freeBlockTableBits)];
+}
+
+// Returns the free block that starts at the specified page or NULL if there is no such block.
+// The lock must be held by the caller.
+static memory_block_t *phy_find_free_block(uintptr_t page) {
+	for (memory_block_t *block = *phy_table_bucket(page); block; block = block->nextInBucket)
+		if (block->startPage == page)
+			return block;
+	return NULL;
+}
+
+// Inserts a block into the free list of its order and into the lookup table.
+// The lock must be held by the caller.
+static void phy_insert_free_block(memory_block_t *block) {
+	memory_block_t **bucket = phy_table_bucket(block->startPage);
+	block->nextInBucket = *bucket;
+	*bucket = block;
+
+	block->previous = NULL;
+	if ((block->next = freeLists[block->order]))
+		block->next->previous = block;
+	freeLists[block->order] = block;
+	freeOrders |= (1UL << block->order);
+	freePageCount += (1UL << block->order);
+}
+
+// Removes a block from its free list and from the lookup table.
+// The lock must be held by the caller.
+static void phy_remove_free_block(memory_block_t *block) {
+	memory_block_t **bucket = phy_table_bucket(block->startPage);
+	while (*bucket != block)
+		bucket = &(*bucket)->nextInBucket;
+	*bucket = block->nextInBucket;
+
+	if (block->previous)
+		block->previous->next = block->next;
+	else if (!(freeLists[block->order] = block->next))
+		freeOrders &= ~(1UL << block->order);
+	if (block->next)
+		block->next->previous = block->previous;
+	freePageCount -= (1UL << block->order);
+}
+
+
+// Enlarges the free block lookup table to about one bucket per FREE_BLOCK_TABLE_PAGES free pages, so that
+// chains stay short however fragmented the memory gets. The new table is allocated before the lock is taken,
+// as malloc may call phy_page_alloc. If there is not enough memory, the current table is kept.
+static void phy_resize_table(void) {
+	size_t bits = FREE_BLOCK_TABLE_MIN_BITS;
+	while ((FREE_BLOCK_TABLE_PAGES << bits) < freePageCount)
+		bits++;
+	if (bits <= freeBlockTableBits)
+		return;
+
+	memory_block_t **table = (memory_block_t **)calloc(1UL << bits, sizeof(memory_block_t *));
+	if (!table)
+		return;
+
+	int intFlag = phy_lock();
+	memory_block_t **oldTable = freeBlockTable;
+	size_t oldSize = 1UL << freeBlockTableBits;
+	freeBlockTable = table;
+	freeBlockTableBits = bits;
+
+	for (size_t i = 0; i < oldSize; i++) {
+		while (oldTable[i]) {
+			memory_block_t *block = oldTable[i];
+			oldTable[i] = block->nextInBucket;
+			memory_block_t **bucket = phy_table_bucket(block->startPage);
+			block->nextInBucket = *bucket;
+			*bucket = block;
+		}
+	}
+	phy_unlock(intFlag);
+
+	DBG_INIT("free block table: %d buckets", 1 << bits);
+	if (oldTable != initialFreeBlockTable)
+		free(oldTable);
+}
+
+
+// Returns the order of the largest block that starts at the specified page
+// and doesn't span more than the specified number of pages.
+static inline size_t phy_largest_order(uintptr_t page, size_t count) {
+	size_t order = 63 - __builtin_clzl(count);
+	if (page)
+		order = min(order, (size_t)__builtin_ctzl(page));
+	return min(order, (size_t)BUDDY_MAX_ORDER);
+}
+
+
+
+// Allocates the specified number of contiguous pages in physical address space.
+// The block that is used is rounded up to the next power of two, the excess pages are freed again.
+// After this call, phy_cleanup should be called.
+void *phy_page_alloc(size_t count) {
+	assert(count);
+	size_t order = (count > 1 ? 64 - __builtin_clzl(count - 1) : 0);
+	if (order > BUDDY_MAX_ORDER)
+		return NULL;
+
+	// Before we mess around with the free lists, make sure that
+	// there are enough blocks available to split larger blocks.
+	mem_reserve_unused_blocks();
+
+	int intFlag = phy_lock();
+
+	// find the smallest order that has a free block
+	size_t availableOrders = freeOrders & ~((1UL << order) - 1);
+	if (!availableOrders)
+		return phy_unlock(intFlag), NULL;
+	size_t currentOrder = __builtin_ctzl(availableOrders);
+
+	memory_block_t *block = freeLists[currentOrder];
+	phy_remove_free_block(block);
+
+	// split the block until it has the requested order and free the upper halves
+	while (currentOrder > order) {
+		memory_block_t *upperHalf = mem_dequeue_unused_block(0);
+		if (!upperHalf) {
+			// out of block descriptors: put back what remains of the block
+			DBG_ALLOC("phy alloc out of block descriptors");
+			block->order = currentOrder;
+			phy_insert_free_block(block);
+			return phy_unlock(intFlag), NULL;
+		}
+
+		currentOrder--;
+		upperHalf->startPage = block->startPage + (1UL << currentOrder);
+		upperHalf->order = currentOrder;
+		phy_insert_free_block(upperHalf);
+	}
+
+	void *addr = (void *)(block->startPage << PAGE_ALIGN_BITS);
+	phy_unlock(intFlag);
+
+	mem_enqueue_unused_block(block);
+	DBG_ALLOC("phy alloc %d pages at page %d", count, (uintptr_t)addr >> PAGE_ALIGN_BITS);
+
+	// give back the pages that exceed the requested count
+	if (count < (1UL << order))
+		phy_page_free((char *)addr + (count << PAGE_ALIGN_BITS), (1UL << order) - count);
+
+	return addr;
+}
+
+
+// Frees the specified number of contiguous pages in physical address space.
+// Any range of allocated pages may be freed, regardless of how they were allocated.
+// After this call, phy_cleanup should be called.
+void phy_page_free(void *address, size_t count) {
+	assert(!((uintptr_t)address & PAGE_SIZE_MASK));
+	assert(count);
+	uintptr_t page = ((uintptr_t)address >> PAGE_ALIGN_BITS);
+	uintptr_t endPage = page + count;
+
+	DBG_FREE("free %d pages at page %d", count, page);
+
+	// split the range into aligned power-of-two blocks and free each one
+	while (page < endPage) {
+		size_t order = phy_largest_order(page, endPage - page);
+		uintptr_t nextPage = page + (1UL << order);
 
+		// Before we mess around with the free lists, make a
+		// block available to be used.
+		memory_block_t *block = mem_dequeue_unused_block(1);
+		if (!block)
+			bug_check(STATUS_OUT_OF_MEMORY, 0);
+
+		int intFlag = phy_lock();
+		assert(!phy_find_free_block(page)); // double free
+
+		// merge with the buddy as long as it is free
+		while (order < BUDDY_MAX_ORDER) {
+			memory_block_t *buddy = phy_find_free_block(page ^ (1UL << order));
+			if (!buddy || buddy->order != order)
+				break;
+			DBG_FREE("  merge with %d, order %d", buddy->startPage, order);
+			phy_remove_free_block(buddy);
+			mem_enqueue_unused_block(buddy);
+			page &= ~(1UL << order);
+			order++;
+		}
+
+		block->startPage = page;
+		block->order = order;
+		phy_insert_free_block(block);
+
+		phy_unlock(intFlag);
+
+		page = nextPage;
+	}
+}
+
+
+// Limits the size of the list of unused blocks.
+// This should only be called while the heap is in a consistent state.
+void phy_cleanup(void) {
+	memory_block_t *block;
+	while (unusedBlockCount > UNUSED_BLOCKS_MAX && (block = mem_dequeue_unused_block(0)))
+		free(block);
+}
+
+
+
+// Returns the number of physical pages that are currently free.
+size_t phy_get_free_page_count(void) {
+	return freePageCount;
+}
+
+
+#ifdef USING_BENCHMARK
+
+// First-fit allocation from an address-ordered list of free regions, which models the allocator that preceded
+// the buddy allocator (see phy_benchmark). Returns 0 if there is no region that is large enough.
+static uintptr_t phy_list_alloc(memory_region_t **list, size_t count) {
+	for (memory_region_t **node = list; *node; node = &(*node)->next) {
+		memory_region_t *region = *node;
+		if (region->pageCount < count)
+			continue;
+		uintptr_t page = region->startPage;
+		region->startPage += count;
+		if (!(region->pageCount -= count)) {
+			*node = region->next;
+			free(region);
+		}
+		return page;
+	}
+	return 0;
+}
+
+
+// Returns pages to an address-ordered list of free regions and merges them with adjacent regions.
+static void phy_list_free(memory_region_t **list, uintptr_t page, size_t count) {
+	memory_region_t *previous = NULL, *next = *list;
+	while (next && next->startPage < page)
+		next = (previous = next)->next;
+
+	if (previous && previous->startPage + previous->pageCount == page) {
+		previous->pageCount += count;
+		if (next && page + count == next->startPage) {
+			previous->pageCount += next->pageCount;
+			previous->next = next->next;
+			free(next);
+		}
+	} else if (next && page + count == next->startPage) {
+		next->startPage = page;
+		next->pageCount += count;
+	} else {
+		memory_region_t *region = (memory_region_t *)malloc(sizeof(memory_region_t));
+		if (!region)
+			bug_check(STATUS_OUT_OF_MEMORY, 0);
+		*region = (memory_region_t) { .startPage = page, .pageCount = count, .next = next };
+		if (previous)
+			previous->next = region;
+		else
+			*list = region;
+	}
+}
+
+
+// Stress tests the buddy allocator and compares it with the address-ordered free list that it replaced.
+// The same pseudo-random sequence of allocations (mostly single pages, some up to 64 pages) and frees is run on
+// a model of the free list, on the buddy allocator and again on the buddy allocator, checking that no two
+// allocations overlap. Up to the specified number of allocations are alive at the same time.
+void phy_benchmark(int count) {
+	benchmark_t bench;
+	benchmark_init(&bench, "phy");
+	struct {
+		uintptr_t page;
+		size_t pageCount;
+	} *slots = calloc(count, sizeof(*slots));
+	if (!slots) {
+		LOGE("phy benchmark: out of memory");
+		return;
+	}
+
+	const int steps = 8 * count;
+	memory_region_t *list = NULL;
+	phy_list_free(&list, 1, freePageCount);
+
+	for (int pass = 0; pass < 3; pass++) {
+		int allocs = 0, frees = 0, failed = 0, overlaps = 0;
+		benchmark_reseed(&bench);
+
+		benchmark_start(&bench);
+		for (int step = 0; step < steps + count && !failed; step++) {
+			uint32_t random = benchmark_random(&bench);
+			int slot = (step < steps ? (random >> 8) % count : step - steps); // free everything in the end
+
+			if (slots[slot].pageCount) {
+				if (pass)
+					phy_page_free((void *)(slots[slot].page << PAGE_ALIGN_BITS), slots[slot].pageCount);
+				else
+					phy_list_free(&list, slots[slot].page, slots[slot].pageCount);
+				slots[slot].pageCount = 0;
+				frees++;
+
+			} else if (step < steps) {
+				size_t pageCount = (random & 0x3 ? 1 : 1 + ((random >> 24) & 0x3F));
+				uintptr_t page = (pass ? (uintptr_t)phy_page_alloc(pageCount) >> PAGE_ALIGN_BITS : phy_list_alloc(&list, pageCount));
+				if (!(failed = !page)) {
+					slots[slot].page = page;
+					slots[slot].pageCount = pageCount;
+					allocs++;
+				}
+
+				if (pass == 2 && !failed)
+					for (int i = 0; i < count; i++)
+						if (i != slot && slots[i].pageCount && page < slots[i].page + slots[i].pageCount && slots[i].page < page + pageCount)
+							overlaps++;
+			}
+		}
+
+		if (pass < 2)
+			benchmark_stop(&bench, (pass ? "buddy allocator" : "free list"), allocs, "allocation and free");
+		else if (overlaps)
+			LOGE("phy benchmark: %d overlapping allocations", overlaps);
+		else
+			LOGI("phy benchmark: %d allocations and %d frees without overlaps", allocs, frees);
+		if (failed)
+			LOGE("phy benchmark: allocation failed after %d allocations", allocs);
+
+		// release what is left after a failed allocation
+		for (int i = 0; i < count; i++) {
+			if (!slots[i].pageCount)
+				continue;
+			if (pass)
+				phy_page_free((void *)(slots[i].page << PAGE_ALIGN_BITS), slots[i].pageCount);
+			else
+				phy_list_free(&list, slots[i].page, slots[i].pageCount);
+			slots[i].pageCount = 0;
+		}
+	}
+
+	while (list) {
+		memory_region_t *region = list;
+		list = list->next;
+		free(region);
+	}
+	free(slots);
+	phy_cleanup();
+}
+
+#endif // USING_BENCHMARK
 
 
 
 // initializes physical memory managment by using the list that
-// was generated by the bootloader to generate a list of free and allocated memory regions
-// that will then be used by phy_page_alloc and phy_page_free.
+// was generated by the bootloader to generate a list of free and reserved memory regions.
+// The free regions are then handed to the buddy allocator, which is used by phy_page_alloc and phy_page_free.
 // This function uses malloc and free extensively, so these must already be initialized and
-// have a large enough heap to not try to allocate a new heap. The required amount of memory
-// depends on the memory map and can be estimated:
-// ((memory map entries + 3) * sizeof(memory_block_t)) => ~320B for 6 entries
+// have a large enough heap to not try to allocate a new heap before the first free region
+// was handed over. The required amount of memory depends on the memory map and can be estimated:
+// ((memory map entries + 3) * sizeof(memory_region_t) + 2 * BUDDY_ORDER_COUNT * sizeof(memory_block_t)) => ~2KB for 6 entries
 void phy_page_init() {
 	//debug(5, (uint64_t)memoryMap);
 	bios_memory_block_t *biosMemoryMap = *memoryMapPtr;
 
-	memory_block_t *freeBlocks = NULL;
-	memory_block_t *reservedBlocks = NULL;
+	memory_region_t *freeBlocks = NULL;
+	memory_region_t *reservedBlocks = NULL;
 
 
 	// step 1:
@@ -165,7 +625,7 @@ void phy_page_init() {
 		}
 
 		// create a native data structure for the memory region
-		memory_block_t *newBlock = (memory_block_t *)malloc(sizeof(memory_block_t));
+		memory_region_t *newBlock = (memory_region_t *)malloc(sizeof(memory_region_t));
 		assert(newBlock);
 		newBlock->startPage = biosMemoryMap[i].baseAddress >> PAGE_ALIGN_BITS;
 		newBlock->pageCount = biosMemoryMap[i].length >> PAGE_ALIGN_BITS;
@@ -175,8 +635,8 @@ void phy_page_init() {
 		if (biosMemoryMap[i].type == 1) {
 			// free blocks are inserted in address order and don't overlap
 
-			memory_block_t *previous = NULL;
-			memory_block_t *next = freeBlocks;
+			memory_region_t *previous = NULL;
+			memory_region_t *next = freeBlocks;
 
 			// find the correct position within the free-blocks-list
 			while (next) {
@@ -236,8 +696,8 @@ void phy_page_init() {
 	// cut out all regions that are in the reserved-regions list
 
 	while (reservedBlocks) {
-		memory_block_t *previous = NULL;
-		memory_block_t *next = freeBlocks;
+		memory_region_t *previous = NULL;
+		memory_region_t *next = freeBlocks;
 
 		DBG_INIT("reserve block %d", reservedBlocks->startPage);
 
@@ -257,7 +717,7 @@ void phy_page_init() {
 		if (previous) {
 			if (previous->startPage + previous->pageCount > reservedBlocks->startPage + reservedBlocks->pageCount) {
 				DBG_INIT("  split previous block");
-				memory_block_t *newBlock = (memory_block_t *)malloc(sizeof(memory_block_t));
+				memory_region_t *newBlock = (memory_region_t *)malloc(sizeof(memory_region_t));
 				assert(newBlock);
 				newBlock->startPage = reservedBlocks->startPage + reservedBlocks->pageCount;
 				newBlock->pageCount = (previous->startPage + previous->pageCount) - (reservedBlocks->startPage + reservedBlocks->pageCount);
@@ -280,7 +740,7 @@ void phy_page_init() {
 				DBG_INIT("  remove next block");
 				if (previous) previous->next = next->next;
 				else freeBlocks = next->next;
-				memory_block_t *obsoleteBlock = next;
+				memory_region_t *obsoleteBlock = next;
 				next = next->next;
 				free(obsoleteBlock);
 			}
@@ -296,532 +756,33 @@ void phy_page_init() {
 		}
 
 
-		memory_block_t *obsoleteBlock = reservedBlocks;
+		memory_region_t *obsoleteBlock = reservedBlocks;
 		reservedBlocks = reservedBlocks->next;
 		free(obsoleteBlock);
 	}
 
 
 	// step 3:
-	// fill the gaps between free regions with blocks that are marked "allocated"
-
-	uintptr_t currentPage = 0;
-	memory_block_t *next = freeBlocks, *previous = NULL;
-
-	while (next) {
-		next->flags = 0;
-
-		// remove empty blocks
-		if (!(next->pageCount)) {
-			next = next->next;
-			if (previous)
-				previous->next = next;
-			else
-				freeBlocks = next;
-		}
-
-		if (next->startPage > currentPage) {
-			memory_block_t *newBlock = (memory_block_t *)malloc(sizeof(memory_block_t));
-			assert(newBlock);
-			newBlock->startPage = currentPage;
-			newBlock->pageCount = next->startPage - currentPage;
-			newBlock->flags = 1;
-			newBlock->next = next;
-			if (previous) previous->next = newBlock;
-			else freeBlocks = newBlock;
-			currentPage += newBlock->pageCount;
-		}
-
-		currentPage += next->pageCount;
-		next = (previous = next)->next;
-	}
+	// hand all free regions over to the buddy allocator
+	// (page 0 is never handed out, as its address would be indistinguishable from NULL)
 
-	firstMemoryBlock = freeBlocks;
-}
-
-
-
-
-/*
-//// Checks if the specified block has a length of zero, in which case it will be removed.
-//// In this case, the two adjacent blocks are coalesced if possible
-//void memory_block_validate(memory_block_t *block) {
-//	if (!block->pageCount) {
-//		if (block->previousBlock && block->nextBlock) {
-//			if (block->previousBlock->allocated == block->nextBlock->allocated) {
-//				// merge previous block with next block
-//				block->previousBlock->pageCount += block->nextBlock->pageCount;
-//				if (block->nextBlock->nextBlock)
-//					block->nextBlock->nextBlock->previousBlock = block;
-//				block->nextBlock = block->nextBlock->nextBlock;
-//				memmgr_stage_free(block->nextBlock);
-//			}
-//			block->nextBlock->previousBlock = block->previousBlock;
-//		}
-//		block->previousBlock->nextBlock = block->nextBlock;
-//		memmgr_stage_free(block);
-//	}
-//}
-
-// Constructs and inserts a new empty block before the specified one if necessary.
-// e.g. when an allocated block is requested and the block before the specified
-// one is already marked allocated, no action is taken.
-// Returns a non-zero value if the operation succeeded.
-int memory_block_insert_before(memory_block_t *block, int allocated) {
-	if (block->previousBlock->allocated != (allocated ? 1 : 0)) {
-		memory_block_t *newBlock = (memory_block_t *)malloc(sizeof(memory_block_t));
-		if (!newBlock) return 0;
-		newBlock->startPage = block->startPage;
-		newBlock->allocated = (allocated ? 1 : 0);
-		newBlock->pageCount = 0;
-		newBlock->previousBlock = block->previousBlock;
-		newBlock->nextBlock = block;
-		block->previousBlock->nextBlock = newBlock;
-		block->previousBlock = newBlock;
-	}
-	return 1;
-}
-
-// Constructs and inserts a new empty block after the specified one if necessary.
-// Returns a non-zero value if the operation succeeded.
-int memory_block_insert_after(memory_block_t *block, int allocated) {
-	if (block->nextBlock ? block->nextBlock->allocated != (allocated ? 1 : 0) : 1) {
-		memory_block_t *newBlock = (memory_block_t *)malloc(sizeof(memory_block_t));
-		if (!newBlock) return 0;
-		newBlock->startPage = block->startPage + block->pageCount;
-		newBlock->allocated = (allocated ? 1 : 0);
-		newBlock->pageCount = 0;
-		newBlock->previousBlock = block;
-		newBlock->nextBlock = block->nextBlock;
-		if (block->nextBlock)
-			block->nextBlock->previousBlock = newBlock;
-		block->nextBlock = newBlock;
-	}
-	return 1;
-}
-
-// Splits the specified block at the specified address into two blocks if necessary.
-// i.e. when the blocks start address and the specified split address are equal, no action is taken.
-// The address must be page aligned and within the block.
-// The new block is inserted before the specified block.
-int memory_block_split(memory_block_t *block, uintptr_t page) {
-	if ((page != block->startPage) && (page != (block->startPage + block->pageCount))) {
-		memory_block_t *newBlock = (memory_block_t *)malloc(sizeof(memory_block_t));
-		if (!newBlock) return 0;
-
-		newBlock->startPage = block->startPage;
-		newBlock->pageCount = page - block->startPage;
-		newBlock->allocated = block->allocated;
-		block->startPage = page;
-		block->pageCount -= newBlock->pageCount;
-		newBlock->previousBlock = block->previousBlock;
-		newBlock->nextBlock = block;
-		if (block->previousBlock)
-			block->previousBlock->nextBlock = newBlock;
-		block->previousBlock = newBlock;
-	}
-	return 1;
-}
-*/
-
-
-
-// Adds a block to the list of unused blocks.
-//	thread-safe: yes
-void mem_enqueue_unused_block(memory_block_t *block) {
-	assert(block);
-	memory_block_t *unusedBlocksFetch;
-	do {
-		unusedBlocksFetch = unusedBlocks;
-		block->next = unusedBlocksFetch;
-	} while (!(__sync_bool_compare_and_swap(&unusedBlocks, unusedBlocksFetch, block)));
-}
-
-// Removes and returns a block from the list of unused blocks.
-// Returns NULL if the list was empty and no new block could be allocated.
-//	allowAlloc: if set, if the list is empty, a new block is allocated.
-//	thread-safe: yes
-memory_block_t *mem_dequeue_unused_block(int allowAlloc) {
-	memory_block_t *unusedBlocksFetch;
-	do {
-		unusedBlocksFetch = unusedBlocks;
-		if (!unusedBlocksFetch)
-			return (allowAlloc ? (memory_block_t *)malloc(sizeof(memory_block_t)) : NULL);
-	} while (!(__sync_bool_compare_and_swap(&unusedBlocks, unusedBlocksFetch, unusedBlocksFetch->next)));
-	return unusedBlocksFetch;
-}
-
-
-// Acquires the specified block by setting the in-use flag.
-// Returns the flags before acquisition.
-// A thread must never acquire a block that is before another block that it already owns.
-//	thread-safe: yes
-int mem_block_acquire(memory_block_t *block) {
-	int oldFlags;
-	while ((oldFlags = __sync_fetch_and_or(&(block->flags), 2)) & 2);
-	return oldFlags;
-}
-
-
-// Acquires the head of the memory list.
-// A thread must never acquire the head if it already owns an element of the list.
-// The head can be released by setting it to a non-null value.
-memory_block_t *mem_list_acquire() {
-	memory_block_t *head;
-	while (!(head = __sync_fetch_and_and(&firstMemoryBlock, 0)));
-	return head;
-}
-
-
-
-// Removes the current memory block from the list and merges the two adjacent blocks if possible.
-// It is assumed that the previous and current blocks are already owned by the current thread,
-// and that the current block has a size of 0.
-//	thread-safe: yes
-void mem_block_remove(memory_block_t *previous, memory_block_t *current) {
-	memory_block_t *next = previous->next = current->next;
-	mem_enqueue_unused_block(current);
-
-	// acquire next block
-	if (!next)
-		return;
-	int oldFlags = mem_block_acquire(next);
-
-	// check if previous and next block can be merged
-	if ((oldFlags & 1) != (previous->flags & 1)) {
-		next->flags = oldFlags;
-		return;
-	}
-
-	assert(previous->startPage + previous->pageCount == next->startPage);
-	previous->pageCount += next->pageCount;
-	previous->next = next->next;
-	mem_enqueue_unused_block(next);
-}
-
-
-
-// Allocates the specified number of contiguous pages in physical address space.
-// If clear is set, the allocated pages are filled with zeros
-// After this call, phy_cleanup should be called.
-void *phy_page_alloc(size_t count) {
-	memory_block_t *previous, *current;
-	int oldFlagsP, oldFlagsC, wasInUse;
-
-	do {
-		previous = NULL;
-		memory_block_t *firstMemoryBlockTemp = current = mem_list_acquire();
-		oldFlagsP = 0; oldFlagsC = 0; wasInUse = 0;
-
-		for (; current; current = current->next) {
-			if (previous) {
-				// a free block can only be allocated if the previous one was already allocated
-
-				if ((oldFlagsC = __sync_val_compare_and_swap(&(current->flags), 0, 3)) == 0) { // find and acquire a block that is free and not in use
-					if (current->pageCount >= count) {
-
-						// At this point we found a suitable free block that is preceeded by an allocated block.
-						// Grow previous block and shrink current block.
-						void *addr = (void *)((previous->startPage + previous->pageCount) << PAGE_ALIGN_BITS);
-						previous->pageCount += count;
-						current->startPage += count;
-						if (!(current->pageCount -= count))
-							mem_block_remove(previous, current);
-						else
-							current->flags = oldFlagsC;
-						
-						previous->flags = oldFlagsP;
-						return addr;
-					}
-
-					// release current block
-					current->flags = oldFlagsC;
-				}
-
-				// release previous block
-				previous->flags = oldFlagsP;
-				previous = NULL;
-			} else if (firstMemoryBlockTemp) {
-				// release head of the list
-				firstMemoryBlock = firstMemoryBlockTemp;
-				firstMemoryBlockTemp = NULL;
-			}
-
-			if ((oldFlagsP = __sync_val_compare_and_swap(&(current->flags), 1, 3)) == 1) // find and acquire a block that is allocated and not in use
-				previous = current;
-			else
-				previous = NULL;
-
-			wasInUse |= (oldFlagsP & 2) | (oldFlagsC & 2);
-		}
-
-		if (previous)
-			previous->flags = oldFlagsP;
-	} while (wasInUse); // repeat the whole scan if any of the blocks were being edited by another thread.
-
-	return NULL;
-
-
-
-
-	/*
-	memmgr_enter_routine();
-
-	//LOGI("phy page alloc\n");
-
-	for (memory_block_t *currentBlock = firstMemoryBlock; currentBlock; currentBlock = currentBlock->nextBlock) {
-		//LOGI("check block\n");
-		if (currentBlock->allocated) continue;
-		if (currentBlock->pageCount < count) continue;
-	
-		// if the block before this one was not allocated, insert an empty one
-		// todo: assert(block->previousBlock->allocated);
-		// if (!memory_block_insert_before(currentBlock, 1)) must not use malloc here
-		// 	return memmgr_exit_routine(), NULL;
-	
-		// expand previous (allocated) block and shrink this one
-		uintptr_t result = currentBlock->startPage << PAGE_ALIGN_BITS;
-		currentBlock->previousBlock->pageCount += count;
-		currentBlock->pageCount -= count;
-		currentBlock->startPage += count;
-	
-		// if this block became empty, remove it
-		//memory_block_validate_block(currentBlock);
-	
-		//LOGI("phy page alloc complete\n");
-		return memmgr_exit_routine(), (void *)result;
-	}
-	
-	LOGE("phy page alloc failed\n");
-	
-	// all memory has been scanned without success
-	return memmgr_exit_routine(), NULL;
-	*/
-}
-
-
-// Frees the specified number of contiguous pages in physical address space.
-// After this call, phy_cleanup should be called.
-void phy_page_free(void *address, size_t count) {
-	assert(!((uintptr_t)address & PAGE_SIZE_MASK));
-	assert(count);
-	uintptr_t page = ((uintptr_t)address >> PAGE_ALIGN_BITS);
-
-	// Before we mess around with the memory list, make some 
-	// blocks available to be used if neccessary.
-	memory_block_t *dequeuedBlock1 = mem_dequeue_unused_block(1);
-	memory_block_t *dequeuedBlock2 = mem_dequeue_unused_block(1);
-	if (!dequeuedBlock1 || !dequeuedBlock2)
-		bug_check(STATUS_OUT_OF_MEMORY, 0);
-
-
-	memory_block_t *previous, *current, *next;
-	int oldFlagsP = 0, oldFlagsC = 0, oldFlagsN = 0;
-
-	previous = NULL;
-	memory_block_t *firstMemoryBlockTemp = current = mem_list_acquire();
-
-	// find the memory block that contains the pages to be freed
-	for (;;) {
-		assert(current);
-		oldFlagsC = mem_block_acquire(current);
-
-		if ((current->startPage <= page) && (current->startPage + current->pageCount > page)) {
-			assert(current->startPage + current->pageCount >= page + count); // ensure that the pages are fully within the current block
-			next = current->next;
-			if (next) oldFlagsN = mem_block_acquire(next);
-			break;
+	while (freeBlocks) {
+		if (!freeBlocks->startPage && freeBlocks->pageCount) {
+			freeBlocks->startPage++;
+			freeBlocks->pageCount--;
 		}
 
-		if (previous)
-			previous->flags = oldFlagsP;
-		else
-			firstMemoryBlock = firstMemoryBlockTemp;
-		previous = current;
-		current = current->next;
-		oldFlagsP = oldFlagsC;
-	}
-
-
-	// The pages to be freed are now in current, while
-	// previous and next point to the adjacent blocks or are NULL,
-	// oldFlagsP, oldFlagsC, oldFlagsN hold their old flags.
-	// All three blocks (if not NULL) are owned by the current thread.
-	// If previous is NULL, that means that the head of the list has been acquired.
-	
-	DBG_FREE("free %d", page);
-
-	// ensure that the pages to be freed are aligned with the start of current block
-	if (current->startPage != page) {
-		size_t delta = page - current->startPage;
-		if (previous && ((oldFlagsP & 1) == (current->flags & 1))) {
-			DBG_FREE("  shift before (delta %d)", delta);
-			previous->pageCount += delta;
-		} else {
-			DBG_FREE("  split start of %d, %d (delta %d)", current->startPage, current->pageCount, delta);
-			memory_block_t *newBlock = dequeuedBlock1;
-			dequeuedBlock1 = NULL;
-			newBlock->pageCount = delta;
-			newBlock->startPage = current->startPage;
-			newBlock->next = current;
-			newBlock->flags = current->flags;
-			if (previous) {
-				previous->next = newBlock;
-				previous->flags = oldFlagsP;
-			} else {
-				firstMemoryBlock = newBlock;
-			}
-			previous = newBlock;
-			oldFlagsP = oldFlagsC;
+		if (freeBlocks->pageCount) {
+			DBG_INIT("free region at page %d: %d pages", freeBlocks->startPage, freeBlocks->pageCount);
+			phy_page_free((void *)(freeBlocks->startPage << PAGE_ALIGN_BITS), freeBlocks->pageCount);
 		}
-		current->startPage = page;
-		current->pageCount -= delta;
-	}
-
-	// ensure that the pages to be freed are aligned with the end of the current block
-	if (current->pageCount != count) {
-		size_t delta = current->pageCount - count;
-		if (next && ((oldFlagsN & 1) == (current->flags & 1))) {
-			DBG_FREE("  shift after (delta %d)", delta);
-			next->startPage -= delta;
-			next->pageCount += delta;
-		} else {
-			DBG_FREE("  split end of %d, %d (delta %d)", current->startPage, current->pageCount, delta);
-			memory_block_t *newBlock = dequeuedBlock2;
-			dequeuedBlock2 = NULL;
-			newBlock->pageCount = delta;
-			newBlock->startPage = current->startPage + count;
-			newBlock->next = next;
-			newBlock->flags = current->flags;
-			current->next = newBlock;
-			if (next)
-				next->flags = oldFlagsN;
-			next = newBlock;
-			oldFlagsN = oldFlagsC;
-		}
-		current->pageCount -= delta;
-	}
-
-	if (previous) DBG_FREE("  previous: %d, %d", previous->startPage, previous->pageCount);
-	DBG_FREE("  current: %d, %d", current->startPage, current->pageCount);
-	if (next) DBG_FREE("  next: %d, %d", next->startPage, next->pageCount);
-
-	// clear the allocated flag
-	current->flags &= ~(1);
-
-	// try to coalesce with previous block and release previous block
-	if (previous) {
-		if ((previous->flags & 1) == (current->flags & 1)) {
-			previous->pageCount += current->pageCount;
-			previous->next = current->next;
-			mem_enqueue_unused_block(current);
-			current = previous;
-		} else {
-			previous->flags = oldFlagsP;
-		}
-	} else {
-		firstMemoryBlock = firstMemoryBlockTemp;
-	}
-
-	// try to coalesce with next block and release next block
-	if (next) {
-		if ((next->flags & 1) == (current->flags & 1)) {
-			current->pageCount += next->pageCount;
-			current->next = next->next;
-			mem_enqueue_unused_block(next);
-		} else {
-			next->flags = oldFlagsN;
-		}
-	}
 
-	// release current block
-	current->flags &= ~(2);
-
-
-	// recycle blocks that were dequeued but not used
-	if (dequeuedBlock1)
-		mem_enqueue_unused_block(dequeuedBlock1);
-	if (dequeuedBlock2)
-		mem_enqueue_unused_block(dequeuedBlock2);
-
-
-
-
-
-
-
-
-
-
-
-	/*
-
-	memmgr_enter_routine();
-
-	memory_block_t *currentBlock = firstMemoryBlock;
-	while (currentBlock->nextBlock) {
-		if (currentBlock->nextBlock->startPage > ((uintptr_t)address >> PAGE_ALIGN_BITS)) break;
-		currentBlock = currentBlock->nextBlock;
-	}
-
-	// the pages to be freed are somewhere in currentBlock
-
-	if (currentBlock->startPage + currentBlock->pageCount == ((uintptr_t)address >> PAGE_ALIGN_BITS) + count) {
-
-		// case 1: the pages to be freed are at the end of currentBlock or equal
-		memory_block_insert_after(currentBlock, 0);
-
-		currentBlock->nextBlock->pageCount += count;
-		currentBlock->nextBlock->startPage -= count;
-		currentBlock->pageCount -= count;
-
-	} else {
-
-		// case 2: the pages to be freed are somewhere in the middle of currentBlock
-		memory_block_split(currentBlock, (uintptr_t)address);
-
-		// case 3: the pages to be freed are at the beginning of currentBlock
-		memory_block_insert_before(currentBlock, 0);
-
-		currentBlock->previousBlock->pageCount += count;
-		currentBlock->pageCount -= count;
-		currentBlock->startPage += count;
-	}
-
-	memmgr_exit_routine();*/
-}
-
-
-// Removes or coaleces blocks whenever possible. (NO)
-// Limits the size of the list of unused blocks.
-// This should only be called while the heap is in a consistent state.
-void phy_cleanup(void) {
-	memory_block_t *blocks[UNUSED_BLOCKS_MAX];
-	memory_block_t *block;
-	size_t i = 0;
-
-	// unqueue all blocks and keep some
-	while ((block = mem_dequeue_unused_block(0))) {
-		if (i < UNUSED_BLOCKS_MAX)
-			blocks[i++] = block;
-		else
-			free(block);
+		memory_region_t *obsoleteBlock = freeBlocks;
+		freeBlocks = freeBlocks->next;
+		free(obsoleteBlock);
 	}
 
-	// enqueue the blocks we kept
-	while (i--)
-		mem_enqueue_unused_block(blocks[i]);
-
-
-	/*
-	for (memory_block_t *currentBlock = firstMemoryBlock->nextBlock; currentBlock; currentBlock = currentBlock->nextBlock) {
-		if (currentBlock->pageCount && (currentBlock->allocated != currentBlock->previousBlock->allocated))
-			continue;
-		currentBlock->previousBlock->nextBlock = currentBlock->nextBlock;
-		if (currentBlock->nextBlock)
-			currentBlock->nextBlock->previousBlock = currentBlock->previousBlock;
-		free(currentBlock);
-	}
-	*/
+	// step 4:
+	// now that the amount of memory is known (and malloc can get more memory), the lookup table gets its final size
+	phy_resize_table();
 }
-
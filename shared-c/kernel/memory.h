@@ -9,5 +9,9 @@ void phy_page_init(void);
 void *phy_page_alloc(size_t count);
 void phy_page_free(void *address, size_t count);
 void phy_cleanup(void);
+size_t phy_get_free_page_count(void);
+#ifdef USING_BENCHMARK
+void phy_benchmark(int count);
+#endif
 
 #endif // __MEMORY_H__
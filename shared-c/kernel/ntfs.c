@@ -21,8 +21,14 @@
 #define DBG_INDEX(...)
 
 
-#define MFT_CACHE_SIZE					(32)
-#define MFT_CACHE_SIZE_MASK				(0x1FUL)
+// the size of the MFT record cache can be configured in config.h
+#ifndef MFT_CACHE_SET_BITS
+#define MFT_CACHE_SET_BITS				(3)		// the MFT cache has 2^MFT_CACHE_SET_BITS sets...
+#endif
+#define MFT_CACHE_SETS					(1 << MFT_CACHE_SET_BITS)
+#ifndef MFT_CACHE_WAYS
+#define MFT_CACHE_WAYS					(4)		// ...of MFT_CACHE_WAYS records each
+#endif
 #define INDEX_BUFFER_CACHE_SIZE			(32)
 #define INDEX_BUFFER_CACHE_SIZE_MASK	(0x1FUL)
 
@@ -133,11 +139,28 @@ typedef struct __attribute__((__packed__)) {
 
 
 
+// A contiguous run of clusters of a non-resident attribute
+typedef struct
+{
+	uint64_t vcn;					// the first virtual cluster number (relative to the attribute) of this extent
+	int64_t lcn;					// the first logical cluster number (relative to the volume) or -1 for sparse extents
+	uint64_t length;				// the number of clusters in this extent
+} ntfs_extent_t;
+
+// The decoded runlist of a non-resident attribute, sorted by VCN
+typedef struct
+{
+	uint64_t count;					// the number of extents
+	ntfs_extent_t extents[];
+} ntfs_extent_map_t;
+
+
 typedef struct
 {
 	ntfs_index_root_t *root;		// content of the index root attribute (resides in the owner's file record)
 	char *bitmap;					// the index bitmap (only valid if the index root has children)
 	ntfs_attribute_t *allocation;	// the index allocation attribute
+	ntfs_extent_map_t *allocationExtents;	// the decoded runlist of the index allocation (NULL until first used)
 	uint64_t allocatedBuffers;		// the number of allocated buffers
 	ntfs_index_buffer_t *cache[INDEX_BUFFER_CACHE_SIZE];	// a cache for the index buffers
 } ntfs_index_tree_t;
@@ -149,7 +172,9 @@ typedef struct
 	uint64_t references;			// the number of times this structure is used
 	ntfs_file_record_t *record;		// a buffer that holds the MFT segment for this file (always valid if the file is opened)
 	ntfs_attribute_t *data;			// pointer to the data attribute (NULL for directories) (don't free, resides in the record)
+	ntfs_extent_map_t *dataExtents;	// the decoded runlist of the data attribute (NULL until first used or if the attribute is resident)
 	ntfs_index_tree_t *i30;			// $I30 index of the directory (NULL for files)
+	int cached;						// set while this structure is in the MFT cache
 } ntfs_file_t;
 
 
@@ -162,9 +187,12 @@ typedef struct
 	uint64_t bytesPerMftSegment;
 	uint64_t bytesPerIndexBuffer;
 
-	ntfs_file_t *cache[MFT_CACHE_SIZE];	// stores the MFT records of up to 32 files that were recently used
+	ntfs_file_t *cache[MFT_CACHE_SETS][MFT_CACHE_WAYS];	// stores the MFT records of files that were recently used, each set is ordered from most to least recently used
+	uint64_t cacheHits;					// number of ntfs_open calls that found the MFT record in cache
+	uint64_t cacheMisses;				// number of ntfs_open calls that had to load the MFT record from disk
 	ntfs_file_record_t *mftSegment0;	// MFT segment 0 (defines the MFT file itself)
 	ntfs_attribute_t *mftData;			// data attribute of MFT segment 0
+	ntfs_extent_map_t *mftExtents;		// the decoded runlist of the MFT data attribute
 } ntfs_t;
 
 
@@ -192,41 +220,103 @@ unicode_t directoryIndexName = UNICODE("$I30");
 
 
 
-// Loads the dataruns defined by a runlist.
-//	currentCluster: the starting cluster
-//	dataruns: a pointer to the runlist
-//	offset: an offset into the data defined by the runlist
-//	count: the number of bytes to load
-status_t ntfs_load_dataruns(ntfs_t *ntfs, int64_t currentCluster, char *dataruns, uint64_t offset, uint64_t count, char *buffer) {
-	status_t status;
+// Decodes the runlist of a non-resident attribute into an extent map.
+// In case the call succeeds, the map must be freed at some point.
+status_t ntfs_decode_dataruns(ntfs_attribute_t *attribute, ntfs_extent_map_t **mapPtr) {
+	*mapPtr = NULL;
+	char *runlist = ((char *)attribute) + attribute->extendedHeader.nonResidentHeader.runlistOffset;
+	char *runlistEnd = ((char *)attribute) + attribute->length;
+
+	// count the runs to determine the size of the map
+	uint64_t count = 0;
+	for (char *dataruns = runlist; dataruns < runlistEnd && *dataruns; dataruns += 1 + (*dataruns & 0xF) + ((*dataruns >> 4) & 0xF))
+		count++;
+
+	ntfs_extent_map_t *map = (ntfs_extent_map_t *)malloc(sizeof(ntfs_extent_map_t) + count * sizeof(ntfs_extent_t));
+	if (!map)
+		return STATUS_OUT_OF_MEMORY;
+	map->count = count;
+
+	uint64_t currentVcn = attribute->extendedHeader.nonResidentHeader.startCluster;
+	int64_t currentLcn = 0;
+	char *dataruns = runlist;
 
-	while (*dataruns && count) {
+	for (uint64_t run = 0; run < count; run++) {
 		uint8_t offsetBytes = (*dataruns >> 4) & 0xF;
 		uint8_t countBytes = *dataruns & 0xF;
 		dataruns++;
 
+		if (dataruns + countBytes + offsetBytes > runlistEnd || countBytes > 8 || offsetBytes > 8)
+			return free(map), STATUS_DATA_CORRUPT;
+
 		// load unsigned length field
 		uint64_t clusterCount = 0;
 		for (int i = 0; i < countBytes; i++)
-			clusterCount |= ((*(dataruns++) & 0xFF) << (8 * i));
+			clusterCount |= ((uint64_t)(*(dataruns++) & 0xFF) << (8 * i));
+
+		// load signed offset field (relative to the previous run, absent for sparse runs)
+		if (offsetBytes) {
+			uint64_t clusterOffset = 0;
+			for (int i = 0; i < offsetBytes; i++)
+				clusterOffset |= ((uint64_t)(*(dataruns++) & 0xFF) << (8 * i));
+			int offsetShift = 64 - 8 * offsetBytes;
+			currentLcn += ((int64_t)(clusterOffset << offsetShift) >> offsetShift);
+		}
 
-		// load signed offset field
-		int64_t clusterOffset = 0;
-		for (int i = 0; i < offsetBytes; i++)
-			clusterOffset |= ((*(dataruns++) & 0xFF) << (8 * i));
-		int offsetShift = 64 - 8 * offsetBytes;
-		currentCluster += ((clusterOffset << offsetShift) >> offsetShift);
+		map->extents[run] = (ntfs_extent_t) { .vcn = currentVcn, .lcn = (offsetBytes ? currentLcn : -1), .length = clusterCount };
+		currentVcn += clusterCount;
+	}
 
-		if (offset >= clusterCount * ntfs->bytesPerCluster) {
-			offset -= clusterCount * ntfs->bytesPerCluster;
-			continue;
-		}
+	*mapPtr = map;
+	return STATUS_SUCCESS;
+}
+
+
+// Returns the index of the extent that contains the specified VCN.
+// Returns map->count if the VCN is not covered by the map.
+uint64_t ntfs_find_extent(ntfs_extent_map_t *map, uint64_t vcn) {
+	uint64_t lower = 0, upper = map->count;
 
-		// load from current datarun
-		uint64_t effectiveCount = min(count, clusterCount * ntfs->bytesPerCluster - offset);
-		if ((status = volume_read(ntfs->volume, currentCluster * ntfs->bytesPerCluster + offset, effectiveCount, buffer)))
+	// find the last extent that starts at or before the VCN
+	while (upper - lower > 1) {
+		uint64_t middle = lower + ((upper - lower) >> 1);
+		if (map->extents[middle].vcn <= vcn)
+			lower = middle;
+		else
+			upper = middle;
+	}
+
+	if (lower >= map->count || vcn < map->extents[lower].vcn || vcn - map->extents[lower].vcn >= map->extents[lower].length)
+		return map->count;
+	return lower;
+}
+
+
+// Loads data that is described by an extent map.
+//	map: the decoded runlist
+//	offset: an offset into the data defined by the runlist
+//	count: the number of bytes to load
+status_t ntfs_load_extents(ntfs_t *ntfs, ntfs_extent_map_t *map, uint64_t offset, uint64_t count, char *buffer) {
+	status_t status;
+	if (!count)
+		return STATUS_SUCCESS;
+
+	uint64_t index = ntfs_find_extent(map, offset / ntfs->bytesPerCluster);
+
+	for (; count; index++) {
+		if (index >= map->count)
+			return STATUS_DATA_CORRUPT; // the runlist doesn't cover the requested range
+
+		ntfs_extent_t *extent = &map->extents[index];
+		uint64_t extentOffset = offset - extent->vcn * ntfs->bytesPerCluster;
+		uint64_t effectiveCount = min(count, extent->length * ntfs->bytesPerCluster - extentOffset);
+
+		if (extent->lcn < 0)
+			memset(buffer, 0, effectiveCount);
+		else if ((status = volume_read(ntfs->volume, extent->lcn * ntfs->bytesPerCluster + extentOffset, effectiveCount, buffer)))
 			return status;
-		offset = 0;
+
+		offset += effectiveCount;
 		count -= effectiveCount;
 		buffer += effectiveCount;
 	}
@@ -270,19 +360,34 @@ uint64_t ntfs_get_attribute_size(ntfs_attribute_t *attribute) {
 
 
 // Loads part of an attribute from the volume into a buffer.
-//	type: the attribute type
-//	name: the name of the attribute (NULL: don't care)
+//	attribute: the attribute header
+//	extentsPtr: where the decoded runlist of a non-resident attribute is cached.
+//		If it points to NULL, the runlist is decoded and stored there (must be freed along with the attribute).
+//		If extentsPtr is NULL, the runlist is decoded for this call only.
 //	offset: the offset into the attribute
 //	count: the number of bytes to read
 //	buffer: the buffer (of sufficient size) into which the bytes should be loaded
-status_t ntfs_load_attribute(ntfs_t *ntfs, ntfs_attribute_t *attribute, uint64_t offset, uint64_t count, char *buffer) {
+status_t ntfs_load_attribute(ntfs_t *ntfs, ntfs_attribute_t *attribute, ntfs_extent_map_t **extentsPtr, uint64_t offset, uint64_t count, char *buffer) {
+	status_t status;
 	if (attribute->compressed) // can't read compressed, encrypted or sparse attributes
 		return STATUS_NOT_IMPLEMENTED;
 
 	if (attribute->nonResident) {
 		if (offset + count > attribute->extendedHeader.nonResidentHeader.realSize)
 			return STATUS_OUT_OF_RANGE;
-		return ntfs_load_dataruns(ntfs, attribute->extendedHeader.nonResidentHeader.startCluster, ((char *)attribute) + attribute->extendedHeader.nonResidentHeader.runlistOffset, offset, count, buffer);
+
+		if (!extentsPtr) {
+			ntfs_extent_map_t *extents;
+			if ((status = ntfs_decode_dataruns(attribute, &extents)))
+				return status;
+			status = ntfs_load_extents(ntfs, extents, offset, count, buffer);
+			return free(extents), status;
+		}
+
+		if (!*extentsPtr)
+			if ((status = ntfs_decode_dataruns(attribute, extentsPtr)))
+				return status;
+		return ntfs_load_extents(ntfs, *extentsPtr, offset, count, buffer);
 	} else {
 		if (offset + count > attribute->extendedHeader.residentHeader.length)
 			return STATUS_OUT_OF_RANGE;
@@ -344,7 +449,7 @@ status_t ntfs_load_index(ntfs_t *ntfs, ntfs_file_t *file, unicode_t *name, ntfs_
 		tree->bitmap = (char *)malloc(bitmapSize);
 		if (!tree->bitmap)
 			return free(tree), STATUS_OUT_OF_MEMORY;
-		if ((status = ntfs_load_attribute(ntfs, bitmapAttr, 0, bitmapSize, tree->bitmap)))
+		if ((status = ntfs_load_attribute(ntfs, bitmapAttr, NULL, 0, bitmapSize, tree->bitmap)))
 			return free(tree->bitmap), free(tree), status;
 	} else {
 		tree->allocatedBuffers = 0;
@@ -366,6 +471,8 @@ void ntfs_index_tree_free(ntfs_index_tree_t *tree) {
 	}
 	if (tree->bitmap)
 		free(tree->bitmap);
+	if (tree->allocationExtents)
+		free(tree->allocationExtents);
 	free(tree);
 	debug(0x40, (uint64_t)tree);
 }
@@ -403,7 +510,7 @@ status_t ntfs_load_index_buffer(ntfs_t *ntfs, ntfs_index_tree_t *tree, uint64_t
 		buffer = (ntfs_index_buffer_t *)malloc(tree->root->bufferSize);
 		if (!buffer)
 			return STATUS_OUT_OF_MEMORY;
-		if ((status = ntfs_load_attribute(ntfs, tree->allocation, *number * tree->root->bufferSize, tree->root->bufferSize, (char *)buffer)))
+		if ((status = ntfs_load_attribute(ntfs, tree->allocation, &(tree->allocationExtents), *number * tree->root->bufferSize, tree->root->bufferSize, (char *)buffer)))
 			return free(buffer), status;
 		if ((status = ntfs_fixup(ntfs, &(buffer->header), *(uint32_t *)"INDX")))
 			return free(buffer), status;
@@ -420,6 +527,8 @@ status_t ntfs_load_index_buffer(ntfs_t *ntfs, ntfs_index_tree_t *tree, uint64_t
 void ntfs_file_free(ntfs_file_t *file) {
 	if (file->record)
 		free(file->record);
+	if (file->dataExtents)
+		free(file->dataExtents);
 	if (file->i30)
 		ntfs_index_tree_free(file->i30);
 	free(file);
@@ -428,23 +537,38 @@ void ntfs_file_free(ntfs_file_t *file) {
 
 // Loads a file record (and index buffer in case it is a directory),
 // stores it in cache and keeps track of how often it was opened.
+// The cache is set-associative with LRU replacement within each set. Records that are
+// currently open are never evicted. If all records of a set are open, the newly loaded
+// record bypasses the cache and is freed when it is closed.
 status_t ntfs_open(ntfs_t *ntfs, uint64_t reference, ntfs_file_t **filePtr) {
 	status_t status;
 	*filePtr = NULL;
 	uint64_t segment = reference & 0xFFFFFFFFFFFFUL;
 	uint16_t sequenceNumber = reference >> 48;
 
-	ntfs_file_t *file = ntfs->cache[segment & MFT_CACHE_SIZE_MASK];
+	ntfs_file_t **set = ntfs->cache[segment & (MFT_CACHE_SETS - 1)];
+	ntfs_file_t *file = NULL;
+	int way;
 
-	// if the cache location is occupied by another file, it is evicted.
-	if (file) if (file->segment != segment) {
-		if (!file->references)
-			ntfs_file_free(file);
-		ntfs->cache[segment & MFT_CACHE_SIZE_MASK] = file = NULL;
+	// look up the file in its cache set
+	for (way = 0; way < MFT_CACHE_WAYS; way++) {
+		if (set[way] && set[way]->segment == segment) {
+			file = set[way];
+			break;
+		}
 	}
 
-	// load the file from disk if necessary and store in cache
-	if (!file) {
+	if (file) {
+		ntfs->cacheHits++;
+
+		// move the file to the front of the set (most recently used)
+		for (; way; way--)
+			set[way] = set[way - 1];
+		set[0] = file;
+	} else {
+		ntfs->cacheMisses++;
+
+		// load the file from disk
 		file = (ntfs_file_t *)calloc(sizeof(ntfs_file_t), 1);
 		if (!file)
 			return STATUS_OUT_OF_MEMORY;
@@ -454,11 +578,9 @@ status_t ntfs_open(ntfs_t *ntfs, uint64_t reference, ntfs_file_t **filePtr) {
 
 		// load MFT record
 		file->record = (ntfs_file_record_t *)malloc(ntfs->bytesPerMftSegment);
-		if ((status = ntfs_load_dataruns(ntfs,
-			ntfs->mftData->extendedHeader.nonResidentHeader.startCluster,
-			((char *)ntfs->mftData) + ntfs->mftData->extendedHeader.nonResidentHeader.runlistOffset, segment * ntfs->bytesPerMftSegment,
-			ntfs->bytesPerMftSegment,
-			(char *)(file->record))))
+		if (!file->record)
+			return ntfs_file_free(file), STATUS_OUT_OF_MEMORY;
+		if ((status = ntfs_load_extents(ntfs, ntfs->mftExtents, segment * ntfs->bytesPerMftSegment, ntfs->bytesPerMftSegment, (char *)(file->record))))
 			return ntfs_file_free(file), status;
 		if ((status = ntfs_fixup(ntfs, &(file->record->header), *(uint32_t *)"FILE")))
 			return ntfs_file_free(file), status;
@@ -478,8 +600,20 @@ status_t ntfs_open(ntfs_t *ntfs, uint64_t reference, ntfs_file_t **filePtr) {
 				return ntfs_file_free(file), STATUS_DATA_CORRUPT;
 		}
 
-
-		ntfs->cache[segment & MFT_CACHE_SIZE_MASK] = file;
+		// find the least recently used slot that is empty or holds a file that is not open
+		for (way = MFT_CACHE_WAYS - 1; way >= 0; way--)
+			if (!set[way] || !set[way]->references)
+				break;
+
+		// evict that file and insert the new one at the front of the set
+		if (way >= 0) {
+			if (set[way])
+				ntfs_file_free(set[way]);
+			for (; way; way--)
+				set[way] = set[way - 1];
+			set[0] = file;
+			file->cached = 1;
+		}
 	}
 
 	file->references++;
@@ -490,16 +624,28 @@ status_t ntfs_open(ntfs_t *ntfs, uint64_t reference, ntfs_file_t **filePtr) {
 
 
 // Releases the resources associated with an open file. The memory is freed
-// if the last reference to the file is closed and it was evicted from cache.
+// if the last reference to the file is closed and it is not in cache.
 status_t ntfs_close(ntfs_t *ntfs, ntfs_file_t *file) {
 	DBG_FILE("close file at %x64 ", (uint64_t)file);
 	if (!--(file->references))
-		if (file != ntfs->cache[file->segment & MFT_CACHE_SIZE_MASK])
+		if (!file->cached)
 			ntfs_file_free(file);
 	return STATUS_SUCCESS;
 }
 
 
+// Returns the hit and miss counters of the MFT record cache of an NTFS volume.
+// Returns STATUS_INCOMPATIBLE if the file system is not NTFS.
+status_t ntfs_get_cache_statistics(fs_t *fs, uint64_t *hits, uint64_t *misses) {
+	if (fs->open != (file_open_proc_t)ntfs_open)
+		return STATUS_INCOMPATIBLE;
+	ntfs_t *ntfs = (ntfs_t *)(fs->context);
+	*hits = ntfs->cacheHits;
+	*misses = ntfs->cacheMisses;
+	return STATUS_SUCCESS;
+}
+
+
 // Returns the name of the file or directory.
 // The buffer returned in the unicode string must be freed.
 status_t ntfs_get_name(ntfs_t *ntfs, ntfs_file_t *file, unicode_t *name) {
@@ -514,7 +660,7 @@ status_t ntfs_get_name(ntfs_t *ntfs, ntfs_file_t *file, unicode_t *name) {
 	ntfs_file_name_t *fileName = (ntfs_file_name_t *)malloc(fileNameSize);
 	if (!fileName)
 		return STATUS_OUT_OF_MEMORY;
-	if ((status = ntfs_load_attribute(ntfs, attribute, 0, fileNameSize, (char *)fileName)))
+	if ((status = ntfs_load_attribute(ntfs, attribute, NULL, 0, fileNameSize, (char *)fileName)))
 		return free(fileName), status;
 
 	// copy file name
@@ -587,7 +733,7 @@ status_t ntfs_get_child(ntfs_t *ntfs, ntfs_file_t *dir, unicode_t *name, uint64_
 
 // Loads the specified portion of the file's data attribute.
 status_t ntfs_read(ntfs_t *ntfs, ntfs_file_t *file, uint64_t offset, uint64_t count, char *buffer) {
-	return ntfs_load_attribute(ntfs, file->data, offset, count, buffer);
+	return ntfs_load_attribute(ntfs, file->data, &(file->dataExtents), offset, count, buffer);
 }
 
 
@@ -651,21 +797,23 @@ status_t ntfs_init(volume_t *volume, char *vbr, fs_t **fsPtr, uint64_t *rootRefe
 	if ((status = ntfs_fixup(ntfs, &(ntfs->mftSegment0->header), *(uint32_t *)"FILE")))
 		return free(ntfs->mftSegment0), free(fs), status;
 	ntfs->mftData = ntfs_find_attribute(ntfs->mftSegment0, NTFS_ATTRIBUTE_TYPE_DATA, NULL);
-	if (!ntfs->mftData)
+	if (!ntfs->mftData || !ntfs->mftData->nonResident)
 		return free(ntfs->mftSegment0), free(fs), STATUS_DATA_CORRUPT;
+	if ((status = ntfs_decode_dataruns(ntfs->mftData, &(ntfs->mftExtents))))
+		return free(ntfs->mftSegment0), free(fs), status;
 
 	// load unicode uppercase mapping (for file name comparision)
 	// todo: load only if not already set up
 	ntfs_file_t *upcase;
 	wchar_t *mapping = (wchar_t *)malloc(1 << 17);
 	if (!mapping)
-		return free(ntfs->mftSegment0), free(fs), STATUS_OUT_OF_MEMORY;
+		return free(ntfs->mftExtents), free(ntfs->mftSegment0), free(fs), STATUS_OUT_OF_MEMORY;
 	if ((status = ntfs_open(ntfs, 0xA, &upcase))) // $UpCase is always at 0xA
-		return free(ntfs->mftSegment0), free(fs), free(mapping), status;
+		return free(ntfs->mftExtents), free(ntfs->mftSegment0), free(fs), free(mapping), status;
 	status = ntfs_read(ntfs, upcase, 0, (1 << 17), (char *)mapping);
 	ntfs_close(ntfs, upcase);
 	if (status)
-		return free(ntfs->mftSegment0), free(fs), free(mapping), status;
+		return free(ntfs->mftExtents), free(ntfs->mftSegment0), free(fs), free(mapping), status;
 	unicode_set_uppercase(mapping);
 
 	//directoryIndexName = UNICODE("$I30");
@@ -676,6 +824,104 @@ status_t ntfs_init(volume_t *volume, char *vbr, fs_t **fsPtr, uint64_t *rootRefe
 }
 
 
+#ifdef USING_BENCHMARK
+
+// Returns the LCN of the specified VCN by parsing the runlist from the start, as reads did before extent maps existed.
+// Returns -1 if the VCN is not covered by the runlist.
+static int64_t ntfs_lookup_benchmark_parse(ntfs_attribute_t *attribute, uint64_t vcn) {
+	char *dataruns = ((char *)attribute) + attribute->extendedHeader.nonResidentHeader.runlistOffset;
+	uint64_t currentVcn = attribute->extendedHeader.nonResidentHeader.startCluster;
+	int64_t currentLcn = 0;
+
+	while (*dataruns) {
+		uint8_t offsetBytes = (*dataruns >> 4) & 0xF;
+		uint8_t countBytes = *dataruns & 0xF;
+		dataruns++;
+
+		uint64_t clusterCount = 0;
+		for (int i = 0; i < countBytes; i++)
+			clusterCount |= ((uint64_t)(*(dataruns++) & 0xFF) << (8 * i));
+		uint64_t clusterOffset = 0;
+		for (int i = 0; i < offsetBytes; i++)
+			clusterOffset |= ((uint64_t)(*(dataruns++) & 0xFF) << (8 * i));
+		int offsetShift = 64 - 8 * offsetBytes;
+		currentLcn += ((int64_t)(clusterOffset << offsetShift) >> offsetShift);
+
+		if (vcn - currentVcn < clusterCount)
+			return currentLcn + (vcn - currentVcn);
+		currentVcn += clusterCount;
+	}
+
+	return -1;
+}
+
+
+// Compares finding the LCN of a VCN by parsing the runlist (as every read did before) with a lookup in the extent map.
+// Only the lookup is measured, not reading a file: the attribute is synthetic and has the specified number of runs
+// of 1 to 16 clusters each, which jump back and forth like those of a fragmented file. The same number of lookups
+// is spread evenly over the attribute.
+void ntfs_lookup_benchmark(int runs) {
+	benchmark_t bench;
+	benchmark_init(&bench, "ntfs lookup");
+	// each run has a 1 byte length and a 3 byte offset field
+	size_t runlistLength = 5 * (size_t)runs + 1;
+	ntfs_attribute_t *attribute = (ntfs_attribute_t *)malloc(sizeof(ntfs_attribute_t) + runlistLength);
+	if (!attribute) {
+		LOGE("ntfs lookup benchmark: out of memory");
+		return;
+	}
+
+	memset(attribute, 0, sizeof(ntfs_attribute_t));
+	attribute->length = sizeof(ntfs_attribute_t) + runlistLength;
+	attribute->nonResident = 1;
+	attribute->extendedHeader.nonResidentHeader.runlistOffset = sizeof(ntfs_attribute_t);
+
+	// the runs jump back and forth on the volume, as they do in a fragmented file
+	uint8_t *dataruns = (uint8_t *)attribute + sizeof(ntfs_attribute_t);
+	uint64_t clusters = 0;
+	for (int i = 0; i < runs; i++) {
+		uint32_t random = benchmark_random(&bench);
+		uint8_t clusterCount = 1 + ((random >> 8) & 0xF);
+		int32_t clusterOffset = (i ? (int32_t)((random >> 12) & 0xFFFF) - 0x7FFF : 0x400000);
+		*dataruns++ = 0x31;
+		*dataruns++ = clusterCount;
+		for (int j = 0; j < 3; j++)
+			*dataruns++ = (uint32_t)clusterOffset >> (8 * j);
+		clusters += clusterCount;
+	}
+	*dataruns = 0;
+
+	int64_t sums[2] = { 0, 0 };
+	for (int pass = 0; pass < 2; pass++) {
+		ntfs_extent_map_t *map = NULL;
+
+		benchmark_start(&bench);
+		if (pass && ntfs_decode_dataruns(attribute, &map)) {
+			LOGE("ntfs lookup benchmark: could not decode the runlist");
+			break;
+		}
+		for (int i = 0; i < runs; i++) {
+			uint64_t vcn = clusters * i / runs;
+			if (pass) {
+				ntfs_extent_t *extent = &map->extents[ntfs_find_extent(map, vcn)];
+				sums[pass] += extent->lcn + (vcn - extent->vcn);
+			} else {
+				sums[pass] += ntfs_lookup_benchmark_parse(attribute, vcn);
+			}
+		}
+		benchmark_stop(&bench, (pass ? "extent map" : "runlist"), runs, "lookup");
+		free(map);
+	}
+
+	if (sums[0] != sums[1])
+		LOGE("ntfs lookup benchmark: the runlist and the extent map returned different clusters");
+	free(attribute);
+}
+
+#endif // USING_BENCHMARK
+
+
+
 driver_t ntfsDriver = { .initProc = (status_t(*)(void))ntfs_init };
 
 // Registers the NTFS driver. Subsequent calls to fs_init will be able to initialize volumes that are NTFS formatted.
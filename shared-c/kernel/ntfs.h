@@ -10,5 +10,9 @@
 #define __NTFS_H__
 
 void ntfs_register(void);
+status_t ntfs_get_cache_statistics(fs_t *fs, uint64_t *hits, uint64_t *misses);
+#ifdef USING_BENCHMARK
+void ntfs_lookup_benchmark(int runs);
+#endif
 
 #endif
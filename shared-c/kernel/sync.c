@@ -0,0 +1,405 @@
+
+/*
+*
+* Provides blocking synchronization objects for threads: mutexes, counting semaphores and condition variables.
+* Each object has a FIFO queue of waiting threads. A waiting thread is suspended and is resumed by the thread that
+* removes it from the queue. Mutexes and semaphores are handed over directly to the first waiting thread, so
+* waiters are served in the order in which they arrived.
+* A thread that holds a mutex inherits the priority of the threads that wait for it, so that a thread with a
+* low priority can't hold up a thread with a high priority for long (priority inheritance).
+* Interrupts are only disabled while a wait queue is modified, never for the duration of a critical section.
+*
+* created: 16.10.26
+*
+*/
+
+#include <system.h>
+#include "sync.h"
+
+#ifdef USING_THREADING
+
+
+#define MUTEX_UNLOCKED		(0)
+#define MUTEX_LOCKED		(1)	// locked, no thread is waiting
+#define MUTEX_CONTENDED		(2)	// locked, threads may be waiting
+
+// Maximum number of times a thread polls a mutex before it blocks. A thread only spins while the owner of the
+// mutex is running on another processor, as only then the mutex is likely to be released soon.
+#define MUTEX_SPIN_LIMIT	(1000)
+
+// Maximum length of a chain of threads that wait for each other's mutexes, along which a priority is inherited
+#define MUTEX_INHERIT_DEPTH	(8)
+
+// Protects the priority inheritance state, i.e. the waiterPriority of all mutexes and the blockedOn field of all threads.
+// It is only taken when a mutex is contended.
+volatile int inheritLock = 0;
+
+
+
+// Appends an entry to a wait queue. The lock of the queue must be held.
+static void wait_queue_push(wait_queue_t *queue, wait_entry_t *entry) {
+	entry->next = NULL;
+	if (queue->tail)
+		queue->tail->next = entry;
+	else
+		queue->head = entry;
+	queue->tail = entry;
+}
+
+
+// Removes the first entry from a wait queue and resumes its thread.
+// The lock of the queue must be held and interrupts must be disabled.
+// Returns the thread that was woken up or NULL if the queue was empty.
+static thread_t *wait_queue_wake(wait_queue_t *queue) {
+	wait_entry_t *entry = queue->head;
+	if (!entry)
+		return NULL;
+
+	queue->head = entry->next;
+	if (!queue->head)
+		queue->tail = NULL;
+
+	// the entry may disappear as soon as the waiting thread sees the flag
+	thread_t *thread = entry->thread;
+	__sync_synchronize();
+	entry->woken = 1;
+	thread_resume(thread);
+	return thread;
+}
+
+
+// Suspends the calling thread until its entry was removed from the wait queue.
+// As the flag is checked and set while holding the lock of the queue, no wake up can be missed.
+static void wait_queue_block(wait_queue_t *queue, wait_entry_t *entry) {
+	while (!entry->woken) {
+		atomic() {
+			spin_lock(&queue->lock);
+			if (!entry->woken)
+				thread_suspend_prepare(THREAD_SUSPENDED, (uintptr_t)queue);
+			spin_unlock(&queue->lock);
+		}
+		if (!entry->woken)
+			thread_yield();
+	}
+}
+
+
+
+// Initializes a mutex in the unlocked state
+void mutex_init(mutex_t *mutex) {
+	*mutex = (mutex_t) { .state = MUTEX_UNLOCKED, .waiterPriority = -1 };
+}
+
+
+// Adds a mutex to the list of mutexes held by the calling thread
+static void mutex_add_held(mutex_t *mutex, thread_t *thread) {
+	mutex->nextHeld = thread->heldMutexes;
+	thread->heldMutexes = mutex;
+}
+
+
+// Acquires a mutex if it's available without blocking.
+// Returns 1 if the mutex was acquired.
+int mutex_try_lock(mutex_t *mutex) {
+	if (!__sync_bool_compare_and_swap(&mutex->state, MUTEX_UNLOCKED, MUTEX_LOCKED))
+		return 0;
+	thread_t *thread = thread_current();
+	mutex->owner = thread;
+	mutex_add_held(mutex, thread);
+	return 1;
+}
+
+
+// Lets the owner of a mutex inherit the specified priority. If the owner itself waits for a mutex,
+// the priority is passed on to the owner of that mutex and so on. The inheritance lock must be held.
+static void mutex_inherit(mutex_t *mutex, int priority) {
+	for (int depth = 0; mutex && depth < MUTEX_INHERIT_DEPTH; depth++) {
+		if (priority > mutex->waiterPriority)
+			mutex->waiterPriority = priority;
+
+		thread_t *owner = mutex->owner;
+		if (!owner || owner->priority >= priority)
+			break;
+		thread_inherit_priority(owner, priority);
+		mutex = owner->blockedOn;
+	}
+}
+
+
+// Acquires a mutex. If the mutex is held by another thread, the calling thread first spins for a short while
+// if the owner is running, and then blocks until the mutex is handed over to it.
+// Mutexes are not recursive.
+void mutex_lock(mutex_t *mutex) {
+	if (mutex_try_lock(mutex))
+		return;
+
+	for (int i = 0; i < MUTEX_SPIN_LIMIT; i++) {
+		thread_t *owner = mutex->owner;
+		if (owner && !thread_is_active(owner))
+			break;
+		if (mutex->state == MUTEX_UNLOCKED && mutex_try_lock(mutex))
+			return;
+		__builtin_ia32_pause();
+	}
+
+	thread_t *thread = thread_current();
+	wait_entry_t entry = { .thread = thread };
+	int acquired;
+
+	atomic() {
+		spin_lock(&inheritLock);
+		spin_lock(&mutex->waiters.lock);
+		acquired = (__sync_lock_test_and_set(&mutex->state, MUTEX_CONTENDED) == MUTEX_UNLOCKED);
+		if (!acquired)
+			wait_queue_push(&mutex->waiters, &entry);
+		spin_unlock(&mutex->waiters.lock);
+
+		if (!acquired) {
+			thread->blockedOn = mutex;
+			mutex_inherit(mutex, thread->priority);
+		}
+		spin_unlock(&inheritLock);
+	}
+
+	if (acquired)
+		mutex->owner = thread;
+	else
+		wait_queue_block(&mutex->waiters, &entry); // the owner was set by mutex_unlock
+	mutex_add_held(mutex, thread);
+}
+
+
+// Releases a mutex that is held by the calling thread.
+// If threads are waiting for the mutex, it is handed over to the first of them.
+void mutex_unlock(mutex_t *mutex) {
+	assert(mutex->state != MUTEX_UNLOCKED);
+
+	thread_t *thread = mutex->owner;
+	for (mutex_t * volatile *node = &thread->heldMutexes; *node; node = &(*node)->nextHeld) {
+		if (*node == mutex) {
+			*node = mutex->nextHeld;
+			break;
+		}
+	}
+
+	mutex->owner = NULL;
+	if (__sync_bool_compare_and_swap(&mutex->state, MUTEX_LOCKED, MUTEX_UNLOCKED))
+		return;
+
+	atomic() {
+		spin_lock(&inheritLock);
+		spin_lock(&mutex->waiters.lock);
+
+		wait_entry_t *first = mutex->waiters.head;
+		if (first) {
+			thread_t *newOwner = first->thread;
+			mutex->owner = newOwner;
+			mutex->state = (first->next ? MUTEX_CONTENDED : MUTEX_LOCKED);
+			newOwner->blockedOn = NULL;
+
+			// the new owner inherits the priority of the remaining waiters
+			mutex->waiterPriority = -1;
+			for (wait_entry_t *entry = first->next; entry; entry = entry->next)
+				if (entry->thread->priority > mutex->waiterPriority)
+					mutex->waiterPriority = entry->thread->priority;
+			if (mutex->waiterPriority > newOwner->inheritedPriority)
+				thread_inherit_priority(newOwner, mutex->waiterPriority);
+
+			wait_queue_wake(&mutex->waiters);
+		} else {
+			mutex->state = MUTEX_UNLOCKED;
+			mutex->waiterPriority = -1;
+		}
+		spin_unlock(&mutex->waiters.lock);
+
+		// the releasing thread keeps the priority inherited through the mutexes that it still holds
+		int inherited = -1;
+		for (mutex_t *held = thread->heldMutexes; held; held = held->nextHeld)
+			if (held->waiterPriority > inherited)
+				inherited = held->waiterPriority;
+		if (inherited != thread->inheritedPriority)
+			thread_inherit_priority(thread, inherited);
+
+		spin_unlock(&inheritLock);
+	}
+}
+
+
+
+// Initializes a semaphore with the specified count
+void semaphore_init(semaphore_t *semaphore, int count) {
+	*semaphore = (semaphore_t) { .count = count };
+}
+
+
+// Decrements the count of a semaphore if it is positive.
+// Returns 1 if the count was decremented.
+int semaphore_try_down(semaphore_t *semaphore) {
+	for (int count = semaphore->count; count > 0; count = semaphore->count)
+		if (__sync_bool_compare_and_swap(&semaphore->count, count, count - 1))
+			return 1;
+	return 0;
+}
+
+
+// Decrements the count of a semaphore. If the count is zero, the calling thread blocks until semaphore_up is called.
+void semaphore_down(semaphore_t *semaphore) {
+	if (semaphore_try_down(semaphore))
+		return;
+
+	wait_entry_t entry = { .thread = thread_current() };
+	int acquired;
+
+	atomic() {
+		spin_lock(&semaphore->waiters.lock);
+		acquired = semaphore_try_down(semaphore);
+		if (!acquired)
+			wait_queue_push(&semaphore->waiters, &entry);
+		spin_unlock(&semaphore->waiters.lock);
+	}
+
+	if (!acquired)
+		wait_queue_block(&semaphore->waiters, &entry);
+}
+
+
+// Increments the count of a semaphore or, if threads are waiting, wakes up the first of them instead.
+void semaphore_up(semaphore_t *semaphore) {
+	atomic() {
+		spin_lock(&semaphore->waiters.lock);
+		if (!wait_queue_wake(&semaphore->waiters))
+			__sync_fetch_and_add(&semaphore->count, 1);
+		spin_unlock(&semaphore->waiters.lock);
+	}
+}
+
+
+
+// Initializes a condition variable
+void condition_init(condition_t *condition) {
+	*condition = (condition_t) { .waiters = { 0 } };
+}
+
+
+// Releases the mutex, waits until the condition is signalled and reacquires the mutex.
+// As with any condition variable, the caller should check its condition again after this returns.
+void condition_wait(condition_t *condition, mutex_t *mutex) {
+	wait_entry_t entry = { .thread = thread_current() };
+
+	atomic() {
+		spin_lock(&condition->waiters.lock);
+		wait_queue_push(&condition->waiters, &entry);
+		spin_unlock(&condition->waiters.lock);
+	}
+
+	// a signal that arrives between these two calls is not lost, as the entry is already queued
+	mutex_unlock(mutex);
+	wait_queue_block(&condition->waiters, &entry);
+	mutex_lock(mutex);
+}
+
+
+// Wakes up the thread that waits the longest for the condition variable (if any)
+void condition_signal(condition_t *condition) {
+	atomic() {
+		spin_lock(&condition->waiters.lock);
+		wait_queue_wake(&condition->waiters);
+		spin_unlock(&condition->waiters.lock);
+	}
+}
+
+
+// Wakes up all threads that wait for the condition variable
+void condition_broadcast(condition_t *condition) {
+	atomic() {
+		spin_lock(&condition->waiters.lock);
+		while (wait_queue_wake(&condition->waiters));
+		spin_unlock(&condition->waiters.lock);
+	}
+}
+
+
+
+#ifdef USING_BENCHMARK
+
+#define SYNC_BENCHMARK_STACK_SIZE	(4 * PAGE_SIZE)
+
+typedef struct {
+	int useMutex;					// 0: spin lock with interrupts disabled, 1: mutex
+	int iterations;					// number of critical sections per thread
+	mutex_t mutex;
+	volatile int spinLock;
+	semaphore_t done;				// counts the threads that are done
+	volatile uint64_t counter;		// incremented inside the critical sections
+} sync_benchmark_t;
+
+
+static void sync_benchmark_thread(void *param) {
+	sync_benchmark_t *benchmark = param;
+
+	for (int i = 0; i < benchmark->iterations; i++) {
+		if (benchmark->useMutex) {
+			mutex_lock(&benchmark->mutex);
+			benchmark->counter++;
+			mutex_unlock(&benchmark->mutex);
+		} else {
+			atomic() {
+				spin_lock(&benchmark->spinLock);
+				benchmark->counter++;
+				spin_unlock(&benchmark->spinLock);
+			}
+		}
+	}
+
+	// threads can't terminate, so the thread stays suspended forever
+	semaphore_up(&benchmark->done);
+	for (;;)
+		thread_suspend();
+}
+
+
+// Measures the cost of a critical section that is contended by several threads, once protected by a
+// spin lock with interrupts disabled and once by a mutex. The results are written to the log.
+// The threads and their stacks are not freed, as threads can't be terminated.
+//	threadCount: the number of threads that compete for the lock
+//	iterations: the number of times each thread enters the critical section
+void sync_benchmark(int threadCount, int iterations) {
+	benchmark_t bench;
+	benchmark_init(&bench, "sync");
+	LOGI("sync benchmark: %d threads on %d processors", threadCount, (int)cpuCount);
+
+	for (int pass = 0; pass < 2; pass++) {
+		sync_benchmark_t *benchmark = malloc(sizeof(sync_benchmark_t));
+		thread_t *threads = malloc(threadCount * sizeof(thread_t));
+		char *stacks = malloc(threadCount * SYNC_BENCHMARK_STACK_SIZE);
+		if (!benchmark || !threads || !stacks) {
+			LOGE("sync benchmark: out of memory");
+			return;
+		}
+
+		benchmark->useMutex = pass;
+		benchmark->iterations = iterations;
+		benchmark->spinLock = 0;
+		benchmark->counter = 0;
+		mutex_init(&benchmark->mutex);
+		semaphore_init(&benchmark->done, 0);
+
+		for (int i = 0; i < threadCount; i++)
+			thread_init(&threads[i], sync_benchmark_thread, benchmark, (uintptr_t)(stacks + (i + 1) * SYNC_BENCHMARK_STACK_SIZE));
+
+		uint64_t expected = (uint64_t)threadCount * iterations;
+		benchmark_start(&bench);
+		for (int i = 0; i < threadCount; i++)
+			thread_resume(&threads[i]);
+		for (int i = 0; i < threadCount; i++)
+			semaphore_down(&benchmark->done);
+		benchmark_stop(&bench, (pass ? "mutex" : "spin lock"), expected, "critical section");
+
+		if (benchmark->counter != expected)
+			LOGE("sync benchmark: counter is %d, expected %d", (int)benchmark->counter, (int)expected);
+	}
+}
+
+#endif // USING_BENCHMARK
+
+#endif // USING_THREADING
@@ -0,0 +1,61 @@
+
+#ifndef __SYNC_H__
+#define __SYNC_H__
+
+#ifdef USING_THREADING
+
+
+// A thread that waits in a wait queue. The entry lives on the stack of the waiting thread.
+typedef struct wait_entry_t {
+	thread_t *thread;				// the waiting thread
+	struct wait_entry_t *next;		// the next thread in the queue
+	volatile int woken;				// set as soon as the thread is removed from the queue
+} wait_entry_t;
+
+// FIFO queue of threads that wait for a synchronization object
+typedef struct {
+	volatile int lock;				// protects the queue and the state of the object it belongs to
+	wait_entry_t *head;
+	wait_entry_t *tail;
+} wait_queue_t;
+
+
+typedef struct mutex_t {
+	volatile int state;				// one of the MUTEX_ constants defined in sync.c
+	thread_t * volatile owner;		// the thread that holds the mutex (may lag behind the state)
+	int waiterPriority;				// the highest priority of all waiting threads (-1 if none)
+	struct mutex_t *nextHeld;		// the next mutex in the list of mutexes held by the owner
+	wait_queue_t waiters;
+} mutex_t;
+
+typedef struct {
+	volatile int count;				// number of times the semaphore can be taken without blocking
+	wait_queue_t waiters;
+} semaphore_t;
+
+typedef struct {
+	wait_queue_t waiters;
+} condition_t;
+
+
+// mutex_lock, semaphore_down and condition_wait may block and must therefore be called with interrupts enabled.
+// None of these functions may be called from an interrupt handler.
+void mutex_init(mutex_t *mutex);
+void mutex_lock(mutex_t *mutex);
+int mutex_try_lock(mutex_t *mutex);
+void mutex_unlock(mutex_t *mutex);
+void semaphore_init(semaphore_t *semaphore, int count);
+void semaphore_down(semaphore_t *semaphore);
+int semaphore_try_down(semaphore_t *semaphore);
+void semaphore_up(semaphore_t *semaphore);
+void condition_init(condition_t *condition);
+void condition_wait(condition_t *condition, mutex_t *mutex);
+void condition_signal(condition_t *condition);
+void condition_broadcast(condition_t *condition);
+#ifdef USING_BENCHMARK
+void sync_benchmark(int threadCount, int iterations);
+#endif
+
+#endif // USING_THREADING
+
+#endif // __SYNC_H__
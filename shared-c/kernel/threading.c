@@ -1,5 +1,9 @@
 
 
+// thread_switch and thread_fpu_handler run in interrupt context and must leave the vector registers untouched
+// (see interrupts.c)
+#pragma GCC target("general-regs-only")
+
 #include <system.h>
 #include "threading.h"
 
@@ -72,19 +76,45 @@ typedef struct {
 
 thread_t systemThread = {
 	.state = THREAD_RUNNING,
-	.previous = &systemThread,
-	.next = &systemThread,
+	.priority = THREAD_PRIORITY_NORMAL,
+	.basePriority = THREAD_PRIORITY_NORMAL,
+	.inheritedPriority = -1,
+	.cpu = 0,
+	.lastCpu = 0,
+	.affinity = 0, // BIOS calls are only possible on the bootstrap processor
 };
 
-thread_t idleThread;
 
+// Each processor has its own run queue. The threads of a run queue are only executed by the associated processor,
+// unless an idle processor steals a thread from a busy one.
+// The runnable threads of each priority level form a circle (doubly linked list). A bitmap of the non-empty levels
+// allows to find the thread with the highest priority in constant time. Within a level, threads take turns.
+typedef struct {
+	volatile int lock;				// protects all fields and the circles of threads
+	thread_t *currentThread;		// the active thread of the processor (remains in its circle while it is active)
+	thread_t *ready[THREAD_PRIORITY_COUNT];	// for each priority level, the thread whose turn is next (NULL if the level is empty)
+	uint32_t readyMask;				// bit n is set if ready[n] is not NULL
+	thread_t idleThread;			// the thread that is active if there is nothing else to do (not in any circle)
+	volatile int threadCount;		// number of threads in the circles
+	thread_t *fpuOwner;				// the thread whose state is loaded in the vector registers of the processor (NULL if none)
+	int fpuTrap;					// set while CR0.TS is set on the processor
+	int fpuSwitching;				// set while thread_fpu_handler saves and loads the vector registers
+	int tickless;					// set while the timer of the processor is not running periodically
+	system_ticks_t timerDeadline;	// the system tick at which the timer fires while tickless (NO_DEADLINE if stopped)
+} run_queue_t;
+
+run_queue_t runQueues[CPU_MAX];
 
-// Doubly linked list (circle) that contains all threads running threads.
-// The head of the list is always the active thread.
-volatile thread_t *currentThread = &systemThread;
+// Pairing heap of all suspended threads that are scheduled to wake up at some time, the root wakes up first.
+// While the bootstrap processor is tickless, its timer is programmed to fire when the first thread must wake up.
+thread_t *scheduledThreads;
+volatile int sleepLock = 0;		// also protects the tickless state of the bootstrap processor
 
-// Singly linked list of all suspended threads that are scheduled to wake up at some time, sorted by wake up time.
-volatile thread_t *scheduledThreads;
+// The periodic timer makes the threads of a processor take turns. It only runs while there are several of them.
+#define TIMESLICE_INTERVAL		(20000)
+#define TIMESLICE_PRESCALER		(6)
+
+#define NO_DEADLINE				((system_ticks_t)-1)
 
 
 // code for the idle thread (requires no stack)
@@ -97,45 +127,305 @@ __asm (
 );
 
 
-// Switches to the next thread in the loop. Interrupts of the local processor must be disabled.
-void thread_switch(execution_context_t *context) {
-	thread_t *oldThread = currentThread;
-	oldThread->context = *context;
-	currentThread = oldThread->next;
+// Appends a thread to the circle of its priority level. The lock of the queue must be held.
+static void run_queue_insert(run_queue_t *queue, thread_t *thread) {
+	int level = thread->runLevel = thread->priority;
+	thread_t *first = queue->ready[level];
+	if (first) {
+		thread->next = first;
+		thread->previous = first->previous;
+		first->previous->next = thread;
+		first->previous = thread;
+	} else {
+		thread->previous = thread->next = thread;
+		queue->ready[level] = thread;
+		queue->readyMask |= (1U << level);
+	}
+	queue->threadCount++;
+}
+
+
+// Removes a thread from its circle. The lock of the queue must be held.
+static void run_queue_remove(run_queue_t *queue, thread_t *thread) {
+	int level = thread->runLevel;
+	if (thread->next == thread) {
+		queue->ready[level] = NULL;
+		queue->readyMask &= ~(1U << level);
+	} else {
+		thread->previous->next = thread->next;
+		thread->next->previous = thread->previous;
+		if (queue->ready[level] == thread)
+			queue->ready[level] = thread->next;
+	}
+	queue->threadCount--;
+}
+
+
+// Returns the thread whose turn is next on the highest non-empty priority level or NULL if the queue is empty.
+// The lock of the queue must be held.
+static inline thread_t *run_queue_first(run_queue_t *queue) {
+	if (!queue->readyMask)
+		return NULL;
+	return queue->ready[31 - __builtin_clz(queue->readyMask)];
+}
+
+
+// Makes the specified processor reconsider which thread should be active
+static inline void thread_reschedule(int cpu) {
+	if (cpu == cpu_current()->index)
+		apic_timer_trigger();
+	else
+		smp_reschedule(cpu);
+}
+
+
+// Combines two heaps of sleeping threads and returns the new root. The roots must have no siblings.
+static inline thread_t *sleep_heap_meld(thread_t *a, thread_t *b) {
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+	if (b->suspendInfo < a->suspendInfo) {
+		thread_t *temp = a;
+		a = b;
+		b = temp;
+	}
+	b->next = a->child;
+	a->child = b;
+	return a;
+}
+
+
+// Adds a sleeping thread to a heap in constant time.
+static inline void sleep_heap_insert(thread_t **root, thread_t *thread) {
+	thread->child = thread->next = NULL;
+	*root = sleep_heap_meld(*root, thread);
+}
+
+
+// Removes the root of a non-empty heap and returns it. This takes amortized logarithmic time.
+// The children of the root are melded in pairs from left to right and the pairs are then melded from right to left.
+static thread_t *sleep_heap_pop(thread_t **root) {
+	thread_t *first = *root;
+	thread_t *pairs = NULL; // the pairs in reverse order, linked through the next field
+	thread_t *child = first->child;
+
+	while (child) {
+		thread_t *a = child, *b = child->next;
+		child = (b ? b->next : NULL);
+		a->next = NULL;
+		if (b)
+			b->next = NULL;
+		a = sleep_heap_meld(a, b);
+		a->next = pairs;
+		pairs = a;
+	}
+
+	thread_t *newRoot = NULL;
+	while (pairs) {
+		thread_t *pair = pairs;
+		pairs = pairs->next;
+		pair->next = NULL;
+		newRoot = sleep_heap_meld(newRoot, pair);
+	}
+
+	*root = newRoot;
+	first->child = first->next = NULL;
+	return first;
+}
+
+
+static void thread_enqueue(thread_t *thread, int preemptLocal);
+
 
+// Resumes all sleeping threads whose wake up time has passed.
+// Must be called with interrupts disabled and without holding a run queue lock.
+static void thread_wake_scheduled(void) {
+	system_ticks_t now = apic_update_ticks();
+	for (;;) {
+		if (!scheduledThreads || scheduledThreads->suspendInfo > (intptr_t)now)
+			return;
 
-	if (oldThread == &idleThread) {
-		// if we were idling but another thread was resumed, remove idle thread
-		if (currentThread != &idleThread) {
-			idleThread.previous->next = idleThread.next;
-			idleThread.next->previous = idleThread.previous;
+		thread_t *thread = NULL;
+		spin_lock(&sleepLock);
+		if (scheduledThreads && scheduledThreads->suspendInfo <= (intptr_t)now)
+			thread = sleep_heap_pop(&scheduledThreads); // remove from heap before resuming
+		spin_unlock(&sleepLock);
+
+		if (thread)
+			thread_enqueue(thread, 0); // the caller is about to select a thread anyway
+	}
+}
+
+
+// Switches the timer of the local processor between periodic and tickless operation.
+// As long as only one thread (or none) is runnable, there is no point in interrupting it. In this case the timer of
+// the bootstrap processor only fires when the next sleeping thread must be woken up and the timers of all other
+// processors are stopped. Without an invariant TSC, the timer of the bootstrap processor keeps running periodically,
+// because it counts the ticks (and wakes up the sleeping threads), while the other timers are still stopped.
+// The lock of the queue must be held.
+static void thread_update_timer(run_queue_t *queue, int cpuIndex) {
+	if (!apic_timer_tickless_available())
+		return;
+
+	if (queue->threadCount > 1) {
+		if (queue->tickless) {
+			spin_lock(&sleepLock);
+			queue->tickless = 0;
+			spin_unlock(&sleepLock);
+			apic_timer_start(TIMESLICE_INTERVAL, TIMESLICE_PRESCALER);
 		}
+		return;
+	}
+
+	// the deadline is decided while holding sleepLock, so that a thread that goes to sleep concurrently either is
+	// already in the list or sees the new deadline (see thread_switch)
+	spin_lock(&sleepLock);
+	system_ticks_t deadline = ((!cpuIndex && scheduledThreads) ? (system_ticks_t)scheduledThreads->suspendInfo : NO_DEADLINE);
+	int stopped = (queue->tickless && queue->timerDeadline == NO_DEADLINE);
+	queue->tickless = 1;
+	queue->timerDeadline = deadline;
+	spin_unlock(&sleepLock);
+
+	if (deadline != NO_DEADLINE)
+		apic_timer_oneshot(deadline); // also rearms a timer that fired before the deadline
+	else if (!stopped)
+		apic_timer_stop();
+}
+
+
+// Sets or clears CR0.TS on the local processor, unless it is already in the requested state.
+static inline void thread_fpu_trap(run_queue_t *queue, int trap) {
+	if (queue->fpuTrap == trap)
+		return;
+	if (trap)
+		stts();
+	else
+		clts();
+	queue->fpuTrap = trap;
+}
+
+
+// Invoked by the first floating-point or SIMD instruction after a thread was switched in, if the vector registers
+// of the processor hold the state of another thread. The state of that thread is saved and the active thread's state
+// is loaded. Threads that don't use vector registers therefore never cause a save or restore.
+// Interrupt handlers are compiled without SSE, but fatal error paths (bug_check, LOGE) may still end up here from
+// within another handler. For this reason it is registered without stack switch.
+// The handler itself can't be interrupted by another #NM: it runs with interrupts disabled, clears CR0.TS before it
+// touches anything else and sets it nowhere. A nested #NM could only come from a fault within the handler whose
+// error path sets CR0.TS again, and it would save or load the registers in the middle of the outer save or load.
+// This is not supported and stops the system. TS is already clear at that point, so bug_check can't trap again.
+static void thread_fpu_handler(uint64_t intNumber, uint64_t errCode, execution_context_t *context) {
+	clts();
+	run_queue_t *queue = &runQueues[cpu_current()->index];
+	queue->fpuTrap = 0;
+	if (queue->fpuSwitching)
+		bug_check(STATUS_INVALID_OPERATION, intNumber);
+
+	thread_t *thread = queue->currentThread;
+	if (queue->fpuOwner == thread)
+		return;
+
+	queue->fpuSwitching = 1;
+	if (queue->fpuOwner)
+		fpu_save(queue->fpuOwner->fpuState);
+
+	// threads without a state area (idle threads) leave the registers undefined
+	if (thread->fpuState)
+		fpu_restore(thread->fpuState);
+	queue->fpuOwner = (thread->fpuState ? thread : NULL);
+	queue->fpuSwitching = 0;
+}
+
+
+// Moves a waiting thread from the busiest run queue to the specified (idle) run queue. Threads with a high priority
+// are moved first. The lock of the idle queue must be held. Busy queues that are locked at the moment are skipped.
+// Returns the thread that was moved or NULL if there was none.
+static thread_t *thread_steal(run_queue_t *queue, int cpuIndex) {
+	run_queue_t *victim = NULL;
+	for (int i = 0; i < cpuCount; i++)
+		if (i != cpuIndex && runQueues[i].threadCount > 1 && (!victim || runQueues[i].threadCount > victim->threadCount))
+			victim = &runQueues[i];
+
+	if (!victim || !__sync_bool_compare_and_swap(&victim->lock, 0, 1))
+		return NULL;
+
+	// only threads that are not active on the victim processor can be moved
+	thread_t *stolen = NULL;
+	uint32_t mask = victim->readyMask;
+	while (mask && !stolen) {
+		int level = 31 - __builtin_clz(mask);
+		mask &= ~(1U << level);
+
+		thread_t *thread = victim->ready[level];
+		do {
+			// the vector registers of the victim processor may still hold the state of the thread
+			if (thread != victim->currentThread && thread->affinity < 0 && thread != victim->fpuOwner) {
+				stolen = thread;
+				break;
+			}
+			thread = thread->next;
+		} while (thread != victim->ready[level]);
+	}
+
+	if (stolen) {
+		run_queue_remove(victim, stolen);
+		stolen->cpu = cpuIndex;
+		run_queue_insert(queue, stolen);
+	}
+
+	spin_unlock(&victim->lock);
+	return stolen;
+}
 
-	} else if (oldThread->state != THREAD_RUNNING) { // suspend old thread if necessary
-		if (oldThread == currentThread) { // if this was the only thread, invoke idle thread
-			currentThread = &idleThread;
-			idleThread.previous = idleThread.next = &idleThread;
-		} else {
-			oldThread->previous->next = oldThread->next;
-			oldThread->next->previous = oldThread->previous;
+
+// Switches to the next thread in the run queue of the local processor. Interrupts of the local processor must be disabled.
+void thread_switch(execution_context_t *context) {
+	int cpuIndex = cpu_current()->index;
+	run_queue_t *queue = &runQueues[cpuIndex];
+
+	// resume scheduled threads
+	thread_wake_scheduled();
+
+	spin_lock(&queue->lock);
+
+	thread_t *oldThread = queue->currentThread;
+	oldThread->context = *context; // copied with general purpose registers, the vector registers belong to the FPU owner
+
+
+	if (oldThread == &queue->idleThread) {
+		// the idle thread is not in any circle
+
+	} else if (oldThread->state == THREAD_RUNNING) {
+		// the old thread goes to the end of its level, so that the other threads on the same level get their turn
+		if (queue->ready[oldThread->runLevel] == oldThread)
+			queue->ready[oldThread->runLevel] = oldThread->next;
+
+	} else { // suspend old thread
+		run_queue_remove(queue, oldThread);
+
+		// from now on, the thread may be resumed on any processor, so its vector registers can't stay here
+		if (queue->fpuOwner == oldThread) {
+			fpu_save(oldThread->fpuState);
+			queue->fpuOwner = NULL;
 		}
+		oldThread->cpu = -1;
 
-		thread_t * volatile *nextNodePtr;
+		int wakeBsp = 0;
 
 		switch (oldThread->state) {
 			case THREAD_SUSPENDED:
 				break;
 
 			case THREAD_SCHEDULED:
-				// insert current thread into list of scheduled threads (sorted by wake up time)
-				nextNodePtr = &scheduledThreads;
-				while (*nextNodePtr) {
-					if ((*nextNodePtr)->suspendInfo > oldThread->suspendInfo)
-						break;
-					nextNodePtr = &((*nextNodePtr)->next);
-				}
-				oldThread->next = *nextNodePtr;
-				*nextNodePtr = oldThread;
+				spin_lock(&sleepLock);
+				sleep_heap_insert(&scheduledThreads, oldThread);
+
+				// a tickless bootstrap processor must reprogram its timer if the thread wakes up before its deadline
+				wakeBsp = (cpuIndex && scheduledThreads == oldThread && runQueues[0].tickless && (system_ticks_t)oldThread->suspendInfo < runQueues[0].timerDeadline);
+				spin_unlock(&sleepLock);
+				if (wakeBsp)
+					smp_reschedule(0);
 				break;
 
 			default:
@@ -145,26 +435,80 @@ void thread_switch(execution_context_t *context) {
 	}
 
 
-	// resume scheduled threads
-	while (scheduledThreads) {
-		if (scheduledThreads->suspendInfo > systemTicks)
-			break;
-		thread_t *t = scheduledThreads;
-		scheduledThreads = scheduledThreads->next; // remove from list before resuming
-		thread_resume(t);
+	// select the first thread of the highest priority level, if there is nothing to do, look for work on other processors
+	thread_t *newThread = run_queue_first(queue);
+	if (!newThread && cpuCount > 1)
+		newThread = thread_steal(queue, cpuIndex);
+	queue->currentThread = (newThread ? newThread : &queue->idleThread);
+
+
+	// restore context of new thread, vector registers are restored lazily by thread_fpu_handler
+	queue->currentThread->lastCpu = cpuIndex;
+	*context = queue->currentThread->context;
+	thread_fpu_trap(queue, queue->currentThread != queue->fpuOwner);
+
+	thread_update_timer(queue, cpuIndex);
+
+	spin_unlock(&queue->lock);
+}
+
+
+// Starts the scheduler on an application processor. The processor idles until a thread is assigned to it.
+// The timer is left stopped until the processor has several threads to run (if tickless operation is available).
+static void __attribute__((__noreturn__)) threading_init_ap(void) {
+	run_queue_t *queue = &runQueues[cpu_current()->index];
+	thread_fpu_trap(queue, 1);
+	if (apic_timer_tickless_available()) {
+		queue->tickless = 1;
+		queue->timerDeadline = NO_DEADLINE;
+	} else {
+		apic_timer_start(TIMESLICE_INTERVAL, TIMESLICE_PRESCALER);
 	}
+	interrupts_on();
+	idle_loop(NULL);
+	for (;;);
+}
 
 
-	// restore context of new thread
-	*context = currentThread->context;
+// Allocates a state area for the vector registers of a thread
+static void *thread_fpu_alloc(void) {
+	void *area = aligned_alloc(FPU_STATE_ALIGNMENT, fpuStateSize);
+	if (!area)
+		bug_check(STATUS_OUT_OF_MEMORY, fpuStateSize);
+	fpu_init_state(area);
+	return area;
 }
 
 
-// apic_init must be called prior to this functions
+// apic_init must be called prior to this functions.
+// Also brings up all other processors, each with its own run queue.
 void threading_init(void) {
-	thread_init(&idleThread, idle_loop, NULL, 0);
+	for (int i = 0; i < CPU_MAX; i++) {
+		run_queue_t *queue = &runQueues[i];
+		thread_init(&queue->idleThread, idle_loop, NULL, 0);
+		queue->idleThread.cpu = queue->idleThread.lastCpu = queue->idleThread.affinity = i;
+		queue->idleThread.state = THREAD_RUNNING;
+		queue->idleThread.priority = queue->idleThread.basePriority = -1; // below all other threads
+		queue->currentThread = &queue->idleThread;
+	}
+
+	run_queue_insert(&runQueues[0], &systemThread);
+	runQueues[0].currentThread = &systemThread;
+
+	// the system thread has been using the vector registers all along
+	systemThread.fpuState = thread_fpu_alloc();
+	runQueues[0].fpuOwner = &systemThread;
+
+	// the first switch makes the bootstrap processor tickless if the system thread is alone (and the TSC is invariant)
+	// (the timer is calibrated before the other processors are started, because they rely on the calibration, but
+	// it is only started once they are up, as smp_init must not be interrupted)
+	interrupt_register_ex(INTERRUPT_NUMBER_NOCOPROC, 0, thread_fpu_handler, STACK_NUM_CURRENT);
 	apic_timer_config(thread_switch);
-	apic_timer_start(20000, 6);
+	atomic() {
+		apic_timer_calibrate(TIMESLICE_INTERVAL, TIMESLICE_PRESCALER);
+		smp_init(threading_init_ap);
+		apic_timer_start(TIMESLICE_INTERVAL, TIMESLICE_PRESCALER);
+	}
 }
 
 
@@ -173,10 +517,13 @@ void threading_init(void) {
 //	threadEntry: address where the thread should start execution
 //	context: this address will be passed as an argument to the thread entry function.
 //	stackpointer: address of the first byte after the new threads stack
-void thread_init(thread_t *thread, thread_start_t threadStart, void *param, uintptr_t stackpointer) {
+//	priority: between THREAD_PRIORITY_LOWEST and THREAD_PRIORITY_HIGHEST, a runnable thread is only executed
+//		if there is no runnable thread with a higher priority on the same processor
+void thread_init_ex(thread_t *thread, thread_start_t threadStart, void *param, uintptr_t stackpointer, int priority) {
 	assert(thread);
 	assert(threadStart);
 	//assert(stackpointer); idleThread has no stack
+	assert(priority >= THREAD_PRIORITY_LOWEST && priority <= THREAD_PRIORITY_HIGHEST);
 
 	thread->context.ss = STACK_SEGMENT_SELECTOR;
 	thread->context.rsp = stackpointer;
@@ -185,35 +532,190 @@ void thread_init(thread_t *thread, thread_start_t threadStart, void *param, uint
 	thread->context.rdi = (uint64_t)param;
 	thread->context.rflags = (1UL << 9); // enable interrupts in the new context
 	thread->state = THREAD_SUSPENDED;
+	thread->cpu = -1;
+	thread->lastCpu = -1;
+	thread->affinity = -1;
+	thread->priority = thread->basePriority = priority;
+	thread->inheritedPriority = -1;
+	thread->blockedOn = NULL;
+	thread->heldMutexes = NULL;
+	thread->fpuState = (stackpointer ? thread_fpu_alloc() : NULL); // the idle threads never use vector registers
+}
+
+
+// Initializes a thread structure with normal priority. The thread will be placed in suspended state.
+void thread_init(thread_t *thread, thread_start_t threadStart, void *param, uintptr_t stackpointer) {
+	thread_init_ex(thread, threadStart, param, stackpointer, THREAD_PRIORITY_NORMAL);
 }
 
 
-// Starts or resumes a thread on the local processor.
+// Selects the processor that should run the specified thread.
+// The last processor of the thread is preferred (its caches may still be warm), unless it is considerably busier than others.
+static int thread_select_cpu(thread_t *thread) {
+	if (thread->affinity >= 0)
+		return thread->affinity;
+
+	int best = 0;
+	for (int i = 1; i < cpuCount; i++)
+		if (cpus[i].online && runQueues[i].threadCount < runQueues[best].threadCount)
+			best = i;
+
+	int last = thread->lastCpu;
+	if (last >= 0 && last < cpuCount && runQueues[last].threadCount <= runQueues[best].threadCount + 1)
+		return last;
+	return best;
+}
+
+
+// Places a thread that is not running in the run queue of the least busy processor.
+// If the thread has a higher priority than the active thread of that processor, the processor is rescheduled,
+// unless it is the local processor and preemptLocal is 0. Interrupts must be disabled.
+static void thread_enqueue(thread_t *thread, int preemptLocal) {
+	for (;;) {
+		int cpu = thread->cpu;
+
+		if (cpu >= 0) {
+			// the thread is still in a run queue (it may not have been switched out yet)
+			spin_lock(&runQueues[cpu].lock);
+			int done = (thread->cpu == cpu);
+			if (done)
+				thread->state = THREAD_RUNNING;
+			spin_unlock(&runQueues[cpu].lock);
+			if (done)
+				return;
+			continue;
+		}
+
+		int target = thread_select_cpu(thread);
+		run_queue_t *queue = &runQueues[target];
+		spin_lock(&queue->lock);
+		if (__sync_bool_compare_and_swap(&thread->cpu, -1, target)) {
+			thread->state = THREAD_RUNNING;
+			run_queue_insert(queue, thread);
+			// a tickless processor must start taking turns as soon as it has several threads
+			int reschedule = (thread->priority > queue->currentThread->priority || (queue->tickless && queue->threadCount > 1));
+			spin_unlock(&queue->lock);
+
+			if (reschedule && (preemptLocal || target != cpu_current()->index))
+				thread_reschedule(target);
+			return;
+		}
+		spin_unlock(&queue->lock);
+	}
+}
+
+
+// Starts or resumes a thread. The thread is placed in the run queue of the least busy processor.
+// If its priority is higher than that of the active thread of the processor, it preempts that thread.
+// Threads that were suspended using thread_sleep must not be resumed using this function.
 void thread_resume(thread_t *thread) {
 	assert(thread);
+	atomic()
+		thread_enqueue(thread, 1);
+}
+
+
+// Applies a change of the base or inherited priority of a thread. If the thread is in a run queue, it is moved
+// to the circle of its new priority level and the processor is rescheduled if the thread with the highest priority
+// is no longer the active one.
+static void thread_update_priority(thread_t *thread) {
+	int priority = (thread->inheritedPriority > thread->basePriority ? thread->inheritedPriority : thread->basePriority);
+
 	atomic() {
-		// insert the thread into the scheduling circle directly after the current thread
-		thread->previous = currentThread;
-		thread->next = currentThread->next;
-		currentThread->next->previous = thread;
-		currentThread->next = thread;
-		thread->state = THREAD_RUNNING;
+		for (;;) {
+			int cpu = thread->cpu;
+
+			if (cpu < 0) {
+				// the new priority is used as soon as the thread is inserted into a run queue
+				thread->priority = priority;
+				__sync_synchronize();
+				if (thread->cpu < 0)
+					break;
+				continue; // the thread was inserted in the meantime, maybe with the old priority
+			}
+
+			run_queue_t *queue = &runQueues[cpu];
+			spin_lock(&queue->lock);
+			if (thread->cpu != cpu) {
+				spin_unlock(&queue->lock);
+				continue;
+			}
+
+			thread->priority = priority;
+			if (thread->runLevel != priority) {
+				run_queue_remove(queue, thread);
+				run_queue_insert(queue, thread);
+			}
+
+			thread_t *first = run_queue_first(queue);
+			int reschedule = (first && first->priority > queue->currentThread->priority);
+			spin_unlock(&queue->lock);
+
+			if (reschedule)
+				thread_reschedule(cpu);
+			break;
+		}
 	}
 }
 
 
+// Sets the priority of a thread. The thread may still run at a higher priority while it holds a mutex
+// that a thread with a higher priority waits for.
+void thread_set_priority(thread_t *thread, int priority) {
+	assert(priority >= THREAD_PRIORITY_LOWEST && priority <= THREAD_PRIORITY_HIGHEST);
+	thread->basePriority = priority;
+	thread_update_priority(thread);
+}
+
+
+// Lets a thread run with at least the specified priority, in addition to its own priority.
+// This is used for priority inheritance by kernel locks.
+//	priority: the inherited priority or -1 to remove an inherited priority
+void thread_inherit_priority(thread_t *thread, int priority) {
+	thread->inheritedPriority = priority;
+	thread_update_priority(thread);
+}
+
+
 // Makes the current thread give up the rest of its current time slice
 void thread_yield(void) {
 	apic_timer_trigger();
 }
 
 
+// Returns the thread that executes this function.
+thread_t *thread_current(void) {
+	thread_t *thread;
+	atomic()
+		thread = runQueues[cpu_current()->index].currentThread;
+	return thread;
+}
+
+
+// Returns 1 if the specified thread is currently executing on some processor.
+// The result is only a hint, as it may change at any time.
+int thread_is_active(thread_t *thread) {
+	int cpu = thread->cpu;
+	return cpu >= 0 && runQueues[cpu].currentThread == thread;
+}
+
+
+// Marks the calling thread as suspended without giving up the processor. The thread is suspended at the next
+// thread switch, unless it is resumed before. This allows a thread to enqueue itself somewhere and suspend
+// without missing a thread_resume call that happens in between. Interrupts must be disabled.
+void thread_suspend_prepare(thread_state_t suspendMode, uintptr_t suspendInfo) {
+	run_queue_t *queue = &runQueues[cpu_current()->index];
+	spin_lock(&queue->lock);
+	queue->currentThread->state = suspendMode;
+	queue->currentThread->suspendInfo = suspendInfo;
+	spin_unlock(&queue->lock);
+}
+
+
 // Suspends the calling thread using the specified trigger mode to wake the thread up.
 void thread_suspend_ex(thread_state_t suspendMode, uintptr_t suspendInfo) {
-	atomic() {
-		currentThread->state = suspendMode;
-		currentThread->suspendInfo = suspendInfo;
-	}
+	atomic()
+		thread_suspend_prepare(suspendMode, suspendInfo);
 	thread_yield();
 }
 
@@ -226,7 +728,65 @@ void thread_suspend(void) {
 
 // Puts the calling thread to sleep for the specified number of system ticks.
 void thread_sleep(system_ticks_t delay) {
-	thread_suspend_ex(THREAD_SCHEDULED, systemTicks + delay);
+	thread_suspend_ex(THREAD_SCHEDULED, apic_update_ticks() + delay);
+}
+
+
+#ifdef USING_BENCHMARK
+
+// Compares the sorted list that used to hold the sleeping threads with the heap, by putting the specified number of
+// dummy threads with pseudo-random wake up times to sleep and waking them up in order.
+void thread_sleep_benchmark(int count) {
+	benchmark_t bench;
+	benchmark_init(&bench, "sleep");
+	thread_t *threads = malloc(count * sizeof(thread_t));
+	if (!threads) {
+		LOGE("sleep benchmark: out of memory");
+		return;
+	}
+
+	LOGI("sleep benchmark: %d threads", count);
+	for (int pass = 0; pass < 2; pass++) {
+		benchmark_reseed(&bench);
+		for (int i = 0; i < count; i++)
+			threads[i].suspendInfo = benchmark_random(&bench) >> 8;
+
+		thread_t *root = NULL;
+		benchmark_start(&bench);
+		for (int i = 0; i < count; i++) {
+			if (pass) {
+				sleep_heap_insert(&root, &threads[i]);
+			} else {
+				thread_t **nextNodePtr = &root;
+				while (*nextNodePtr && (*nextNodePtr)->suspendInfo <= threads[i].suspendInfo)
+					nextNodePtr = (thread_t **)&((*nextNodePtr)->next);
+				threads[i].next = *nextNodePtr;
+				*nextNodePtr = &threads[i];
+			}
+		}
+		benchmark_stop(&bench, (pass ? "heap" : "sorted list"), count, "sleep");
+
+		intptr_t last = 0;
+		int sorted = 1;
+		benchmark_start(&bench);
+		for (int i = 0; i < count; i++) {
+			thread_t *thread = root;
+			if (pass)
+				sleep_heap_pop(&root);
+			else
+				root = thread->next;
+			sorted &= (thread->suspendInfo >= last);
+			last = thread->suspendInfo;
+		}
+		benchmark_stop(&bench, (pass ? "heap" : "sorted list"), count, "wake up");
+
+		if (!sorted)
+			LOGE("sleep benchmark: threads were not woken up in order");
+	}
+
+	free((void *)threads);
 }
 
+#endif // USING_BENCHMARK
+
 #endif // USING_THREADING
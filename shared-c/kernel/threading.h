@@ -12,21 +12,60 @@ typedef enum
 } thread_state_t;
 
 
+#define THREAD_PRIORITY_COUNT		(32)	// number of priority levels (at most 32)
+#define THREAD_PRIORITY_LOWEST		(0)
+#define THREAD_PRIORITY_NORMAL		(16)
+#define THREAD_PRIORITY_HIGHEST		(THREAD_PRIORITY_COUNT - 1)
+
+
 typedef volatile struct thread_t {
 	thread_state_t state;
 	intptr_t suspendInfo;					// meaning depends on the thread state
 	execution_context_t context;			// execution context
 	volatile struct thread_t *previous;		// points to the previous running thread (only valid while the thread is active)
-	volatile struct thread_t *next;			// points to the next running thread (only valid while the thread is active)
+	volatile struct thread_t *next;			// points to the next running thread (only valid while the thread is active), or to the next sibling in the heap of sleeping threads
+	volatile struct thread_t *child;		// the first child in the heap of sleeping threads (only valid while the thread sleeps)
+	int cpu;								// the processor whose run queue contains the thread (-1 while the thread is not in any run queue)
+	int lastCpu;							// the processor that ran the thread most recently
+	int affinity;							// the only processor that may run the thread (-1 if it may run on any processor)
+	int priority;							// the effective priority (the higher of basePriority and inheritedPriority)
+	int basePriority;						// the priority that was assigned to the thread
+	int inheritedPriority;					// the priority inherited from threads that wait for a mutex held by this thread (-1 if none)
+	int runLevel;							// the priority level of the circle that holds the thread (only valid while in a run queue)
+	struct mutex_t *blockedOn;				// the mutex that the thread waits for (NULL if none)
+	struct mutex_t *heldMutexes;			// list of the mutexes that the thread holds (only accessed by the thread itself)
+	void *fpuState;							// FPU, SSE and AVX registers while they are not loaded (NULL if the thread doesn't use them)
 } thread_t;
 
 
 typedef void(*thread_start_t)(void *param);
 
+
+// Acquires a spin lock. Interrupts of the local processor must be disabled.
+static inline void spin_lock(volatile int *lock) {
+	while (!__sync_bool_compare_and_swap(lock, 0, 1))
+		__builtin_ia32_pause();
+}
+
+// Releases a spin lock.
+static inline void spin_unlock(volatile int *lock) {
+	__sync_lock_release(lock);
+}
+
+
 void threading_init(void);
+void thread_init_ex(thread_t *thread, thread_start_t threadStart, void *param, uintptr_t stackpointer, int priority);
 void thread_init(thread_t *thread, thread_start_t threadStart, void *param, uintptr_t stackpointer);
+void thread_set_priority(thread_t *thread, int priority);
+void thread_inherit_priority(thread_t *thread, int priority);
+thread_t *thread_current(void);
+#ifdef USING_BENCHMARK
+void thread_sleep_benchmark(int count);
+#endif
+int thread_is_active(thread_t *thread);
 void thread_resume(thread_t *thread);
 void thread_yield(void);
+void thread_suspend_prepare(thread_state_t suspendMode, uintptr_t suspendInfo);
 void thread_suspend_ex(thread_state_t suspendMode, uintptr_t suspendInfo);
 void thread_suspend(void);
 void thread_sleep(system_ticks_t delay);
@@ -34,6 +34,7 @@ void biosdisk_setup_transfer(uint64_t startSector, uint64_t sectorCount, realmod
 
 
 // Reads sectors from a BIOS drive. The sectors must be within disk boundaries.
+// The block cache doesn't serialize reads, so each transfer is done atomically, as the real mode buffers are shared.
 status_t biosdisk_read(disk_t *disk, uint64_t startSector, uint64_t sectorCount, char *buffer) {
 	assert(buffer);
 	assert(disk);
@@ -44,18 +45,21 @@ status_t biosdisk_read(disk_t *disk, uint64_t startSector, uint64_t sectorCount,
 
 	while (sectorCount) {
 		uint64_t count = min(sectorCount, 0x7F); // transfer at most 127 sectors at once
+		int failed;
+
+		atomic() {
+			// set up registers and disk transfer command
+			regs.eax = 0x4200;
+			regs.edx = (uint8_t)disk->reference;
+			biosdisk_setup_transfer(startSector, count, &regs);
+
+			// issue read command and copy to buffer
+			failed = (realmode_int(0x13, &regs) & 1) || (regs.eax & 0xFF);
+			if (!failed)
+				memcpy(buffer, realmodeBuffer, count * disk->bytesPerSector);
+		}
 
-		// set up registers and disk transfer command
-		regs.eax = 0x4200;
-		regs.edx = (uint8_t)disk->reference;
-		biosdisk_setup_transfer(startSector, count, &regs);
-
-		// issue read command
-		if (realmode_int(0x13, &regs) & 1) return STATUS_DISK_READ_ERROR;
-		if (regs.eax & 0xFF) return STATUS_DISK_READ_ERROR;
-
-		// copy to buffer
-		memcpy(buffer, realmodeBuffer, count * disk->bytesPerSector);
+		if (failed) return STATUS_DISK_READ_ERROR;
 		startSector += count;
 		sectorCount -= count;
 		buffer += count * disk->bytesPerSector;
@@ -0,0 +1,79 @@
+/*
+*
+* Provides disks that are backed by image files on the host, so that the volume and filesystem code (in particular
+* the block cache) can be tested without real hardware, e.g.:
+*	disk_t disk;
+*	if (!filedisk_open(&disk, "scratch.img", 512))
+*		block_cache_test(&disk, 100000, 1), filedisk_close(&disk);
+* Images must be smaller than 2GB, as they are accessed with fseek.
+*
+* created: 16.10.26
+*
+*/
+
+#include <system.h>
+#include <stdio.h>
+#include "filedisk.h"
+
+#ifdef USING_FILESYSTEM
+
+
+// Reads sectors from an image file. The sectors must be within disk boundaries.
+static status_t filedisk_read(disk_t *disk, uint64_t startSector, uint64_t sectorCount, char *buffer) {
+	assert(buffer);
+	assert(disk);
+	assert(disk->sectorCount >= startSector + sectorCount);
+
+	FILE *file = (FILE *)(uintptr_t)disk->reference;
+	if (fseek(file, startSector * disk->bytesPerSector, SEEK_SET))
+		return STATUS_DISK_READ_ERROR;
+	if (fread(buffer, disk->bytesPerSector, sectorCount, file) != sectorCount)
+		return STATUS_DISK_READ_ERROR;
+	return STATUS_SUCCESS;
+}
+
+
+// Writes sectors to an image file. The sectors must be within disk boundaries.
+static status_t filedisk_write(disk_t *disk, uint64_t startSector, uint64_t sectorCount, char *buffer) {
+	assert(buffer);
+	assert(disk);
+	assert(disk->sectorCount >= startSector + sectorCount);
+
+	FILE *file = (FILE *)(uintptr_t)disk->reference;
+	if (fseek(file, startSector * disk->bytesPerSector, SEEK_SET))
+		return STATUS_DISK_WRITE_ERROR;
+	if (fwrite(buffer, disk->bytesPerSector, sectorCount, file) != sectorCount)
+		return STATUS_DISK_WRITE_ERROR;
+	return STATUS_SUCCESS;
+}
+
+
+// Opens an existing image file as a disk. A partial sector at the end of the file is ignored.
+status_t filedisk_open(disk_t *disk, const char *path, uint64_t bytesPerSector) {
+	FILE *file = fopen(path, "r+b");
+	if (!file)
+		return STATUS_FILE_NOT_FOUND;
+
+	long size;
+	if (fseek(file, 0, SEEK_END) || (size = ftell(file)) < 0)
+		return fclose(file), STATUS_FILE_READ_ERROR;
+
+	*disk = (disk_t) {
+		.sectorCount = size / bytesPerSector,
+		.bytesPerSector = bytesPerSector,
+		.reference = (uintptr_t)file,
+		.read = filedisk_read,
+		.write = filedisk_write
+	};
+	return STATUS_SUCCESS;
+}
+
+
+// Closes a disk that was opened by filedisk_open. Cached blocks of the disk must no longer be used.
+void filedisk_close(disk_t *disk) {
+	fclose((FILE *)(uintptr_t)disk->reference);
+	disk->reference = 0;
+}
+
+
+#endif // USING_FILESYSTEM
@@ -0,0 +1,18 @@
+/*
+*
+* Provides disks that are backed by image files on the host.
+*
+* created: 16.10.26
+*
+*/
+#ifndef __WINDOWS_FILEDISK_H__
+#define __WINDOWS_FILEDISK_H__
+
+#ifdef USING_FILESYSTEM
+
+status_t filedisk_open(disk_t *disk, const char *path, uint64_t bytesPerSector);
+void filedisk_close(disk_t *disk);
+
+#endif // USING_FILESYSTEM
+
+#endif // __WINDOWS_FILEDISK_H__
@@ -9,12 +9,21 @@
 
 
 #include <windows.h>
+#include <intrin.h>
 
 void windows_init(void);
 #define io_init() windows_init()
 
 #define _delay_ms(ms)	Sleep(ms)
 
+// Returns the time stamp counter of the processor (the benchmarks measure time with it)
+static inline uint64_t read_tsc(void) {
+	return __rdtsc();
+}
+
+// Tells the processor that it is waiting in a spin loop
+#define cpu_relax()		YieldProcessor()
+
 // can't control interrupts in windows
 #define interrupts_on()
 #define interrupts_off()
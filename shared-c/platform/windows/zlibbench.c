@@ -0,0 +1,208 @@
+/*
+*
+* Compares the DEFLATE implementation with zlib on the host, next to the benchmarks in huffman.c and deflate.c, e.g.:
+*	if (!zlib_benchmark_init())
+*		huffman_benchmark(1000000), zlib_huffman_benchmark(16UL << 20), zlib_inflate_benchmark(16UL << 20), zlib_deflate_benchmark(16UL << 20);
+* The calls into zlib are made by zlibcall.c.
+*
+* created: 17.10.26
+*
+*/
+
+#include <system.h>
+#include "zlibbench.h"
+
+#if defined(USING_BENCHMARK) && defined(USING_DEFLATE)
+
+
+static int zlibLoaded;
+
+
+// Loads zlib1.dll. This must be called before any of the benchmarks below.
+status_t zlib_benchmark_init(void) {
+	const char *version = zlib_load();
+	if (!version) {
+		LOGE("zlib benchmark: zlib1.dll could not be loaded");
+		return STATUS_NOT_SUPPORTED;
+	}
+	LOGI("zlib benchmark: using zlib %s", version);
+	zlibLoaded = 1;
+	return STATUS_SUCCESS;
+}
+
+
+// Compresses data with zlib and then decompresses it with inflate and with zlib. Both results are checked against the input.
+//	level, strategy: passed to zlib when compressing
+static void zlib_inflate_compare(benchmark_t *bench, const uint8_t *data, size_t length, int level, int strategy) {
+	size_t size = length + (length >> 3) + 1024;
+	uint8_t *compressed = (uint8_t *)malloc(size);
+	uint8_t *output = (uint8_t *)malloc(length ? length : 1);
+	bytestream_t stream = { .data = NULL };
+	size_t compressedLength = 0;
+	if (!compressed || !output || stream_alloc(&stream, length ? length : 1)
+		|| zlib_compress_raw(data, length, compressed, size, level, strategy, &compressedLength)) {
+		LOGE("%s benchmark: could not compress %d kB", bench->name, (int)(length >> 10));
+		free(compressed);
+		free(output);
+		stream_free(&stream);
+		return;
+	}
+
+	LOGI("%s benchmark: %d kB compressed to %d kB", bench->name, (int)(length >> 10), (int)(compressedLength >> 10));
+	for (int pass = 0; pass < 2; pass++) {
+		size_t produced;
+		status_t status;
+
+		benchmark_start(bench);
+		if (pass) {
+			status = (zlib_decompress_raw(compressed, compressedLength, output, length, &produced) ? STATUS_DATA_CORRUPT : STATUS_SUCCESS);
+		} else {
+			stream.wPos = stream.rPos = 0;
+			status = inflate_ex(compressed, compressedLength, &stream, DEFLATE_FORMAT_RAW);
+			produced = stream.wPos;
+		}
+		benchmark_stop(bench, (pass ? "zlib" : "inflate"), length >> 10, "kB");
+
+		if (status || produced != length || memcmp(pass ? output : (uint8_t *)stream.data, data, length))
+			LOGE("%s benchmark: %s: status %d, the data did not survive the round trip", bench->name, (pass ? "zlib" : "inflate"), status);
+	}
+
+	free(compressed);
+	free(output);
+	stream_free(&stream);
+}
+
+
+// Compares decoding huffman codes with inflate and with zlib. The data consists of pseudo-random bytes with
+// frequencies that fall off like those of text (as in huffman_benchmark). zlib compresses it with huffman codes only,
+// so that decompressing it is almost entirely decoding literals.
+//	length: the number of bytes to compress and decompress (allocated on the heap)
+void zlib_huffman_benchmark(size_t length) {
+	benchmark_t bench;
+	benchmark_init(&bench, "zlib huffman");
+	if (!zlibLoaded) {
+		LOGE("zlib huffman benchmark: zlib was not loaded");
+		return;
+	}
+
+	uint32_t cumulative[256], total = 0;
+	for (int i = 0; i < 256; i++)
+		cumulative[i] = (total += 1 + (1 << 24) / ((i + 16) * (i + 16)));
+
+	uint8_t *data = (uint8_t *)malloc(length ? length : 1);
+	if (!data) {
+		LOGE("zlib huffman benchmark: could not allocate %d kB", (int)(length >> 10));
+		return;
+	}
+	for (size_t i = 0; i < length; i++) {
+		uint32_t value = (benchmark_random(&bench) >> 8) % total;
+		int lower = 0, upper = 255;
+		while (lower < upper) {
+			int middle = (lower + upper) >> 1;
+			if (cumulative[middle] > value)
+				upper = middle;
+			else
+				lower = middle + 1;
+		}
+		data[i] = lower;
+	}
+
+	zlib_inflate_compare(&bench, data, length, 6, ZLIB_STRATEGY_HUFFMAN_ONLY);
+	free(data);
+}
+
+
+// Compares inflate with zlib on the text-like data of inflate_benchmark (see deflate_benchmark_data),
+// compressed by zlib at its default level.
+//	length: the number of bytes to compress and decompress (allocated on the heap)
+void zlib_inflate_benchmark(size_t length) {
+	benchmark_t bench;
+	benchmark_init(&bench, "zlib inflate");
+	if (!zlibLoaded) {
+		LOGE("zlib inflate benchmark: zlib was not loaded");
+		return;
+	}
+
+	uint8_t *data = (uint8_t *)malloc(length ? length : 1);
+	if (!data) {
+		LOGE("zlib inflate benchmark: could not allocate %d kB", (int)(length >> 10));
+		return;
+	}
+	deflate_benchmark_data(data, length);
+
+	zlib_inflate_compare(&bench, data, length, 6, ZLIB_STRATEGY_DEFAULT);
+	free(data);
+}
+
+
+// Compares deflate with zlib at several levels on the text-like data of deflate_benchmark (see deflate_benchmark_data)
+// and logs the speed and the compression ratio of each. The output of deflate is decompressed by zlib and the output
+// of zlib by inflate, and both are compared with the input.
+//	length: the number of bytes to compress (allocated on the heap)
+void zlib_deflate_benchmark(size_t length) {
+	static const struct { int level; const char *name; } levels[] = {
+		{ DEFLATE_LEVEL_FAST, "level 1" }, { 3, "level 3" }, { DEFLATE_LEVEL_DEFAULT, "level 6" }, { DEFLATE_LEVEL_BEST, "level 9" },
+	};
+	benchmark_t bench;
+	benchmark_init(&bench, "zlib deflate");
+	if (!zlibLoaded) {
+		LOGE("zlib deflate benchmark: zlib was not loaded");
+		return;
+	}
+
+	size_t size = length + (length >> 3) + 1024;
+	uint8_t *data = (uint8_t *)malloc(length ? length : 1);
+	uint8_t *compressed = (uint8_t *)malloc(size);
+	uint8_t *output = (uint8_t *)malloc(length ? length : 1);
+	if (!data || !compressed || !output) {
+		LOGE("zlib deflate benchmark: could not allocate %d kB", (int)(length >> 10));
+		free(data);
+		free(compressed);
+		free(output);
+		return;
+	}
+	deflate_benchmark_data(data, length);
+
+	LOGI("zlib deflate benchmark: %d kB", (int)(length >> 10));
+	for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+		LOGI("zlib deflate benchmark: %s", levels[l].name);
+
+		for (int pass = 0; pass < 2; pass++) {
+			bytestream_t stream = { .data = NULL };
+			size_t compressedLength = 0, produced = 0;
+			status_t status;
+
+			benchmark_start(&bench);
+			if (pass) {
+				status = (zlib_compress_raw(data, length, compressed, size, levels[l].level, ZLIB_STRATEGY_DEFAULT, &compressedLength) ? STATUS_BUFFER_OVERRUN : STATUS_SUCCESS);
+			} else if ((status = stream_alloc(&stream, length / 2 + 1)) == STATUS_SUCCESS) {
+				status = deflate_ex(data, length, &stream, levels[l].level, DEFLATE_FORMAT_RAW);
+				compressedLength = stream.wPos;
+			}
+			benchmark_stop(&bench, (pass ? "zlib" : "deflate"), length >> 10, "kB");
+
+			// decompress with the other implementation
+			if (!status && pass) {
+				if ((status = stream_alloc(&stream, length ? length : 1)) == STATUS_SUCCESS)
+					status = inflate_ex(compressed, compressedLength, &stream, DEFLATE_FORMAT_RAW);
+				produced = stream.wPos;
+			} else if (!status) {
+				status = (zlib_decompress_raw(stream.data, compressedLength, output, length, &produced) ? STATUS_DATA_CORRUPT : STATUS_SUCCESS);
+			}
+
+			if (status || produced != length || memcmp(pass ? (uint8_t *)stream.data : output, data, length))
+				LOGE("zlib deflate benchmark: %s: status %d, the data did not survive the round trip", (pass ? "zlib" : "deflate"), status);
+			else
+				LOGI("zlib deflate benchmark: %s: compressed to %d.%d%%", (pass ? "zlib" : "deflate"),
+					(int)(compressedLength * 100 / (length ? length : 1)), (int)(compressedLength * 1000 / (length ? length : 1) % 10));
+			stream_free(&stream);
+		}
+	}
+
+	free(data);
+	free(compressed);
+	free(output);
+}
+
+
+#endif // USING_BENCHMARK && USING_DEFLATE
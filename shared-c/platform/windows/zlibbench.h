@@ -0,0 +1,28 @@
+/*
+*
+* Compares the DEFLATE implementation with zlib on the host.
+*
+* created: 17.10.26
+*
+*/
+#ifndef __WINDOWS_ZLIBBENCH_H__
+#define __WINDOWS_ZLIBBENCH_H__
+
+#if defined(USING_BENCHMARK) && defined(USING_DEFLATE)
+
+#define ZLIB_STRATEGY_DEFAULT		(0)	// Z_DEFAULT_STRATEGY
+#define ZLIB_STRATEGY_HUFFMAN_ONLY	(2)	// Z_HUFFMAN_ONLY: no back-references, only huffman coded literals
+
+// implemented in zlibcall.c
+const char *zlib_load(void);
+int zlib_compress_raw(const void *data, size_t length, void *output, size_t size, int level, int strategy, size_t *compressedLength);
+int zlib_decompress_raw(const void *data, size_t length, void *output, size_t size, size_t *produced);
+
+status_t zlib_benchmark_init(void);
+void zlib_huffman_benchmark(size_t length);
+void zlib_inflate_benchmark(size_t length);
+void zlib_deflate_benchmark(size_t length);
+
+#endif // USING_BENCHMARK && USING_DEFLATE
+
+#endif // __WINDOWS_ZLIBBENCH_H__
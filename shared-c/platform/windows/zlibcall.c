@@ -0,0 +1,78 @@
+/*
+*
+* Calls into zlib1.dll for the comparisons in zlibbench.c.
+* This file only includes zlib.h and is compiled without -fpack-struct, so that z_stream has the layout that zlib
+* expects. It uses none of the structures of the framework, only plain buffers. zlib is loaded at runtime instead
+* of being linked, because its inflate and deflate functions have the same names as the ones in deflate.c.
+*
+* created: 17.10.26
+*
+*/
+
+#include <windows.h>
+#include <zlib.h>
+
+#if defined(USING_BENCHMARK) && defined(USING_DEFLATE)
+
+
+// the functions of zlib1.dll that are used
+static __typeof__(zlibVersion) *zlibVersionFunc;
+static __typeof__(deflateInit2_) *deflateInit2Func;
+static __typeof__(deflate) *deflateFunc;
+static __typeof__(deflateEnd) *deflateEndFunc;
+static __typeof__(inflateInit2_) *inflateInit2Func;
+static __typeof__(inflate) *inflateFunc;
+static __typeof__(inflateEnd) *inflateEndFunc;
+
+
+// Loads zlib1.dll. Returns the version of zlib or NULL if it is not available.
+const char *zlib_load(void) {
+	HMODULE module = LoadLibraryA("zlib1.dll");
+	if (!module)
+		return NULL;
+
+	zlibVersionFunc = (__typeof__(zlibVersionFunc))GetProcAddress(module, "zlibVersion");
+	deflateInit2Func = (__typeof__(deflateInit2Func))GetProcAddress(module, "deflateInit2_");
+	deflateFunc = (__typeof__(deflateFunc))GetProcAddress(module, "deflate");
+	deflateEndFunc = (__typeof__(deflateEndFunc))GetProcAddress(module, "deflateEnd");
+	inflateInit2Func = (__typeof__(inflateInit2Func))GetProcAddress(module, "inflateInit2_");
+	inflateFunc = (__typeof__(inflateFunc))GetProcAddress(module, "inflate");
+	inflateEndFunc = (__typeof__(inflateEndFunc))GetProcAddress(module, "inflateEnd");
+	if (!zlibVersionFunc || !deflateInit2Func || !deflateFunc || !deflateEndFunc || !inflateInit2Func || !inflateFunc || !inflateEndFunc)
+		zlibVersionFunc = NULL;
+	return (zlibVersionFunc ? zlibVersionFunc() : NULL);
+}
+
+
+// Compresses data into a bare DEFLATE stream.
+//	size: the size of the output buffer
+//	strategy: one of the Z_ strategies (e.g. Z_HUFFMAN_ONLY)
+//	compressedLength: receives the length of the compressed data
+// Returns zero on success.
+int zlib_compress_raw(const void *data, size_t length, void *output, size_t size, int level, int strategy, size_t *compressedLength) {
+	z_stream stream = { .next_in = (Bytef *)data, .avail_in = length, .next_out = (Bytef *)output, .avail_out = size };
+	if (!zlibVersionFunc || deflateInit2Func(&stream, level, Z_DEFLATED, -15, 8, strategy, ZLIB_VERSION, sizeof(z_stream)) != Z_OK)
+		return Z_STREAM_ERROR;
+	int result = deflateFunc(&stream, Z_FINISH);
+	*compressedLength = stream.total_out;
+	deflateEndFunc(&stream);
+	return (result == Z_STREAM_END ? Z_OK : Z_BUF_ERROR);
+}
+
+
+// Decompresses a bare DEFLATE stream.
+//	size: the size of the output buffer
+//	produced: receives the length of the decompressed data
+// Returns zero on success.
+int zlib_decompress_raw(const void *data, size_t length, void *output, size_t size, size_t *produced) {
+	z_stream stream = { .next_in = (Bytef *)data, .avail_in = length, .next_out = (Bytef *)output, .avail_out = size };
+	if (!zlibVersionFunc || inflateInit2Func(&stream, -15, ZLIB_VERSION, sizeof(z_stream)) != Z_OK)
+		return Z_STREAM_ERROR;
+	int result = inflateFunc(&stream, Z_FINISH);
+	*produced = stream.total_out;
+	inflateEndFunc(&stream);
+	return (result == Z_STREAM_END ? Z_OK : Z_DATA_ERROR);
+}
+
+
+#endif // USING_BENCHMARK && USING_DEFLATE
@@ -19,6 +19,7 @@
 
 void *malloc(size_t size);
 void *realloc(void *block, size_t size);
+void *aligned_alloc(size_t alignment, size_t size);
 void free(void *block);
 
 // Allocates the specified number of elements and clears the memory.
@@ -34,6 +35,9 @@ static inline void* calloc(size_t num, size_t size) {
 // Copies memory from source to destination
 void *memcpy(void *restrict __dest, const void *restrict __src, size_t __n);
 
+// Copies memory from source to destination (the blocks may overlap)
+void *memmove(void *__dest, const void *__src, size_t __n);
+
 // Returns 0 if two blocks of memory are equal
 int memcmp(const void *ptr1, const void *ptr2, size_t num);
 
@@ -245,6 +245,13 @@ static inline uint32_t little_endian_32(uint32_t val) {
 #include <system/log.h>
 #include <system/math.h>
 #include <system/time.h>
+#include <system/benchmark.h>
+#ifdef USING_DEFLATE
+#  include <system/stream.h>
+#  include <system/huffman.h>
+#  include <system/checksum.h>
+#  include <system/deflate.h>
+#endif
 
 #include <hardware/i2c.h>
 #include <hardware/motor.h>
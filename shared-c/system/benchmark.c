@@ -0,0 +1,28 @@
+/*
+*
+* Provides the time measurement of the benchmarks.
+*
+* created: 16.10.26
+*
+*/
+
+#include <system.h>
+#include "benchmark.h"
+
+#ifdef USING_BENCHMARK
+
+
+// Ends a measurement and writes the number of cycles per unit of work to the log.
+//	variant: the code path that was measured
+//	count: the number of units of work that were done
+//	unit: the name of a unit of work (e.g. "allocation" or "kB")
+// Returns the number of cycles that the measurement took.
+uint64_t benchmark_stop(benchmark_t *bench, const char *variant, uint64_t count, const char *unit) {
+	uint64_t cycles = read_tsc() - bench->start;
+	uint64_t tenths = cycles * 10 / (count ? count : 1);
+	LOGI("%s benchmark: %s: %d.%d cycles per %s", bench->name, variant, (int)(tenths / 10), (int)(tenths % 10), unit);
+	return cycles;
+}
+
+
+#endif // USING_BENCHMARK
@@ -0,0 +1,54 @@
+/*
+*
+* Provides what the benchmarks of the individual modules have in common: a pseudo-random number generator,
+* so that every variant of a benchmark sees the same input, and the time measurement.
+* The benchmarks are only compiled with the BENCHMARK feature (the kernel runs them at startup when it is
+* built with "make BENCHMARK=1"). The time is measured in cycles using read_tsc, which the architecture or
+* platform layer must provide.
+*
+* created: 16.10.26
+*
+*/
+
+#ifndef __BENCHMARK_H__
+#define __BENCHMARK_H__
+
+#ifdef USING_BENCHMARK
+
+
+typedef struct
+{
+	const char *name;		// precedes every line that the benchmark writes to the log
+	uint32_t random;		// state of the pseudo-random number generator
+	uint64_t start;			// time stamp at which the current measurement was started
+} benchmark_t;
+
+
+// Prepares a benchmark.
+static inline void benchmark_init(benchmark_t *bench, const char *name) {
+	bench->name = name;
+	bench->random = 12345;
+	bench->start = 0;
+}
+
+// Restarts the sequence of pseudo-random numbers, so that the next variant sees the same input as the previous one.
+static inline void benchmark_reseed(benchmark_t *bench) {
+	bench->random = 12345;
+}
+
+// Returns the next pseudo-random number. The generator is linear congruential, so the low bits are not very random.
+static inline uint32_t benchmark_random(benchmark_t *bench) {
+	return bench->random = bench->random * 1103515245 + 12345;
+}
+
+// Starts a measurement.
+static inline void benchmark_start(benchmark_t *bench) {
+	bench->start = read_tsc();
+}
+
+uint64_t benchmark_stop(benchmark_t *bench, const char *variant, uint64_t count, const char *unit);
+
+
+#endif // USING_BENCHMARK
+
+#endif // __BENCHMARK_H__
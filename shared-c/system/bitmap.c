@@ -45,24 +45,113 @@ void bitmap_setpixel(bitmap_t *bitmap, int64_t x, int64_t y, color_t color) {
 
 
 
-//CPUACCELFUNC(int, test_func, (int arg1, int arg2), {
-//	return arg1 + arg2;
-//})
-
-// todo: remove this stuff
-CPUACCELDECL(int, test_func, (int arg1, int arg2));
-CPUACCELFUNC(int, test_func, (int arg1, int arg2), {
-	return arg1 + arg2;
+// The row kernels below work on the individual 8-bit channels of a row of pixels.
+// Horizontally interpolated rows hold each channel in 8.8 fixed point.
+// The vector types are mapped to whatever registers the CPU feature level of the kernel provides.
+typedef uint8_t bitmap_u8x16_t __attribute__((__vector_size__(16), __aligned__(1), __may_alias__));
+typedef uint16_t bitmap_u16x16_t __attribute__((__vector_size__(32), __aligned__(1), __may_alias__));
+typedef uint32_t bitmap_u32x16_t __attribute__((__vector_size__(64), __aligned__(1), __may_alias__));
+typedef uint16_t bitmap_u16x4_t __attribute__((__vector_size__(8)));
+typedef uint32_t bitmap_u32x4_t __attribute__((__vector_size__(16), __aligned__(4), __may_alias__));
+typedef uint64_t bitmap_u64x4_t __attribute__((__vector_size__(32)));
+typedef uint8_t bitmap_u8x4_t __attribute__((__vector_size__(4), __aligned__(1), __may_alias__));
+
+
+// Interpolates a source row horizontally.
+//	dest: receives 4 channels per destination pixel
+//	src: the source row
+//	columns: byte offset of the left source pixel for each destination pixel
+//	weights: weight of the right source pixel (0...256) for each destination pixel
+//	next: byte offset of the right source pixel relative to the left one
+CPUACCELDECL(void, bitmap_interpolate_row, (uint16_t *dest, const uint8_t *src, const uint32_t *columns, const uint16_t *weights, size_t next, size_t count));
+CPUACCELFUNC(void, bitmap_interpolate_row, (uint16_t *dest, const uint8_t *src, const uint32_t *columns, const uint16_t *weights, size_t next, size_t count), {
+	for (size_t i = 0; i < count; i++) {
+		const uint8_t *p0 = src + columns[i];
+		bitmap_u16x4_t c0 = __builtin_convertvector(*(bitmap_u8x4_t *)p0, bitmap_u16x4_t);
+		bitmap_u16x4_t c1 = __builtin_convertvector(*(bitmap_u8x4_t *)(p0 + next), bitmap_u16x4_t);
+		*(bitmap_u16x4_t *)(dest + 4 * i) = c0 * (uint16_t)(256 - weights[i]) + c1 * weights[i];
+	}
+})
+
+// Interpolates vertically between two horizontally interpolated rows.
+//	weight: weight of the second row (0...256)
+//	count: number of channels (4 per pixel)
+CPUACCELDECL(void, bitmap_blend_rows, (uint8_t *dest, const uint16_t *row0, const uint16_t *row1, uint32_t weight, size_t count));
+CPUACCELFUNC(void, bitmap_blend_rows, (uint8_t *dest, const uint16_t *row0, const uint16_t *row1, uint32_t weight, size_t count), {
+	uint32_t inverse = 256 - weight;
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		bitmap_u32x16_t a = __builtin_convertvector(*(bitmap_u16x16_t *)(row0 + i), bitmap_u32x16_t);
+		bitmap_u32x16_t b = __builtin_convertvector(*(bitmap_u16x16_t *)(row1 + i), bitmap_u32x16_t);
+		*(bitmap_u8x16_t *)(dest + i) = __builtin_convertvector((a * inverse + b * weight + 0x8000) >> 16, bitmap_u8x16_t);
+	}
+	for (; i < count; i++)
+		dest[i] = (row0[i] * inverse + row1[i] * weight + 0x8000) >> 16;
+})
+
+// Adds a source row to an accumulator row.
+//	count: number of channels (4 per pixel)
+CPUACCELDECL(void, bitmap_accumulate_row, (uint32_t *acc, const uint8_t *src, size_t count));
+CPUACCELFUNC(void, bitmap_accumulate_row, (uint32_t *acc, const uint8_t *src, size_t count), {
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16)
+		*(bitmap_u32x16_t *)(acc + i) += __builtin_convertvector(*(bitmap_u8x16_t *)(src + i), bitmap_u32x16_t);
+	for (; i < count; i++)
+		acc[i] += src[i];
 })
 
+// Adds up the accumulated source pixels that each destination pixel covers and turns the sums into averages.
+//	columns: index of the first and the last + 1 accumulated pixel for each destination pixel
+//	scales: 65536 divided by the number of source columns of each destination pixel
+//	rowScale: 65536 divided by the number of source rows
+CPUACCELDECL(void, bitmap_reduce_row, (uint8_t *dest, const uint32_t *acc, const uint32_t *columns, const uint32_t *scales, uint32_t rowScale, size_t count));
+CPUACCELFUNC(void, bitmap_reduce_row, (uint8_t *dest, const uint32_t *acc, const uint32_t *columns, const uint32_t *scales, uint32_t rowScale, size_t count), {
+	for (size_t i = 0; i < count; i++) {
+		bitmap_u32x4_t sum = { 0, 0, 0, 0 };
+		for (uint32_t j = columns[2 * i]; j < columns[2 * i + 1]; j++)
+			sum += *(bitmap_u32x4_t *)(acc + 4 * j);
+		bitmap_u64x4_t average = (__builtin_convertvector(sum, bitmap_u64x4_t) * ((uint64_t)scales[i] * rowScale) + 0x80000000UL) >> 32;
+		*(bitmap_u8x4_t *)(dest + 4 * i) = __builtin_convertvector(average, bitmap_u8x4_t);
+	}
+})
+
+
+// Returns the smallest integer that is not less than the specified value (for non-negative values).
+static inline int64_t bitmap_ceil(double value) {
+	int64_t result = (int64_t)value;
+	return result + (result < value);
+}
+
+// Maps a position in 16.16 fixed point to the first of the two pixels that are interpolated and the weight (0...256)
+// of the second pixel. Positions outside of the image are clamped to the edge.
+static inline void bitmap_sample(int64_t pos, int64_t size, int64_t *index, uint32_t *weight) {
+	*index = (pos < 0 ? 0 : (pos >> 16));
+	*weight = (pos < 0 ? 0 : ((pos >> 8) & 0xFF));
+	if (*index >= size - 1) {
+		*index = (size > 1 ? size - 2 : 0);
+		*weight = (size > 1 ? 256 : 0);
+	}
+}
+
+// Maps the 16.16 fixed point range [start, start + step) to a range of whole pixels that contains at least one pixel of the image.
+static inline void bitmap_box(int64_t start, int64_t step, int64_t size, int64_t *first, int64_t *end) {
+	*first = (start + 0x8000) >> 16;
+	*end = (start + step + 0x8000) >> 16;
+	if (*first < 0) *first = 0;
+	if (*end > size) *end = size;
+	if (*first >= size) *first = size - 1;
+	if (*end <= *first) *end = *first + 1;
+}
+
 
-// Paints one bitmap onto another bitmap. (Currently not good for scaling down)
+// Paints one bitmap onto another bitmap.
+// The source is sampled in 16.16 fixed point: bilinear interpolation is used for enlarging, area averaging for shrinking.
+// Source pixels outside of the source image are clamped to the edge of the image.
 //	dest: destination image
 //	src: source image
 //	destRect: rectangle in the destination image to paint to (paints over the whole image if NULL)
 //	srcRect: rectangle in the source image to read from (uses the whole image if NULL)
 void bitmap_paint(bitmap_t *dest, bitmap_t *src, rect_t *destRect, rect_t *srcRect) {
-	// int b = test_func(23, 45);
 	assert(dest); assert(src);
 	rect_t destFrame = (rect_t) { .x = 0, .y = 0, .width = (double)dest->width, .height = (double)dest->height };
 	rect_t srcFrame = (rect_t) { .x = 0, .y = 0, .width = (double)src->width, .height = (double)src->height };
@@ -70,14 +159,107 @@ void bitmap_paint(bitmap_t *dest, bitmap_t *src, rect_t *destRect, rect_t *srcRe
 	if (!srcRect) srcRect = &srcFrame;
 	assert(destRect->width > 0); assert(destRect->height > 0);
 	assert(srcRect->width > 0); assert(srcRect->height > 0);
+	assert(src->width > 0); assert(src->height > 0);
+
+	// the part of the destination rectangle that lies within the destination image
+	int64_t offsetX = (int64_t)destRect->x, offsetY = (int64_t)destRect->y;
+	int64_t left = max(0, -offsetX), right = min(bitmap_ceil(destRect->width), (int64_t)dest->width - offsetX);
+	int64_t top = max(0, -offsetY), bottom = min(bitmap_ceil(destRect->height), (int64_t)dest->height - offsetY);
+	if (left >= right || top >= bottom)
+		return;
+	size_t count = right - left;
+
+	// source step per destination pixel and source origin in 16.16 fixed point
+	int64_t stepX = (int64_t)(srcRect->width / destRect->width * 65536), stepY = (int64_t)(srcRect->height / destRect->height * 65536);
+	int64_t originX = (int64_t)(srcRect->x * 65536), originY = (int64_t)(srcRect->y * 65536);
+	int shrink = (stepX >= 0x10000 && stepY >= 0x10000 && (stepX > 0x10000 || stepY > 0x10000));
+
+	size_t size = (shrink ? (3 * count + 4 * src->width) * sizeof(uint32_t) : count * (sizeof(uint32_t) + sizeof(uint16_t) + 8 * sizeof(uint16_t)));
+	char *buffer = (char *)malloc(size);
+	if (!buffer)
+		return;
+	uint32_t *columns = (uint32_t *)buffer;
+	const uint8_t *srcData = (const uint8_t *)src->data;
+	size_t srcStride = src->width * sizeof(color_t);
+
+	if (shrink) {
+		uint32_t *scales = columns + 2 * count;
+		uint32_t *acc = scales + count;
+
+		// the accumulator only covers the source columns that are actually needed
+		int64_t firstColumn = src->width, endColumn = 0;
+		for (size_t i = 0; i < count; i++) {
+			int64_t first, end;
+			bitmap_box(originX + (left + (int64_t)i) * stepX, stepX, src->width, &first, &end);
+			columns[2 * i] = first;
+			columns[2 * i + 1] = end;
+			scales[i] = 0x10000 / (end - first);
+			firstColumn = min(firstColumn, first);
+			endColumn = max(endColumn, end);
+		}
+		for (size_t i = 0; i < 2 * count; i++)
+			columns[i] -= firstColumn;
+		size_t accCount = 4 * (endColumn - firstColumn);
+
+		for (int64_t y = top; y < bottom; y++) {
+			int64_t first, end;
+			bitmap_box(originY + y * stepY, stepY, src->height, &first, &end);
+			memset(acc, 0, accCount * sizeof(uint32_t));
+			for (int64_t row = first; row < end; row++)
+				bitmap_accumulate_row(acc, srcData + row * srcStride + firstColumn * sizeof(color_t), accCount);
+			bitmap_reduce_row((uint8_t *)(dest->data + (y + offsetY) * dest->width + left + offsetX), acc, columns, scales, 0x10000 / (end - first), count);
+		}
 
+	} else {
+		uint16_t *weights = (uint16_t *)(columns + count);
+		uint16_t *rows[2] = { weights + count, weights + 5 * count };
+		int64_t rowIndices[2] = { -1, -1 }; // the source rows that are currently interpolated in rows[] (row n is always in rows[n & 1])
+
+		// sample at pixel centers
+		originX += stepX / 2 - 0x8000;
+		originY += stepY / 2 - 0x8000;
+
+		for (size_t i = 0; i < count; i++) {
+			int64_t index;
+			uint32_t weight;
+			bitmap_sample(originX + (left + (int64_t)i) * stepX, src->width, &index, &weight);
+			columns[i] = index * sizeof(color_t);
+			weights[i] = weight;
+		}
+		size_t next = (src->width > 1 ? sizeof(color_t) : 0);
+
+		for (int64_t y = top; y < bottom; y++) {
+			int64_t row;
+			uint32_t weight;
+			bitmap_sample(originY + y * stepY, src->height, &row, &weight);
+
+			// interpolate the two source rows horizontally unless this was already done for the previous line
+			for (int64_t r = row; r <= row + (src->height > 1); r++) {
+				if (rowIndices[r & 1] != r) {
+					bitmap_interpolate_row(rows[r & 1], srcData + r * srcStride, columns, weights, next, count);
+					rowIndices[r & 1] = r;
+				}
+			}
+
+			int64_t row1 = row + (src->height > 1);
+			bitmap_blend_rows((uint8_t *)(dest->data + (y + offsetY) * dest->width + left + offsetX), rows[row & 1], rows[row1 & 1], weight, 4 * count);
+		}
+	}
+
+	free(buffer);
+}
+
+
+#ifdef USING_BENCHMARK
+
+// Paints one bitmap onto another bitmap by interpolating each pixel in double precision, like bitmap_paint used to
+// (see bitmap_benchmark). Source pixels outside of the source image are black.
+static void bitmap_paint_double(bitmap_t *dest, bitmap_t *src, rect_t *destRect, rect_t *srcRect) {
 	double ratioX = srcRect->width / destRect->width;
 	double ratioY = srcRect->height / destRect->height;
 
-	// paint pixel by pixel in the destination rectangle
 	for (int64_t y = max(0, -destRect->y); y < min(destRect->height, dest->height - destRect->y); y++) {
 		for (int64_t x = max(0, -destRect->x); x < min(destRect->width, dest->width - destRect->x); x++) {
-			// find the theoretical coordinates in the source image
 			double srcX = (double)x * ratioX;
 			double srcY = (double)y * ratioY;
 			double pX = srcX - (double)(int64_t)srcX;
@@ -87,7 +269,6 @@ void bitmap_paint(bitmap_t *dest, bitmap_t *src, rect_t *destRect, rect_t *srcRe
 			double p10 = pX * (1 - pY);
 			double p11 = pX * pY;
 
-			// find the 4 colors that surround the theoretical point in the source image
 			int64_t srcXint = (int64_t)(srcX + srcRect->x);
 			int64_t srcYint = (int64_t)(srcY + srcRect->y);
 			int withinX0 = (srcXint >= 0 && srcXint < src->width);
@@ -99,17 +280,80 @@ void bitmap_paint(bitmap_t *dest, bitmap_t *src, rect_t *destRect, rect_t *srcRe
 			color_t color10 = (withinX1 && withinY0) ? src->data[srcYint * src->width + srcXint + 1] : COLOR_BLACK;
 			color_t color11 = (withinX1 && withinY1) ? src->data[(srcYint + 1) * src->width + srcXint + 1] : COLOR_BLACK;
 
-			// mix the 4 surrounding colors
 			color_t color;
 			color.red = (double)color00.red * p00 + (double)color01.red * p01 + (double)color10.red * p10 + (double)color11.red * p11;
 			color.green = (double)color00.green * p00 + (double)color01.green * p01 + (double)color10.green * p10 + (double)color11.green * p11;
 			color.blue = (double)color00.blue * p00 + (double)color01.blue * p01 + (double)color10.blue * p10 + (double)color11.blue * p11;
+			color.alpha = 255;
 			dest->data[((y + (size_t)destRect->y) * dest->width + x + (size_t)destRect->x)] = color;
 		}
 	}
 }
 
 
+// Compares the double precision filter that bitmap_paint used before with the fixed point row kernels
+// when enlarging, copying and shrinking a pseudo-random image. Painting a single color must reproduce that color exactly.
+// The results are written to the log in cycles per 100 destination pixels.
+//	repeats: number of times each image is painted
+void bitmap_benchmark(int repeats) {
+	benchmark_t bench;
+	benchmark_init(&bench, "bitmap");
+	const struct { uint64_t srcWidth, srcHeight, destWidth, destHeight; } cases[] = {
+		{ 640, 480, 1024, 768 },
+		{ 1024, 768, 1024, 768 },
+		{ 1920, 1080, 640, 360 },
+	};
+	if (repeats < 1)
+		repeats = 1;
+
+	for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+		bitmap_t *src = bitmap_alloc(cases[c].srcWidth, cases[c].srcHeight);
+		bitmap_t *dest = bitmap_alloc(cases[c].destWidth, cases[c].destHeight);
+		if (!src || !dest) {
+			LOGE("bitmap benchmark: could not allocate the %dx%d and %dx%d images", (int)cases[c].srcWidth, (int)cases[c].srcHeight, (int)cases[c].destWidth, (int)cases[c].destHeight);
+			if (src) bitmap_free(src);
+			if (dest) bitmap_free(dest);
+			return;
+		}
+
+		// a single color must come out unchanged, no matter how it is scaled
+		for (size_t i = 0; i < src->width * src->height; i++)
+			src->data[i] = (color_t) { .red = 12, .green = 34, .blue = 56, .alpha = 255 };
+		bitmap_paint(dest, src, NULL, NULL);
+		size_t wrong = 0;
+		for (size_t i = 0; i < dest->width * dest->height; i++)
+			wrong += (dest->data[i].red != 12 || dest->data[i].green != 34 || dest->data[i].blue != 56 || dest->data[i].alpha != 255);
+		if (wrong)
+			LOGE("bitmap benchmark: %d of %d pixels changed their color", (int)wrong, (int)(dest->width * dest->height));
+
+		benchmark_reseed(&bench);
+		for (size_t i = 0; i < src->width * src->height; i++) {
+			uint32_t random = benchmark_random(&bench);
+			src->data[i] = (color_t) { .red = random >> 8, .green = random >> 16, .blue = random >> 24, .alpha = 255 };
+		}
+
+		rect_t destRect = (rect_t) { .x = 0, .y = 0, .width = (double)dest->width, .height = (double)dest->height };
+		rect_t srcRect = (rect_t) { .x = 0, .y = 0, .width = (double)src->width, .height = (double)src->height };
+		LOGI("bitmap benchmark: %dx%d to %dx%d", (int)src->width, (int)src->height, (int)dest->width, (int)dest->height);
+		for (int pass = 0; pass < 2; pass++) {
+			benchmark_start(&bench);
+			for (int i = 0; i < repeats; i++) {
+				if (pass)
+					bitmap_paint(dest, src, &destRect, &srcRect);
+				else
+					bitmap_paint_double(dest, src, &destRect, &srcRect);
+			}
+			benchmark_stop(&bench, (pass ? "fixed point" : "double precision"), repeats * dest->width * dest->height / 100, "100 pixels");
+		}
+
+		bitmap_free(src);
+		bitmap_free(dest);
+	}
+}
+
+#endif // USING_BENCHMARK
+
+
 
 #ifdef USING_FILESYSTEM
 
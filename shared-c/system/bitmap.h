@@ -37,6 +37,9 @@ bitmap_t *bitmap_alloc(uint64_t width, uint64_t height);
 void bitmap_free(bitmap_t *bitmap);
 void bitmap_setpixel(bitmap_t *bitmap, int64_t x, int64_t y, color_t color);
 void bitmap_paint(bitmap_t *dest, bitmap_t *src, rect_t *destRect, rect_t *srcRect);
+#ifdef USING_BENCHMARK
+void bitmap_benchmark(int repeats);
+#endif
 
 #ifdef USING_FILESYSTEM
 status_t bitmap_load(file_t *file, bitmap_t **bitmapPtr);
@@ -0,0 +1,203 @@
+/*
+*
+* Computes the Adler-32 checksum of zlib (RFC1950) and the CRC32 of gzip (RFC1952).
+* Adler-32 sums 8 byte chunks in vectors, CRC32 uses slicing-by-8 tables and, at the CPU feature level that includes
+* carry-less multiplication, folds 64 bytes at a time (Intel, "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ").
+*
+* created: 16.10.26
+*
+*/
+
+#include <system.h>
+#include "checksum.h"
+
+#ifdef USING_DEFLATE
+
+
+#define ADLER32_BASE	(65521)	// the largest prime below 2^16
+#define ADLER32_NMAX	(5552)	// the number of bytes after which the sums must be reduced, so that they don't overflow
+
+#define CRC32_POLYNOMIAL	(0xEDB88320)	// the reflected gzip polynomial
+#define CRC32_FOLD_MIN		(64)			// the shortest input that is folded with carry-less multiplication
+
+
+#if defined(__i386__) || defined(__x86_64__) || defined(__amd64__)
+#define CRC32_FOLD_SUPPORTED	// carry-less multiplication can be compiled (x86 only), level 2 of CPUACCELFUNC uses it
+#endif
+
+
+typedef uint8_t checksum_u8x8_t __attribute__((__vector_size__(8), __aligned__(1), __may_alias__));
+typedef uint32_t checksum_u32x8_t __attribute__((__vector_size__(32)));
+
+
+// Updates the two Adler-32 sums with a chunk of data.
+// Each lane of the vectors handles one byte position of the 8 byte chunks: sums accumulates the bytes of the lane
+// and prefix accumulates the values that sums had before each chunk. This yields the second sum without multiplying
+// inside the loop. The same loop is compiled for every level, the compiler maps the vectors to the registers that
+// the level provides (SSE or AVX2 on x86).
+CPUACCELDECL(uint32_t, adler32_accel, (uint32_t adler, const uint8_t *data, size_t length));
+CPUACCELFUNC(uint32_t, adler32_accel, (uint32_t adler, const uint8_t *data, size_t length), {
+	uint32_t a = adler & 0xFFFF, b = adler >> 16;
+
+	while (length) {
+		size_t blockLength = (length < ADLER32_NMAX ? length : ADLER32_NMAX);
+		size_t chunks = blockLength / 8;
+		length -= blockLength;
+
+		if (chunks) {
+			checksum_u32x8_t sums = { 0 }, prefix = { 0 };
+			for (size_t i = 0; i < chunks; i++, data += 8) {
+				prefix += sums;
+				sums += __builtin_convertvector(*(checksum_u8x8_t *)data, checksum_u32x8_t);
+			}
+
+			uint64_t total = 0, weighted = 0, prefixTotal = 0;
+			for (int i = 0; i < 8; i++) {
+				total += sums[i];
+				weighted += (uint64_t)(8 - i) * sums[i];
+				prefixTotal += prefix[i];
+			}
+			b = (b + 8 * chunks * (uint64_t)a + 8 * prefixTotal + weighted) % ADLER32_BASE;
+			a = (a + total) % ADLER32_BASE;
+		}
+
+		for (size_t i = chunks * 8; i < blockLength; i++) {
+			a += *data++;
+			b += a;
+		}
+		a %= ADLER32_BASE;
+		b %= ADLER32_BASE;
+	}
+
+	return a | (b << 16);
+})
+
+
+// Updates an Adler-32 checksum.
+//	adler: the checksum of the preceding data (ADLER32_INIT for the first chunk)
+uint32_t adler32_update(uint32_t adler, const void *data, size_t length) {
+	return adler32_accel(adler, (const uint8_t *)data, length);
+}
+
+
+// the slicing-by-8 tables are built on first use
+// crc32Table[k][n] is the CRC of the byte n followed by k zero bytes
+static uint32_t crc32Table[8][256];
+static volatile bool crc32TableReady = 0;
+
+
+// Builds the slicing-by-8 tables if this did not happen yet.
+static void crc32_init_table(void) {
+	if (crc32TableReady)
+		return;
+
+	for (int n = 0; n < 256; n++) {
+		uint32_t crc = n;
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (CRC32_POLYNOMIAL & -(crc & 1));
+		crc32Table[0][n] = crc;
+	}
+	for (int n = 0; n < 256; n++)
+		for (int k = 1; k < 8; k++)
+			crc32Table[k][n] = (crc32Table[k - 1][n] >> 8) ^ crc32Table[0][crc32Table[k - 1][n] & 0xFF];
+
+	__sync_synchronize();
+	crc32TableReady = 1;
+}
+
+
+// Updates the inverted CRC register with 8 bytes per step.
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *data, size_t length) {
+	for (; length >= 8; length -= 8, data += 8) {
+		uint32_t low = crc ^ (data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24));
+		uint32_t high = data[4] | (data[5] << 8) | (data[6] << 16) | ((uint32_t)data[7] << 24);
+		crc = crc32Table[7][low & 0xFF] ^ crc32Table[6][(low >> 8) & 0xFF] ^
+			crc32Table[5][(low >> 16) & 0xFF] ^ crc32Table[4][low >> 24] ^
+			crc32Table[3][high & 0xFF] ^ crc32Table[2][(high >> 8) & 0xFF] ^
+			crc32Table[1][(high >> 16) & 0xFF] ^ crc32Table[0][high >> 24];
+	}
+
+	for (; length; length--)
+		crc = crc32Table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+
+#ifdef CRC32_FOLD_SUPPORTED
+
+typedef long long crc32_v2di_t __attribute__((__vector_size__(16)));
+typedef long long crc32_v2di_u_t __attribute__((__vector_size__(16), __aligned__(1), __may_alias__));
+typedef uint32_t crc32_v4si_t __attribute__((__vector_size__(16)));
+
+#define CRC32_CLMUL(a, b, select)	__builtin_ia32_pclmulqdq128((a), (b), (select))
+#define CRC32_SHIFT_RIGHT(a, bytes)	__builtin_ia32_psrldqi128((a), (bytes) * 8)
+
+// Updates the inverted CRC register by folding 16 byte chunks with carry-less multiplication.
+// The constants are x^(4*128+32), x^(4*128-32), x^(128+32), x^(128-32) and x^64 modulo the polynomial, followed by
+// the polynomial and its Barrett constant, all bit reflected.
+//	length: a multiple of 16 that is at least CRC32_FOLD_MIN
+static uint32_t __attribute__((__target__("pclmul"))) crc32_fold(uint32_t crc, const uint8_t *data, size_t length) {
+	const crc32_v2di_t k1k2 = { 0x154442BD4, 0x1C6E41596 };
+	const crc32_v2di_t k3k4 = { 0x1751997D0, 0x0CCAA009E };
+	const crc32_v2di_t k5k0 = { 0x163CD6124, 0 };
+	const crc32_v2di_t poly = { 0x1DB710641, 0x1F7011641 };
+	const crc32_v2di_t mask32 = (crc32_v2di_t)(crc32_v4si_t) { 0xFFFFFFFF, 0, 0xFFFFFFFF, 0 };
+
+	// fold four chunks in parallel
+	crc32_v2di_t x1 = *(crc32_v2di_u_t *)data ^ (crc32_v2di_t) { crc, 0 };
+	crc32_v2di_t x2 = *((crc32_v2di_u_t *)data + 1);
+	crc32_v2di_t x3 = *((crc32_v2di_u_t *)data + 2);
+	crc32_v2di_t x4 = *((crc32_v2di_u_t *)data + 3);
+	for (data += 64, length -= 64; length >= 64; data += 64, length -= 64) {
+		x1 = CRC32_CLMUL(x1, k1k2, 0x00) ^ CRC32_CLMUL(x1, k1k2, 0x11) ^ *(crc32_v2di_u_t *)data;
+		x2 = CRC32_CLMUL(x2, k1k2, 0x00) ^ CRC32_CLMUL(x2, k1k2, 0x11) ^ *((crc32_v2di_u_t *)data + 1);
+		x3 = CRC32_CLMUL(x3, k1k2, 0x00) ^ CRC32_CLMUL(x3, k1k2, 0x11) ^ *((crc32_v2di_u_t *)data + 2);
+		x4 = CRC32_CLMUL(x4, k1k2, 0x00) ^ CRC32_CLMUL(x4, k1k2, 0x11) ^ *((crc32_v2di_u_t *)data + 3);
+	}
+
+	// fold into a single chunk and fold the remaining chunks into it
+	x1 = CRC32_CLMUL(x1, k3k4, 0x00) ^ CRC32_CLMUL(x1, k3k4, 0x11) ^ x2;
+	x1 = CRC32_CLMUL(x1, k3k4, 0x00) ^ CRC32_CLMUL(x1, k3k4, 0x11) ^ x3;
+	x1 = CRC32_CLMUL(x1, k3k4, 0x00) ^ CRC32_CLMUL(x1, k3k4, 0x11) ^ x4;
+	for (; length >= 16; data += 16, length -= 16)
+		x1 = CRC32_CLMUL(x1, k3k4, 0x00) ^ CRC32_CLMUL(x1, k3k4, 0x11) ^ *(crc32_v2di_u_t *)data;
+
+	// fold 128 bits into 64 bits
+	x1 = CRC32_SHIFT_RIGHT(x1, 8) ^ CRC32_CLMUL(x1, k3k4, 0x10);
+	x1 = CRC32_CLMUL(x1 & mask32, k5k0, 0x00) ^ CRC32_SHIFT_RIGHT(x1, 4);
+
+	// Barrett reduction to 32 bits
+	crc32_v2di_t quotient = CRC32_CLMUL(x1 & mask32, poly, 0x10);
+	x1 ^= CRC32_CLMUL(quotient & mask32, poly, 0x00);
+	return ((crc32_v4si_t)x1)[1];
+}
+
+
+#else
+#define crc32_fold(crc, data, length)	(crc)	// never called, CPUACCELLEVEL is 0 without the x86 architecture layer
+#endif // CRC32_FOLD_SUPPORTED
+
+
+// Updates the inverted CRC register. Level 2 (which includes PCLMUL) folds all complete 16 byte chunks first.
+CPUACCELDECL(uint32_t, crc32_accel, (uint32_t crc, const uint8_t *data, size_t length));
+CPUACCELFUNC(uint32_t, crc32_accel, (uint32_t crc, const uint8_t *data, size_t length), {
+	if (CPUACCELLEVEL > 1 && length >= CRC32_FOLD_MIN) {
+		size_t folded = length & ~(size_t)15;
+		crc = crc32_fold(crc, data, folded);
+		data += folded;
+		length -= folded;
+	}
+
+	crc32_init_table();
+	return crc32_slice8(crc, data, length);
+})
+
+
+// Updates a CRC32 checksum.
+//	crc: the checksum of the preceding data (CRC32_INIT for the first chunk)
+uint32_t crc32_update(uint32_t crc, const void *data, size_t length) {
+	return ~crc32_accel(~crc, (const uint8_t *)data, length);
+}
+
+
+#endif // USING_DEFLATE
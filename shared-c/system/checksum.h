@@ -0,0 +1,25 @@
+/*
+*
+* Computes the checksums of the zlib (RFC1950) and gzip (RFC1952) formats.
+*
+* created: 16.10.26
+*
+*/
+
+#ifndef __CHECKSUM_H__
+#define __CHECKSUM_H__
+
+#ifdef USING_DEFLATE
+
+
+#define ADLER32_INIT	(1)	// the Adler-32 checksum of no data
+#define CRC32_INIT		(0)	// the CRC32 checksum of no data
+
+
+uint32_t adler32_update(uint32_t adler, const void *data, size_t length);
+uint32_t crc32_update(uint32_t crc, const void *data, size_t length);
+
+
+#endif // USING_DEFLATE
+
+#endif // __CHECKSUM_H__
@@ -1,10 +1,17 @@
 /*
 *
-* Implements decompression of DEFLATE formatted data (RFC1951)
+* Implements compression and decompression of DEFLATE formatted data (RFC1951)
 *
 * created: 15.01.15
 */
 
+#include <system.h>
+#include "stream.h"
+#include "huffman.h"
+#include "checksum.h"
+#include "deflate.h"
+
+#ifdef USING_DEFLATE
 
 
 #define BLOCK_TYPE_RAW		(0)
@@ -12,200 +19,1318 @@
 #define BLOCK_TYPE_DYNAMIC	(2)
 
 
-#define ALPHABET_SIZE	(288)	// number of symbols in the literal and distance alphabets
-#define MAX_BITS		(15)	// maximum number of bits per code in the literal and distance codings
+#define LITERAL_ALPHABET_SIZE	(288)	// number of symbols in the literal/length alphabet (including the two unused ones)
+#define DISTANCE_ALPHABET_SIZE	(30)	// number of symbols in the distance alphabet
+#define LENGTH_ALPHABET_SIZE	(19)	// number of symbols in the code length alphabet
+#define END_OF_BLOCK			(256)
+
+
+// base values and number of extra bits for the length symbols 257...285 (RFC 1951, 3.2.5)
+static const uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t lengthExtraBits[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+
+// base values and number of extra bits for the distance symbols 0...29
+static const uint16_t distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t distanceExtraBits[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// order in which the code lengths of the code length alphabet are stored
+static const uint8_t lengthOrder[LENGTH_ALPHABET_SIZE] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+
+#define INFLATE_STATE_HEADER	(0)	// a block header is expected next
+#define INFLATE_STATE_RAW		(1)	// an uncompressed block is being copied
+#define INFLATE_STATE_BLOCK		(2)	// a compressed block is being decoded
+#define INFLATE_STATE_DONE		(3)	// the end of the stream was reached
+#define INFLATE_STATE_ZLIB		(4)	// a zlib header is expected next
+#define INFLATE_STATE_GZIP		(5)	// the fixed part of a gzip header is expected next
+#define INFLATE_STATE_GZIP_FIELDS	(6)	// the optional fields of a gzip header are being skipped
+#define INFLATE_STATE_TRAILER	(7)	// the last block was decoded and the checksum is expected next
+
+#define INFLATE_MAX_MATCH		(258)	// the maximum number of bytes that a single symbol can produce
+
+// zlib header (RFC 1950, 2.2)
+#define ZLIB_METHOD_DEFLATE		(8)
+#define ZLIB_FLAG_DICTIONARY	(1 << 5)
+
+// gzip header (RFC 1952, 2.3)
+#define GZIP_ID					(0x8B1F)
+#define GZIP_METHOD_DEFLATE		(8)
+#define GZIP_FLAG_HEADER_CRC	(1 << 1)
+#define GZIP_FLAG_EXTRA			(1 << 2)
+#define GZIP_FLAG_NAME			(1 << 3)
+#define GZIP_FLAG_COMMENT		(1 << 4)
+#define GZIP_FLAG_RESERVED		(0xE0)
+#define GZIP_OS_UNKNOWN			(255)
 
 
+// the codings for dynamic blocks (too large for the stack, so they are allocated once per inflater)
+typedef struct inflate_codings_t {
+	huffman_t literalCoding;
+	huffman_t distanceCoding;
+} inflate_codings_t;
 
+// the fixed codings are built on first use (RFC 1951, 3.2.6)
+static huffman_t fixedLiteralCoding;
+static huffman_t fixedDistanceCoding;
+static volatile bool fixedCodingsReady = 0;
 
 
-// Reads a huffman coding tree from an input stream. The tree itself is decoded using another coding.
-//	input: the stream to read the coding from
-//	coding: the coding that should be used to read the new coding
-//	symbolCount: the number of symbols in the new coding
-//	result: set to the newly generated huffman coding tree (must be released using huffman_free)
+
+// Builds the fixed literal and distance codings if this did not happen yet.
+static void inflate_init_fixed(void) {
+	if (fixedCodingsReady)
+		return;
+
+	uint8_t lengths[LITERAL_ALPHABET_SIZE];
+	memset(lengths, 8, 144);
+	memset(lengths + 144, 9, 112);
+	memset(lengths + 256, 7, 24);
+	memset(lengths + 280, 8, 8);
+	huffman_init(&fixedLiteralCoding, lengths, LITERAL_ALPHABET_SIZE);
+
+	memset(lengths, 5, DISTANCE_ALPHABET_SIZE);
+	huffman_init(&fixedDistanceCoding, lengths, DISTANCE_ALPHABET_SIZE);
+
+	__sync_synchronize();
+	fixedCodingsReady = 1;
+}
+
+
+// Reads a sequence of code lengths from an input stream. The code lengths themselves are huffman encoded.
+//	input: the stream to read the code lengths from
+//	coding: the coding that should be used to read the code lengths
+//	count: the number of code lengths to read
+//	lengths: receives the code lengths
 // Returns a non-zero error code if the operation failed.
-status_t inflate_tree(bitstream_t *input, huffman_t *coding, int symbolCount, huffman_t **result) {
-	int codeLengths[symbolCount] = { 0 };
-	uint64_t symbol, lastLength = 0, repeat;
-	
-	for (int i = 0; i < symbolCount;) {
-		if (status = huffman_read_symbol(input, coding, &symbol)) return status;
+static status_t inflate_lengths(bitstream_t *input, const huffman_t *coding, int count, uint8_t *lengths) {
+	status_t status;
+	uint64_t symbol, repeat;
+	uint8_t lastLength = 0;
+
+	for (int i = 0; i < count;) {
+		if ((status = huffman_read_symbol(input, coding, &symbol))) return status;
 		if (symbol <= 15) { // explicit length of this code
-			codeLengths[i++] = lastLength = symbol;
+			lengths[i++] = lastLength = symbol;
 		} else { // implicitly defined code length (use length from previous code or use 0)
-			if (status = huffman_read_symbol(input, (symbol == 16 ? 2 (symbol == 17 ? 3 : 7)), &repeat)) return status;
+			if (symbol == 16 && !i) return STATUS_DATA_CORRUPT;
+			if ((status = bitstream_read(input, (symbol == 16 ? 2 : (symbol == 17 ? 3 : 7)), &repeat))) return status;
 			repeat += (symbol == 18 ? 11 : 3);
 			if (symbol != 16) lastLength = 0;
-			while (repeat--) codeLengths[i++] = lastLength;
+			if (i + repeat > (uint64_t)count) return STATUS_DATA_CORRUPT;
+			while (repeat--) lengths[i++] = lastLength;
 		}
 	}
 
-	*result = huffman_init(codeLengths, symbolCount, MAX_CODE_BITS);
-	if (!result) return STATUS_OUT_OF_MEMORY;
-
 	return STATUS_SUCCESS;
 }
 
 
+// Appends data to the window.
+static void inflate_window_write(inflater_t *inflater, const void *data, size_t count) {
+	size_t offset = inflater->windowPos & (INFLATE_WINDOW_SIZE - 1);
+	size_t part = INFLATE_WINDOW_SIZE - offset;
+	if (part > count)
+		part = count;
+	memcpy(inflater->window + offset, data, part);
+	memcpy(inflater->window, (const char *)data + part, count - part);
+	inflater->windowPos += count;
+	inflater->pending += count;
+}
+
+
+// Copies a match that does not wrap around the end of the window. The source may overlap with the destination.
+// Long distances are copied in chunks of 16 or 8 bytes. A chunk must not load bytes that were just stored at a
+// different offset, as this defeats store forwarding and is slower than copying byte by byte. Since a pattern
+// repeats with any multiple of its length, short distances are widened to a multiple of 8 after writing the first
+// repetitions byte by byte (unless the match is too short for this to pay off).
+static inline void inflate_copy_match(uint8_t *dst, size_t distance, size_t length) {
+	const uint8_t *src = dst - distance;
+
+	if (distance == 1) {
+		memset(dst, *src, length);
+		return;
+	}
+
+	if (distance < 8) {
+		size_t wide = distance;
+		while (wide & 7)
+			wide += distance;
+		if (wide < length) {
+			for (size_t i = 0; i < wide - distance; i++)
+				dst[i] = src[i];
+			dst += wide - distance;
+			length -= wide - distance;
+			distance = wide; // src stays the same, it now lies wide bytes before dst
+		}
+	}
+
+	if (distance >= 16) {
+		for (; length >= 16; length -= 16, dst += 16, src += 16)
+			__builtin_memcpy(dst, src, 16);
+	}
+	if (!(distance & 7) || distance >= 16) {
+		for (; length >= 8; length -= 8, dst += 8, src += 8)
+			__builtin_memcpy(dst, src, 8);
+	}
+	while (length--)
+		*dst++ = *src++;
+}
+
+
+// Copies a back-reference to the end of the window.
+// Matches that wrap around the end of the window are copied byte by byte.
+static status_t inflate_back_ref(inflater_t *inflater, size_t distance, size_t length) {
+	if (distance > inflater->windowPos)
+		return STATUS_DATA_CORRUPT;
+	uint8_t *window = inflater->window;
+	uint64_t pos = inflater->windowPos;
+	size_t dstOffset = pos & (INFLATE_WINDOW_SIZE - 1);
+	size_t srcOffset = (pos - distance) & (INFLATE_WINDOW_SIZE - 1);
 
-// Decodes a bitstream until the end-of-block symbol is found, using the specified literal and distance codings.
-//	input: the stream that stores the encoded block
-//	output: the stream to which the data should be written
-//	literalCoding: the huffman coding that should be used to decode literals and lengths
-//	distanceCoding: the huffman coding that should be used to decode distances
+	if (dstOffset + length <= INFLATE_WINDOW_SIZE && srcOffset < dstOffset) {
+		inflate_copy_match(window + dstOffset, distance, length);
+	} else {
+		for (size_t i = 0; i < length; i++, pos++)
+			window[pos & (INFLATE_WINDOW_SIZE - 1)] = window[(pos - distance) & (INFLATE_WINDOW_SIZE - 1)];
+	}
+
+	inflater->windowPos += length;
+	inflater->pending += length;
+	return STATUS_SUCCESS;
+}
+
+
+// Decodes symbols of a compressed block until the end-of-block symbol is found, the window is full or at least
+// the specified number of bytes are pending. If the input runs out, the incomplete symbol is left in the input.
 // Returns a non-zero error code if the operation failed.
-status_t inflate_block(bitstream_t *input, stream_t *output, huffman_t *literalCoding, huffman_t *distanceCoding) {
-	uint64_t symbol, length, distance;
+static status_t inflate_block(inflater_t *inflater, size_t wanted) {
+	status_t status;
+	bitstream_t *input = &inflater->input;
+	uint64_t symbol, extra;
 
-	for (;;) {
-		if (status = huffman_read_symbol(input, literalCoding, &symbol)) return status;
-		if (symbol == 256) return STATUS_SUCCESS;
+	while (inflater->pending < wanted && inflater->pending + INFLATE_MAX_MATCH <= INFLATE_WINDOW_SIZE) {
+		uintptr_t bytePos = inflater->inputStream.rPos;
+		int bitPos = input->rPos;
+
+		if ((status = huffman_read_symbol(input, inflater->literalCoding, &symbol))) return status;
 		if (symbol < 256) {
-			stream_write_byte(output, symbol);
+			inflater->window[inflater->windowPos++ & (INFLATE_WINDOW_SIZE - 1)] = symbol;
+			inflater->pending++;
 			continue;
 		}
+		if (symbol == END_OF_BLOCK) {
+			inflater->state = (inflater->isLastBlock ? INFLATE_STATE_TRAILER : INFLATE_STATE_HEADER);
+			return STATUS_SUCCESS;
+		}
 
 		// decode back-reference length
-		symbol &= 0xFF;
-		if (symbol < 5) {
-			length = symbol + 2;
-		} else {
-			symbol -= 5;
-			int extraBits = (symbol >> 2);
-			length = 7;
-			for (int i = 0; i < extraBits; i++) length += (4 << i);
-			symbol = length + ((symbol & 3UL) << extraBits);
-			if (status = bitstream_read(input, extraBits, &length)) return status;
-			length += symbol;
-		}
+		symbol -= 257;
+		if (symbol >= 29) return STATUS_DATA_CORRUPT;
+		if ((status = bitstream_read(input, lengthExtraBits[symbol], &extra))) goto rewind;
+		size_t length = lengthBase[symbol] + extra;
 
 		// decode back-reference distance
-		if (status = huffman_read_symbol(input, distanceCoding, &symbol)) return status;
-		if (symbol < 2) {
-			distance = symbol + 1;
+		if ((status = huffman_read_symbol(input, inflater->distanceCoding, &symbol))) goto rewind;
+		if (symbol >= 30) return STATUS_DATA_CORRUPT;
+		if ((status = bitstream_read(input, distanceExtraBits[symbol], &extra))) goto rewind;
+		size_t distance = distanceBase[symbol] + extra;
+
+		if ((status = inflate_back_ref(inflater, distance, length))) return status;
+		continue;
+
+rewind:
+		// the symbol is retried when more input is available
+		inflater->inputStream.rPos = bytePos;
+		input->rPos = bitPos;
+		return status;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+
+// Reads the header of a dynamic block and builds the codings that it describes.
+static status_t inflate_dynamic_header(bitstream_t *input, inflate_codings_t *codings) {
+	status_t status;
+	uint64_t numLit, numDist, numCLen, value;
+
+	if ((status = bitstream_read(input, 5, &numLit))) return status;
+	if ((status = bitstream_read(input, 5, &numDist))) return status;
+	if ((status = bitstream_read(input, 4, &numCLen))) return status;
+	numLit += 257; // literal alphabet size
+	numDist += 1; // distance alphabet size
+	numCLen += 4; // number of code length codes
+	if (numLit > 286 || numDist > DISTANCE_ALPHABET_SIZE)
+		return STATUS_DATA_CORRUPT;
+
+	// read the coding that encodes the literal and distance code lengths
+	// (the distance coding is only built afterwards, so its storage can be used for this)
+	uint8_t lengths[286 + DISTANCE_ALPHABET_SIZE] = { 0 };
+	for (int i = 0; i < (int)numCLen; i++) {
+		if ((status = bitstream_read(input, 3, &value))) return status;
+		lengths[lengthOrder[i]] = value;
+	}
+	if ((status = huffman_init(&codings->distanceCoding, lengths, LENGTH_ALPHABET_SIZE))) return status;
+
+	// read the code lengths of the literal and distance codings (they form a single sequence)
+	if ((status = inflate_lengths(input, &codings->distanceCoding, numLit + numDist, lengths))) return status;
+	if (!lengths[END_OF_BLOCK]) return STATUS_DATA_CORRUPT;
+
+	if ((status = huffman_init(&codings->literalCoding, lengths, numLit))) return status;
+	return huffman_init(&codings->distanceCoding, lengths + numLit, numDist);
+}
+
+
+// Reads a block header. Nothing is consumed if the header is incomplete.
+static status_t inflate_header(inflater_t *inflater) {
+	status_t status;
+	bitstream_t *input = &inflater->input;
+	uint64_t isLastBlock, blockType, rawLength, rawNLength;
+
+	if ((status = bitstream_read(input, 1, &isLastBlock))) return status;
+	if ((status = bitstream_read(input, 2, &blockType))) return status;
+
+	switch (blockType) {
+		case BLOCK_TYPE_RAW:
+			// raw blocks are always byte aligned
+			if ((status = bitstream_align(input))) return status;
+			if ((status = bitstream_read(input, 16, &rawLength))) return status;
+			if ((status = bitstream_read(input, 16, &rawNLength))) return status;
+			if (rawLength != (~rawNLength & 0xFFFF))
+				return STATUS_DATA_CORRUPT;
+			inflater->rawRemaining = rawLength;
+			inflater->state = INFLATE_STATE_RAW;
+			break;
+
+		case BLOCK_TYPE_FIXED:
+			inflate_init_fixed();
+			inflater->literalCoding = &fixedLiteralCoding;
+			inflater->distanceCoding = &fixedDistanceCoding;
+			inflater->state = INFLATE_STATE_BLOCK;
+			break;
+
+		case BLOCK_TYPE_DYNAMIC:
+			if (!inflater->codings && !(inflater->codings = (inflate_codings_t *)malloc(sizeof(inflate_codings_t))))
+				return STATUS_OUT_OF_MEMORY;
+			if ((status = inflate_dynamic_header(input, inflater->codings))) return status;
+			inflater->literalCoding = &inflater->codings->literalCoding;
+			inflater->distanceCoding = &inflater->codings->distanceCoding;
+			inflater->state = INFLATE_STATE_BLOCK;
+			break;
+
+		default:
+			return STATUS_DATA_CORRUPT;
+	}
+
+	inflater->isLastBlock = isLastBlock;
+	return STATUS_SUCCESS;
+}
+
+
+// Copies as much of an uncompressed block to the window as the input and the window allow.
+static status_t inflate_raw(inflater_t *inflater) {
+	bytestream_t *stream = &inflater->inputStream;
+	size_t count = stream->wPos - stream->rPos;
+	if (count > inflater->rawRemaining)
+		count = inflater->rawRemaining;
+	if (count > INFLATE_WINDOW_SIZE - inflater->pending)
+		count = INFLATE_WINDOW_SIZE - inflater->pending;
+	if (!count && inflater->rawRemaining)
+		return STATUS_END_OF_STREAM;
+
+	inflate_window_write(inflater, stream->data + stream->rPos, count);
+	stream->rPos += count;
+	if (!(inflater->rawRemaining -= count))
+		inflater->state = (inflater->isLastBlock ? INFLATE_STATE_TRAILER : INFLATE_STATE_HEADER);
+	return STATUS_SUCCESS;
+}
+
+
+// Reads a zlib header. Nothing is consumed if the header is incomplete.
+static status_t inflate_zlib_header(inflater_t *inflater) {
+	status_t status;
+	uint64_t header;
+
+	if ((status = bitstream_read(&inflater->input, 16, &header))) return status;
+	int method = header & 0xFF, flags = header >> 8;
+	if ((method & 0x0F) != ZLIB_METHOD_DEFLATE || (method >> 4) > 7 || ((method << 8) | flags) % 31)
+		return STATUS_DATA_CORRUPT;
+	if (flags & ZLIB_FLAG_DICTIONARY)
+		return STATUS_NOT_SUPPORTED; // preset dictionaries are not supported
+
+	inflater->state = INFLATE_STATE_HEADER;
+	return STATUS_SUCCESS;
+}
+
+
+// Reads the fixed part of a gzip header. Nothing is consumed if it is incomplete.
+static status_t inflate_gzip_header(inflater_t *inflater) {
+	status_t status;
+	uint64_t header, timeAndOS;
+
+	if ((status = bitstream_read(&inflater->input, 32, &header))) return status;
+	if ((status = bitstream_read(&inflater->input, 48, &timeAndOS))) return status;
+	if ((header & 0xFFFF) != GZIP_ID || ((header >> 16) & 0xFF) != GZIP_METHOD_DEFLATE || (header >> 24) & GZIP_FLAG_RESERVED)
+		return STATUS_DATA_CORRUPT;
+
+	inflater->headerFlags = header >> 24;
+	inflater->state = INFLATE_STATE_GZIP_FIELDS;
+	return STATUS_SUCCESS;
+}
+
+
+// Skips the optional fields of a gzip header in the order in which they appear. Unlike the other headers, the
+// fields are consumed as they arrive, because they are not limited in size.
+static status_t inflate_gzip_fields(inflater_t *inflater) {
+	bytestream_t *stream = &inflater->inputStream;
+
+	for (;;) {
+		const char *data = stream->data + stream->rPos;
+		size_t available = stream->wPos - stream->rPos;
+
+		if (inflater->headerSkip) {
+			size_t count = (available < inflater->headerSkip ? available : inflater->headerSkip);
+			stream->rPos += count;
+			if ((inflater->headerSkip -= count))
+				return STATUS_END_OF_STREAM;
+		} else if (inflater->headerFlags & GZIP_FLAG_EXTRA) {
+			if (available < 2)
+				return STATUS_END_OF_STREAM;
+			inflater->headerSkip = (uint8_t)data[0] | ((uint8_t)data[1] << 8);
+			inflater->headerFlags &= ~GZIP_FLAG_EXTRA;
+			stream->rPos += 2;
+		} else if (inflater->headerFlags & (GZIP_FLAG_NAME | GZIP_FLAG_COMMENT)) {
+			// the file name and the comment are zero terminated
+			size_t length = 0;
+			while (length < available && data[length])
+				length++;
+			if (length == available) {
+				stream->rPos += available;
+				return STATUS_END_OF_STREAM;
+			}
+			inflater->headerFlags &= ~(inflater->headerFlags & GZIP_FLAG_NAME ? GZIP_FLAG_NAME : GZIP_FLAG_COMMENT);
+			stream->rPos += length + 1;
+		} else if (inflater->headerFlags & GZIP_FLAG_HEADER_CRC) {
+			inflater->headerSkip = 2;
+			inflater->headerFlags &= ~GZIP_FLAG_HEADER_CRC;
 		} else {
-			symbol -= 2;
-			int extraBits = (symbol >> 1);
-			length = 3;
-			for (int i = 0; i < extraBits; i++) length += (2 << i);
-			symbol = length + ((symbol & 1UL) << extraBits);
-			if (status = bitstream_read(input, extraBits, &length)) return status;
-			length += symbol;
+			inflater->state = INFLATE_STATE_HEADER;
+			return STATUS_SUCCESS;
 		}
+	}
+}
+
 
-		// copy back-reference byte by byte (may overlap with current position)
-		while (length--) {
-			uint8_t val;
-			if (status = stream_back_ref(output, distance, &val)) return status;
-			stream_write_byte(output, val);
+// Reads the checksum that follows the last block of a zlib or gzip stream. Nothing is consumed if it is incomplete.
+// The checksum is only compared once all data was drained.
+static status_t inflate_trailer(inflater_t *inflater) {
+	status_t status;
+	bitstream_t *input = &inflater->input;
+	uint64_t checksum, size = 0;
+
+	if (inflater->format != DEFLATE_FORMAT_RAW) {
+		if ((status = bitstream_align(input))) return status;
+		if ((status = bitstream_read(input, 32, &checksum))) return status;
+		if (inflater->format == DEFLATE_FORMAT_GZIP) {
+			if ((status = bitstream_read(input, 32, &size))) return status;
+		} else {
+			// zlib stores the checksum MSB first
+			checksum = ((checksum & 0xFF) << 24) | ((checksum & 0xFF00) << 8) | ((checksum >> 8) & 0xFF00) | (checksum >> 24);
 		}
+		inflater->expectedChecksum = checksum;
+		inflater->expectedSize = size;
 	}
+
+	inflater->state = INFLATE_STATE_DONE;
+	return STATUS_SUCCESS;
 }
 
 
+// Decodes input into the window until at least the specified number of bytes are pending, the window is full or
+// the last block was decoded.
+// Returns STATUS_END_OF_STREAM if more input is required.
+static status_t inflate_run(inflater_t *inflater, size_t wanted) {
+	status_t status = STATUS_SUCCESS;
+
+	while (!status && inflater->pending < wanted && inflater->pending + INFLATE_MAX_MATCH <= INFLATE_WINDOW_SIZE) {
+		uintptr_t bytePos = inflater->inputStream.rPos;
+		int bitPos = inflater->input.rPos;
+		status_t (*readHeader)(inflater_t *inflater) = NULL;
+
+		switch (inflater->state) {
+			case INFLATE_STATE_HEADER:
+				readHeader = inflate_header;
+				break;
 
+			case INFLATE_STATE_ZLIB:
+				readHeader = inflate_zlib_header;
+				break;
 
+			case INFLATE_STATE_GZIP:
+				readHeader = inflate_gzip_header;
+				break;
 
-status_t inflate(void *data, size_t length) {
-	bitstream_t *input = bitstream_init(data, length);
-	stream_t output = stream_init(2 * length); // check
+			case INFLATE_STATE_GZIP_FIELDS:
+				status = inflate_gzip_fields(inflater);
+				break;
 
+			case INFLATE_STATE_TRAILER:
+				readHeader = inflate_trailer;
+				break;
 
-	uint64_t isLastBlock, blockType;
-	uint64_t length, nlength;
+			case INFLATE_STATE_RAW:
+				status = inflate_raw(inflater);
+				break;
 
-	do {
-		if (bitstream_read(input, 1, &isLastBlock)) return INFLATE_RETURN_ERR;
-		if (bitstream_read(input, 2, &blockType)) return INFLATE_RETURN_ERR;
-
-		switch (blockType) {
-			case BLOCK_TYPE_RAW: // read uncompressed block
-				bitstream_byte_align(input); // raw blocks are always byte aligned
-				if (bitstream_read(input, 2, &length)) return INFLATE_EXIT(STATUS_END_OF_STREAM);
-				if (bitstream_read(input, 2, &nlength)) return INFLATE_EXIT(STATUS_END_OF_STREAM);
-				if (length != ~nlength) return INFLATE_EXIT(STATUS_INVALID_CHECKSUM); // are these in little or big endian?
-				
-				// copy to output stream
-				char *raw = ((char *)input.data) + (input.position >> 3);
-				input.position += (length << 3);
-				if (bitstream_end_of_stream(input)) return INFLATE_EXIT(STATUS_END_OF_STREAM);
-				if (stream_write(raw, length)) return INFLATE_EXIT(STATUS_OUT_OF_MEMORY);
+			case INFLATE_STATE_BLOCK:
+				status = inflate_block(inflater, wanted);
 				break;
 
-			case BLOCK_TYPE_FIXED:
+			default:
+				return STATUS_SUCCESS;
+		}
+
+		// an incomplete header or trailer is read again when more input is available
+		if (readHeader && (status = readHeader(inflater)) == STATUS_END_OF_STREAM) {
+			inflater->inputStream.rPos = bytePos;
+			inflater->input.rPos = bitPos;
+		}
+	}
+
+	return status;
+}
+
+
+// Prepares an inflater for a new DEFLATE stream. The inflater must be released using inflate_end.
+// Returns STATUS_OUT_OF_MEMORY if the window or the input buffer could not be allocated.
+status_t inflate_init(inflater_t *inflater) {
+	return inflate_init_ex(inflater, DEFLATE_FORMAT_RAW);
+}
+
+
+// Prepares an inflater for a new stream of the specified format (one of the DEFLATE_FORMAT_ constants).
+// Of a gzip file that consists of multiple members, only the first member is decompressed.
+// The inflater must be released using inflate_end.
+// Returns STATUS_OUT_OF_MEMORY if the window or the input buffer could not be allocated.
+status_t inflate_init_ex(inflater_t *inflater, int format) {
+	if (format != DEFLATE_FORMAT_RAW && format != DEFLATE_FORMAT_ZLIB && format != DEFLATE_FORMAT_GZIP)
+		return STATUS_INVALID_ARGUMENT;
+
+	memset(inflater, 0, sizeof(inflater_t));
+	if (!(inflater->window = (uint8_t *)malloc(INFLATE_WINDOW_SIZE)))
+		return STATUS_OUT_OF_MEMORY;
+	if (stream_alloc(&inflater->inputStream, INFLATE_INPUT_SIZE)) {
+		free(inflater->window);
+		return STATUS_OUT_OF_MEMORY;
+	}
+	inflater->input = bitstream_init(&inflater->inputStream);
+	inflater->format = format;
+	inflater->state = (format == DEFLATE_FORMAT_ZLIB ? INFLATE_STATE_ZLIB : (format == DEFLATE_FORMAT_GZIP ? INFLATE_STATE_GZIP : INFLATE_STATE_HEADER));
+	inflater->checksum = (format == DEFLATE_FORMAT_ZLIB ? ADLER32_INIT : CRC32_INIT);
+	return STATUS_SUCCESS;
+}
+
+
+// Passes compressed data to an inflater. Only as much data is accepted as fits into the input buffer, the rest
+// must be fed again after some output was drained.
+// Returns the number of bytes that were accepted.
+size_t inflate_feed(inflater_t *inflater, const void *data, size_t length) {
+	bytestream_t *stream = &inflater->inputStream;
+
+	// move the input that was not yet consumed to the beginning of the buffer
+	if (stream->rPos) {
+		memmove(stream->data, stream->data + stream->rPos, stream->wPos - stream->rPos);
+		stream->wPos -= stream->rPos;
+		stream->rPos = 0;
+	}
+
+	if (length > stream->capacity - stream->wPos)
+		length = stream->capacity - stream->wPos;
+	memcpy(stream->data + stream->wPos, data, length);
+	stream->wPos += length;
+	return length;
+}
+
+
+// Compares the checksum and the size of the drained data with the values found at the end of the stream.
+static status_t inflate_verify(inflater_t *inflater) {
+	if (inflater->format == DEFLATE_FORMAT_RAW)
+		return STATUS_SUCCESS;
+	if (inflater->checksum != inflater->expectedChecksum)
+		return STATUS_DATA_CORRUPT;
+	if (inflater->format == DEFLATE_FORMAT_GZIP && (uint32_t)inflater->windowPos != inflater->expectedSize)
+		return STATUS_DATA_CORRUPT;
+	return STATUS_SUCCESS;
+}
+
+
+// Decompresses data that was fed to an inflater.
+//	buffer, size: the buffer that receives the decompressed data
+//	produced: receives the number of bytes that were written to the buffer
+// Returns STATUS_SUCCESS once the end of the stream was reached and all data was drained,
+// STATUS_IN_PROGRESS if the buffer was filled before that and STATUS_BUFFER_UNDERRUN if more data must be fed first.
+// STATUS_DATA_CORRUPT is returned instead of STATUS_SUCCESS if the checksum of a zlib or gzip stream doesn't match.
+// After any other status code, the inflater can only be released.
+status_t inflate_drain(inflater_t *inflater, void *buffer, size_t size, size_t *produced) {
+	status_t status = STATUS_SUCCESS;
+	*produced = 0;
+
+	for (;;) {
+		// copy pending data out of the window (in two parts if it wraps around)
+		size_t count = (inflater->pending < size - *produced ? inflater->pending : size - *produced);
+		size_t offset = (inflater->windowPos - inflater->pending) & (INFLATE_WINDOW_SIZE - 1);
+		size_t part = (count < INFLATE_WINDOW_SIZE - offset ? count : INFLATE_WINDOW_SIZE - offset);
+		memcpy((char *)buffer + *produced, inflater->window + offset, part);
+		memcpy((char *)buffer + *produced + part, inflater->window, count - part);
+
+		// the checksum is computed while the data is still in the cache
+		if (inflater->format == DEFLATE_FORMAT_ZLIB)
+			inflater->checksum = adler32_update(inflater->checksum, (char *)buffer + *produced, count);
+		else if (inflater->format == DEFLATE_FORMAT_GZIP)
+			inflater->checksum = crc32_update(inflater->checksum, (char *)buffer + *produced, count);
+		inflater->pending -= count;
+		*produced += count;
+
+		if (!inflater->pending && inflater->state == INFLATE_STATE_DONE)
+			return inflate_verify(inflater);
+		if (*produced == size)
+			return STATUS_IN_PROGRESS;
+		if (status)
+			return status;
+
+		if ((status = inflate_run(inflater, size - *produced)) == STATUS_END_OF_STREAM)
+			status = STATUS_BUFFER_UNDERRUN;
+	}
+}
+
+
+// Releases the buffers of an inflater.
+void inflate_end(inflater_t *inflater) {
+	stream_free(&inflater->inputStream);
+	free(inflater->window);
+	free(inflater->codings);
+	inflater->window = NULL;
+	inflater->codings = NULL;
+}
+
+
+// Decompresses a DEFLATE stream that is entirely in memory.
+//	data, length: the compressed data
+//	output: the stream to which the decompressed data is appended (must be allocated using stream_alloc)
+// Returns a non-zero error code if the data is invalid or incomplete.
+status_t inflate(const void *data, size_t length, bytestream_t *output) {
+	return inflate_ex(data, length, output, DEFLATE_FORMAT_RAW);
+}
 
-				// assemble fixed coding tree (as defined in RFC 1951, 3.2.6)
-				int fixedCoding[LITERAL_ALPHABET_SIZE];
-				for (int i = 0; i <= 143; i++) fixedCoding(i) = 8;
-				for (int i = 144; i <= 255; i++) fixedCoding(i) = 9;
-				for (int i = 256; i <= 279; i++) fixedCoding(i) = 7;
-				for (int i = 280; i <= 287; i++) fixedCoding(i) = 7;
-				huffman_t *coding = huffman_init(fixedCoding, LITERAL_ALPHABET_SIZE, MAX_CODE_BITS);
-				if (!coding) return INFLATE_EXIT(STATUS_OUT_OF_MEMORY);
 
-				// read block
-				int status = inflate_block(input, output, coding, coding); // same coding is used for literals and lengths
-				huffman_free(coding);
-				if (status) INFLATE_EXIT(DEFLATE_STATUS_INVALID_BLOCK_TYPE);
+// Decompresses a stream of the specified format (one of the DEFLATE_FORMAT_ constants) that is entirely in memory.
+// Returns a non-zero error code if the data is invalid or incomplete or if the checksum doesn't match.
+status_t inflate_ex(const void *data, size_t length, bytestream_t *output, int format) {
+	inflater_t inflater;
+	status_t status;
+	if ((status = inflate_init_ex(&inflater, format)))
+		return status;
+
+	for (;;) {
+		size_t accepted = inflate_feed(&inflater, data, length);
+		data = (const char *)data + accepted;
+		length -= accepted;
 
+		// decompress directly into the output stream
+		if (output->wPos >= output->capacity)
+			if ((status = stream_expand(output)))
 				break;
+		size_t produced;
+		status = inflate_drain(&inflater, output->data + output->wPos, output->capacity - output->wPos, &produced);
+		output->wPos += produced;
 
-			case BLOCK_TYPE_DYNAMIC:
-
-				int status = 0;
-				status |= bitstream_read(input, 5, &numLit); numLit += 257; // literal alphabet size
-				status |= bitstream_read(input, 5, &numDist); numDist += 1; // distance alphabet size
-				status |= bitstream_read(input, 4, &numCLen); numCLen += 4; // number of code length codes
-				if (status) INFLATE_EXIT(DEFLATE_STATUS_INVALID_BLOCK_TYPE);
-
-				// read the huffman tree that encodes the literal and length code trees
-				int codeLengthCodeLengths[19] = { 0 };
-				int codeLengthCodeLengthIndices[] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
-				while (numCLen--)
-					status |= bitstream_read(input, 3, &(codeLengthCodeLengths[codeLengthCodeLengthIndices[i]]));
-				if (status) INFLATE_EXIT(DEFLATE_STATUS_INVALID_BLOCK_TYPE);
-				huffman_t *treeCoding = huffman_init(codeLengthCodeLengths, 19, MAX_CODE_BITS);
-				if (!coding) return INFLATE_EXIT(STATUS_OUT_OF_MEMORY);
-
-				// read the coding trees for literal and length codes
-				huffman_t *literalCoding = NULL, *distanceCoding = NULL;
-				if (status = inflate_tree(input, treeCoding, numLit, &literalCoding)) {
-					huffman_free(treeCoding);
-					INFLATE_EXIT(DEFLATE_STATUS_INVALID_BLOCK_TYPE);
-				}
-				if (status = inflate_tree(input, treeCoding, numDist, &distanceCoding)) {
-					huffman_free(treeCoding);
-					huffman_free(distanceCoding);
-					INFLATE_EXIT(DEFLATE_STATUS_INVALID_BLOCK_TYPE);
+		if (status == STATUS_IN_PROGRESS || (status == STATUS_BUFFER_UNDERRUN && length))
+			continue;
+		if (status == STATUS_BUFFER_UNDERRUN)
+			status = STATUS_END_OF_STREAM;
+		break;
+	}
+
+	inflate_end(&inflater);
+	return status;
+}
+
+
+// Parameters of the match finder for each compression level.
+// Hash chains are followed for at most maxChain steps and a match of niceLength bytes ends the search early.
+// With lazy matching, a match is only taken if the next position doesn't start a longer one.
+static const struct {
+	uint16_t maxChain;
+	uint16_t niceLength;
+	uint8_t lazy;
+} deflateLevels[DEFLATE_LEVEL_BEST + 1] = {
+	{ 0, 0, 0 },		// stored blocks only
+	{ 4, 8, 0 },
+	{ 8, 16, 0 },
+	{ 32, 32, 0 },
+	{ 16, 16, 1 },
+	{ 32, 32, 1 },
+	{ 128, 128, 1 },
+	{ 256, 128, 1 },
+	{ 1024, 258, 1 },
+	{ 4096, 258, 1 },
+};
+
+
+#define DEFLATE_HASH_BITS		(15)
+#define DEFLATE_HASH_SIZE		(1 << DEFLATE_HASH_BITS)
+#define DEFLATE_MAX_DISTANCE	(INFLATE_WINDOW_SIZE - 1)	// keeps chain links from being overwritten while in use
+#define DEFLATE_MIN_MATCH		(3)
+#define DEFLATE_BLOCK_SYMBOLS	(16384)	// number of literals and matches that are collected before a block is written
+#define DEFLATE_STORED_MAX		(65535)	// the largest stored block
+#define DEFLATE_NO_POSITION		(0xFFFFFFFF)
+
+
+// The state of a compression. The entire input is in memory, so positions refer to the input directly.
+typedef struct {
+	const uint8_t *data;
+	size_t length;
+	bitstream_t output;
+	int maxChain;
+	int niceLength;
+
+	uint32_t head[DEFLATE_HASH_SIZE];		// for each hash, the most recent position with that hash
+	uint32_t previous[INFLATE_WINDOW_SIZE];	// for each position in the window, the previous position with the same hash
+
+	// the current block
+	size_t blockStart;						// the input position where the block starts
+	int symbolCount;
+	uint16_t lengths[DEFLATE_BLOCK_SYMBOLS];	// literal value or match length of each symbol
+	uint16_t distances[DEFLATE_BLOCK_SYMBOLS];	// match distance of each symbol (0 for literals)
+	uint32_t literalFrequencies[LITERAL_ALPHABET_SIZE];
+	uint32_t distanceFrequencies[DISTANCE_ALPHABET_SIZE];
+} deflater_t;
+
+
+// A huffman coding in the form needed for encoding
+typedef struct {
+	uint8_t lengths[LITERAL_ALPHABET_SIZE];
+	uint16_t codes[LITERAL_ALPHABET_SIZE];
+} deflate_coding_t;
+
+
+// Returns the length symbol (0 ... 28, add 257 for the literal alphabet) of a match length.
+static inline int deflate_length_symbol(int length) {
+	// from 11 on, there are four symbols for each power of two
+	if (length == INFLATE_MAX_MATCH)
+		return 28;
+	if (length < 11)
+		return length - 3;
+	int extraBits = 31 - __builtin_clz(length - 3) - 2;
+	return 4 * extraBits + ((length - 3) >> extraBits);
+}
+
+
+// Returns the distance symbol of a match distance.
+static inline int deflate_distance_symbol(int distance) {
+	// from 5 on, there are two symbols for each power of two
+	if (distance <= 4)
+		return distance - 1;
+	int bits = 31 - __builtin_clz(distance - 1);
+	return 2 * bits + (((distance - 1) >> (bits - 1)) & 1);
+}
+
+
+// Returns the hash of the 3 bytes at the specified position.
+static inline uint32_t deflate_hash(const uint8_t *data) {
+	return ((data[0] << 10) ^ (data[1] << 5) ^ data[2]) & (DEFLATE_HASH_SIZE - 1);
+}
+
+
+// Adds a position to the hash chains (if 3 bytes are left to hash) and returns the previous head of its chain.
+static inline uint32_t deflate_insert(deflater_t *deflater, size_t pos) {
+	if (pos + DEFLATE_MIN_MATCH > deflater->length)
+		return DEFLATE_NO_POSITION;
+	uint32_t hash = deflate_hash(deflater->data + pos);
+	uint32_t candidate = deflater->head[hash];
+	deflater->previous[pos & (INFLATE_WINDOW_SIZE - 1)] = candidate;
+	deflater->head[hash] = pos;
+	return candidate;
+}
+
+
+// Adds a position to the hash chains and searches the earlier positions with the same hash for the longest match.
+// Returns the length of the match (0 if there is none) and stores its distance.
+static int deflate_find_match(deflater_t *deflater, size_t pos, int *distance) {
+	uint32_t candidate = deflate_insert(deflater, pos);
+	const uint8_t *data = deflater->data;
+	size_t maxLength = deflater->length - pos;
+	if (maxLength > INFLATE_MAX_MATCH)
+		maxLength = INFLATE_MAX_MATCH;
+	if (maxLength < DEFLATE_MIN_MATCH)
+		return 0;
+
+	int bestLength = DEFLATE_MIN_MATCH - 1;
+	for (int chain = deflater->maxChain; chain > 0 && candidate != DEFLATE_NO_POSITION && pos - candidate <= DEFLATE_MAX_DISTANCE; chain--) {
+		// the byte that would make this match the longest one is checked first
+		if (data[candidate + bestLength] == data[pos + bestLength] && data[candidate] == data[pos]) {
+			size_t length = 1;
+			while (length < maxLength && data[candidate + length] == data[pos + length])
+				length++;
+			if ((int)length > bestLength) {
+				bestLength = length;
+				*distance = pos - candidate;
+				if (length >= (size_t)deflater->niceLength || length == maxLength)
+					break;
+			}
+		}
+
+		uint32_t next = deflater->previous[candidate & (INFLATE_WINDOW_SIZE - 1)];
+		if (next >= candidate)
+			break;
+		candidate = next;
+	}
+
+	return (bestLength >= DEFLATE_MIN_MATCH ? bestLength : 0);
+}
+
+
+// Writes the symbols of the current block using the specified codings.
+static status_t deflate_write_symbols(deflater_t *deflater, const deflate_coding_t *literalCoding, const deflate_coding_t *distanceCoding) {
+	status_t status;
+	bitstream_t *output = &deflater->output;
+
+	for (int i = 0; i < deflater->symbolCount; i++) {
+		int length = deflater->lengths[i];
+		int distance = deflater->distances[i];
+		if (!distance) {
+			if ((status = bitstream_write(output, literalCoding->lengths[length], literalCoding->codes[length]))) return status;
+			continue;
+		}
+
+		int symbol = deflate_length_symbol(length);
+		if ((status = bitstream_write(output, literalCoding->lengths[257 + symbol], literalCoding->codes[257 + symbol]))) return status;
+		if ((status = bitstream_write(output, lengthExtraBits[symbol], length - lengthBase[symbol]))) return status;
+		symbol = deflate_distance_symbol(distance);
+		if ((status = bitstream_write(output, distanceCoding->lengths[symbol], distanceCoding->codes[symbol]))) return status;
+		if ((status = bitstream_write(output, distanceExtraBits[symbol], distance - distanceBase[symbol]))) return status;
+	}
+
+	return bitstream_write(output, literalCoding->lengths[END_OF_BLOCK], literalCoding->codes[END_OF_BLOCK]);
+}
+
+
+// Returns the number of bits that the symbols of the current block take up with the specified code lengths.
+static size_t deflate_symbol_bits(deflater_t *deflater, const uint8_t *literalLengths, const uint8_t *distanceLengths) {
+	size_t bits = 0;
+	for (int i = 0; i < 286; i++)
+		bits += (size_t)deflater->literalFrequencies[i] * (literalLengths[i] + (i > 256 ? lengthExtraBits[i - 257] : 0));
+	for (int i = 0; i < DISTANCE_ALPHABET_SIZE; i++)
+		bits += (size_t)deflater->distanceFrequencies[i] * (distanceLengths[i] + distanceExtraBits[i]);
+	return bits;
+}
+
+
+// Writes the input from the start of the current block up to the specified position as stored blocks.
+static status_t deflate_write_stored(deflater_t *deflater, size_t end, int isLastBlock) {
+	status_t status;
+	bitstream_t *output = &deflater->output;
+	size_t pos = deflater->blockStart;
+
+	do {
+		size_t length = (end - pos > DEFLATE_STORED_MAX ? DEFLATE_STORED_MAX : end - pos);
+		int isLast = (isLastBlock && pos + length == end);
+		if ((status = bitstream_write(output, 3, isLast | (BLOCK_TYPE_RAW << 1)))) return status;
+		bitstream_write_align(output);
+		if ((status = bitstream_write(output, 32, length | ((~length & 0xFFFF) << 16)))) return status;
+		if ((status = stream_write(output->stream, deflater->data + pos, length))) return status;
+		pos += length;
+	} while (pos < end);
+
+	return STATUS_SUCCESS;
+}
+
+
+// Writes the current block, which ends at the specified input position, in whichever form is the smallest:
+// stored, compressed with the fixed codings or compressed with codings that are tailored to the block.
+static status_t deflate_write_block(deflater_t *deflater, size_t end, int isLastBlock) {
+	status_t status;
+	bitstream_t *output = &deflater->output;
+	deflater->literalFrequencies[END_OF_BLOCK]++;
+
+	// the fixed codings (RFC 1951, 3.2.6)
+	deflate_coding_t fixedLiteral, fixedDistance;
+	memset(fixedLiteral.lengths, 8, 144);
+	memset(fixedLiteral.lengths + 144, 9, 112);
+	memset(fixedLiteral.lengths + 256, 7, 24);
+	memset(fixedLiteral.lengths + 280, 8, 8);
+	memset(fixedDistance.lengths, 5, DISTANCE_ALPHABET_SIZE);
+
+	// the dynamic codings
+	deflate_coding_t literal, distance;
+	huffman_build_lengths(deflater->literalFrequencies, 286, HUFFMAN_MAX_BITS, literal.lengths);
+	huffman_build_lengths(deflater->distanceFrequencies, DISTANCE_ALPHABET_SIZE, HUFFMAN_MAX_BITS, distance.lengths);
+	int numLit = 286, numDist = DISTANCE_ALPHABET_SIZE;
+	while (numLit > 257 && !literal.lengths[numLit - 1])
+		numLit--;
+	while (numDist > 1 && !distance.lengths[numDist - 1])
+		numDist--;
+
+	// the code lengths of both codings form a single sequence, in which runs are encoded with the symbols 16, 17 and 18
+	uint8_t sequence[286 + DISTANCE_ALPHABET_SIZE];
+	uint8_t runSymbols[286 + DISTANCE_ALPHABET_SIZE];
+	uint8_t runExtra[286 + DISTANCE_ALPHABET_SIZE];
+	uint32_t runFrequencies[LENGTH_ALPHABET_SIZE] = { 0 };
+	int sequenceLength = numLit + numDist, runCount = 0;
+	memcpy(sequence, literal.lengths, numLit);
+	memcpy(sequence + numLit, distance.lengths, numDist);
+
+	for (int i = 0; i < sequenceLength;) {
+		int value = sequence[i], run = 1;
+		while (i + run < sequenceLength && sequence[i + run] == value)
+			run++;
+
+		if (!value && run >= 3) {
+			run = (run > 138 ? 138 : run);
+			runSymbols[runCount] = (run >= 11 ? 18 : 17);
+			runExtra[runCount++] = run - (run >= 11 ? 11 : 3);
+		} else if (value && run >= 4) {
+			run = (run > 7 ? 7 : run);
+			runSymbols[runCount] = value;
+			runExtra[runCount++] = 0;
+			runFrequencies[value]++;
+			runSymbols[runCount] = 16;
+			runExtra[runCount++] = run - 1 - 3;
+		} else {
+			run = 1;
+			runSymbols[runCount] = value;
+			runExtra[runCount++] = 0;
+		}
+		runFrequencies[runSymbols[runCount - 1]]++;
+		i += run;
+	}
+
+	deflate_coding_t lengthCoding;
+	huffman_build_lengths(runFrequencies, LENGTH_ALPHABET_SIZE, 7, lengthCoding.lengths);
+	int numCLen = LENGTH_ALPHABET_SIZE;
+	while (numCLen > 4 && !lengthCoding.lengths[lengthOrder[numCLen - 1]])
+		numCLen--;
+
+	// compare the sizes of the three forms
+	size_t dynamicBits = 3 + 5 + 5 + 4 + 3 * numCLen + deflate_symbol_bits(deflater, literal.lengths, distance.lengths);
+	for (int i = 0; i < LENGTH_ALPHABET_SIZE; i++)
+		dynamicBits += runFrequencies[i] * (lengthCoding.lengths[i] + (i == 16 ? 2 : (i == 17 ? 3 : (i == 18 ? 7 : 0))));
+	size_t fixedBits = 3 + deflate_symbol_bits(deflater, fixedLiteral.lengths, fixedDistance.lengths);
+	size_t storedLength = end - deflater->blockStart;
+	size_t storedBits = (storedLength / DEFLATE_STORED_MAX + 1) * (3 + 7 + 32) + 8 * storedLength;
+
+	if (storedBits <= fixedBits && storedBits <= dynamicBits) {
+		status = deflate_write_stored(deflater, end, isLastBlock);
+	} else if (fixedBits <= dynamicBits) {
+		huffman_build_codes(fixedLiteral.lengths, LITERAL_ALPHABET_SIZE, fixedLiteral.codes);
+		huffman_build_codes(fixedDistance.lengths, DISTANCE_ALPHABET_SIZE, fixedDistance.codes);
+		if ((status = bitstream_write(output, 3, isLastBlock | (BLOCK_TYPE_FIXED << 1)))) return status;
+		status = deflate_write_symbols(deflater, &fixedLiteral, &fixedDistance);
+	} else {
+		huffman_build_codes(literal.lengths, numLit, literal.codes);
+		huffman_build_codes(distance.lengths, numDist, distance.codes);
+		huffman_build_codes(lengthCoding.lengths, LENGTH_ALPHABET_SIZE, lengthCoding.codes);
+		if ((status = bitstream_write(output, 3, isLastBlock | (BLOCK_TYPE_DYNAMIC << 1)))) return status;
+		if ((status = bitstream_write(output, 14, (numLit - 257) | ((numDist - 1) << 5) | ((numCLen - 4) << 10)))) return status;
+		for (int i = 0; i < numCLen; i++)
+			if ((status = bitstream_write(output, 3, lengthCoding.lengths[lengthOrder[i]]))) return status;
+		for (int i = 0; i < runCount; i++) {
+			int symbol = runSymbols[i];
+			if ((status = bitstream_write(output, lengthCoding.lengths[symbol], lengthCoding.codes[symbol]))) return status;
+			if (symbol >= 16)
+				if ((status = bitstream_write(output, (symbol == 16 ? 2 : (symbol == 17 ? 3 : 7)), runExtra[i]))) return status;
+		}
+		status = deflate_write_symbols(deflater, &literal, &distance);
+	}
+
+	deflater->blockStart = end;
+	deflater->symbolCount = 0;
+	memset(deflater->literalFrequencies, 0, sizeof(deflater->literalFrequencies));
+	memset(deflater->distanceFrequencies, 0, sizeof(deflater->distanceFrequencies));
+	return status;
+}
+
+
+// Adds a literal or a match to the current block and writes the block if it is full.
+//	pos: the input position after the symbol
+static inline status_t deflate_add_symbol(deflater_t *deflater, int length, int distance, size_t pos) {
+	deflater->lengths[deflater->symbolCount] = length;
+	deflater->distances[deflater->symbolCount] = distance;
+	if (distance) {
+		deflater->literalFrequencies[257 + deflate_length_symbol(length)]++;
+		deflater->distanceFrequencies[deflate_distance_symbol(distance)]++;
+	} else {
+		deflater->literalFrequencies[length]++;
+	}
+
+	if (++deflater->symbolCount < DEFLATE_BLOCK_SYMBOLS)
+		return STATUS_SUCCESS;
+	return deflate_write_block(deflater, pos, 0);
+}
+
+
+// Compresses data into a DEFLATE stream (RFC 1951).
+//	data, length: the data to compress
+//	output: the stream to which the compressed data is appended (must be allocated using stream_alloc)
+//	level: DEFLATE_LEVEL_STORED ... DEFLATE_LEVEL_BEST, higher levels search longer for matches.
+//		Levels 1 to 3 take the first match that is found (greedy), higher levels check if the next
+//		position has a longer match before taking one (lazy).
+// Returns a non-zero error code if the operation failed.
+status_t deflate(const void *data, size_t length, bytestream_t *output, int level) {
+	if (level < DEFLATE_LEVEL_STORED || level > DEFLATE_LEVEL_BEST)
+		return STATUS_INVALID_ARGUMENT;
+
+	deflater_t *deflater = (deflater_t *)malloc(sizeof(deflater_t));
+	if (!deflater)
+		return STATUS_OUT_OF_MEMORY;
+	memset(deflater->head, 0xFF, sizeof(deflater->head));
+	memset(deflater->literalFrequencies, 0, sizeof(deflater->literalFrequencies));
+	memset(deflater->distanceFrequencies, 0, sizeof(deflater->distanceFrequencies));
+	deflater->data = (const uint8_t *)data;
+	deflater->length = length;
+	deflater->output = bitstream_init(output);
+	deflater->maxChain = deflateLevels[level].maxChain;
+	deflater->niceLength = deflateLevels[level].niceLength;
+	deflater->blockStart = 0;
+	deflater->symbolCount = 0;
+
+	status_t status = STATUS_SUCCESS;
+	size_t pos = 0;
+
+	if (level == DEFLATE_LEVEL_STORED) {
+		status = deflate_write_stored(deflater, length, 1);
+	} else {
+		size_t hashed = 0; // the positions before this one are in the hash chains
+		int matchLength = 0, distance = 0;
+		while (pos < length && !status) {
+			if (hashed <= pos) {
+				matchLength = deflate_find_match(deflater, pos, &distance);
+				hashed = pos + 1;
+			}
+
+			if (!matchLength) {
+				status = deflate_add_symbol(deflater, deflater->data[pos], 0, pos + 1);
+				pos++;
+				continue;
+			}
+
+			// with lazy matching, the match is dropped in favor of a literal if the next position has a longer one
+			if (deflateLevels[level].lazy && matchLength < deflater->niceLength && pos + 1 < length) {
+				int nextDistance;
+				int nextLength = deflate_find_match(deflater, pos + 1, &nextDistance);
+				hashed = pos + 2;
+				if (nextLength > matchLength) {
+					status = deflate_add_symbol(deflater, deflater->data[pos], 0, pos + 1);
+					pos++;
+					matchLength = nextLength;
+					distance = nextDistance;
+					continue;
 				}
-				huffman_free(treeCoding);
+			}
+
+			// the remaining positions of the match are added to the hash chains without searching
+			size_t end = pos + matchLength;
+			status = deflate_add_symbol(deflater, matchLength, distance, end);
+			while (++pos < end)
+				if (pos >= hashed)
+					deflate_insert(deflater, pos);
+			hashed = (hashed > end ? hashed : end);
+		}
+	}
+
+	if (!status && level != DEFLATE_LEVEL_STORED)
+		status = deflate_write_block(deflater, pos, 1);
+	bitstream_write_align(&deflater->output);
+
+	free(deflater);
+	return status;
+}
+
+
+// Compresses data into a stream of the specified format (one of the DEFLATE_FORMAT_ constants).
+// A gzip member is written without file name and modification time.
+// Returns a non-zero error code if the operation failed.
+status_t deflate_ex(const void *data, size_t length, bytestream_t *output, int level, int format) {
+	status_t status;
+	uint8_t header[10], trailer[8];
+	size_t headerLength, trailerLength;
+
+	if (level < DEFLATE_LEVEL_STORED || level > DEFLATE_LEVEL_BEST)
+		return STATUS_INVALID_ARGUMENT;
+
+	if (format == DEFLATE_FORMAT_RAW) {
+		return deflate(data, length, output, level);
+	} else if (format == DEFLATE_FORMAT_ZLIB) {
+		// a 32kB window and a hint on the level (RFC 1950, 2.2), followed by the Adler-32 checksum MSB first
+		int levelHint = (level < 2 ? 0 : (level < 6 ? 1 : (level == 6 ? 2 : 3)));
+		header[0] = ZLIB_METHOD_DEFLATE | (7 << 4);
+		header[1] = levelHint << 6;
+		header[1] += 31 - ((header[0] << 8) | header[1]) % 31;
+		headerLength = 2;
+
+		uint32_t checksum = adler32_update(ADLER32_INIT, data, length);
+		for (int i = 0; i < 4; i++)
+			trailer[i] = checksum >> (24 - 8 * i);
+		trailerLength = 4;
+	} else if (format == DEFLATE_FORMAT_GZIP) {
+		// no optional fields and no modification time, followed by the CRC32 and the size LSB first (RFC 1952, 2.3)
+		memset(header, 0, sizeof(header));
+		header[0] = GZIP_ID & 0xFF;
+		header[1] = GZIP_ID >> 8;
+		header[2] = GZIP_METHOD_DEFLATE;
+		header[8] = (level == DEFLATE_LEVEL_BEST ? 2 : (level == DEFLATE_LEVEL_FAST ? 4 : 0));
+		header[9] = GZIP_OS_UNKNOWN;
+		headerLength = 10;
+
+		uint32_t checksum = crc32_update(CRC32_INIT, data, length);
+		for (int i = 0; i < 4; i++) {
+			trailer[i] = checksum >> (8 * i);
+			trailer[4 + i] = (uint32_t)length >> (8 * i);
+		}
+		trailerLength = 8;
+	} else {
+		return STATUS_INVALID_ARGUMENT;
+	}
+
+	if ((status = stream_write(output, header, headerLength))) return status;
+	if ((status = deflate(data, length, output, level))) return status;
+	return stream_write(output, trailer, trailerLength);
+}
+
+
+#ifdef USING_BENCHMARK
+
+// Measures how fast a bitstream is read, once with the bits assembled byte by byte and once with 8 byte loads.
+// The widths of the reads cycle through 1 to 15 bits, like those of huffman codes and extra bits.
+//	length: the number of bytes to read (allocated on the heap)
+void bitstream_benchmark(size_t length) {
+	benchmark_t bench;
+	benchmark_init(&bench, "bitstream");
+	bytestream_t stream;
+	if (stream_alloc(&stream, length)) {
+		LOGE("bitstream benchmark: could not allocate %d kB", (int)(length >> 10));
+		return;
+	}
+
+	for (size_t i = 0; i < length; i++)
+		stream.data[i] = benchmark_random(&bench) >> 24;
+	stream.wPos = length;
 
-				// read block
-				status = inflate_block(input, output, literalCoding, distanceCoding);
-				huffman_free(literalCoding);
-				huffman_free(distanceCoding);
-				if (status) INFLATE_EXIT(DEFLATE_STATUS_INVALID_BLOCK_TYPE);
+	uint64_t sums[2];
+	for (int pass = 0; pass < 2; pass++) {
+		bitstream_t bitstream = bitstream_init(&stream);
+		uint64_t sum = 0, value;
+		int bits = 1;
+		stream.rPos = 0;
 
+		benchmark_start(&bench);
+		for (;;) {
+			int available = (pass ? bitstream_peek(&bitstream, bits, &value) : bitstream_peek_bytewise(&bitstream, bits, &value));
+			if (available < bits)
 				break;
+			bitstream_consume(&bitstream, bits);
+			sum += value;
+			bits = (bits == 15 ? 1 : bits + 1);
+		}
+		benchmark_stop(&bench, (pass ? "8 byte loads" : "bytewise"), length >> 10, "kB");
 
-			default:
-				return INFLATE_EXIT(DEFLATE_STATUS_INVALID_BLOCK_TYPE);
+		sums[pass] = sum;
+	}
+
+	if (sums[0] != sums[1])
+		LOGE("bitstream benchmark: the two readers returned different bits");
+	stream_free(&stream);
+}
+
+
+// Compares copying back-references byte by byte with inflate_copy_match for a range of distances.
+// For each distance, a buffer is filled with consecutive matches of pseudo-random lengths (3...258 bytes),
+// once with each method, and the two buffers are compared.
+//	length: the size of each of the two buffers (allocated on the heap)
+void inflate_copy_benchmark(size_t length) {
+	static const size_t distances[] = { 1, 2, 3, 5, 8, 9, 12, 16, 24, 100, 4000 };
+	benchmark_t bench;
+	benchmark_init(&bench, "inflate copy");
+	if (length < 4000 + INFLATE_MAX_MATCH) {
+		LOGE("inflate copy benchmark: %d bytes are too few for the largest distance", (int)length);
+		return;
+	}
+	uint8_t *buffers[2] = { (uint8_t *)malloc(length), (uint8_t *)malloc(length) };
+	if (!buffers[0] || !buffers[1]) {
+		LOGE("inflate copy benchmark: could not allocate 2 x %d kB", (int)(length >> 10));
+		free(buffers[0]);
+		free(buffers[1]);
+		return;
+	}
+
+	for (size_t d = 0; d < sizeof(distances) / sizeof(distances[0]); d++) {
+		size_t distance = distances[d], end = distance;
+		LOGI("inflate copy benchmark: distance %d", (int)distance);
+
+		for (int pass = 0; pass < 2; pass++) {
+			uint8_t *buffer = buffers[pass];
+			benchmark_reseed(&bench);
+			for (size_t i = 0; i < distance; i++)
+				buffer[i] = benchmark_random(&bench) >> 24;
+
+			benchmark_start(&bench);
+			for (end = distance; end + INFLATE_MAX_MATCH <= length;) {
+				size_t count = 3 + (benchmark_random(&bench) >> 16) % (INFLATE_MAX_MATCH - 2);
+				if (pass) {
+					inflate_copy_match(buffer + end, distance, count);
+				} else {
+					for (size_t i = 0; i < count; i++)
+						buffer[end + i] = buffer[end + i - distance];
+				}
+				end += count;
+			}
+			benchmark_stop(&bench, (pass ? "chunks" : "byte loop"), end >> 10, "kB");
 		}
 
+		if (memcmp(buffers[0], buffers[1], end))
+			LOGE("inflate copy benchmark: distance %d: the two methods copied different data", (int)distance);
+	}
 
-	} while (!isLastBlock);
+	free(buffers[0]);
+	free(buffers[1]);
+}
 
 
-	return STATUS_SUCCESS;
+// Fills a buffer with pseudo-random data that compresses roughly like text: words from a small vocabulary,
+// interspersed with runs of a single byte and short stretches of random bytes. Every call produces the same data,
+// so that it can be used to compare with other implementations (see platform/windows/zlibbench.c).
+void deflate_benchmark_data(uint8_t *data, size_t length) {
+	static const char *words[] = { "the ", "kernel ", "thread ", "memory ", "page ", "of ", "and ", "to ", "a ", "is ",
+		"scheduler ", "interrupt ", "driver ", "file ", "in ", "for ", "stream ", "block ", "with ", "returns ",
+		"status ", "lock ", "that ", "buffer ", "on ", "timer ", "heap ", "window ", "be ", "not ", "if ", "\n" };
+	benchmark_t bench;
+	benchmark_init(&bench, "deflate data");
+
+	for (size_t i = 0; i < length;) {
+		uint32_t random = benchmark_random(&bench);
+		uint32_t kind = (random >> 8) & 63;
+		if (!kind) {
+			size_t count = min(length - i, (size_t)((random >> 14) & 63) + 4);
+			memset(data + i, (uint8_t)(random >> 24), count);
+			i += count;
+		} else if (kind == 1) {
+			for (size_t end = min(length, i + ((random >> 14) & 15) + 1); i < end; i++)
+				data[i] = benchmark_random(&bench) >> 24;
+		} else {
+			const char *word = words[(random >> 16) & 31];
+			for (; *word && i < length; word++)
+				data[i++] = *word;
+		}
+	}
+}
+
+
+// Compares decompressing into a single buffer that grows to the size of the data with the streaming inflater,
+// which only keeps the window and drains the data in chunks of 16 kB. Both results are checked against the input.
+//	length: the number of bytes to compress and decompress (allocated on the heap)
+void inflate_benchmark(size_t length) {
+	benchmark_t bench;
+	benchmark_init(&bench, "inflate");
+	uint8_t *data = (uint8_t *)malloc(length ? length : 1);
+	uint8_t *chunk = (uint8_t *)malloc(16384);
+	bytestream_t compressed = { .data = NULL }, output = { .data = NULL };
+	if (data)
+		deflate_benchmark_data(data, length);
+	if (!data || !chunk || stream_alloc(&compressed, length / 2) || deflate(data, length, &compressed, DEFLATE_LEVEL_DEFAULT)) {
+		LOGE("inflate benchmark: could not compress %d kB", (int)(length >> 10));
+		free(data);
+		free(chunk);
+		stream_free(&compressed);
+		return;
+	}
+
+	LOGI("inflate benchmark: %d kB from %d kB", (int)(length >> 10), (int)(compressed.wPos >> 10));
+	for (int pass = 0; pass < 2; pass++) {
+		status_t status;
+		size_t memory, mismatch = 0, total = 0;
+
+		benchmark_start(&bench);
+		if (!pass) {
+			if ((status = stream_alloc(&output, 4096)) == STATUS_SUCCESS)
+				status = inflate(compressed.data, compressed.wPos, &output);
+			memory = output.capacity;
+			total = output.wPos;
+			mismatch = (status || total != length || memcmp(output.data, data, length));
+			stream_free(&output);
+		} else {
+			inflater_t inflater;
+			const char *input = compressed.data;
+			size_t remaining = compressed.wPos, produced;
+			memory = INFLATE_WINDOW_SIZE + INFLATE_INPUT_SIZE + 16384;
+			if ((status = inflate_init(&inflater)) == STATUS_SUCCESS) {
+				do {
+					size_t accepted = inflate_feed(&inflater, input, remaining);
+					input += accepted;
+					remaining -= accepted;
+					status = inflate_drain(&inflater, chunk, 16384, &produced);
+					mismatch |= (total + produced > length || memcmp(chunk, data + total, produced));
+					total += produced;
+				} while (!mismatch && (status == STATUS_IN_PROGRESS || (status == STATUS_BUFFER_UNDERRUN && remaining)));
+				mismatch |= (status || total != length);
+				inflate_end(&inflater);
+			}
+		}
+		benchmark_stop(&bench, (pass ? "streaming" : "single buffer"), length >> 10, "kB");
+
+		if (mismatch)
+			LOGE("inflate benchmark: %s: status %d, %d of %d kB decompressed correctly", (pass ? "streaming" : "single buffer"), status, (int)(total >> 10), (int)(length >> 10));
+		LOGI("inflate benchmark: %s: %d kB of buffers", (pass ? "streaming" : "single buffer"), (int)(memory >> 10));
+	}
+
+	free(data);
+	free(chunk);
+	stream_free(&compressed);
 }
 
 
+// Compresses text-like pseudo-random data with several levels and logs the speed and the compression ratio of each.
+// Every result is decompressed again and compared with the input.
+//	length: the number of bytes to compress (allocated on the heap)
+void deflate_benchmark(size_t length) {
+	static const struct { int level; const char *name; } levels[] = {
+		{ DEFLATE_LEVEL_STORED, "level 0" }, { DEFLATE_LEVEL_FAST, "level 1" }, { 3, "level 3" },
+		{ DEFLATE_LEVEL_DEFAULT, "level 6" }, { DEFLATE_LEVEL_BEST, "level 9" },
+	};
+	benchmark_t bench;
+	benchmark_init(&bench, "deflate");
+	uint8_t *data = (uint8_t *)malloc(length ? length : 1);
+	if (!data) {
+		LOGE("deflate benchmark: could not allocate %d kB", (int)(length >> 10));
+		return;
+	}
+	deflate_benchmark_data(data, length);
 
+	LOGI("deflate benchmark: %d kB", (int)(length >> 10));
+	for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+		bytestream_t compressed = { .data = NULL }, output = { .data = NULL };
+		status_t status;
 
+		benchmark_start(&bench);
+		if ((status = stream_alloc(&compressed, length / 2)) == STATUS_SUCCESS)
+			status = deflate(data, length, &compressed, levels[l].level);
+		benchmark_stop(&bench, levels[l].name, length >> 10, "kB");
 
+		if (!status && (status = stream_alloc(&output, length)) == STATUS_SUCCESS)
+			status = inflate(compressed.data, compressed.wPos, &output);
+		if (status || output.wPos != length || memcmp(output.data, data, length))
+			LOGE("deflate benchmark: %s: status %d, the data did not survive the round trip", levels[l].name, status);
+		else
+			LOGI("deflate benchmark: %s: compressed to %d.%d%%", levels[l].name,
+				(int)(compressed.wPos * 100 / (length ? length : 1)), (int)(compressed.wPos * 1000 / (length ? length : 1) % 10));
 
+		stream_free(&compressed);
+		stream_free(&output);
+	}
 
+	free(data);
+}
 
+#endif // USING_BENCHMARK
 
 
+#endif // USING_DEFLATE
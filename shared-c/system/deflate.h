@@ -0,0 +1,74 @@
+/*
+*
+* Implements compression and decompression of DEFLATE formatted data (RFC1951),
+* optionally wrapped in a zlib (RFC1950) or gzip (RFC1952) container.
+*
+* created: 15.01.15
+*
+*/
+
+#ifndef __DEFLATE_H__
+#define __DEFLATE_H__
+
+#ifdef USING_DEFLATE
+
+
+#define INFLATE_WINDOW_SIZE		(32768)	// the largest distance of a back-reference (RFC 1951, 2.3)
+#define INFLATE_INPUT_SIZE		(4096)	// compressed data that is buffered by an inflater (must hold any dynamic block header)
+
+#define DEFLATE_LEVEL_STORED	(0)	// no compression
+#define DEFLATE_LEVEL_FAST		(1)	// greedy matching with short hash chains
+#define DEFLATE_LEVEL_DEFAULT	(6)	// lazy matching
+#define DEFLATE_LEVEL_BEST		(9)	// lazy matching with long hash chains
+
+#define DEFLATE_FORMAT_RAW		(0)	// a bare DEFLATE stream
+#define DEFLATE_FORMAT_ZLIB		(1)	// a zlib stream, which ends with an Adler-32 checksum
+#define DEFLATE_FORMAT_GZIP		(2)	// a gzip member, which ends with a CRC32 checksum and the size of the data
+
+
+// The state of a streaming decompression. Only the last INFLATE_WINDOW_SIZE bytes of output are kept, so the memory
+// usage does not depend on the size of the data. An inflater must not be moved after inflate_init.
+// The checksum of a zlib or gzip stream is updated while the data is drained and verified at the end of the stream.
+typedef struct
+{
+	int format;							// one of the DEFLATE_FORMAT_ constants
+	int state;							// one of the INFLATE_STATE_ constants (defined in deflate.c)
+	int headerFlags;					// the optional fields of a gzip header that were not yet skipped
+	size_t headerSkip;					// number of bytes of the current gzip header field that are still to be skipped
+	int isLastBlock;					// set while the last block of the stream is decoded
+	size_t rawRemaining;				// number of bytes left in the current uncompressed block
+	const huffman_t *literalCoding;		// the codings of the current compressed block
+	const huffman_t *distanceCoding;
+	struct inflate_codings_t *codings;	// storage for the codings of dynamic blocks (allocated on first use)
+	bytestream_t inputStream;			// compressed data that was fed but not yet consumed
+	bitstream_t input;
+	uint8_t *window;					// circular buffer that holds the most recent output
+	uint64_t windowPos;					// total number of bytes written to the window
+	size_t pending;						// number of bytes at the end of the window that were not yet drained
+	uint32_t checksum;					// the checksum of the data that was drained so far
+	uint32_t expectedChecksum;			// the checksum and the size (modulo 2^32) found at the end of the stream
+	uint32_t expectedSize;
+} inflater_t;
+
+
+status_t inflate_init(inflater_t *inflater);
+status_t inflate_init_ex(inflater_t *inflater, int format);
+size_t inflate_feed(inflater_t *inflater, const void *data, size_t length);
+status_t inflate_drain(inflater_t *inflater, void *buffer, size_t size, size_t *produced);
+void inflate_end(inflater_t *inflater);
+status_t inflate(const void *data, size_t length, bytestream_t *output);
+status_t inflate_ex(const void *data, size_t length, bytestream_t *output, int format);
+status_t deflate(const void *data, size_t length, bytestream_t *output, int level);
+status_t deflate_ex(const void *data, size_t length, bytestream_t *output, int level, int format);
+#ifdef USING_BENCHMARK
+void deflate_benchmark_data(uint8_t *data, size_t length);
+void bitstream_benchmark(size_t length);
+void inflate_benchmark(size_t length);
+void inflate_copy_benchmark(size_t length);
+void deflate_benchmark(size_t length);
+#endif
+
+
+#endif // USING_DEFLATE
+
+#endif // __DEFLATE_H__
@@ -74,80 +74,418 @@ volume_t* volume_init(disk_t *disk, size_t *count) {
 }
 
 
-// Reads or writes a fragment of a sector
-status_t volume_readwrite_frag(volume_t *volume, int read, uint64_t sector, uint64_t offset, uint64_t count, char *buffer) {
-	status_t status;
+// The volume_read and volume_write functions go through a block cache that sits between
+// the volume and the disk. The cache holds blocks of BLOCK_CACHE_BLOCK_SIZE bytes (or one
+// sector if sectors are larger), identified by the disk and the block number on the disk.
+// Blocks are found through a hash table and replaced in LRU order.
+// Writes are passed through to the disk immediately (write-through).
+// When a disk is read sequentially, blocks are read ahead with a window that doubles on every
+// sequential request (up to BLOCK_CACHE_READ_AHEAD_MAX) and is reset on any other request.
+// The cache is protected by a single lock that is held for the entire request, except while blocks are
+// allocated and read from disk on a miss. It is a spin lock that is held with interrupts disabled, because
+// volumes are read before threading is initialized, which rules out mutexes. After a read, the lock is
+// reacquired and blocks that were inserted in the meantime are left alone. If a write was issued while the
+// lock was released, the data that was read may be stale, so it is discarded and the lookup is repeated.
+// Writes still hold the lock during the disk access, because they are written from the cached block.
+// Blocks that are evicted are kept as spare blocks and reused by the next miss, so that the heap is only
+// used while the lock is released.
+
+//#define DBG_CACHE(...)	LOGI(__VA_ARGS__)
+#define DBG_CACHE(...)
+
+#define BLOCK_CACHE_BLOCK_SIZE			(4096)
+#define BLOCK_CACHE_READ_AHEAD_MAX		(32)	// maximum number of blocks read at once
+#define BLOCK_CACHE_MEMORY_SHARE_BITS	(6)		// the cache may use 2^-BLOCK_CACHE_MEMORY_SHARE_BITS of the free physical memory
+#define BLOCK_CACHE_MIN_BLOCKS			(4 * BLOCK_CACHE_READ_AHEAD_MAX)
+#define BLOCK_CACHE_MAX_BLOCKS			(16384)
+#define BLOCK_CACHE_DEFAULT_BLOCKS		(1024)	// used if the amount of physical memory is unknown
+
+
+typedef struct cache_block_t
+{
+	disk_t *disk;						// the disk this block belongs to (NULL if the block is unused)
+	uint64_t number;					// block number on the disk (the first sector is number * sectors per block)
+	size_t size;						// size of the data buffer
+	int readAhead;						// set if the block was read speculatively and not used since
+	struct cache_block_t *nextInBucket;	// next block in the same hash bucket
+	struct cache_block_t *newer;		// next more recently used block
+	struct cache_block_t *older;		// next less recently used block
+	char data[];
+} cache_block_t;
+
+
+struct
+{
+	cache_block_t **buckets;			// hash table of all blocks in cache
+	size_t bucketMask;					// number of buckets - 1
+	cache_block_t *newest;				// most recently used block
+	cache_block_t *oldest;				// least recently used block
+	cache_block_t *spare;				// evicted blocks that can be reused (linked by nextInBucket)
+	uint64_t writes;					// number of writes that went to disk
+	block_cache_statistics_t stats;
+	volatile int lock;					// held by the processor that currently accesses the cache
+	int intFlag;						// the interrupt state of the lock holder before the lock was acquired
+} blockCache = { .buckets = NULL };
+
+
+#ifdef USING_THREADING
+
+// Acquires the block cache lock and disables interrupts on the local processor.
+// Interrupts stay enabled while another processor holds the lock, so that TLB shootdowns are still answered.
+static void block_cache_lock(void) {
+	for (;;) {
+		int intFlag = atomic_enter();
+		if (__sync_bool_compare_and_swap(&blockCache.lock, 0, 1)) {
+			blockCache.intFlag = intFlag;
+			return;
+		}
+		atomic_exit(intFlag);
+		while (blockCache.lock)
+			cpu_relax();
+	}
+}
 
-	char tempBuf[volume->disk->bytesPerSector];
 
-	if ((status = volume->disk->read(volume->disk, volume->startSector + sector, 1, tempBuf)))
-		return status;
+// Releases the block cache lock and restores the interrupt state.
+static void block_cache_unlock(void) {
+	int intFlag = blockCache.intFlag;
+	spin_unlock(&blockCache.lock);
+	atomic_exit(intFlag);
+}
 
-	if (read) {
-		memcpy(buffer, tempBuf + offset, count);
-	} else {
-		memcpy(tempBuf + offset, buffer, count);
-		if ((status = volume->disk->write(volume->disk, volume->startSector + sector, 1, tempBuf)))
-			return status;
-	}
+#else
+
+// Without threading, the entire request is executed in an atomic section (see volume_readwrite),
+// which isn't left for the disk access.
+#define block_cache_lock()
+#define block_cache_unlock()
+
+#endif
 
+
+// Sets up the block cache. The maximum size is derived from the amount of free physical memory.
+static status_t block_cache_init(void) {
+#ifdef USING_VIRTUAL_MEMORY
+	size_t maxBlocks = (phy_get_free_page_count() * PAGE_SIZE) / BLOCK_CACHE_BLOCK_SIZE >> BLOCK_CACHE_MEMORY_SHARE_BITS;
+	maxBlocks = max(min(maxBlocks, BLOCK_CACHE_MAX_BLOCKS), BLOCK_CACHE_MIN_BLOCKS);
+#else
+	size_t maxBlocks = BLOCK_CACHE_DEFAULT_BLOCKS;
+#endif
+
+	// use about one bucket per block
+	size_t bucketCount = 1;
+	while (bucketCount < maxBlocks)
+		bucketCount <<= 1;
+
+	if (!(blockCache.buckets = (cache_block_t **)calloc(bucketCount, sizeof(cache_block_t *))))
+		return STATUS_OUT_OF_MEMORY;
+	blockCache.bucketMask = bucketCount - 1;
+	blockCache.stats.maxBlocks = maxBlocks;
+	blockCache.stats.blockSize = BLOCK_CACHE_BLOCK_SIZE;
+	DBG_CACHE("block cache: up to %d blocks", maxBlocks);
 	return STATUS_SUCCESS;
 }
 
 
-// Reads or writes from the specified volume.
-status_t volume_readwrite(volume_t *volume, int read, uint64_t offset, uint64_t count, char *buffer) {
-	assert(volume);
-	assert(buffer);
-	assert(offset <= volume->sectorCount * volume->disk->bytesPerSector);
-	assert(offset + count <= volume->sectorCount * volume->disk->bytesPerSector);
-	if (!count) return STATUS_SUCCESS;
-	status_t status;
+// Returns the number of bytes per cache block on the specified disk
+static inline uint64_t block_cache_block_size(disk_t *disk) {
+	return (disk->bytesPerSector < BLOCK_CACHE_BLOCK_SIZE ? (BLOCK_CACHE_BLOCK_SIZE / disk->bytesPerSector) * disk->bytesPerSector : disk->bytesPerSector);
+}
 
-	// calculate some metrics
-	int startMissAligned = ((offset % volume->disk->bytesPerSector) ? 1 : 0);
-	int endMissAligned = (((offset + count) % volume->disk->bytesPerSector) ? 1 : 0);
-	uint64_t firstSector = offset / volume->disk->bytesPerSector;
-	uint64_t bytesInFirstSector = ((firstSector + startMissAligned) * volume->disk->bytesPerSector) - offset;
-	uint64_t fullSectors = ((count > bytesInFirstSector) ? ((count - bytesInFirstSector) / volume->disk->bytesPerSector) : 0);
-	uint64_t lastSector = (offset + count) / volume->disk->bytesPerSector;
-	uint64_t bytesInLastSector = (offset + count) - (lastSector * volume->disk->bytesPerSector);
-
-	// handle special case
-	if (startMissAligned && endMissAligned && (firstSector == lastSector)) {
-		if ((status = volume_readwrite_frag(volume, read, firstSector, volume->disk->bytesPerSector - bytesInFirstSector, count, buffer)))
-			return status;
-		return STATUS_SUCCESS;
+
+// Returns the hash bucket of the specified block
+static inline cache_block_t **block_cache_bucket(disk_t *disk, uint64_t number) {
+	return &blockCache.buckets[((number + (uintptr_t)disk) * 0x9E3779B97F4A7C15UL >> 32) & blockCache.bucketMask];
+}
+
+
+// Removes a block from the LRU list.
+static void block_cache_unlink(cache_block_t *block) {
+	if (block->newer) block->newer->older = block->older;
+	else blockCache.newest = block->older;
+	if (block->older) block->older->newer = block->newer;
+	else blockCache.oldest = block->newer;
+}
+
+
+// Marks a block as the most recently used block.
+static void block_cache_touch(cache_block_t *block) {
+	if (blockCache.newest == block)
+		return;
+	block_cache_unlink(block);
+	block->newer = NULL;
+	if ((block->older = blockCache.newest))
+		block->older->newer = block;
+	else
+		blockCache.oldest = block;
+	blockCache.newest = block;
+}
+
+
+// Returns the cached block with the specified number or NULL if it is not in cache.
+static cache_block_t *block_cache_find(disk_t *disk, uint64_t number) {
+	for (cache_block_t *block = *block_cache_bucket(disk, number); block; block = block->nextInBucket)
+		if (block->disk == disk && block->number == number)
+			return block;
+	return NULL;
+}
+
+
+// Returns a block for the specified disk that can be filled with new data, preferably a spare one.
+// The block cache lock must be held. NULL is returned if there is no spare block, in which case
+// a new one has to be allocated with block_cache_new after the lock has been released.
+static cache_block_t *block_cache_take_spare(disk_t *disk) {
+	size_t size = block_cache_block_size(disk);
+	cache_block_t *block;
+	while ((block = blockCache.spare)) {
+		blockCache.spare = block->nextInBucket;
+		if (block->size == size)
+			return block;
+		free(block); // only happens if disks with sectors larger than a block are mixed with other ones
 	}
+	return NULL;
+}
 
-	// transfer part of the first sector
-	if (startMissAligned) {
-		if ((status = volume_readwrite_frag(volume, read, firstSector, volume->disk->bytesPerSector - bytesInFirstSector, bytesInFirstSector, buffer)))
-			return status;
-		buffer += bytesInFirstSector;
+
+// Returns a block to the spare blocks. The block cache lock must be held.
+static inline void block_cache_put_spare(cache_block_t *block) {
+	block->nextInBucket = blockCache.spare;
+	blockCache.spare = block;
+}
+
+
+// Allocates a block for the specified disk. The block cache lock must not be held.
+static cache_block_t *block_cache_new(disk_t *disk) {
+	size_t size = block_cache_block_size(disk);
+	cache_block_t *block = (cache_block_t *)malloc(sizeof(cache_block_t) + size);
+	if (block)
+		block->size = size;
+	return block;
+}
+
+
+// Makes a block available for lookup and marks it as the most recently used one.
+// If the cache is full, the least recently used block is evicted and becomes a spare block.
+static void block_cache_insert(cache_block_t *block, disk_t *disk, uint64_t number) {
+	if (blockCache.stats.blocks >= blockCache.stats.maxBlocks) {
+		cache_block_t *oldest = blockCache.oldest;
+		cache_block_t **bucket = block_cache_bucket(oldest->disk, oldest->number);
+		while (*bucket != oldest)
+			bucket = &(*bucket)->nextInBucket;
+		*bucket = oldest->nextInBucket;
+		block_cache_unlink(oldest);
+		blockCache.stats.blocks--;
+		block_cache_put_spare(oldest);
 	}
 
-	// transfer full sectors
-	if (fullSectors) {
-		if (read)
-			status = volume->disk->read(volume->disk, volume->startSector + firstSector + startMissAligned, fullSectors, buffer);
-		else
-			status = volume->disk->write(volume->disk, volume->startSector + firstSector + startMissAligned, fullSectors, buffer);
+	cache_block_t **bucket = block_cache_bucket(disk, number);
+	block->disk = disk;
+	block->number = number;
+	block->nextInBucket = *bucket;
+	*bucket = block;
+
+	block->newer = NULL;
+	if ((block->older = blockCache.newest))
+		block->older->newer = block;
+	else
+		blockCache.oldest = block;
+	blockCache.newest = block;
+	blockCache.stats.blocks++;
+}
+
+
+// Returns the specified block, reading it from disk if it is not in cache. The block cache lock must be held,
+// but it is released while blocks are allocated and read, so cached blocks may have been evicted on return.
+// On a miss, the blocks that directly follow up to the block specified by limit are read along
+// with the requested block, as long as they are not already in cache. Blocks after the block
+// specified by last are considered to be read ahead.
+static status_t block_cache_get(disk_t *disk, uint64_t number, uint64_t last, uint64_t limit, cache_block_t **blockPtr) {
+	cache_block_t *blocks[BLOCK_CACHE_READ_AHEAD_MAX];
+	status_t status = STATUS_SUCCESS;
+	cache_block_t *block;
+	int missed = 0;
+
+	for (;;) {
+		if ((block = block_cache_find(disk, number))) {
+			if (!missed)
+				blockCache.stats.hits++;
+			if (block->readAhead)
+				blockCache.stats.readAheadHits++, block->readAhead = 0;
+			block_cache_touch(block);
+			*blockPtr = block;
+			return STATUS_SUCCESS;
+		}
+
+		if (!missed)
+			blockCache.stats.misses++;
+		missed = 1;
+
+		// determine how many blocks to read at once
+		uint64_t sectorsPerBlock = block_cache_block_size(disk) / disk->bytesPerSector;
+		uint64_t blockCount = (disk->sectorCount + sectorsPerBlock - 1) / sectorsPerBlock;
+		uint64_t count = 1;
+		limit = min(limit, blockCount - 1);
+		while (number + count <= limit && count < BLOCK_CACHE_READ_AHEAD_MAX && !block_cache_find(disk, number + count))
+			count++;
+
+		uint64_t firstSector = number * sectorsPerBlock;
+		uint64_t sectorCount = min(count * sectorsPerBlock, disk->sectorCount - firstSector);
+		uint64_t writes = blockCache.writes;
+		DBG_CACHE("block cache: read %d blocks at %d", (int)count, (int)number);
+
+		for (uint64_t i = 0; i < count; i++)
+			blocks[i] = block_cache_take_spare(disk);
+
+		block_cache_unlock();
+
+		for (uint64_t i = 0; i < count && !status; i++)
+			if (!blocks[i] && !(blocks[i] = block_cache_new(disk)))
+				status = STATUS_OUT_OF_MEMORY;
+
+		if (!status) {
+			if (count == 1) {
+				// a single block is read directly into the cache
+				status = disk->read(disk, firstSector, sectorCount, blocks[0]->data);
+			} else {
+				// multiple blocks are read in one request and then distributed
+				char *buffer = (char *)malloc(sectorCount * disk->bytesPerSector);
+				if (!buffer)
+					status = STATUS_OUT_OF_MEMORY;
+				else if (!(status = disk->read(disk, firstSector, sectorCount, buffer)))
+					for (uint64_t i = 0; i < count; i++)
+						memcpy(blocks[i]->data, buffer + i * blocks[i]->size, min(blocks[i]->size, (sectorCount - i * sectorsPerBlock) * disk->bytesPerSector));
+				free(buffer);
+			}
+		}
+
+		block_cache_lock();
+
+		// insert in reverse order so that the requested block ends up as the most recently used one
+		// (blocks that were inserted by another request while the lock was released are more recent)
+		int stale = (blockCache.writes != writes);
+		for (uint64_t i = count; i--;) {
+			if (!blocks[i])
+				continue;
+			if (status || stale || block_cache_find(disk, number + i)) {
+				block_cache_put_spare(blocks[i]);
+				continue;
+			}
+			blocks[i]->readAhead = (number + i > last);
+			block_cache_insert(blocks[i], disk, number + i);
+			if (number + i > max(number, last))
+				blockCache.stats.readAhead++;
+		}
+
 		if (status)
 			return status;
-		buffer += fullSectors * volume->disk->bytesPerSector;
 	}
+}
+
+
+// Returns the hit and miss counters and the size of the block cache.
+// The counters are read without taking the lock and may therefore be slightly inconsistent.
+void block_cache_get_statistics(block_cache_statistics_t *stats) {
+	*stats = blockCache.stats;
+}
 
-	// transfer part of the last sector
-	if (endMissAligned) {
-		if ((status = volume_readwrite_frag(volume, read, lastSector, 0, bytesInLastSector, buffer)))
+
+// Prints the block cache statistics.
+void block_cache_dump(void) {
+	block_cache_statistics_t stats;
+	block_cache_get_statistics(&stats);
+	uint64_t accesses = stats.hits + stats.misses;
+	LOGI("block cache: %d of %d blocks used, %d hits, %d misses (%d%% hit rate), %d of %d blocks read ahead were used",
+		(int)stats.blocks, (int)stats.maxBlocks, (int)stats.hits, (int)stats.misses,
+		(int)(accesses ? stats.hits * 100 / accesses : 0), (int)stats.readAheadHits, (int)stats.readAhead);
+}
+
+
+// Reads or writes from the specified volume. The block cache lock must be held.
+static status_t volume_readwrite_locked(volume_t *volume, int read, uint64_t offset, uint64_t count, char *buffer) {
+	status_t status;
+
+	if (!blockCache.buckets)
+		if ((status = block_cache_init()))
 			return status;
+
+	// calculate some metrics
+	disk_t *disk = volume->disk;
+	uint64_t blockSize = block_cache_block_size(disk);
+	uint64_t diskOffset = volume->startSector * disk->bytesPerSector + offset;
+	uint64_t firstBlock = diskOffset / blockSize;
+	uint64_t lastBlock = (diskOffset + count - 1) / blockSize;
+	uint64_t limit = lastBlock;
+
+	// adapt the read-ahead window (a request that starts in the last block of the previous one is still sequential)
+	if (read) {
+		if (firstBlock + 1 == disk->nextSequentialBlock || firstBlock == disk->nextSequentialBlock)
+			disk->readAheadWindow = min(max(disk->readAheadWindow << 1, 1), BLOCK_CACHE_READ_AHEAD_MAX);
+		else
+			disk->readAheadWindow = 0;
+		disk->nextSequentialBlock = lastBlock + 1;
+		limit += disk->readAheadWindow;
+	}
+
+	for (uint64_t number = firstBlock; number <= lastBlock; number++) {
+		uint64_t blockOffset = (number == firstBlock ? diskOffset % blockSize : 0);
+		uint64_t blockCount = min(count, blockSize - blockOffset);
+		cache_block_t *block;
+
+		if (read) {
+			if ((status = block_cache_get(disk, number, lastBlock, limit, &block)))
+				return status;
+			memcpy(buffer, block->data + blockOffset, blockCount);
+		} else {
+			// only sectors that are partially written need to be loaded
+			uint64_t firstSector = blockOffset / disk->bytesPerSector;
+			uint64_t endSector = (blockOffset + blockCount + disk->bytesPerSector - 1) / disk->bytesPerSector;
+			int aligned = !(blockOffset % disk->bytesPerSector) && !((blockOffset + blockCount) % disk->bytesPerSector);
+
+			if (!(block = block_cache_find(disk, number)) && !aligned)
+				if ((status = block_cache_get(disk, number, number, number, &block)))
+					return status;
+
+			blockCache.writes++;
+			if (block) {
+				memcpy(block->data + blockOffset, buffer, blockCount);
+				status = disk->write(disk, number * (blockSize / disk->bytesPerSector) + firstSector, endSector - firstSector, block->data + firstSector * disk->bytesPerSector);
+			} else {
+				status = disk->write(disk, number * (blockSize / disk->bytesPerSector) + firstSector, endSector - firstSector, buffer);
+			}
+			if (status)
+				return status;
+		}
+
+		buffer += blockCount;
+		count -= blockCount;
 	}
 
 	return STATUS_SUCCESS;
 }
 
 
+// Reads or writes from the specified volume.
+status_t volume_readwrite(volume_t *volume, int read, uint64_t offset, uint64_t count, char *buffer) {
+	assert(volume);
+	assert(buffer);
+	assert(offset <= volume->sectorCount * volume->disk->bytesPerSector);
+	assert(offset + count <= volume->sectorCount * volume->disk->bytesPerSector);
+	if (!count) return STATUS_SUCCESS;
+	status_t status;
+
+#ifdef USING_THREADING
+	block_cache_lock();
+	status = volume_readwrite_locked(volume, read, offset, count, buffer);
+	block_cache_unlock();
+#else
+	atomic()
+		status = volume_readwrite_locked(volume, read, offset, count, buffer);
+#endif
+
+	return status;
+}
+
+
 // Reads from the specified volume. Reading beyond the volume is not allowed.
 status_t volume_read(volume_t *volume, uint64_t offset, uint64_t count, char *buffer) {
 	return volume_readwrite(volume, 1, offset, count, buffer);
@@ -160,6 +498,97 @@ status_t volume_write(volume_t *volume, uint64_t offset, uint64_t count, char *b
 }
 
 
+// Reads a range of bytes directly from the disk, bypassing the block cache.
+//	buffer: must be large enough for all sectors that the range touches
+static status_t block_cache_test_read(disk_t *disk, uint64_t offset, uint64_t count, char **data, char *buffer) {
+	uint64_t firstSector = offset / disk->bytesPerSector;
+	uint64_t endSector = (offset + count + disk->bytesPerSector - 1) / disk->bytesPerSector;
+	*data = buffer + offset % disk->bytesPerSector;
+	return disk->read(disk, firstSector, endSector - firstSector, buffer);
+}
+
+
+// Checks the block cache against direct disk access and prints the hit rates.
+// Random requests of random length go through a volume that spans the entire disk. Most of them hit a small region
+// at the start of the disk, like filesystem metadata does. Every read is compared with the data read directly from
+// the disk, every write is read back directly. A sequential scan at the end exercises the read-ahead.
+// Writes destroy the content of the disk, so they should only be enabled for scratch disks, e.g. a file disk on the
+// host (see platform/windows/filedisk.c).
+//	iterations: the number of random requests
+//	write: if non-zero, every fourth random request is a write
+status_t block_cache_test(disk_t *disk, int iterations, int write) {
+	volume_t volume = { .disk = disk, .startSector = 0, .sectorCount = disk->sectorCount };
+	uint64_t size = disk->sectorCount * disk->bytesPerSector;
+	uint64_t hotSize = min(size, 64 * BLOCK_CACHE_BLOCK_SIZE);
+	uint64_t maxCount = min(size, 3 * BLOCK_CACHE_BLOCK_SIZE);
+	status_t status = STATUS_SUCCESS;
+
+	char *buffer = (char *)malloc(maxCount);
+	char *direct = (char *)malloc(maxCount + 2 * disk->bytesPerSector);
+	if (!buffer || !direct) {
+		LOGE("block cache test: out of memory");
+		return free(buffer), free(direct), STATUS_OUT_OF_MEMORY;
+	}
+
+	block_cache_statistics_t before;
+	block_cache_get_statistics(&before);
+
+	uint64_t random = 12345;
+	for (int i = 0; i < iterations && !status; i++) {
+		random = random * 6364136223846793005UL + 1442695040888963407UL;
+		uint64_t count = 1 + (random >> 40) % maxCount;
+		uint64_t offset = ((random >> 8) & 0xFFFFFFFF) % ((random & 3) ? hotSize : size);
+		offset = min(offset, size - count);
+		int isWrite = (write && !(i & 3));
+		char *data;
+
+		if (isWrite) {
+			for (uint64_t j = 0; j < count; j++) {
+				random = random * 6364136223846793005UL + 1442695040888963407UL;
+				buffer[j] = random >> 56;
+			}
+			if ((status = volume_write(&volume, offset, count, buffer)))
+				break;
+		} else if ((status = volume_read(&volume, offset, count, buffer))) {
+			break;
+		}
+
+		if ((status = block_cache_test_read(disk, offset, count, &data, direct)))
+			break;
+		if (memcmp(buffer, data, count)) {
+			LOGE("block cache test: %s of %d bytes at %d differs from disk", isWrite ? "write" : "read", (int)count, (int)offset);
+			status = STATUS_DATA_CORRUPT;
+		}
+	}
+
+	// read the start of the disk sequentially in small requests
+	uint64_t scanSize = min(size, 512 * BLOCK_CACHE_BLOCK_SIZE);
+	for (uint64_t offset = 0; offset < scanSize && !status; offset += 1024) {
+		uint64_t count = min(1024, scanSize - offset);
+		char *data;
+		if ((status = volume_read(&volume, offset, count, buffer)))
+			break;
+		if ((status = block_cache_test_read(disk, offset, count, &data, direct)))
+			break;
+		if (memcmp(buffer, data, count)) {
+			LOGE("block cache test: sequential read at %d differs from disk", (int)offset);
+			status = STATUS_DATA_CORRUPT;
+		}
+	}
+
+	block_cache_statistics_t after;
+	block_cache_get_statistics(&after);
+	uint64_t hits = after.hits - before.hits, misses = after.misses - before.misses;
+	LOGI("block cache test: %s, %d hits, %d misses (%d%% hit rate), %d of %d blocks read ahead were used",
+		status ? "failed" : "passed", (int)hits, (int)misses, (int)(hits + misses ? hits * 100 / (hits + misses) : 0),
+		(int)(after.readAheadHits - before.readAheadHits), (int)(after.readAhead - before.readAhead));
+
+	free(buffer);
+	free(direct);
+	return status;
+}
+
+
 // Tries to initialize the filesystem on the specified volume.
 status_t fs_init(volume_t *volume, file_t *root) {
 	status_t status;
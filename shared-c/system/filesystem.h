@@ -31,9 +31,24 @@ typedef struct disk_t
 	uint64_t reference;			// disk reference specific to the underlying driver
 	status_t(*read)(struct disk_t *disk, uint64_t startSector, uint64_t sectorCount, char *buffer);
 	status_t(*write)(struct disk_t *disk, uint64_t startSector, uint64_t sectorCount, char *buffer);
+
+	uint64_t nextSequentialBlock;	// managed by the block cache: the cache block that would continue the last read
+	uint64_t readAheadWindow;		// managed by the block cache: the number of blocks currently read ahead
 } disk_t;
 
 
+typedef struct
+{
+	uint64_t hits;				// number of block accesses that were served from cache
+	uint64_t misses;			// number of block accesses that had to be read from disk
+	uint64_t readAhead;			// number of blocks that were read from disk speculatively
+	uint64_t readAheadHits;		// number of speculatively read blocks that were used afterwards
+	size_t blocks;				// number of blocks currently in cache
+	size_t maxBlocks;			// maximum number of blocks in cache
+	size_t blockSize;			// size of a cache block in bytes
+} block_cache_statistics_t;
+
+
 typedef struct volume_t
 {
 	disk_t *disk;
@@ -45,6 +60,9 @@ typedef struct volume_t
 volume_t* volume_init(disk_t *disk, size_t *count);
 status_t volume_read(volume_t *volume, uint64_t offset, uint64_t count, char *buffer);
 status_t volume_write(volume_t *volume, uint64_t offset, uint64_t count, char *buffer);
+void block_cache_get_statistics(block_cache_statistics_t *stats);
+void block_cache_dump(void);
+status_t block_cache_test(disk_t *disk, int iterations, int write);
 
 
 typedef status_t(*file_open_proc_t)(void *fsContext, uint64_t handle, void **filePtr);
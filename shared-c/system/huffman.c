@@ -1,106 +1,355 @@
 /*
 *
-*
+* Builds lookup tables for canonical huffman codes and decodes symbols using these tables.
+* A symbol is decoded with one table lookup (two for codes longer than HUFFMAN_PRIMARY_BITS),
+* instead of walking a tree bit by bit.
+* For encoding, code lengths are derived from symbol frequencies and turned into canonical codes.
 *
 * created: 15.01.15
 *
 */
 
+#include <system.h>
+#include "stream.h"
+#include "huffman.h"
 
+#ifdef USING_DEFLATE
 
-// Represents a huffman code tree that can represent symbols the size of a pointer.
-typedef union huffman_t
-{
-	struct {
-		union huffman_t* child0;
-		union huffman_t* child1; // must not be used if child0 is NULL
-	} node;
-	struct {
-		uintptr_t notALeaf;
-		uintptr_t value;
-	} leaf;
-} huffman_t;
 
+// Reverses the order of the lowest bits of a code.
+// Huffman codes are packed starting with the MSB of the code, while the bitstream is read starting with the LSB.
+static inline unsigned int huffman_reverse(unsigned int code, int bits) {
+	unsigned int result = 0;
+	while (bits--) {
+		result = (result << 1) | (code & 1);
+		code >>= 1;
+	}
+	return result;
+}
 
 
-// Creates a huffman coding tree using the constraints imposed by the deflate algorithm.
-// The tree must be freed using huffman_free after use.
-//	lengthList: a list that contains for each symbol the corresponding code length (in bits)
+// Builds the lookup tables for a huffman coding using the constraints imposed by the deflate algorithm.
+// Incomplete codings are accepted, in this case the unused codes are rejected when decoding.
+//	coding: the structure that receives the tables
+//	lengthList: a list that contains for each symbol the corresponding code length in bits (0 excludes the symbol from the coding)
 //	symbolCount: number of elements in lengthList
-//	maxBits: maximum code length
-huffman_t* huffman_init(int *lengthList, int symbolCount, int maxBits) {
+// Returns STATUS_DATA_CORRUPT if the code lengths do not describe a valid coding.
+status_t huffman_init(huffman_t *coding, const uint8_t *lengthList, int symbolCount) {
 
 	// count how often each length occurs
-	int blCount[maxBits + 1] = { 0 }; //	blCount: number of codes for each code length (e.g. blCount[3] specifies the number of 3-bit long codes)
-	for (int i = 0; i < symbolCount; i++)
+	int blCount[HUFFMAN_MAX_BITS + 1] = { 0 }; // number of codes for each code length (e.g. blCount[3] specifies the number of 3-bit long codes)
+	int maxBits = 1;
+	for (int i = 0; i < symbolCount; i++) {
+		if (lengthList[i] > HUFFMAN_MAX_BITS)
+			return STATUS_DATA_CORRUPT;
 		blCount[lengthList[i]]++;
+		if (lengthList[i] > maxBits)
+			maxBits = lengthList[i];
+	}
 	blCount[0] = 0;
 
-	// determine the first value for each code length
-	int currentCode[maxbits + 1];
+	// reject over-subscribed codings
+	int left = 1;
+	for (int bits = 1; bits <= HUFFMAN_MAX_BITS; bits++)
+		if ((left = (left << 1) - blCount[bits]) < 0)
+			return STATUS_DATA_CORRUPT;
+
+	// determine the first code for each code length
+	int firstCode[HUFFMAN_MAX_BITS + 1];
+	int nextCode[HUFFMAN_MAX_BITS + 1];
 	int code = 0;
-	for (int bits = 1; bits <= maxBits; bits++) {
-		code = (code + bl_count[bits - 1]) << 1;
-		currentCode[bits] = code;
+	for (int bits = 1; bits <= HUFFMAN_MAX_BITS; bits++) {
+		code = (code + blCount[bits - 1]) << 1;
+		firstCode[bits] = code;
 	}
 
-	huffman_t *tree = (huffman_t *)calloc(sizeof(huffman_t));
-	if (!tree) return NULL;
+	int primaryBits = coding->primaryBits = (maxBits < HUFFMAN_PRIMARY_BITS ? maxBits : HUFFMAN_PRIMARY_BITS);
+	int primarySize = (1 << primaryBits);
+	huffman_entry_t *table = coding->table;
+	memset(table, 0, primarySize * sizeof(huffman_entry_t));
 
-	// insert each symbol into tree
+	// find out how many bits each secondary table needs (the longest code that starts with the table's prefix)
+	memcpy(nextCode, firstCode, sizeof(nextCode));
 	for (int i = 0; i < symbolCount; i++) {
-		if (!lengthList[i]) continue; // code length zero excludes the symbol from the tree
-		code = currentCode[lengthList[i]]++;
-		huffman_t *currentNode = tree;
-
-		// traverse the tree (for the current code) while creating nodes that don't exist yet
-		while (lengthList[i]--) {
-			huffman_t **currentNodePtr = (((code >> lengthList[i]) & 1) ? &(currentNode->node.child1) : &(currentNode->node.child0));
-			if (!*currentNodePtr) {
-				*currentNodePtr = (huffman_t *)calloc(sizeof(huffman_t));
-				if (!*currentNodePtr) return huffman_free(tree), NULL;
-			}
-			currentNode = *currentNodePtr;
+		int bits = lengthList[i];
+		if (bits <= primaryBits)
+			continue;
+		code = nextCode[bits]++;
+		huffman_entry_t *entry = &table[huffman_reverse(code >> (bits - primaryBits), primaryBits)];
+		if (entry->link < bits - primaryBits)
+			entry->link = bits - primaryBits;
+	}
+
+	// allocate the secondary tables
+	int size = primarySize;
+	for (int i = 0; i < primarySize; i++) {
+		if (!table[i].link)
+			continue;
+		if (size + (1 << table[i].link) > HUFFMAN_TABLE_SIZE)
+			return STATUS_DATA_CORRUPT;
+		table[i].value = size;
+		table[i].bits = primaryBits;
+		memset(&table[size], 0, (1 << table[i].link) * sizeof(huffman_entry_t));
+		size += (1 << table[i].link);
+	}
+
+	// insert each symbol, replicated to all entries whose index starts with the symbol's code
+	memcpy(nextCode, firstCode, sizeof(nextCode));
+	for (int i = 0; i < symbolCount; i++) {
+		int bits = lengthList[i];
+		if (!bits)
+			continue;
+		unsigned int reversed = huffman_reverse(nextCode[bits]++, bits);
+
+		if (bits <= primaryBits) {
+			for (unsigned int index = reversed; index < (unsigned int)primarySize; index += (1 << bits))
+				table[index] = (huffman_entry_t) { .value = i, .bits = bits, .link = 0 };
+		} else {
+			huffman_entry_t *link = &table[reversed & (primarySize - 1)];
+			huffman_entry_t *secondary = &table[link->value];
+			for (unsigned int index = (reversed >> primaryBits); index < (1U << link->link); index += (1 << (bits - primaryBits)))
+				secondary[index] = (huffman_entry_t) { .value = i, .bits = bits - primaryBits, .link = 0 };
 		}
-		currentNode->leaf.value = i;
 	}
 
-	return tree;
+	return STATUS_SUCCESS;
 }
 
 
+// Reads the next huffman coded symbol from a bitstream using the provided coding.
+// Nothing is consumed if the operation fails.
+//	Returns a non-zero error code if the operation fails
+status_t huffman_read_symbol(bitstream_t *bitstream, const huffman_t *coding, uint64_t *result) {
+	uint64_t bits;
+	int requested = coding->primaryBits;
+	int available = bitstream_peek(bitstream, requested, &bits);
+	const huffman_entry_t *entry = &coding->table[bits];
+	int length = entry->bits;
 
-// Recursively frees a huffman coding tree generated by huffman_init
-void huffman_free(huffman_t *tree) {
-	if (tree->node.child0) {
-		huffman_free(tree->node.child0);
-		if (tree->node.child1)
-			huffman_free(tree->node.child0);
+	// follow the link to the secondary table
+	if (entry->link) {
+		requested += entry->link;
+		available = bitstream_peek(bitstream, requested, &bits);
+		entry = &coding->table[entry->value + (bits >> coding->primaryBits)];
+		length = (entry->bits ? coding->primaryBits + entry->bits : 0);
 	}
-	free(tree);
+
+	if (!length || available < length)
+		return (available < requested ? STATUS_END_OF_STREAM : STATUS_DATA_CORRUPT);
+
+	bitstream_consume(bitstream, length);
+	*result = entry->value;
+	return STATUS_SUCCESS;
 }
 
 
+// Computes the code lengths of a huffman coding for the specified symbol frequencies, such that no code is longer
+// than maxBits. Symbols that never occur get no code. The coding is always complete, so at least two symbols get a
+// code, even if they never occur.
+//	frequencies: the number of occurrences of each symbol
+//	symbolCount: number of symbols in the alphabet (at most 288)
+//	maxBits: the maximum code length (at most HUFFMAN_MAX_BITS)
+//	lengthList: receives the code length of each symbol
+void huffman_build_lengths(const uint32_t *frequencies, int symbolCount, int maxBits, uint8_t *lengthList) {
+	uint16_t order[288];	// the symbols that get a code, sorted by frequency
+	uint32_t weight[2 * 288];	// the leaves (in the same order) followed by the inner nodes of the tree
+	uint16_t parent[2 * 288];	// for each node the parent node, later the depth of the node
+	int count = 0;
+
+	memset(lengthList, 0, symbolCount);
+	for (int i = 0; i < symbolCount; i++)
+		if (frequencies[i])
+			order[count++] = i;
+	for (int i = 0; count < 2 && i < symbolCount; i++)
+		if (!frequencies[i])
+			order[count++] = i;
+
+	for (int i = 1; i < count; i++) {
+		uint16_t symbol = order[i];
+		int j = i;
+		for (; j > 0 && frequencies[order[j - 1]] > frequencies[symbol]; j--)
+			order[j] = order[j - 1];
+		order[j] = symbol;
+	}
+	for (int i = 0; i < count; i++)
+		weight[i] = frequencies[order[i]];
+
+	// the inner nodes are created with non-decreasing weights, so the two lightest nodes are always at the front of
+	// either the leaves or the inner nodes
+	int leaf = 0, inner = count;
+	for (int node = count; node < 2 * count - 1; node++) {
+		int a = ((leaf < count && (inner >= node || weight[leaf] <= weight[inner])) ? leaf++ : inner++);
+		int b = ((leaf < count && (inner >= node || weight[leaf] <= weight[inner])) ? leaf++ : inner++);
+		weight[node] = weight[a] + weight[b];
+		parent[a] = parent[b] = node;
+	}
+
+	// turn the parent links into depths (a parent is always created after its children)
+	int blCount[HUFFMAN_MAX_BITS + 1] = { 0 };
+	parent[2 * count - 2] = 0;
+	for (int i = 2 * count - 3; i >= 0; i--)
+		parent[i] = parent[parent[i]] + 1;
+
+	// codes that are too long are shortened to maxBits, other codes are then lengthened until the coding is valid
+	uint32_t kraft = 0; // sum of 2^(maxBits - length) over all codes (2^maxBits for a complete coding)
+	for (int i = 0; i < count; i++) {
+		int bits = (parent[i] > maxBits ? maxBits : parent[i]);
+		blCount[bits]++;
+		kraft += 1U << (maxBits - bits);
+	}
+	while (kraft > (1U << maxBits)) {
+		int bits = maxBits - 1;
+		while (!blCount[bits])
+			bits--;
+		blCount[bits]--;
+		blCount[bits + 1]++;
+		kraft -= 1U << (maxBits - bits - 1);
+	}
+
+	// this may have left some codes unused, which are given to the longest codes that fit
+	while (kraft < (1U << maxBits)) {
+		int bits = maxBits;
+		while (!blCount[bits] || (1U << (maxBits - bits)) > (1U << maxBits) - kraft)
+			bits--;
+		blCount[bits]--;
+		blCount[bits - 1]++;
+		kraft += 1U << (maxBits - bits);
+	}
+
+	// the least frequent symbols get the longest codes
+	for (int bits = maxBits, i = 0; bits > 0; bits--)
+		for (int n = blCount[bits]; n > 0; n--)
+			lengthList[order[i++]] = bits;
+}
 
-// Reads the next huffman coded symbol from a bitstream using the provided coding tree.
-//	Returns a non-zero error code if the operation fails
-status_t huffman_read_symbol(bitstream_t *bitstream, huffman_t *coding, uint64_t *result) {
-	status_t status;
 
-	// traverse tree until a leaf is reached
-	do {
+// Computes the canonical codes for the specified code lengths (RFC 1951, 3.2.2). The codes are returned with their
+// bits reversed, so that they can be written to a bitstream as they are.
+//	lengthList: the code length of each symbol (0 if the symbol has no code)
+//	symbolCount: number of elements in lengthList
+//	codes: receives the code of each symbol
+void huffman_build_codes(const uint8_t *lengthList, int symbolCount, uint16_t *codes) {
+	int blCount[HUFFMAN_MAX_BITS + 1] = { 0 };
+	int nextCode[HUFFMAN_MAX_BITS + 1];
+	for (int i = 0; i < symbolCount; i++)
+		blCount[lengthList[i]]++;
+	blCount[0] = 0;
+
+	int code = 0;
+	for (int bits = 1; bits <= HUFFMAN_MAX_BITS; bits++) {
+		code = (code + blCount[bits - 1]) << 1;
+		nextCode[bits] = code;
+	}
+
+	for (int i = 0; i < symbolCount; i++)
+		codes[i] = (lengthList[i] ? huffman_reverse(nextCode[lengthList[i]]++, lengthList[i]) : 0);
+}
+
+
+#ifdef USING_BENCHMARK
+
+// Reads a huffman coded symbol one bit at a time, like the tree that huffman_init used to build (see huffman_benchmark).
+//	blCount: the number of codes of each length
+//	symbols: the symbols that have a code, sorted by their codes
+static status_t huffman_read_symbol_bitwise(bitstream_t *bitstream, const int *blCount, const uint16_t *symbols, uint64_t *result) {
+	int code = 0, first = 0, index = 0;
+	for (int bits = 1; bits <= HUFFMAN_MAX_BITS; bits++) {
 		uint64_t bit;
-		if (status = bitstream_read(bitstream, 1, &bit)) return status;
-		if (!bit)
-			coding = coding->node.child0;
-		else
-			coding = coding->node.child1;
-	} while (coding->leaf.notALeaf);
-
-	*result = coding->leaf.value;
-	return STATUS_SUCCESS;
+		if (bitstream_peek(bitstream, 1, &bit) < 1)
+			return STATUS_END_OF_STREAM;
+		bitstream_consume(bitstream, 1);
+
+		code |= bit;
+		if (code - first < blCount[bits]) {
+			*result = symbols[index + code - first];
+			return STATUS_SUCCESS;
+		}
+		index += blCount[bits];
+		first = (first + blCount[bits]) << 1;
+		code <<= 1;
+	}
+	return STATUS_DATA_CORRUPT;
 }
 
 
+// Compares decoding one bit at a time (as with the tree that was used before) with the lookup tables.
+// The specified number of pseudo-random literal/length symbols is encoded, with frequencies that fall off like those
+// of text, so that most codes are short but some are longer than HUFFMAN_PRIMARY_BITS.
+// The results are written to the log.
+void huffman_benchmark(int count) {
+	benchmark_t bench;
+	benchmark_init(&bench, "huffman");
+	uint32_t frequencies[286], cumulative[286], total = 0;
+	for (int i = 0; i < 286; i++)
+		cumulative[i] = (total += frequencies[i] = 1 + (1 << 24) / ((i + 16) * (i + 16)));
+
+	uint8_t lengths[286];
+	uint16_t codes[286], symbols[286];
+	int blCount[HUFFMAN_MAX_BITS + 1] = { 0 };
+	huffman_build_lengths(frequencies, 286, HUFFMAN_MAX_BITS, lengths);
+	huffman_build_codes(lengths, 286, codes);
+	for (int bits = 1, n = 0; bits <= HUFFMAN_MAX_BITS; bits++)
+		for (int i = 0; i < 286; i++) {
+			if (lengths[i] == bits) {
+				symbols[n++] = i;
+				blCount[bits]++;
+			}
+		}
+
+	huffman_t *coding = (huffman_t *)malloc(sizeof(huffman_t));
+	uint16_t *input = (uint16_t *)malloc(count * sizeof(uint16_t));
+	bytestream_t stream = { .data = NULL };
+	if (!coding || !input || stream_alloc(&stream, count) || huffman_init(coding, lengths, 286)) {
+		LOGE("huffman benchmark: could not set up %d symbols", count);
+		free(coding);
+		free(input);
+		stream_free(&stream);
+		return;
+	}
+
+	bitstream_t bitstream = bitstream_init(&stream);
+	for (int i = 0; i < count; i++) {
+		uint32_t value = (benchmark_random(&bench) >> 8) % total;
+		int lower = 0, upper = 285;
+		while (lower < upper) {
+			int middle = (lower + upper) >> 1;
+			if (cumulative[middle] > value)
+				upper = middle;
+			else
+				lower = middle + 1;
+		}
+		input[i] = lower;
+		if (bitstream_write(&bitstream, lengths[lower], codes[lower])) {
+			LOGE("huffman benchmark: out of memory");
+			count = i;
+			break;
+		}
+	}
+
+	for (int pass = 0; pass < 2; pass++) {
+		bitstream = bitstream_init(&stream);
+		stream.rPos = 0;
+		int errors = 0, i;
+
+		benchmark_start(&bench);
+		for (i = 0; i < count; i++) {
+			uint64_t value;
+			if (pass ? huffman_read_symbol(&bitstream, coding, &value) : huffman_read_symbol_bitwise(&bitstream, blCount, symbols, &value))
+				break;
+			errors += (value != input[i]);
+		}
+		benchmark_stop(&bench, (pass ? "lookup tables" : "bitwise"), i, "symbol");
+
+		if (i < count || errors)
+			LOGE("huffman benchmark: %s: %d of %d symbols decoded, %d of them wrong", (pass ? "lookup tables" : "bitwise"), i, count, errors);
+	}
+
+	free(coding);
+	free(input);
+	stream_free(&stream);
+}
+
+#endif // USING_BENCHMARK
 
 
+#endif // USING_DEFLATE
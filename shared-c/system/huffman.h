@@ -0,0 +1,50 @@
+/*
+*
+* Encodes and decodes canonical huffman codes as used by DEFLATE (RFC1951).
+*
+* created: 15.01.15
+*
+*/
+
+#ifndef __HUFFMAN_H__
+#define __HUFFMAN_H__
+
+#ifdef USING_DEFLATE
+
+
+#define HUFFMAN_MAX_BITS		(15)	// maximum code length
+#define HUFFMAN_PRIMARY_BITS	(9)		// number of bits that are resolved by the primary lookup table
+#define HUFFMAN_TABLE_SIZE		(852)	// primary and secondary tables of any valid coding with up to 286 symbols (same bound as zlib's ENOUGH_LENS)
+
+
+// An entry in a huffman lookup table
+typedef struct
+{
+	uint16_t value;		// the decoded symbol or, for links, the index of the secondary table
+	uint8_t bits;		// number of bits consumed by this entry (0 if no code starts with these bits)
+	uint8_t link;		// number of bits that index the secondary table (0 if the entry holds a symbol)
+} huffman_entry_t;
+
+
+// A huffman coding in the form of lookup tables.
+// The primary table is indexed by the next primaryBits bits of the input. Codes that are longer than that
+// resolve to a link to a secondary table, which is indexed by the bits that follow.
+typedef struct
+{
+	int primaryBits;
+	huffman_entry_t table[HUFFMAN_TABLE_SIZE];	// the primary table, followed by all secondary tables
+} huffman_t;
+
+
+status_t huffman_init(huffman_t *coding, const uint8_t *lengthList, int symbolCount);
+status_t huffman_read_symbol(bitstream_t *bitstream, const huffman_t *coding, uint64_t *result);
+void huffman_build_lengths(const uint32_t *frequencies, int symbolCount, int maxBits, uint8_t *lengthList);
+void huffman_build_codes(const uint8_t *lengthList, int symbolCount, uint16_t *codes);
+#ifdef USING_BENCHMARK
+void huffman_benchmark(int count);
+#endif
+
+
+#endif // USING_DEFLATE
+
+#endif // __HUFFMAN_H__
@@ -18,11 +18,11 @@ typedef struct
 	size_t capacity;		// total allocated capacity
 	uintptr_t wPos;			// current write position (the capacity is doubled if necessary)
 	uintptr_t rPos;			// current read position (must never exceed write position)
-} stream_t;
+} bytestream_t;
 
 typedef struct
 {
-	stream_t *stream;		// underlying stream
+	bytestream_t *stream;		// underlying stream
 	int wPos;				// write position in the current byte (0...7)
 	int rPos;				// read position in the current byte (0...7)
 } bitstream_t ;
@@ -35,7 +35,7 @@ typedef struct
 // Initializes a stream with the content of a buffer.
 // The caller is responsible of freeing the underlying buffer when the stream is no longer used.
 // When writing to the stream the underlying buffer is reallocated, so it's address may change.
-status_t stream_init(stream_t *stream, void *data, size_t length) {
+static inline status_t stream_init(bytestream_t *stream, void *data, size_t length) {
 	stream->data = data;
 	stream->capacity = length;
 	stream->wPos = length;
@@ -46,10 +46,10 @@ status_t stream_init(stream_t *stream, void *data, size_t length) {
 
 // Initializes a stream by allocating a buffer with the specified initial capacity.
 // The stream must be freed using stream_free.
-status_t stream_alloc(stream_t *stream, size_t capacity) {
-	if (!(stream->data = (char *)malloc(capacity)))
+static inline status_t stream_alloc(bytestream_t *stream, size_t capacity) {
+	if (!(stream->data = (char *)malloc(capacity ? capacity : 1)))
 		return STATUS_OUT_OF_MEMORY;
-	stream->capacity = capacity;
+	stream->capacity = (capacity ? capacity : 1);
 	stream->wPos = 0;
 	stream->rPos = 0;
 	return STATUS_SUCCESS;
@@ -57,7 +57,7 @@ status_t stream_alloc(stream_t *stream, size_t capacity) {
 
 
 // Frees the underlying buffer of a stream.
-void stream_free(stream_t *stream) {
+static inline void stream_free(bytestream_t *stream) {
 	free(stream->data);
 	stream->data = NULL;
 	stream->capacity = 0;
@@ -66,21 +66,21 @@ void stream_free(stream_t *stream) {
 
 // Doubles the capacity of the stream.
 // If the allocation failed, the stream is not extended and STATUS_OUT_OF_MEMORY is returned.
-status_t stream_expand(stream_t *stream) {
-	if (!stream->data) return STATUS_OBJECT_DISPOSED;
+static inline status_t stream_expand(bytestream_t *stream) {
+	if (!stream->data) return STATUS_INVALID_OPERATION;
 	char *newPtr = (char *)realloc(stream->data, stream->capacity << 1);
 	if (!newPtr) return STATUS_OUT_OF_MEMORY;
-	stream->data;
+	stream->data = newPtr;
 	stream->capacity <<= 1;
 	return STATUS_SUCCESS;
 }
 
 
 // Writes a single byte to the stream.
-status_t stream_write_byte(stream_t *stream, char byte) {
+static inline status_t stream_write_byte(bytestream_t *stream, char byte) {
 	status_t status;
 	if (stream->wPos >= stream->capacity)
-		if (status = stream_expand(stream))
+		if ((status = stream_expand(stream)))
 			return status;
 	stream->data[stream->wPos] = byte;
 	stream->wPos += 1;
@@ -89,20 +89,20 @@ status_t stream_write_byte(stream_t *stream, char byte) {
 
 
 // Copies a buffer to the stream.
-status_t stream_write(stream_t *stream, const void *buffer, size_t count) {
+static inline status_t stream_write(bytestream_t *stream, const void *buffer, size_t count) {
 	status_t status;
-	if (stream->wPos + count > stream->capacity)
-		if (status = stream_expand(stream))
+	while (stream->wPos + count > stream->capacity)
+		if ((status = stream_expand(stream)))
 			return status;
-	memcpy(stream->data, buffer, count);
+	memcpy(stream->data + stream->wPos, buffer, count);
 	stream->wPos += count;
 	return STATUS_SUCCESS;
 }
 
 
 // Reads a single byte from the stream.
-status_t stream_read_byte(stream_t *stream, char *result) {
-	if (stream->rPos => stream->wPos)
+static inline status_t stream_read_byte(bytestream_t *stream, char *result) {
+	if (stream->rPos >= stream->wPos)
 		return STATUS_END_OF_STREAM;
 	*result = stream->data[stream->rPos++];
 	return STATUS_SUCCESS;
@@ -110,8 +110,8 @@ status_t stream_read_byte(stream_t *stream, char *result) {
 
 
 // Peeks the next byte in the stream without consuming it
-status_t stream_peek(stream_t *stream, char *result) {
-	if (stream->rPos => stream->wPos)
+static inline status_t stream_peek(bytestream_t *stream, char *result) {
+	if (stream->rPos >= stream->wPos)
 		return STATUS_END_OF_STREAM;
 	*result = stream->data[stream->rPos];
 	return STATUS_SUCCESS;
@@ -119,17 +119,19 @@ status_t stream_peek(stream_t *stream, char *result) {
 
 
 // Copies the specified number of bytes from the input stream to the output stream.
-status_t stream_copy(stream_t *input, stream_t *output, size_t count) {
+static inline status_t stream_copy(bytestream_t *input, bytestream_t *output, size_t count) {
+	status_t status;
 	if (input->rPos + count > input->wPos)
 		return STATUS_END_OF_STREAM;
-	stream_write(output, input->data + rPos, count);
-	stream->rPos += count;
+	if ((status = stream_write(output, input->data + input->rPos, count)))
+		return status;
+	input->rPos += count;
 	return STATUS_SUCCESS;
 }
 
 
 // Advances the read position to the next byte boundary (if necessary).
-status_t bitstream_align(bitstream_t *bitstream) {
+static inline status_t bitstream_align(bitstream_t *bitstream) {
 	if (!bitstream->rPos)
 		return STATUS_SUCCESS;
 	if (bitstream->stream->rPos >= bitstream->stream->wPos)
@@ -140,53 +142,122 @@ status_t bitstream_align(bitstream_t *bitstream) {
 }
 
 
+// Same as bitstream_peek, but assembles the bits byte by byte, so that it never reads beyond the end of the stream.
+static inline int bitstream_peek_bytewise(bitstream_t *bitstream, int bits, uint64_t *result) {
+	bytestream_t *stream = bitstream->stream;
+	uint64_t value = 0;
+	int count = 0;
+	for (uintptr_t pos = stream->rPos; count < bitstream->rPos + bits && pos < stream->wPos; pos++, count += 8)
+		value |= (uint64_t)(uint8_t)stream->data[pos] << count;
+
+	*result = (value >> bitstream->rPos) & ((1ULL << bits) - 1);
+	count -= bitstream->rPos;
+	return (count < 0 ? 0 : (count < bits ? count : bits));
+}
+
+
+// Returns the next bits of the stream without consuming them. Bits beyond the end of the stream read as zero.
+// As long as 8 bytes are left, they are fetched with a single unaligned load, which holds at least 57 unread bits.
+//	bits: the number of bits to peek (0 ... 57)
+// Returns the number of requested bits that are actually available.
+static inline int bitstream_peek(bitstream_t *bitstream, int bits, uint64_t *result) {
+	bytestream_t *stream = bitstream->stream;
+	if (stream->wPos - stream->rPos < 8)
+		return bitstream_peek_bytewise(bitstream, bits, result);
+
+	uint64_t value;
+	__builtin_memcpy(&value, stream->data + stream->rPos, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap64(value);
+#endif
+
+	*result = (value >> bitstream->rPos) & ((1ULL << bits) - 1);
+	return bits;
+}
+
+
+// Consumes the specified number of bits. The bits must have been checked to be available using bitstream_peek.
+static inline void bitstream_consume(bitstream_t *bitstream, int bits) {
+	bitstream->rPos += bits;
+	bitstream->stream->rPos += (bitstream->rPos >> 3);
+	bitstream->rPos &= 7;
+}
+
+
 // Reads the specified number of bits from the stream. The LSB of a byte is always read first.
 //	bits: the number of bits that are to be read (-64 ... 64)
 //		  if the bit number is positive, the result is zero extended, otherwise it is sign extended
-status_t bitstream_read(bitstream_t *bitstream, int bits, uint64_t *result) {
-	status_t status;
-	if ((bitstream->stream->rPos << 3) + bitstream->rPos + bits > (bitstream->stream->wPos << 3) + bitstream->wPos)
-		return STATUS_END_OF_STREAM;
-
+static inline status_t bitstream_read(bitstream_t *bitstream, int bits, uint64_t *result) {
 	int signExtend = ((bits < 0) ? ((bits = -bits), 1) : 0);
+	if (!bits)
+		return *result = 0, STATUS_SUCCESS;
 
-	// read remaining part of the current byte
-	char c;
-	if (status = stream_read_byte(bitstream->stream, &c)) return status;
-	*result = c >> bitstream->position;
-	int readBits = (8 - bitstream->position);
-	bitstream->position = 0;
-
-	// read subsequent bytes
-	for (; readBits < bits; readBits += 8) {
-		if (status = stream_read_byte(bitstream->stream, &c)) return status;
-		*result |= ((uint64_t)c << readBits);
-	}
-
-	// reverse stream if too many bits were read
-	if (readBits > bits) {
-		bitstream->stream->rPos--;
-		bitstream->position = (bits + 8) - readBits;
+	// read in chunks that bitstream_peek can handle
+	uint64_t value = 0, chunk;
+	int lowBits = (bits > 57 ? 32 : 0);
+	if (bitstream_peek(bitstream, lowBits, &value) < lowBits)
+		return STATUS_END_OF_STREAM;
+	bitstream_consume(bitstream, lowBits);
+	if (bitstream_peek(bitstream, bits - lowBits, &chunk) < bits - lowBits) {
+		bitstream->stream->rPos -= (lowBits >> 3); // lowBits is a multiple of 8
+		return STATUS_END_OF_STREAM;
 	}
+	bitstream_consume(bitstream, bits - lowBits);
+	value |= chunk << lowBits;
 
-	// discart excess bits
+	// extend the sign if requested
 	int shift = (64 - bits);
 	if (signExtend)
-		*result = ((int64_t)*result << shift) >> shift;
+		*result = (uint64_t)(((int64_t)(value << shift)) >> shift);
 	else
-		*result = ((uint64_t)*result << shift) >> shift;
+		*result = value;
+
+	return STATUS_SUCCESS;
+}
+
 
+// Appends the specified number of bits to the stream. The LSB of the value is written first.
+//	bits: the number of bits to write (0 ... 57)
+static inline status_t bitstream_write(bitstream_t *bitstream, int bits, uint64_t value) {
+	bytestream_t *stream = bitstream->stream;
+	status_t status;
+	value &= (1ULL << bits) - 1;
+
+	// fill up the last byte if it is incomplete
+	if (bitstream->wPos) {
+		stream->data[stream->wPos - 1] |= (char)(value << bitstream->wPos);
+		int room = 8 - bitstream->wPos;
+		if (bits < room) {
+			bitstream->wPos += bits;
+			return STATUS_SUCCESS;
+		}
+		value >>= room;
+		bits -= room;
+		bitstream->wPos = 0;
+	}
+
+	for (; bits > 0; bits -= 8, value >>= 8) {
+		if ((status = stream_write_byte(stream, (char)value)))
+			return status;
+		bitstream->wPos = (bits < 8 ? bits : 0);
+	}
 	return STATUS_SUCCESS;
 }
 
 
+// Pads the last byte of the stream with zero bits (if necessary), so that the next write is byte aligned.
+static inline void bitstream_write_align(bitstream_t *bitstream) {
+	bitstream->wPos = 0;
+}
+
+
 // Initializes a bitstream using an underlying byte stream.
 // A byte stream that is used by a bitstream must not be used without calling bitstream_align first.
-bitstream_t bitstream_init(stream_t *stream) {
+static inline bitstream_t bitstream_init(bytestream_t *stream) {
 	return (bitstream_t) {
-		.stream = stream;
-		.wPos = 0;
-		.rPos = 0;
+		.stream = stream,
+		.wPos = 0,
+		.rPos = 0,
 	};
 }
 
@@ -13,7 +13,13 @@
 *		resolution: 1 second
 *		may change unpredictably at any time
 *
-* Timers are currently not thread safe (the only guaranteed safety is that the timer_update does not interfere with timer_start and timer_stop).
+* Running timers are kept in a hierarchical timing wheel: level k has TIMER_WHEEL_SLOTS slots, each covering
+* 2^(k*TIMER_WHEEL_BITS) ticks. Starting and stopping a timer is O(1). When the wheel advances past a slot boundary
+* of a higher level, the timers of that slot are redistributed (cascaded) to the lower levels, so each timer is
+* touched at most TIMER_WHEEL_LEVELS times. Spans during which no timer can fire are skipped.
+*
+* The timer functions may be called from interrupt handlers and, on multiprocessor systems, from several processors.
+* Expiration callbacks are invoked without holding the timer lock, so they may start and stop timers.
 *
 * Architecture-specific support required:
 *	timer_register_callback:
@@ -29,45 +35,165 @@
 
 #ifdef USING_TIME
 
-bool timerLock = 0;					// todo: make timer lists lock-free
-timer_t *timerList = NULL;			// linked list of active timers, sorted by their time of expiry
 
+#ifndef TIMER_WHEEL_BITS
+#define TIMER_WHEEL_BITS	4				// each level of the timing wheel has 2^TIMER_WHEEL_BITS slots
+#endif
+#define TIMER_WHEEL_SLOTS	(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK	(TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS	((32 + TIMER_WHEEL_BITS - 1) / TIMER_WHEEL_BITS)
+
+// Returns a mask of the tick bits below the specified level
+#define TIMER_LEVEL_MASK(level)	((uint32_t)((1UL << ((level) * TIMER_WHEEL_BITS)) - 1))
+
+
+bool timerLock = 0;
+timer_t *timerWheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];	// lists of running timers, level k holds timers that expire within 2^((k+1)*TIMER_WHEEL_BITS) ticks
+unsigned int timerLevelCount[TIMER_WHEEL_LEVELS];			// number of timers on each level
+uint32_t timerNext = 0;				// the next tick that the wheel has to process (all timers with an earlier expiry have fired)
+uint32_t timerClock = 0;			// the system ticks, extended to 32 bits
+ticks_t timerTicks = 0;				// the system ticks at the last update of timerClock
+
+
+// Acquires the timer lock. Interrupts must be disabled.
+static inline void timer_lock(void) {
+	while (!__sync_bool_compare_and_swap(&timerLock, 0, 1));
+}
+
+// Releases the timer lock.
+static inline void timer_unlock(void) {
+	__sync_lock_release(&timerLock);
+}
+
+
+// Returns the current time in system ticks, extended to 32 bits (this takes care of overflows of the system ticks).
+// The result is only correct if this is called at an interval of at least TICKS_MAX.
+// The timer lock must be held.
+static uint32_t timer_clock(void) {
+	ticks_t ticks = system_ticks();
+	timerClock += (uint32_t)((ticks - timerTicks) & TICKS_MAX);
+	timerTicks = ticks;
+	return timerClock;
+}
+
+
+// Inserts a running timer into the wheel. Its expiry must not lie before timerNext.
+static void timer_insert(timer_t *timer) {
+	uint32_t delta = timer->expiry - timerNext;
+	int level = 0;
+	while (level < TIMER_WHEEL_LEVELS - 1 && (delta >> ((level + 1) * TIMER_WHEEL_BITS)))
+		level++;
+
+	timer_t **slot = &timerWheel[level][(timer->expiry >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK];
+	if ((timer->next = *slot))
+		(*slot)->link = &timer->next;
+	timer->link = slot;
+	*slot = timer;
+	timer->state.level = level;
+	timerLevelCount[level]++;
+}
+
+
+// Removes a running timer from the wheel.
+static void timer_remove(timer_t *timer) {
+	if ((*timer->link = timer->next))
+		timer->next->link = timer->link;
+	timerLevelCount[timer->state.level]--;
+}
+
+
+// Redistributes the timers in the current slot of the specified level to the lower levels.
+static void timer_cascade(int level) {
+	timer_t **slot = &timerWheel[level][(timerNext >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK];
+	timer_t *timer = *slot;
+	*slot = NULL;
 
-// Triggers all timers in a linked list.
-void timer_trigger(timer_t *timer) {
 	while (timer) {
-		timer->state.running = 0;
-		timer->state.hasExpired = 1;
-		if (timer->callback)
-			timer->callback(timer->context);
-		timer = timer->next;
+		timer_t *next = timer->next;
+		timerLevelCount[level]--;
+		timer_insert(timer);
+		timer = next;
 	}
 }
 
 
-// If an overflow happens between two calls to this function, it returns a list of all timers that should have
-// expired before the overflow and removes them from the active timer list
-timer_t *timer_check_overflow(ticks_t ticks) {
-	static ticks_t oldTicks = 0;
+// Advances the wheel up to (and including) the specified time.
+// All timers that expire until then are removed from the wheel and appended to the list whose tail is passed.
+// Returns the new tail of the list.
+static timer_t **timer_advance(uint32_t now, timer_t **expiredTail) {
+	while ((int32_t)(now - timerNext) >= 0) {
+		// skip ahead to the next slot boundary of the lowest level that contains any timers
+		int empty = 0;
+		while (empty < TIMER_WHEEL_LEVELS && !timerLevelCount[empty])
+			empty++;
+		if (empty == TIMER_WHEEL_LEVELS) {
+			timerNext = now + 1;
+			break;
+		} else if (empty) {
+			uint32_t boundary = (timerNext + TIMER_LEVEL_MASK(empty)) & ~TIMER_LEVEL_MASK(empty);
+			if ((int32_t)(boundary - now) > 0) {
+				timerNext = now + 1;
+				break;
+			}
+			timerNext = boundary;
+		}
 
-	timer_t *expiredTimers = NULL;
-	if (ticks < oldTicks) {
-		// an overflow has occurred
+		// cascade timers from the higher levels whose slot boundary was reached
+		for (int level = 1; level < TIMER_WHEEL_LEVELS && !(timerNext & TIMER_LEVEL_MASK(level)); level++)
+			timer_cascade(level);
 
-#if TICKS_BITS < 32
+		// take all timers that expire now
 		timer_t *timer;
-		while (!(timerList->expiry >> TICKS_BITS)) {
-			timerList = (timer = timerList)->next;
-			timer->next = expiredTimers;
-			expiredTimers = timer;
+		while ((timer = timerWheel[0][timerNext & TIMER_WHEEL_MASK])) {
+			timer_remove(timer);
+			timer->state.running = 0;
+			timer->state.hasExpired = 1;
+			*expiredTail = timer;
+			expiredTail = &timer->next;
 		}
+		*expiredTail = NULL;
 
-		for (timer = timerList; timer; timer = timer->next)
-			timer->expiry -= 1UL << TICKS_BITS;
-#endif
+		timerNext++;
+	}
+
+	return expiredTail;
+}
+
+
+// Returns the number of ticks from now (which must be timerNext - 1) until the wheel has to be advanced again,
+// i.e. until the next timer expires or the next non-empty slot has to be cascaded.
+// Returns 0 if there are no running timers.
+static uint32_t timer_next_event(uint32_t now) {
+	uint32_t interval = 0;
+
+	for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		if (!timerLevelCount[level])
+			continue;
+
+		// find the first non-empty slot, starting at the next slot boundary
+		uint32_t block = (timerNext + TIMER_LEVEL_MASK(level)) >> (level * TIMER_WHEEL_BITS);
+		for (int i = 0; i < TIMER_WHEEL_SLOTS; i++, block++) {
+			if (timerWheel[level][block & TIMER_WHEEL_MASK]) {
+				uint32_t delta = (block << (level * TIMER_WHEEL_BITS)) - now;
+				if (!interval || delta < interval)
+					interval = delta;
+				break;
+			}
+		}
+	}
+
+	return interval;
+}
+
+
+// Triggers all timers in a linked list.
+void timer_trigger(timer_t *timer) {
+	while (timer) {
+		timer_t *next = timer->next; // the callback may restart the timer
+		if (timer->callback)
+			timer->callback(timer->context);
+		timer = next;
 	}
-	oldTicks = ticks;
-	return expiredTimers;
 }
 
 
@@ -77,25 +203,18 @@ void timer_update(void) {
 	timer_t *expiredTimers = NULL;
 
 	atomic() {
-		// if some function holds the timer lock, it is guaranteed to call this function afterwards
-		if (__sync_bool_compare_and_swap(&timerLock, 0, 1)) {
-			// take all timers that should have expired
-			ticks_t currentTime = system_ticks();
-			expiredTimers = timer_check_overflow(currentTime);
-			timer_t *timer;
-			while (timerList ? timerList->expiry <= (uint32_t)currentTime : 0) {
-				timerList = (timer = timerList)->next;
-				timer->next = expiredTimers;
-				expiredTimers = timer;
-			}
+		timer_lock();
 
-			// register handler for the next timer that fires (if any)
-			if (timerList)
-				timer_set_alarm(min(timerList->expiry - (uint32_t)currentTime, TICKS_MAX)); // we may theoretically be 1 tick late
+		// take all timers that should have expired
+		uint32_t currentTime = timer_clock();
+		timer_advance(currentTime, &expiredTimers);
 
-			// release timer lock
-			timerLock = 0;
-		}
+		// register handler for the next timer that fires (if any)
+		uint32_t interval = timer_next_event(currentTime);
+		if (interval)
+			timer_set_alarm(min(interval, TICKS_MAX)); // we may theoretically be 1 tick late
+
+		timer_unlock();
 	}
 
 	timer_trigger(expiredTimers);
@@ -109,28 +228,28 @@ void timer_update(void) {
 void timer_start(timer_t *timer) {
 	timer_t *expiredTimers = NULL;
 
-	// acquire timer lock
-	if (!__sync_bool_compare_and_swap(&timerLock, 0, 1))
-		bug_check(STATUS_SYNC_ERROR, timerLock);
-
-	if (!timer->state.running && !timer->state.hasExpired) {
-		ticks_t currentTime = system_ticks(); // need to fetch ticks atomically
-		expiredTimers = timer_check_overflow(currentTime);
-		uint32_t deadline = (timer->expiry += (uint32_t)currentTime);
-		timer->state.running = 1;
-
-		// find the field that should point to the new timer
-		timer_t **timerPtr = &timerList;
-		while (*timerPtr ? ((*timerPtr)->expiry <= deadline) : 0)
-			timerPtr = &((*timerPtr)->next);
+	atomic() {
+		timer_lock();
+
+		if (!timer->state.running && !timer->state.hasExpired) {
+			// bring the wheel up to date, so that the timer can be inserted relative to the current time
+			uint32_t currentTime = timer_clock();
+			timer_t **expiredTail = timer_advance(currentTime, &expiredTimers);
+
+			timer->expiry += currentTime;
+			if (timer->expiry == currentTime) {
+				timer->state.hasExpired = 1;
+				timer->next = NULL;
+				*expiredTail = timer;
+			} else {
+				timer->state.running = 1;
+				timer_insert(timer);
+			}
+		}
 
-		// insert new timer
-		timer->next = *timerPtr;
-		*timerPtr = timer;
+		timer_unlock();
 	}
 
-	// release timer lock
-	timerLock = 0;
 	timer_update();
 
 	timer_trigger(expiredTimers);
@@ -140,29 +259,20 @@ void timer_start(timer_t *timer) {
 // Pauses the specified timer. The timer can later be resumed using timer_start.
 // Stopping a timer that has already been stopped or expired has no effect.
 void timer_stop(timer_t *timer) {
-	ticks_t currentTime = system_ticks();
-
-	// acquire timer lock
-	if (!__sync_bool_compare_and_swap(&timerLock, 0, 1))
-		bug_check(STATUS_SYNC_ERROR, timerLock);
+	atomic() {
+		timer_lock();
 
-	// find the field that points to the timer
-	timer_t **timerPtr = &timerList;
-	while (*timerPtr && *timerPtr != timer) // traverse normal list
-		timerPtr = &((*timerPtr)->next);
+		if (timer->state.running) {
+			timer_remove(timer);
+			timer->state.running = 0;
+			uint32_t currentTime = timer_clock();
+			timer->expiry = ((int32_t)(timer->expiry - currentTime) > 0 ? timer->expiry - currentTime : 0);
+		}
 
-	// if we found the timer, unlink
-	if (*timerPtr == timer)
-		*timerPtr = (*timerPtr)->next;
+		timer_unlock();
+	}
 
-	// release timer lock
-	timerLock = 0;
 	timer_update();
-
-	if (timer->state.running) {
-		timer->state.running = 0;
-		timer->expiry -= currentTime;
-	}
 }
 
 
@@ -174,4 +284,114 @@ bool timer_has_expired(timer_t *timer) {
 	return timer->state.hasExpired;
 }
 
+
+#ifdef USING_BENCHMARK
+
+#define TIMER_STRESS_MAX_INTERVAL	(2000)	// the longest interval of a timer in timer_stress_test (in system ticks)
+
+// the state of one timer in timer_stress_test
+typedef struct
+{
+	timer_t timer;
+	uint32_t deadline;	// the earliest time at which the callback may be invoked
+	int restarts;		// the number of times the callback restarts the timer
+	int fired;			// the number of times the callback was invoked
+	int32_t lateness;	// the number of ticks by which the callback was late the last time (negative if early)
+} timer_stress_t;
+
+
+// Returns the current time as seen by the timers.
+static uint32_t timer_stress_time(void) {
+	uint32_t currentTime;
+	atomic() {
+		timer_lock();
+		currentTime = timer_clock();
+		timer_unlock();
+	}
+	return currentTime;
+}
+
+
+// Returns a pseudo-random interval for timer_stress_test.
+static uint32_t timer_stress_interval(benchmark_t *bench) {
+	return 1 + (benchmark_random(bench) >> 8) % TIMER_STRESS_MAX_INTERVAL;
+}
+
+
+static void timer_stress_callback(void *context) {
+	timer_stress_t *entry = (timer_stress_t *)context;
+	uint32_t currentTime = timer_stress_time();
+
+	entry->lateness = (int32_t)(currentTime - entry->deadline);
+	entry->fired++;
+
+	// restart the timer from within its own callback
+	if (entry->restarts) {
+		entry->restarts--;
+		entry->timer.expiry = 1 + (currentTime & 0xFF);
+		entry->timer.state.hasExpired = 0;
+		entry->deadline = currentTime + entry->timer.expiry;
+		timer_start(&entry->timer);
+	}
+}
+
+
+// Starts the specified number of timers with pseudo-random intervals of up to TIMER_STRESS_MAX_INTERVAL ticks.
+// A quarter of them is stopped and started again and half of them restarts itself from its callback. Then this
+// function waits until all timers should have fired and checks that each one fired as often as expected and never
+// early. The time it takes to start and to stop and restart the timers is written to the log, as is the result.
+void timer_stress_test(int count) {
+	benchmark_t bench;
+	benchmark_init(&bench, "timer stress");
+	timer_stress_t *entries = (timer_stress_t *)malloc(count * sizeof(timer_stress_t));
+	if (!entries) {
+		LOGE("timer stress test: out of memory");
+		return;
+	}
+
+	benchmark_start(&bench);
+	for (int i = 0; i < count; i++) {
+		entries[i] = (timer_stress_t) { .timer = CREATE_TIMER(timer_stress_interval(&bench), timer_stress_callback, &entries[i]), .restarts = i & 1 };
+		entries[i].deadline = timer_stress_time() + entries[i].timer.expiry;
+		timer_start(&entries[i].timer);
+	}
+	benchmark_stop(&bench, "timing wheel", count, "start");
+
+	benchmark_start(&bench);
+	for (int i = 0; i < count; i += 4) {
+		timer_stop(&entries[i].timer);
+		timer_start(&entries[i].timer);
+	}
+	benchmark_stop(&bench, "timing wheel", (count + 3) / 4, "stop and restart");
+
+	// a callback restarts its timer with an interval of at most 256 ticks
+	ticks_t start = system_ticks();
+	ticks_t timeout = 2 * (TIMER_STRESS_MAX_INTERVAL + 256);
+	for (int done = 0; !done && ((system_ticks() - start) & TICKS_MAX) < timeout; ) {
+		done = 1;
+		for (int i = 0; i < count && done; i++)
+			done = timer_has_expired(&entries[i].timer) && !entries[i].restarts;
+	}
+
+	int early = 0, missed = 0;
+	int32_t maxLateness = 0;
+	for (int i = 0; i < count; i++) {
+		timer_stop(&entries[i].timer);
+		if (entries[i].fired != 1 + (i & 1))
+			missed++;
+		else if (entries[i].lateness < 0)
+			early++;
+		else if (entries[i].lateness > maxLateness)
+			maxLateness = entries[i].lateness;
+	}
+
+	if (early || missed)
+		LOGE("timer stress test: %d timers: %d fired early, %d fired too often or not at all", count, early, missed);
+	else
+		LOGI("timer stress test: %d timers: all fired on time, at most %d ticks late", count, (int)maxLateness);
+	free(entries);
+}
+
+#endif // USING_BENCHMARK
+
 #endif
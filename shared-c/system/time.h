@@ -17,8 +17,10 @@ typedef struct timer_t
 	{
 		unsigned int running : 1;
 		unsigned int hasExpired : 1;
+		unsigned int level : 5;		// the level of the timing wheel that holds the timer (used internally)
 	} state;
 	struct timer_t *next; // pointer used internally to organize the timers
+	struct timer_t **link; // points to the pointer that points to this timer (used internally)
 } timer_t;
 
 
@@ -31,13 +33,17 @@ typedef struct timer_t
 		.running = 0,									\
 		.hasExpired = 0									\
 	},													\
-	.next = NULL										\
+	.next = NULL,										\
+	.link = NULL										\
 }
 
 
 void timer_start(timer_t *timer);
 void timer_stop(timer_t *timer);
 bool timer_has_expired(timer_t *timer);
+#ifdef USING_BENCHMARK
+void timer_stress_test(int count);
+#endif
 
 
 #endif // __TIME_H__